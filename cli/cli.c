@@ -1,8 +1,138 @@
 #include "cli.h"
+#include "compiler.h"
 #include "core.h"
+#include "flight_recorder.h"
+#include "heap_snapshot.h"
+#include "lexer.h"
+#include "profiler.h"
+#include "trace.h"
 #include "vm.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+
+// 词法分析基准测试的最短运行时间（秒），源码会被反复分析直到超过该时间
+#define LEX_BENCH_SECONDS 1.0
+
+// 虚拟机的堆内存上限，由 --heap-limit 设置，为 0 表示不限制
+static size_t heapLimit = 0;
+
+// 线程的执行预算，由 --budget 设置，为 0 表示不限制
+static uint64_t threadBudget = 0;
+
+// 线程的执行预算耗尽时的处理方式，由 --budget-action 设置
+static BudgetAction budgetAction = BUDGET_ABORT;
+
+// 脚本执行完毕后写入堆快照的文件路径，由 --heap-snapshot 设置，为 NULL 表示不写入
+static const char *heapSnapshotPath = NULL;
+
+// 运行时错误退出前写入飞行记录的文件路径，由 --flight-dump 设置，为 NULL 表示不写入
+static const char *flightDumpPath = NULL;
+
+// 采样剖析结果的输出文件路径，由 --profile-samples 设置，为 NULL 表示不采样
+static const char *sampleProfilePath = NULL;
+
+// 采样剖析的频率，由 --sample-hz 设置
+static uint32_t sampleHz = DEFAULT_SAMPLE_HZ;
+
+// 调用剖析报告中输出的方法个数，由 --profile-calls 设置，为 0 表示不开启调用剖析
+static uint32_t callProfileTop = 0;
+
+// 分配剖析的采样间隔（字节），由 --profile-allocs 设置，为 0 表示不开启分配剖析
+static uint32_t allocSampleBytes = 0;
+
+// 编译统计报告中每个模块输出的函数个数，由 --compile-stats 设置，为 0 表示不开启编译统计
+static uint32_t compileStatsTop = 0;
+
+// 时间线的输出文件路径，由 --trace 设置，为 NULL 表示不追踪
+static const char *tracePath = NULL;
+
+#ifdef OPCODE_PROFILE
+// 是否开启指令级剖析，由 --profile-opcodes 设置
+static bool isOpcodeProfiling = false;
+#endif
+
+// 正在剖析的虚拟机，脚本运行出错时会直接 exit，由 atexit 注册的 dumpProfiles 输出剖析结果
+static VM *profiledVM = NULL;
+
+// 输出 profiledVM 的剖析结果，只输出一次
+static void dumpProfiles(void) {
+    VM *vm = profiledVM;
+    if (vm == NULL) {
+        return;
+    }
+    profiledVM = NULL;
+
+    if (vm->sampleProfile != NULL) {
+        // 可能在 exit 的过程中调用，所以不能用会再次 exit 的 IO_ERROR
+        FILE *file = fopen(sampleProfilePath, "w");
+        if (file == NULL) {
+            fprintf(stderr, "Couldn't write sample profile \"%s\".\n", sampleProfilePath);
+        } else {
+            dumpSampleProfile(vm, file);
+            fclose(file);
+        }
+    }
+    if (vm->callProfile != NULL) {
+        dumpCallProfile(vm, stderr);
+    }
+    if (vm->allocProfile != NULL) {
+        dumpAllocProfile(vm, stderr);
+    }
+#ifdef OPCODE_PROFILE
+    if (vm->opcodeProfile != NULL) {
+        dumpOpcodeProfile(vm, stderr);
+    }
+#endif
+    if (compileStats != NULL) {
+        dumpCompileStats(vm, stderr);
+        stopCompileStats();
+    }
+}
+
+// 解析 --heap-limit 的参数，支持 K、M、G 后缀，例如 512M
+// 解析失败返回 false，负数以及乘上后缀后溢出的值也算解析失败，而不是回绕成一个小得多的上限
+// 上限不能超过 SIZE_MAX / 2，memManager 要在上限之上再加超限后留给主调线程的余量（不超过上限的一半左右）
+static bool parseHeapLimit(const char *arg, size_t *limit) {
+    // strtoull 会跳过开头的空白并接受负数，把负数回绕成很大的正数，所以要求以数字开头
+    if (!isdigit((unsigned char)*arg)) {
+        return false;
+    }
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(arg, &end, 10);
+    if (errno == ERANGE) {
+        return false;
+    }
+    uint32_t shift = 0;
+    switch (*end) {
+        case 'G':
+        case 'g':
+            shift = 30;
+            end++;
+            break;
+        case 'M':
+        case 'm':
+            shift = 20;
+            end++;
+            break;
+        case 'K':
+        case 'k':
+            shift = 10;
+            end++;
+            break;
+        default:
+            break;
+    }
+    if (value > (SIZE_MAX / 2) >> shift) {
+        return false;
+    }
+    *limit = (size_t)(value << shift);
+    return *end == '\0';
+}
 
 // 运行脚本文件
 static void runFile(const char *path) {
@@ -22,21 +152,117 @@ static void runFile(const char *path) {
         rootDir = root;
     }
 
+    // 在创建虚拟机之前开启追踪，时间线才能包括 buildCore
+    if (tracePath != NULL) {
+        startTracer(tracePath);
+    }
+
+    // 编译统计同样要在创建虚拟机之前开启，才能包括核心模块的编译
+    if (compileStatsTop > 0) {
+        startCompileStats(compileStatsTop);
+    }
+
     // 创建虚拟机
     VM *vm = newVM();
-    const char *sourceCode = readFile(path);
+    vm->heapLimit = heapLimit;
+    vm->threadBudget = threadBudget;
+    vm->budgetAction = budgetAction;
+    if (vm->flightRecorder != NULL) {
+        vm->flightRecorder->errorDumpPath = flightDumpPath;
+    }
+    if (compileStats != NULL) {
+        profiledVM = vm;
+    }
+    if (sampleProfilePath != NULL) {
+        startSampleProfiler(vm, sampleHz);
+        profiledVM = vm;
+    }
+    if (callProfileTop > 0) {
+        startCallProfiler(vm, callProfileTop);
+        profiledVM = vm;
+    }
+    if (allocSampleBytes > 0) {
+        startAllocProfiler(vm, allocSampleBytes);
+        profiledVM = vm;
+    }
+#ifdef OPCODE_PROFILE
+    if (isOpcodeProfiling) {
+        vm->opcodeProfile = newOpcodeProfile();
+        profiledVM = vm;
+    }
+#endif
+    if (profiledVM != NULL) {
+        atexit(dumpProfiles);
+    }
+    size_t sourceLength;
+    size_t mappedSize;
+    char *sourceCode = mapFile(path, &sourceLength, &mappedSize);
 
     // 第二个参数为模块名称（moduleName），即用文件路径作为模块名称
-    executeModule(vm, OBJ_TO_VALUE(newObjString(vm, path, strlen(path))), sourceCode);
+    VMResult result = executeModule(vm, OBJ_TO_VALUE(newObjString(vm, path, strlen(path))), sourceCode, sourceLength);
+    unmapFile(sourceCode, mappedSize);
+
+    // 在释放虚拟机之前写入堆快照，此时所有对象都还在
+    if (heapSnapshotPath != NULL && writeHeapSnapshot(vm, heapSnapshotPath) < 0) {
+        IO_ERROR("Couldn't write heap snapshot \"%s\".\n", heapSnapshotPath);
+    }
+
+    dumpProfiles();
 
     // 释放虚拟机
     freeVM(vm);
+
+    stopTracer();
+
+    // 和其他运行时错误一样以非零状态退出
+    if (result == VM_RESULT_ERROR) {
+        exit(1);
+    }
+}
+
+// 词法分析基准测试：反复对 path 做词法分析，输出每秒处理的 token 数
+static void benchLexer(const char *path) {
+    VM *vm = newVM();
+    size_t sourceLength;
+    size_t mappedSize;
+    char *sourceCode = mapFile(path, &sourceLength, &mappedSize);
+    ObjModule *objModule = newObjModule(vm, path);
+
+    uint64_t tokenNum = 0;
+    uint32_t roundNum = 0;
+    double elapsed = 0;
+    clock_t start = clock();
+    do {
+        Lexer lexer;
+        initLexer(vm, &lexer, path, sourceCode, sourceLength, objModule);
+        getNextToken(&lexer);
+        while (lexer.curToken.type != TOKEN_EOF) {
+            tokenNum++;
+            getNextToken(&lexer);
+        }
+        roundNum++;
+        elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+    } while (elapsed < LEX_BENCH_SECONDS);
+
+    printf("%s: %zu bytes, %llu tokens per round, %u rounds in %.3fs\n",
+           path, sourceLength, (unsigned long long)(tokenNum / roundNum), roundNum, elapsed);
+    printf("%.0f tokens/sec, %.2f MB/sec\n",
+           tokenNum / elapsed, sourceLength * (double)roundNum / elapsed / (1024 * 1024));
+
+    unmapFile(sourceCode, mappedSize);
+    freeVM(vm);
 }
 
 // 运行命令行
 static void runCli(void) {
     // 创建虚拟机
     VM *vm = newVM();
+    vm->heapLimit = heapLimit;
+    vm->threadBudget = threadBudget;
+    vm->budgetAction = budgetAction;
+    if (vm->flightRecorder != NULL) {
+        vm->flightRecorder->errorDumpPath = flightDumpPath;
+    }
 
     char sourceLine[MAX_LINE_LEN];
     while (true) {
@@ -47,7 +273,7 @@ static void runCli(void) {
             break;
         }
         // 执行输入的脚本代码
-        executeModule(vm, OBJ_TO_VALUE(newObjString(vm, "cli", 3)), sourceLine);
+        executeModule(vm, OBJ_TO_VALUE(newObjString(vm, "cli", 3)), sourceLine, strlen(sourceLine));
     }
 
     // 释放虚拟机
@@ -55,11 +281,135 @@ static void runCli(void) {
 }
 
 int main(int argc, const char **argv) {
-    if (argc == 1) {
+    const char *path = NULL;
+    bool isLexBench = false;
+
+    // 解析命令行选项，选项以 -- 开头，其余参数视为脚本文件路径
+    int idx = 1;
+    while (idx < argc) {
+        if (strcmp(argv[idx], "--lazy-compile") == 0) {
+            // 函数/方法体在第一次调用时才编译，加快只用到少数函数的大脚本的启动，语法错误也要到调用时才报告
+            lazyCompileEnabled = true;
+        } else if (strcmp(argv[idx], "--eager-compile") == 0) {
+            // 编译模块时直接编译所有函数/方法体（默认）
+            lazyCompileEnabled = false;
+        } else if (strcmp(argv[idx], "--bench-lexer") == 0) {
+            // 只对脚本文件做词法分析并输出吞吐量，不编译也不执行
+            isLexBench = true;
+        } else if (strncmp(argv[idx], "--heap-limit=", 13) == 0) {
+            // 限制虚拟机的堆内存，超出后当前线程以运行时错误退出
+            if (!parseHeapLimit(argv[idx] + 13, &heapLimit)) {
+                fprintf(stderr, "invalid heap limit: %s\n", argv[idx] + 13);
+                return 1;
+            }
+        } else if (strncmp(argv[idx], "--budget=", 9) == 0) {
+            // 限制每个线程的执行预算（循环回跳和方法调用的次数），防止死循环卡住虚拟机
+            char *end;
+            unsigned long long budget = strtoull(argv[idx] + 9, &end, 10);
+            if (end == argv[idx] + 9 || *end != '\0' || budget == 0) {
+                fprintf(stderr, "invalid budget: %s\n", argv[idx] + 9);
+                return 1;
+            }
+            threadBudget = (uint64_t)budget;
+        } else if (strcmp(argv[idx], "--budget-action=abort") == 0) {
+            // 预算耗尽时以错误结束线程，主调线程可以通过 isDone 和 error 得知（默认）
+            budgetAction = BUDGET_ABORT;
+        } else if (strcmp(argv[idx], "--budget-action=yield") == 0) {
+            // 预算耗尽时让出给主调线程，主调线程再次 call 时继续执行，用于时间片轮转
+            budgetAction = BUDGET_YIELD;
+        } else if (strncmp(argv[idx], "--heap-snapshot=", 16) == 0) {
+            // 脚本执行完毕后将堆快照写入指定文件
+            heapSnapshotPath = argv[idx] + 16;
+        } else if (strncmp(argv[idx], "--flight-dump=", 14) == 0) {
+            // 运行时错误退出前写入飞行记录
+            flightDumpPath = argv[idx] + 14;
+        } else if (strcmp(argv[idx], "--no-flight-recorder") == 0) {
+            // 不开启飞行记录器，省去记录调用和返回的开销，之后 SIGUSR1、System.dumpFlightRecorder 和 --flight-dump 都无法转储
+            flightRecorderEnabled = false;
+        } else if (strncmp(argv[idx], "--profile-samples=", 18) == 0) {
+            // 按 CPU 时间定时采样脚本的调用栈，脚本执行完毕后以折叠栈格式写入指定文件，可用 flamegraph.pl 生成火焰图
+            sampleProfilePath = argv[idx] + 18;
+        } else if (strncmp(argv[idx], "--sample-hz=", 12) == 0) {
+            char *end;
+            unsigned long hz = strtoul(argv[idx] + 12, &end, 10);
+            if (end == argv[idx] + 12 || *end != '\0' || hz == 0 || hz > 1000000) {
+                fprintf(stderr, "invalid sample rate: %s\n", argv[idx] + 12);
+                return 1;
+            }
+            sampleHz = (uint32_t)hz;
+        } else if (strcmp(argv[idx], "--profile-calls") == 0) {
+            // 统计各函数和原生方法的调用次数、自身耗时及总耗时，脚本执行完毕后输出到 stderr
+            callProfileTop = DEFAULT_CALL_PROFILE_TOP;
+        } else if (strncmp(argv[idx], "--profile-calls=", 16) == 0) {
+            char *end;
+            unsigned long top = strtoul(argv[idx] + 16, &end, 10);
+            if (end == argv[idx] + 16 || *end != '\0' || top == 0 || top > UINT32_MAX) {
+                fprintf(stderr, "invalid method count: %s\n", argv[idx] + 16);
+                return 1;
+            }
+            callProfileTop = (uint32_t)top;
+        } else if (strcmp(argv[idx], "--profile-allocs") == 0) {
+            // 按分配点统计新建对象的字节数和个数，脚本执行完毕后输出到 stderr
+            allocSampleBytes = DEFAULT_ALLOC_SAMPLE_BYTES;
+        } else if (strncmp(argv[idx], "--profile-allocs=", 17) == 0) {
+            // 同上，但每分配指定的字节数才采样一次
+            char *end;
+            unsigned long sampleBytes = strtoul(argv[idx] + 17, &end, 10);
+            if (end == argv[idx] + 17 || *end != '\0' || sampleBytes == 0 || sampleBytes > UINT32_MAX) {
+                fprintf(stderr, "invalid sample interval: %s\n", argv[idx] + 17);
+                return 1;
+            }
+            allocSampleBytes = (uint32_t)sampleBytes;
+        } else if (strcmp(argv[idx], "--compile-stats") == 0) {
+            // 按模块和函数统计编译时间、指令字节数、常量、局部变量、upvalue、栈大小及操作码的静态分布，脚本执行完毕后输出到 stderr
+            compileStatsTop = DEFAULT_COMPILE_STATS_TOP;
+        } else if (strncmp(argv[idx], "--compile-stats=", 16) == 0) {
+            // 同上，但每个模块输出指定个数的函数
+            char *end;
+            unsigned long top = strtoul(argv[idx] + 16, &end, 10);
+            if (end == argv[idx] + 16 || *end != '\0' || top == 0 || top > UINT32_MAX) {
+                fprintf(stderr, "invalid function count: %s\n", argv[idx] + 16);
+                return 1;
+            }
+            compileStatsTop = (uint32_t)top;
+        } else if (strncmp(argv[idx], "--trace=", 8) == 0) {
+            // 记录编译、执行、线程切换等阶段的时间线，以 Chrome trace event 格式写入指定文件
+            tracePath = argv[idx] + 8;
+        } else if (strcmp(argv[idx], "--trace") == 0) {
+            // 同上，文件路径是下一个参数
+            if (idx + 1 == argc) {
+                fprintf(stderr, "--trace requires an output file\n");
+                return 1;
+            }
+            tracePath = argv[++idx];
+        } else if (strcmp(argv[idx], "--profile-opcodes") == 0) {
+            // 统计各操作码、相邻指令对、各函数的指令数及各调用点的方法类型，脚本执行完毕后输出到 stderr
+#ifdef OPCODE_PROFILE
+            isOpcodeProfiling = true;
+#else
+            fprintf(stderr, "--profile-opcodes requires a build with OPCODE_PROFILE (cmake -DOPCODE_PROFILE=ON)\n");
+            return 1;
+#endif
+        } else if (strncmp(argv[idx], "--", 2) == 0) {
+            fprintf(stderr, "unknown option: %s\n", argv[idx]);
+            return 1;
+        } else {
+            path = argv[idx];
+        }
+        idx++;
+    }
+
+    if (isLexBench) {
+        if (path == NULL) {
+            fprintf(stderr, "--bench-lexer requires a script file\n");
+            return 1;
+        }
+        benchLexer(path);
+    } else if (path == NULL) {
         runCli();
     } else {
         // 运行脚本文件
-        runFile(argv[1]);
+        runFile(path);
     }
     return 0;
 }
@@ -1,10 +1,10 @@
 #include "compiler.h"
 #include "core.h"
 #include "lexer.h"
+#include "probes.h"
+#include "profiler.h"
+#include "trace.h"
 #include <string.h>
-#if DEBUG
-#include "debug.h"
-#endif
 
 // 定义编译单元的结构
 // 注：编译单元就是指令流，例如函数、类的方法等独立的指令流都是编译单元
@@ -41,6 +41,18 @@ struct compileUnit {
     // 当前词法解析器
     // 注：每个模块都有一个单独的词法分析器
     Lexer *curLexer;
+
+    // 最近一次写入的操作码在指令流中的索引，用于识别 return 后面的调用是否为尾调用
+    int lastOpCodeIndex;
+
+    // 同时存在的局部变量的最大个数，供编译统计使用
+    uint32_t maxLocalVarNum;
+
+    // 以下供编译统计（di --compile-stats）计算自身的编译时间，未开启时不使用
+    uint64_t statsStartTime;    // 开始编译的时刻（纳秒）
+    uint64_t statsStartLexTime; // 开始编译时已累计的词法分析时间
+    uint64_t statsChildTime;    // 内层编译单元的编译时间，从自身的编译时间中扣除
+    uint64_t statsChildLexTime; // 内层编译单元的词法分析时间
 };
 
 // 将 opcode 对运行时栈大小的影响定义到数组 opCodeSlotsUsed 中
@@ -55,6 +67,9 @@ static const int opCodeSlotsUsed[] = {
 };
 #undef OPCODE_SLOTS
 
+// 是否延迟编译函数/方法体
+bool lazyCompileEnabled = false;
+
 // 按照所处作用域类型划分变量类型
 typedef enum {
     VAR_SCOPE_INVALID,
@@ -109,22 +124,40 @@ typedef struct
     methodSignatureFn methodSign; // 表示该符号在类中被视为一个方法，所以为其生成一个方法签名，语义分析中涉及方法签名生成指令
 } SymbolBindRule;
 
+// OPCODE_BUILD_LIST 和 OPCODE_BUILD_MAP 的操作数占 2 个字节，一条指令最多取走的元素（map 为键值对）个数
+#define MAX_BUILD_ELEMENT_NUM 0xffff
+
+// 编译 list 和 map 字面量时的状态
+// 元素先全部压入运行时栈，最后由一条 BUILD 指令按元素个数一次建成 list 或 map
+// 到目前为止的元素都是常量时不生成指令，只把常量暂存下来，若整个字面量都是常量，就在编译时建好放入常量表，运行时复制一份
+typedef struct {
+    bool isMap;
+    bool isConstant;      // 到目前为止的元素是否都是常量
+    bool isBuilt;         // 元素超过 MAX_BUILD_ELEMENT_NUM 个时已经生成了 BUILD 指令，之后的元素逐个调用 addCore_ 添加
+    uint32_t elementNum;  // 已压入运行时栈、等待 BUILD 指令取走的元素个数
+    ValueBuffer constants; // 暂存的常量元素，map 为键和值交替存放
+} LiteralBuilder;
+
 static uint32_t addConstant(CompileUnit *cu, Value constant);
 static void expression(CompileUnit *cu, BindPower rbp);
+static void expressionTail(CompileUnit *cu, BindPower rbp, bool canAssign);
 static void compileProgram(CompileUnit *cu);
 static void infixOperator(CompileUnit *cu, bool canAssign UNUSED);
+static void isOperator(CompileUnit *cu, bool canAssign UNUSED);
 static void unaryOperator(CompileUnit *cu, bool canAssign UNUSED);
 static void compileStatement(CompileUnit *cu);
 
 // 初始化编译单元 CompileUnit
 // enclosingUnit 表示直接外层编译单元
 // isMethod 表示是否是类的方法
-static void initCompileUnit(Lexer *lexer, CompileUnit *cu, CompileUnit *enclosingUnit, bool isMethod) {
+// lazyFn 为延迟编译的函数，编译单元的指令流直接写入其中；为 NULL 时新建 objFn
+static void initCompileUnit(Lexer *lexer, CompileUnit *cu, CompileUnit *enclosingUnit, bool isMethod, ObjFn *lazyFn) {
     lexer->curCompileUnit = cu;
     cu->curLexer = lexer;
     cu->enclosingUnit = enclosingUnit;
     cu->curLoop = NULL;
     cu->enclosingClassBK = NULL;
+    cu->lastOpCodeIndex = -1;
 
     // 三种情况：1. 模块中直接定义一级函数  2. 内层函数  3. 内层方法（即类的方法）
 
@@ -164,6 +197,23 @@ static void initCompileUnit(Lexer *lexer, CompileUnit *cu, CompileUnit *enclosin
     // 对于基于栈的虚拟机，局部变量是保存在运行时栈的
     // 因此初始化运行时栈时，其大小等于局部变量的大小
     cu->stackSlotNum = cu->localVarNum;
+    cu->maxLocalVarNum = cu->localVarNum;
+
+    if (compileStats != NULL) {
+        cu->statsStartTime = traceNow();
+        cu->statsStartLexTime = compileStats->lexTime;
+        cu->statsChildTime = 0;
+        cu->statsChildLexTime = 0;
+    }
+
+    if (lazyFn != NULL) {
+        // 延迟编译时，函数对象在编译模块时就已经创建（闭包引用的就是它），只需清空其中的占位指令
+        ByteBufferClear(cu->curLexer->vm, &lazyFn->instrStream);
+        lineTableClear(cu->curLexer->vm, &lazyFn->lineTable);
+        lazyFn->maxStackSlotUsedNum = cu->localVarNum;
+        cu->fn = lazyFn;
+        return;
+    }
 
     // 新建 objFn 对象，用于存储编译单元的指令流
     cu->fn = newObjFn(cu->curLexer->vm, cu->curLexer->curModule, cu->localVarNum);
@@ -171,10 +221,8 @@ static void initCompileUnit(Lexer *lexer, CompileUnit *cu, CompileUnit *enclosin
 
 // 向函数的指令流中写入 1 字节，返回其索引
 static int writeByte(CompileUnit *cu, int byte) {
-#if DEBUG
-    // 调试状态时，还需要额外在 fn->debug->lineNo 中写入当前 token 所在行号，方便调试
-    IntBufferAdd(cu->curLexer->vm, &cu->fn->debug->lineNo, cu->curLexer->preToken.lineNo);
-#endif
+    // 记录该字节对应的源码行号，即当前 token 所在行号
+    lineTableAdd(cu->curLexer->vm, &cu->fn->lineTable, cu->curLexer->preToken.lineNo);
 
     ByteBufferAdd(cu->curLexer->vm, &cu->fn->instrStream, (uint8_t)byte);
     return cu->fn->instrStream.count - 1;
@@ -182,7 +230,7 @@ static int writeByte(CompileUnit *cu, int byte) {
 
 // 向函数的指令流中写入操作码
 static void writeOpCode(CompileUnit *cu, OpCode opCode) {
-    writeByte(cu, opCode);
+    cu->lastOpCodeIndex = writeByte(cu, opCode);
     // 计算该编译单元需要用到的运行时栈总大小
     // opCode 为操作符集合对应的枚举数据，值为对应的索引值
     // 而 opCodeSlotsUsed 也是基于操作符集合生成的数组
@@ -266,6 +314,23 @@ uint32_t getBytesOfOperands(const Byte *instrStream, Value *constants, int ip) {
         case OPCODE_CALL14:
         case OPCODE_CALL15:
         case OPCODE_CALL16:
+        case OPCODE_TAIL_CALL0:
+        case OPCODE_TAIL_CALL1:
+        case OPCODE_TAIL_CALL2:
+        case OPCODE_TAIL_CALL3:
+        case OPCODE_TAIL_CALL4:
+        case OPCODE_TAIL_CALL5:
+        case OPCODE_TAIL_CALL6:
+        case OPCODE_TAIL_CALL7:
+        case OPCODE_TAIL_CALL8:
+        case OPCODE_TAIL_CALL9:
+        case OPCODE_TAIL_CALL10:
+        case OPCODE_TAIL_CALL11:
+        case OPCODE_TAIL_CALL12:
+        case OPCODE_TAIL_CALL13:
+        case OPCODE_TAIL_CALL14:
+        case OPCODE_TAIL_CALL15:
+        case OPCODE_TAIL_CALL16:
         case OPCODE_LOAD_CONSTANT:
         case OPCODE_LOAD_MODULE_VAR:
         case OPCODE_STORE_MODULE_VAR:
@@ -276,6 +341,12 @@ uint32_t getBytesOfOperands(const Byte *instrStream, Value *constants, int ip) {
         case OPCODE_OR:
         case OPCODE_INSTANCE_METHOD:
         case OPCODE_STATIC_METHOD:
+        case OPCODE_BUILD_LIST:
+        case OPCODE_BUILD_MAP:
+        case OPCODE_COPY_CONSTANT:
+        case OPCODE_SUBSCRIPT_GET:
+        case OPCODE_SUBSCRIPT_SET:
+        case OPCODE_IS:
             return 2;
 
         case OPCODE_SUPER0:
@@ -299,6 +370,11 @@ uint32_t getBytesOfOperands(const Byte *instrStream, Value *constants, int ip) {
             // 和 writeShortOperand 写入的,共 1 个操作码和 4 个字节的操作数
             return 4;
 
+        case OPCODE_INTRINSIC0:
+        case OPCODE_INTRINSIC1:
+            // 1 个字节的 Intrinsic 和 2 个字节的方法索引，见 emitCallBySignature
+            return 3;
+
         case OPCODE_CREATE_CLOSURE: {
             // 操作码 OPCODE_CREATE_CLOSURE 的操作数是待创建闭包的函数在常量表中的索引，占 2 个字节
 
@@ -432,6 +508,9 @@ static uint32_t addLocalVar(CompileUnit *cu, const char *name, uint32_t length)
     var->length = length;
     var->scopeDepth = cu->scopeDepth;
     var->isUpvalue = false;
+    if (cu->localVarNum >= cu->maxLocalVarNum) {
+        cu->maxLocalVarNum = cu->localVarNum + 1;
+    }
     return cu->localVarNum++;
 }
 
@@ -763,18 +842,54 @@ static void compileBody(CompileUnit *cu, bool isConstruct) {
     writeOpCode(cu, OPCODE_RETURN);
 }
 
+// 记录编译单元的编译统计，并将其编译时间计入直接外层编译单元的 statsChildTime
+static void recordCompileUnitStats(CompileUnit *cu) {
+    uint64_t compileTime = traceNow() - cu->statsStartTime;
+    uint64_t lexTime = compileStats->lexTime - cu->statsStartLexTime;
+    recordFnCompile(cu->fn, compileTime - cu->statsChildTime, lexTime - cu->statsChildLexTime, cu->maxLocalVarNum);
+
+    // 延迟编译时外层的模块编译单元只是还原出来的，没有 fn，也没有开始计时
+    CompileUnit *enclosingUnit = cu->enclosingUnit;
+    if (enclosingUnit != NULL && enclosingUnit->fn != NULL) {
+        enclosingUnit->statsChildTime += compileTime;
+        enclosingUnit->statsChildLexTime += lexTime;
+    }
+}
+
+// 根据指令流判断函数是否只是存取一个实例属性，结果记录在 fn->fieldAccessor 中，供调用处省去帧栈
+// 方法体中 return 之后的指令不会执行，所以只需看指令流的开头，属性索引留在指令流中，由 patchOperand 照常修正
+static void markFieldAccessor(ObjFn *fn) {
+    uint8_t *code = fn->instrStream.datas;
+    uint32_t count = fn->instrStream.count;
+
+    fn->fieldAccessor = FA_NONE;
+    if (count >= 3 && code[0] == OPCODE_LOAD_THIS_FIELD && code[2] == OPCODE_RETURN) {
+        // var x 的 getter：x { return x }
+        fn->fieldAccessor = FA_GETTER;
+    } else if (count >= 5 && code[0] == OPCODE_LOAD_LOCAL_VAR && code[1] == 1 && code[2] == OPCODE_STORE_THIS_FIELD) {
+        if (code[4] == OPCODE_RETURN) {
+            // x=(v) { return x = v }
+            fn->fieldAccessor = FA_SETTER_RETURN;
+        } else if (count >= 7 && code[4] == OPCODE_POP && code[5] == OPCODE_PUSH_NULL && code[6] == OPCODE_RETURN) {
+            // x=(v) { x = v }
+            fn->fieldAccessor = FA_SETTER;
+        }
+    }
+}
+
 // 结束编译单元的编译工作，在直接外层编译单元中为其创建闭包
 // 编译单元本质就是指令流单元
-#if DEBUG
-static ObjFn *endCompileUnit(CompileUnit *cu, const char *debugName, uint32_t debugNameLen) {
-    // 如果处于调试阶段，会额外调用 bindDebugFnName 将函数名 debugName 写入到 cu->fn->debug 中
-    bindDebugFnName(cu->curLexer->vm, cu->fn->debug, debugName, debugNameLen);
-#else
 static ObjFn *endCompileUnit(CompileUnit *cu) {
-#endif
-
     // 生成【标识编译单元编译结束】的指令
     writeOpCode(cu, OPCODE_END);
+    markFieldAccessor(cu->fn);
+
+    // 指令流已经写完，编码行号表的最后一段并收缩其内存
+    lineTableSeal(cu->curLexer->vm, &cu->fn->lineTable);
+
+    if (compileStats != NULL) {
+        recordCompileUnitStats(cu);
+    }
 
     if (cu->enclosingUnit != NULL) {
         // 将当前编译单元的 cu->fn (其中就包括了该编译单元的指令流 cu->fn->instrStream)
@@ -847,16 +962,64 @@ static void processParaList(CompileUnit *cu, Signature *sign) {
     } while (matchToken(cu->curLexer, TOKEN_COMMA));
 }
 
-// 基于方法签名生成【调用方法】的指令
-// 包括 callX 和 superX，即普通方法和基类方法
-static void emitCallBySignature(CompileUnit *cu, Signature *sign, OpCode opcode) {
+// 获取方法签名对应的方法在 vm->allMethodNames 中的索引
+static int getSignatureSymbol(CompileUnit *cu, Signature *sign) {
     // MAX_SIGN_LEN 为方法签名的最大长度
     char signBuffer[MAX_SIGN_LEN];
     // 将方法的签名对象转化成字符串 signBuffer
     uint32_t length = sign2String(sign, signBuffer);
 
     // 确保名为 signBuffer 的方法已经在 cu->curLexer->vm->allMethodNames 中，没有查找到，则向其中添加
-    int symbolIndex = ensureSymbolExist(cu->curLexer->vm, &cu->curLexer->vm->allMethodNames, signBuffer, length);
+    return ensureSymbolExist(cu->curLexer->vm, &cu->curLexer->vm->allMethodNames, signBuffer, length);
+}
+
+// 可以由内联指令 OPCODE_INTRINSICx 代替的核心类方法
+typedef struct {
+    const char *name;
+    SignatureType type;
+    uint32_t argNum;
+    Intrinsic intrinsic;
+} IntrinsicMethod;
+
+static const IntrinsicMethod intrinsicMethods[] = {
+    {"count", SIGN_GETTER, 0, INTRINSIC_COUNT},
+    {"abs", SIGN_GETTER, 0, INTRINSIC_ABS},
+    {"sqrt", SIGN_GETTER, 0, INTRINSIC_SQRT},
+    {"floor", SIGN_GETTER, 0, INTRINSIC_FLOOR},
+    {"isInteger", SIGN_GETTER, 0, INTRINSIC_IS_INTEGER},
+    {"toString", SIGN_GETTER, 0, INTRINSIC_TO_STRING},
+    {"containsKey", SIGN_METHOD, 1, INTRINSIC_CONTAINS_KEY}
+};
+
+// 查找方法签名对应的 Intrinsic，不能由内联指令代替时返回 -1
+static int getIntrinsic(Signature *sign) {
+    uint32_t idx = 0;
+    while (idx < sizeof(intrinsicMethods) / sizeof(intrinsicMethods[0])) {
+        const IntrinsicMethod *method = &intrinsicMethods[idx];
+        if (sign->type == method->type && sign->argNum == method->argNum &&
+            sign->length == strlen(method->name) && memcmp(sign->name, method->name, sign->length) == 0) {
+            return method->intrinsic;
+        }
+        idx++;
+    }
+    return -1;
+}
+
+// 基于方法签名生成【调用方法】的指令
+// 包括 callX 和 superX，即普通方法和基类方法
+static void emitCallBySignature(CompileUnit *cu, Signature *sign, OpCode opcode) {
+    int symbolIndex = getSignatureSymbol(cu, sign);
+
+    // 调用的是 list.count、x.abs 这类核心类的方法时，生成内联指令 OPCODE_INTRINSICx，
+    // 操作数为 1 个字节的 Intrinsic 和 2 个字节的方法索引，接收者不是对应核心类的对象时，虚拟机用方法索引照常调用方法
+    if (opcode == OPCODE_CALL0) {
+        int intrinsic = getIntrinsic(sign);
+        if (intrinsic != -1) {
+            writeOpCodeByteOperand(cu, OPCODE_INTRINSIC0 + sign->argNum, intrinsic);
+            writeShortOperand(cu, symbolIndex);
+            return;
+        }
+    }
 
     // 写入调用方法的指令，其中：
     // 操作码为 callX 或 superX，X 表示调用方法的参数个数，例如 OPCODE_CALL15
@@ -929,7 +1092,7 @@ static void emitGetterMethodCall(CompileUnit *cu, Signature *sign, OpCode opCode
 
         // 开始编译传入的函数
         CompileUnit fnCU;
-        initCompileUnit(cu->curLexer, &fnCU, cu, false);
+        initCompileUnit(cu->curLexer, &fnCU, cu, false, NULL);
         // 临时的函数签名，用于编译传入的函数
         Signature tempFnSign = {SIGN_METHOD, "", 0, 0};
         // 如果下一个字符为 |，说明该传入的函数也有参数
@@ -941,20 +1104,8 @@ static void emitGetterMethodCall(CompileUnit *cu, Signature *sign, OpCode opCode
         fnCU.fn->argNum = tempFnSign.argNum;
         // 开始编译传入的函数的函数体，将该指令写进该函数自己的指令流中
         compileBody(&fnCU, false);
-#if DEBUG
-        // 以接受块参数（即传入函数）的方法来命名传入函数，传入函数名=方法名+" block arg"
-        // 其中加 10，是因为 " block arg" 有 10 个字符
-        char fnName[MAX_SIGN_LEN + 10] = {'\0'};
-        // 将接受块参数的方法的签名转化成字符串，并写入到 fnName 中，最后返回字符串的长度
-        uint32_t len = sign2String(&newSign, fnName);
-        // void *memmove(void *str1, const void *str2, size_t n) 从 str2 复制 n 个字符到 str1
-        // 在上一行生成的字符串结尾追加字符串 " block arg"
-        memmove(fnName + len, " block arg", 10);
-        endCompileUnit(&fnCU, fnName, len + 10);
-#else
         // 结束编译传入的函数
         endCompileUnit(&fnCU);
-#endif
     }
 
     // 如果是构造函数类型的方法，
@@ -1466,40 +1617,228 @@ static void emitLoadModuleVar(CompileUnit *cu, const char *name) {
     writeOpCodeShortOperand(cu, OPCODE_LOAD_MODULE_VAR, index);
 }
 
+// 生成【将常量 value 压入到运行时栈顶】的指令，true、false、null 有专门的指令，不必放入常量表
+static void emitConstantValue(CompileUnit *cu, Value value) {
+    switch (value.type) {
+        case VT_NULL:
+            writeOpCode(cu, OPCODE_PUSH_NULL);
+            break;
+        case VT_TRUE:
+            writeOpCode(cu, OPCODE_PUSH_TRUE);
+            break;
+        case VT_FALSE:
+            writeOpCode(cu, OPCODE_PUSH_FALSE);
+            break;
+        default:
+            emitLoadConstant(cu, value);
+    }
+}
+
+// 初始化编译字面量的状态，isConstant 为 false 时不暂存常量，所有元素都直接生成压栈的指令
+static void initLiteralBuilder(LiteralBuilder *builder, bool isMap, bool isConstant) {
+    builder->isMap = isMap;
+    builder->isConstant = isConstant;
+    builder->isBuilt = false;
+    builder->elementNum = 0;
+    ValueBufferInit(&builder->constants);
+}
+
+// 生成【取走运行时栈顶的 elementNum 个元素，按顺序建成 list 或 map 并压入运行时栈顶】的指令
+static void emitBuildLiteral(CompileUnit *cu, LiteralBuilder *builder) {
+    writeOpCodeShortOperand(cu, builder->isMap ? OPCODE_BUILD_MAP : OPCODE_BUILD_LIST, builder->elementNum);
+    // opcode.inc 中只计入了压入的结果，取走的元素个数由操作数决定，在这里减去
+    cu->stackSlotNum -= builder->isMap ? builder->elementNum * 2 : builder->elementNum;
+    builder->elementNum = 0;
+}
+
+// 开始生成一个元素（map 为键值对）的指令之前调用
+// 等待取走的元素已达到一条 BUILD 指令的上限时，先把它们建成 list 或 map，之后的元素改为逐个调用 addCore_ 添加
+static void beginLiteralElement(CompileUnit *cu, LiteralBuilder *builder) {
+    if (!builder->isBuilt && builder->elementNum == MAX_BUILD_ELEMENT_NUM) {
+        emitBuildLiteral(cu, builder);
+        builder->isBuilt = true;
+    }
+}
+
+// 一个元素（map 为键和值）已经压入运行时栈或者已经暂存为常量之后调用
+static void endLiteralElement(CompileUnit *cu, LiteralBuilder *builder) {
+    if (builder->isConstant) {
+        return;
+    }
+    if (builder->isBuilt) {
+        // 此时 list 或 map 位于元素之下，和原来的字面量一样调用 addCore_ 添加元素
+        if (builder->isMap) {
+            emitCall(cu, "addCore_(_,_)", 13, 2);
+        } else {
+            emitCall(cu, "addCore_(_)", 11, 1);
+        }
+    } else {
+        builder->elementNum++;
+    }
+}
+
+// 遇到第一个不是常量的元素时调用，为之前暂存的常量补上压栈的指令，此后不再暂存常量
+// map 的键是常量而值不是时，最后暂存的是这个键值对的键，补上它之后由调用方继续生成值的指令
+static void flushLiteralConstants(CompileUnit *cu, LiteralBuilder *builder) {
+    builder->isConstant = false;
+    uint32_t valueNum = builder->isMap ? 2 : 1;
+    uint32_t completeNum = builder->constants.count - builder->constants.count % valueNum;
+    uint32_t idx = 0;
+    while (idx < completeNum) {
+        beginLiteralElement(cu, builder);
+        emitConstantValue(cu, builder->constants.datas[idx]);
+        if (builder->isMap) {
+            emitConstantValue(cu, builder->constants.datas[idx + 1]);
+        }
+        endLiteralElement(cu, builder);
+        idx += valueNum;
+    }
+
+    // 正在编译的元素开始时还在暂存常量，没有检查 BUILD 指令的上限，在这里补上检查
+    beginLiteralElement(cu, builder);
+    if (idx < builder->constants.count) {
+        emitConstantValue(cu, builder->constants.datas[idx]);
+    }
+    ValueBufferClear(cu->curLexer->vm, &builder->constants);
+}
+
+// 对数字常量取负，结果与运行时调用 Num 的 - 方法相同
+static Value negateConstant(Value num) {
+    // 0 取负是 -0，只能用 double 表示
+    if (VALUE_IS_INT(num) && VALUE_TO_INT(num) != 0) {
+        return INT_TO_VALUE(-(int64_t)VALUE_TO_INT(num));
+    }
+    return NUM_TO_VALUE(-VALUE_TO_NUM(num));
+}
+
+// 编译字面量中的一个值，即 list 的元素、map 的键或值，rbp 为编译该值所用的绑定权值
+// 到目前为止的元素都是常量且该值也只是一个常量（数字、字符串、true、false、null 或负号加数字）时，不生成指令，只暂存该常量
+// 值之后紧跟的是 follow 或 end 时才说明该值只是一个常量，而要看到这个 token，常量本身就已经读过了，
+// 所以不是常量时，要为已经读过的常量或负号补上指令，再像 expression 一样继续编译后面的中缀部分
+static void literalValue(CompileUnit *cu, LiteralBuilder *builder, BindPower rbp, TokenType follow, TokenType end) {
+    Lexer *lexer = cu->curLexer;
+    if (!builder->isConstant) {
+        expression(cu, rbp);
+        return;
+    }
+    bool canAssign = rbp < BP_ASSIGN;
+
+    // 负号之后是数字时才可能是负数常量
+    if (matchToken(lexer, TOKEN_SUB)) {
+        if (lexer->curToken.type != TOKEN_NUM) {
+            flushLiteralConstants(cu, builder);
+            unaryOperator(cu, canAssign);
+            expressionTail(cu, rbp, canAssign);
+            return;
+        }
+        Value num = lexer->curToken.value;
+        getNextToken(lexer);
+        if (lexer->curToken.type == follow || lexer->curToken.type == end) {
+            ValueBufferAdd(lexer->vm, &builder->constants, negateConstant(num));
+            return;
+        }
+        // 例如 -1.abs 或 -2 * x，和 unaryOperator 一样先编译负号的操作数，再调用 - 方法
+        flushLiteralConstants(cu, builder);
+        emitLoadConstant(cu, num);
+        expressionTail(cu, BP_UNARY, false);
+        emitCall(cu, "-", 1, 0);
+        expressionTail(cu, rbp, canAssign);
+        return;
+    }
+
+    Value constant;
+    switch (lexer->curToken.type) {
+        case TOKEN_NUM:
+        case TOKEN_STRING:
+            constant = lexer->curToken.value;
+            break;
+        case TOKEN_TRUE:
+            constant = VT_TO_VALUE(VT_TRUE);
+            break;
+        case TOKEN_FALSE:
+            constant = VT_TO_VALUE(VT_FALSE);
+            break;
+        case TOKEN_NULL:
+            constant = VT_TO_VALUE(VT_NULL);
+            break;
+        default:
+            flushLiteralConstants(cu, builder);
+            expression(cu, rbp);
+            return;
+    }
+    getNextToken(lexer);
+    if (lexer->curToken.type == follow || lexer->curToken.type == end) {
+        ValueBufferAdd(lexer->vm, &builder->constants, constant);
+        return;
+    }
+    flushLiteralConstants(cu, builder);
+    emitConstantValue(cu, constant);
+    expressionTail(cu, rbp, canAssign);
+}
+
+// 字面量的元素都已编译完，生成建成 list 或 map 的指令
+static void endLiteral(CompileUnit *cu, LiteralBuilder *builder) {
+    VM *vm = cu->curLexer->vm;
+    if (builder->isConstant && builder->constants.count > 0) {
+        // 整个字面量都是常量，在编译时建好放入常量表，运行时由 OPCODE_COPY_CONSTANT 复制一份，所以常量表中的对象不会被脚本修改
+        Value literal;
+        if (builder->isMap) {
+            ObjMap *objMap = newObjMap(vm);
+            mapReserve(vm, objMap, builder->constants.count / 2);
+            uint32_t idx = 0;
+            while (idx < builder->constants.count) {
+                mapSet(vm, objMap, builder->constants.datas[idx], builder->constants.datas[idx + 1]);
+                idx += 2;
+            }
+            literal = OBJ_TO_VALUE(objMap);
+        } else {
+            ObjList *objList = newObjList(vm, builder->constants.count);
+            memcpy(objList->elements.datas, builder->constants.datas, sizeof(Value) * builder->constants.count);
+            literal = OBJ_TO_VALUE(objList);
+        }
+        writeOpCodeShortOperand(cu, OPCODE_COPY_CONSTANT, addConstant(cu, literal));
+    } else if (!builder->isBuilt) {
+        emitBuildLiteral(cu, builder);
+    }
+    ValueBufferClear(vm, &builder->constants);
+}
+
 // 编译内嵌表达式，即内嵌表达式的 nud 方法
 // 内嵌表达式即字符串内可以使用变量，类似 JavaScript 中的字符串模板
 // 例如本书规定写法形式是 %(变量名)
 // 例如 a %(b+c) d %(e) f 会被编译成 ["a", b+c, " d", e, "f "].join()，
 // 其中 a 和 d 是 TOKEN_INTERPOLATION，b/c/e 是 TOKEN_ID，f 是 TOKEN_STRING
 static void stringInterpolation(CompileUnit *cu, bool canAssign UNUSED) {
-    // 创造一个 list 实例，用来保存下面拆分字符串得到的各个部分
-    // 加载 List 模块变量到运行时栈顶
-    emitLoadModuleVar(cu, "List");
-    // 调用 List 的 new 方法，创造一个 list 实例
-    emitCall(cu, "new()", 5, 0);
+    // 和 list 字面量一样，先将拆分字符串得到的各个部分依次压入运行时栈，最后用一条 BUILD 指令建成 list
+    // 各部分中总有表达式，所以不暂存常量
+    LiteralBuilder builder;
+    initLiteralBuilder(&builder, false, false);
 
     // 每次循环处理字符串中的一个内嵌表达式
-    // 例如 a %(b+c) d %(e) f，先将类型为 TOKEN_INTERPOLATION 的字符 a 添加到 list，再将内嵌表达式 b+c 添加到 list，这是一次循环
+    // 例如 a %(b+c) d %(e) f，先将类型为 TOKEN_INTERPOLATION 的字符 a 压入运行时栈，再将内嵌表达式 b+c 的结果压入运行时栈，这是一次循环
     // 下一次循环再处理 d %(e)
     do {
         // 1. 先编译字符串中的类型为 TOKEN_INTERPOLATION 的字符，即生成【加载常量（即该字符）到常量表，并将常量压入到运行时栈顶】的指令
+        beginLiteralElement(cu, &builder);
         literal(cu, false);
-        // 调用 list 实例对象的 addCore 方法，将运行时栈顶的字符添加到 list 实例中
-        emitCall(cu, "addCore_(_)", 11, 1);
+        endLiteralElement(cu, &builder);
 
         // 2. 然后编译内嵌表达式，即生成【计算表达式，并将结果压入到运行时栈顶】的指令
+        beginLiteralElement(cu, &builder);
         expression(cu, BP_LOWEST);
-        // 调用 list 实例对象的 addCore 方法，将上面的表达式结果从运行时栈顶保存到 list 实例中
-        emitCall(cu, "addCore_(_)", 11, 1);
+        endLiteralElement(cu, &builder);
     } while (matchToken(cu->curLexer, TOKEN_INTERPOLATION));
 
     // 读取最后的字符串，例如 a %(b+c) d %(e) f 中的 f
     // 如果结尾没有字符串，则报错
     assertCurToken(cu->curLexer, TOKEN_STRING, "expect string at teh end of interpolation!");
     // 编译最后的字符串，即生成【加载常量（即该字符）到常量表，并将常量压入到运行时栈顶】的指令
+    beginLiteralElement(cu, &builder);
     literal(cu, false);
-    // 调用 list 实例对象的 addCore 方法，将最后的字符串从运行时栈顶保存到 list 实例中
-    emitCall(cu, "addCore_(_)", 11, 1);
+    endLiteralElement(cu, &builder);
+
+    // 生成【将运行时栈顶的各个部分建成 list】的指令
+    endLiteral(cu, &builder);
 
     // 调用 list 实例的 join 方法，将 list 中保存的字符合成一个字符串
     emitCall(cu, "join()", 6, 0);
@@ -1570,13 +1909,10 @@ static void parentheses(CompileUnit *cu, bool canAssign UNUSED) {
 // 编译 map 对象字面量，即大括号 { 的 nud 方法
 static void mapLiteral(CompileUnit *cu, bool canAssign UNUSED) {
     // 执行本函数时，preToken 是字符 { curToken 是字符 { 后面的字符
-    // 这种方式创建 map 对象其实是一种语法糖，内部也是先调用 Map.new() 方法创建一个 map 对象实例，然后通过 map.addCore_() 添加中括号里面的元素
-
-    // 先创建 map 对象
-    // 1. 生成【加载模块变量中的 Map 类到运行时栈顶，用于调用方法时，从该类的 methods 中定位到方法】的指令
-    emitLoadModuleVar(cu, "Map");
-    // 2. 生成【调用 Map 类的 new 方法，创造一个 map 实例】的指令
-    emitCall(cu, "new()", 5, 0);
+    // 先将各个键值对依次压入运行时栈，最后用一条 OPCODE_BUILD_MAP 指令按键值对个数一次建成 map，预先分配好容量，不必逐个调用 addCore_ 反复扩容
+    // 键和值都是常量时，map 在编译时就已建好，运行时只复制一份
+    LiteralBuilder builder;
+    initLiteralBuilder(&builder, true, true);
 
     do {
         // 如果当前字符为 }，说明是空 map，即 {} ，所以无需循环
@@ -1584,50 +1920,50 @@ static void mapLiteral(CompileUnit *cu, bool canAssign UNUSED) {
             break;
         }
 
+        beginLiteralElement(cu, &builder);
         // 生成【计算冒号左边的 key 的表达式，并将计算结果压入到运行时栈】的指令
-        // 注意此处第二个参数不能传入 BP_LOWEST，否则整个 map 字面量都会被处理，正常是处理到冒号 : 就终止，原因请参见 expression 实现
-        expression(cu, BP_UNARY);
+        // 注意此处绑定权值不能为 BP_LOWEST，否则整个 map 字面量都会被处理，正常是处理到冒号 : 就终止，原因请参见 expression 实现
+        literalValue(cu, &builder, BP_UNARY, TOKEN_COLON, TOKEN_COLON);
 
         // key 和 value 之间必须为冒号 :
         assertCurToken(cu->curLexer, TOKEN_COLON, "expect ':' after key!");
 
-        // 生成【计算冒号右边的 key 的表达式，并将计算结果压入到运行时栈】的指令
-        expression(cu, BP_LOWEST);
-
-        // 生成【调用 addCore_(_,_) 方法，将 key 和 value 写入到 map 对象实例中】
-        // 此时 value 和 key 分别位于运行时栈顶和次顶
-        emitCall(cu, "addCore_(_,_)", 13, 2);
+        // 生成【计算冒号右边的 value 的表达式，并将计算结果压入到运行时栈】的指令
+        literalValue(cu, &builder, BP_LOWEST, TOKEN_COMMA, TOKEN_RIGHT_BRACE);
+        endLiteralElement(cu, &builder);
     } while (matchToken(cu->curLexer, TOKEN_COMMA));
     // map 字面量定义必须以 } 结尾
     assertCurToken(cu->curLexer, TOKEN_RIGHT_BRACE, "map literal should end with '}'!");
+
+    // 生成【将运行时栈顶的键值对建成 map】或【复制编译时建好的 map】的指令
+    endLiteral(cu, &builder);
 }
 
 // 编译用于字面量的中括号，即用于字面量的中括号的 nud 方法
 // 例如 var listA = ["dang", 1+2*3, 'x']
 // 执行本函数时，preToken 为 [，curToken 为 [ 后面的字符
 static void listLiteral(CompileUnit *cu, bool canAssign UNUSED) {
-    // 这种方式创建 list 对象其实是一种语法糖，内部也是先调用 List.new() 方法创建一个 list 对象实例，然后通过 list.addCore_() 添加中括号里面的元素
-
-    // 先创建 list 对象
-    // 1. 生成【加载模块变量中的 List 类到运行时栈顶，用于调用方法时，从该类的 methods 中定位到方法】的指令
-    emitLoadModuleVar(cu, "List");
-    // 2. 生成【调用 List 类的 new 方法，创造一个 list 实例】的指令
-    emitCall(cu, "new()", 5, 0);
+    // 先将各个元素依次压入运行时栈，最后用一条 OPCODE_BUILD_LIST 指令按元素个数一次建成 list，不必逐个调用 addCore_ 反复扩容
+    // 元素都是常量时，list 在编译时就已建好，运行时只复制一份
+    LiteralBuilder builder;
+    initLiteralBuilder(&builder, false, true);
 
     do {
         // 如果当前字符为 ]，说明是空列表，即 [] ，所以无需循环
         if (cu->curLexer->curToken.type == TOKEN_RIGHT_BRACKET) {
             break;
         }
-        // 先生成【计算中括号里的每一个表达式的结果，并压入到运行时栈顶】的指令，一次循环计算一个表达式
+        // 生成【计算中括号里的每一个表达式的结果，并压入到运行时栈顶】的指令，一次循环计算一个表达式
         // 例如 var listA = ["dang", 1+2*3, 'x']，第二次循环就计算 1+2*3 的结果 7，然后将 7 压入到运行时栈顶
-        expression(cu, BP_LOWEST);
-
-        // 将运行时栈顶的值（即表达式的计算结果）写入到 list 对象实例中
-        emitCall(cu, "addCore_(_)", 11, 1);
+        beginLiteralElement(cu, &builder);
+        literalValue(cu, &builder, BP_LOWEST, TOKEN_COMMA, TOKEN_RIGHT_BRACKET);
+        endLiteralElement(cu, &builder);
     } while (matchToken(cu->curLexer, TOKEN_COMMA));
     // list 字面量定义必须以 ] 结尾
     assertCurToken(cu->curLexer, TOKEN_RIGHT_BRACKET, "expect ']' after list element!");
+
+    // 生成【将运行时栈顶的元素建成 list】或【复制编译时建好的 list】的指令
+    endLiteral(cu, &builder);
 }
 
 // 编译用于索引 list 元素的中括号，即用于字面量的中括号的 led 方法
@@ -1665,6 +2001,16 @@ static void subscript(CompileUnit *cu, bool canAssign) {
         // 生成【计算右边表达式，并将计算结果压入到运行时栈顶】的指令
         expression(cu, BP_LOWEST);
     }
+    // 最常见的 list[x]、map[x] 及其赋值形式生成专门的下标指令，运行时对 list、map 和字符串直接存取，其余情况仍调用方法
+    // 操作数和 OPCODE_CALLx 一样是方法在 vm->allMethodNames 中的索引，供调用方法时使用
+    if (sign.type == SIGN_SUBSCRIPT && sign.argNum == 1) {
+        writeOpCodeShortOperand(cu, OPCODE_SUBSCRIPT_GET, getSignatureSymbol(cu, &sign));
+        return;
+    }
+    if (sign.type == SIGN_SUBSCRIPT_SETTER && sign.argNum == 2) {
+        writeOpCodeShortOperand(cu, OPCODE_SUBSCRIPT_SET, getSignatureSymbol(cu, &sign));
+        return;
+    }
     // 基于方法签名生成【调用方法】的指令
     emitCallBySignature(cu, &sign, OPCODE_CALL0);
 }
@@ -1852,7 +2198,7 @@ SymbolBindRule Rules[] = {
     /* TOKEN_CLASS */ UNUSED_RULE,
     /* TOKEN_THIS */ PREFIX_SYMBOL(this),
     /* TOKEN_STATIC */ UNUSED_RULE,
-    /* TOKEN_IS */ INFIX_OPERATOR("is", BP_IS),
+    /* TOKEN_IS */ {"is", BP_IS, NULL, isOperator, infixMethodSignature},
     /* TOKEN_SUPER */ PREFIX_SYMBOL(super),
     /* TOKEN_IMPORT */ UNUSED_RULE,
     /* TOKEN_COMMA */ UNUSED_RULE,
@@ -1889,6 +2235,15 @@ SymbolBindRule Rules[] = {
     /* TOKEN_EOF */ UNUSED_RULE,
 };
 
+// 编译 is 运算符，例如 x is Foo
+// is 生成 OPCODE_IS 指令，由虚拟机借助类的祖先表判断，操作数为方法 is(_) 在 vm->allMethodNames 中的索引，
+// 左操作数的类重新定义了 is(_) 时，虚拟机用它照常调用方法
+static void isOperator(CompileUnit *cu, bool canAssign UNUSED) {
+    // 此时左操作数已在栈顶，生成【计算右操作数（即类），并将结果压入到运行时栈顶】的指令
+    expression(cu, BP_IS);
+    writeOpCodeShortOperand(cu, OPCODE_IS, ensureSymbolExist(cu->curLexer->vm, &cu->curLexer->vm->allMethodNames, "is(_)", 5));
+}
+
 // 中缀运算符（例如 + - * /）的 led 方法
 // 即调用此方法对中缀运算符进行语法分析
 // 切记，进入任何一个符号的 led 或 nud 方法时，preToken 都是该方法所属符号（即操作符），curToken 为该方法所属符号的右边符号（即操作数）
@@ -1959,6 +2314,11 @@ static void expression(CompileUnit *cu, BindPower rbp) {
     // 执行操作数 w 的 nud 方法，计算操作数 w 的值
     nud(cu, canAssign);
 
+    expressionTail(cu, rbp, canAssign);
+}
+
+// 编译表达式中已经编译完的操作数 w 之后的中缀部分
+static void expressionTail(CompileUnit *cu, BindPower rbp, bool canAssign) {
     // rbp 为运算符 S 的对操作数的绑定权值
     // 因 curToken 目前为运算符 T，所以 Rules[cu->curLexer->curToken.type].lbp 为运算符 T 对操作数的绑定权值
     // 如果运算符 S 绑定权值大于运算符 T 绑定权值，则操作数 w 为运算符 S 的右操作数，则不进入循环，直接将操作数 w 作为运算符 S 的右操作数返回
@@ -2322,6 +2682,28 @@ static void compileForStatement(CompileUnit *cu) {
     leaveScope(cu);
 }
 
+// 如果 return 后面的表达式以方法调用结束，就把该调用改为尾调用 OPCODE_TAIL_CALLx
+// 调用的结果就是函数的返回值，所以虚拟机可以复用当前帧栈 frame 执行被调用的方法，递归时帧栈和运行时栈不再增长
+// 其后的 OPCODE_RETURN 仍然保留，用于被调用的是原生方法的情况
+// 模块顶层的代码只执行一次，不会递归，所以不做尾调用
+static void markTailCall(CompileUnit *cu) {
+    if (cu->enclosingUnit == NULL || cu->lastOpCodeIndex < 0) {
+        return;
+    }
+    Byte *opCode = &cu->fn->instrStream.datas[cu->lastOpCodeIndex];
+    uint32_t nextIndex = cu->lastOpCodeIndex + 1 + getBytesOfOperands(cu->fn->instrStream.datas, cu->fn->constants.datas, cu->lastOpCodeIndex);
+    // 调用指令之后没有其他指令，即调用指令及其操作数正好位于指令流末尾
+    if (nextIndex != cu->fn->instrStream.count) {
+        return;
+    }
+    if (*opCode >= OPCODE_CALL0 && *opCode <= OPCODE_CALL16) {
+        *opCode += OPCODE_TAIL_CALL0 - OPCODE_CALL0;
+    } else if (*opCode == OPCODE_INTRINSIC0 || *opCode == OPCODE_INTRINSIC1) {
+        // 内联指令照常调用方法时才需要尾调用，在 Intrinsic 操作数上做标记
+        opCode[1] |= INTRINSIC_TAIL_CALL;
+    }
+}
+
 // 编译 return 语句
 inline static void compileReturn(CompileUnit *cu) {
     // 执行此函数时已经读入了 return，即 preToken 为 return
@@ -2334,6 +2716,7 @@ inline static void compileReturn(CompileUnit *cu) {
     } else {
         // 否则就是明确了返回值，则生成【计算 return 后面的表达式，并将计算结果压入到运行时栈顶】的指令
         expression(cu, BP_LOWEST);
+        markTailCall(cu);
     }
     // 生成【退出当前函数并弹出栈顶的值作为返回值】的指令
     writeOpCode(cu, OPCODE_RETURN);
@@ -2468,7 +2851,11 @@ static void emitCreateInstance(CompileUnit *cu, Signature *sign, uint32_t method
     // 定义一个用于存储创建对象的指令的编译单元
     CompileUnit methodCU;
     // 初始化编译单元 methodCU，并将该编译单元作为 cu 的内层编译单元
-    initCompileUnit(cu->curLexer, &methodCU, cu, true);
+    initCompileUnit(cu->curLexer, &methodCU, cu, true, NULL);
+    // 静态方法 new 的参数没有声明为局部变量，但调用时同样位于运行时栈中，要计入栈的使用量
+    // 否则下面的调用指令会让 stackSlotNum 减到 0 以下，无符号数下溢成 4294967295
+    methodCU.stackSlotNum += sign->argNum;
+    methodCU.fn->maxStackSlotUsedNum = methodCU.stackSlotNum;
 
     // 1. 生成【类对象在当前运行时栈的栈底（即 stack[0]），该操作码会创建一个类的实例，然后用该实例替换栈底的类对象】的指令
     writeOpCode(&methodCU, OPCODE_CONSTRUCT);
@@ -2483,13 +2870,128 @@ static void emitCreateInstance(CompileUnit *cu, Signature *sign, uint32_t method
     // 3. 生成【返回 上面指令调用的实例对象的实例方法 new 返回的实例对象】的指令
     writeOpCode(&methodCU, OPCODE_RETURN);
 
-#if DEBUG
-    endCompileUnit(&methodCU, "", 0);
-#else
     // 生成该方法的闭包，并压入到运行时栈顶（由操作码为 OPCODE_CREATE_CLOSURE 的指令实现）
     // 等待下面被定义为类的静态方法 new
     endCompileUnit(&methodCU);
-#endif
+}
+
+// 新建延迟编译的函数体，将 [start, end) 之间的源码片段复制一份保存起来
+// 源码串未必会一直有效（例如命令行中输入的源码），所以需要复制
+static LazyBody *newLazyBody(VM *vm, const char *start, const char *end, int lineNo) {
+    LazyBody *lazyBody = ALLOCATE(vm, LazyBody);
+    if (lazyBody == NULL) {
+        MEM_ERROR("allocate LazyBody failed!");
+    }
+
+    lazyBody->length = (uint32_t)(end - start);
+    lazyBody->source = ALLOCATE_ARRAY(vm, char, lazyBody->length + 1);
+    if (lazyBody->source == NULL) {
+        MEM_ERROR("allocate source of LazyBody failed!");
+    }
+    memcpy(lazyBody->source, start, lazyBody->length);
+    lazyBody->source[lazyBody->length] = '\0';
+
+    lazyBody->lineNo = lineNo;
+    lazyBody->isMethod = false;
+    lazyBody->isStatic = false;
+    lazyBody->classInfo = NULL;
+    lazyBody->fieldNum = 0;
+    lazyBody->staticFieldNum = 0;
+    lazyBody->class = NULL;
+    return lazyBody;
+}
+
+// 释放尚未编译的函数体
+void freeLazyBody(VM *vm, LazyBody *lazyBody) {
+    LazyClassInfo *classInfo = lazyBody->classInfo;
+    // 类信息被同一个类中所有延迟编译的方法共享，最后一个方法释放时才回收
+    if (classInfo != NULL && --classInfo->refCount == 0) {
+        symbolTableClear(vm, &classInfo->fields);
+        symbolTableClear(vm, &classInfo->staticFields);
+        IntBufferClear(vm, &classInfo->staticFieldIndex);
+        DEALLOCATE(vm, classInfo);
+    }
+    DEALLOCATE_ARRAY(vm, lazyBody->source, lazyBody->length + 1);
+    DEALLOCATE(vm, lazyBody);
+}
+
+// 判断模块编译单元中的局部变量 var 是否是类 classBK 的静态属性，即形式为 “Cls类名 静态属性名”
+static bool isStaticFieldOf(LocalVar *var, ClassBookKeep *classBK) {
+    uint32_t clsLen = classBK->name->value.length;
+    return var->name != NULL && var->length > clsLen + 4 &&
+           memcmp(var->name, "Cls", 3) == 0 &&
+           memcmp(var->name + 3, classBK->name->value.start, clsLen) == 0 &&
+           var->name[3 + clsLen] == ' ';
+}
+
+// 跳过方法体，将方法设置成延迟编译
+// 调用此函数时已经读入了方法体的 {，sourceStart 为方法名的起始地址
+static void makeLazyMethod(CompileUnit *cu, CompileUnit *methodCU, const char *sourceStart, int lineNo) {
+    VM *vm = cu->curLexer->vm;
+    ClassBookKeep *classBK = cu->enclosingClassBK;
+
+    // 跳过方法体，执行后 preToken 为方法体的 }
+    skipBlock(cu->curLexer);
+    LazyBody *lazyBody = newLazyBody(vm, sourceStart, cu->curLexer->preToken.start + 1, lineNo);
+    lazyBody->isMethod = true;
+    lazyBody->isStatic = classBK->isStatic;
+
+    // 同一个类中延迟编译的方法共享一份类信息，在类编译结束时填充
+    if (classBK->lazyClassInfo == NULL) {
+        LazyClassInfo *classInfo = ALLOCATE(vm, LazyClassInfo);
+        if (classInfo == NULL) {
+            MEM_ERROR("allocate LazyClassInfo failed!");
+        }
+        classInfo->name = classBK->name;
+        StringBufferInit(&classInfo->fields);
+        StringBufferInit(&classInfo->staticFields);
+        IntBufferInit(&classInfo->staticFieldIndex);
+        classInfo->refCount = 0;
+        classBK->lazyClassInfo = classInfo;
+    }
+    classBK->lazyClassInfo->refCount++;
+    lazyBody->classInfo = classBK->lazyClassInfo;
+
+    // 方法体中只能看到在它之前定义的实例属性
+    lazyBody->fieldNum = classBK->fields.count;
+
+    // 方法只可能将类的静态属性引用为 upvalue（静态属性是模块编译单元的局部变量）
+    // 此时还不知道方法体会用到哪些静态属性，而闭包在类定义执行时就要创建，
+    // 所以预先引用目前已定义的全部静态属性，延迟编译时按相同的顺序恢复这些 upvalue
+    uint32_t upvalueNum = 0;
+    uint32_t idx = 0;
+    while (idx < cu->localVarNum) {
+        if (isStaticFieldOf(&cu->localVars[idx], classBK)) {
+            cu->localVars[idx].isUpvalue = true;
+            methodCU->upvalues[upvalueNum].isEnclosingLocalVar = true;
+            methodCU->upvalues[upvalueNum].index = idx;
+            upvalueNum++;
+        }
+        idx++;
+    }
+    methodCU->fn->upvalueNum = upvalueNum;
+    lazyBody->staticFieldNum = upvalueNum;
+
+    methodCU->fn->lazyBody = lazyBody;
+}
+
+// 类编译结束时，将类的实例属性和静态属性保存到延迟编译的方法所共享的类信息中
+static void fillLazyClassInfo(CompileUnit *cu, ClassBookKeep *classBK) {
+    LazyClassInfo *classInfo = classBK->lazyClassInfo;
+
+    // 直接接管 classBK 中的实例属性符号表，classBK 不再释放它
+    classInfo->fields = classBK->fields;
+    StringBufferInit(&classBK->fields);
+
+    uint32_t idx = 0;
+    while (idx < cu->localVarNum) {
+        LocalVar *var = &cu->localVars[idx];
+        if (isStaticFieldOf(var, classBK)) {
+            addSymbol(cu->curLexer->vm, &classInfo->staticFields, var->name, var->length);
+            IntBufferAdd(cu->curLexer->vm, &classInfo->staticFieldIndex, idx);
+        }
+        idx++;
+    }
 }
 
 // 编译方法定义
@@ -2515,6 +3017,10 @@ static void compileMethod(CompileUnit *cu, Variable classVar, bool isStatic) {
     // 并将该签名设置成对应类的 ClassBookKeep 结构中的 signature（指向当前正在编译的方法的签名）
     cu->enclosingClassBK->signature = &sign;
 
+    // 延迟编译时需要记录方法的源码片段，从方法名开始
+    const char *sourceStart = cu->curLexer->curToken.start;
+    int sourceLineNo = cu->curLexer->curToken.lineNo;
+
     // 读入下一个 token，正常来说应该是方法名后面的符号 (
     // 主要是为了后面调用 methodSign 构造方法签名
     getNextToken(cu->curLexer);
@@ -2522,7 +3028,7 @@ static void compileMethod(CompileUnit *cu, Variable classVar, bool isStatic) {
     // 初始化方法的编译单元
     // 注：方法或函数都是独立的指令流，需要独立的编译单元
     CompileUnit methodCU;
-    initCompileUnit(cu->curLexer, &methodCU, cu, true);
+    initCompileUnit(cu->curLexer, &methodCU, cu, true, NULL);
 
     // 构造方法签名
     methodSign(&methodCU, &sign);
@@ -2542,15 +3048,16 @@ static void compileMethod(CompileUnit *cu, Variable classVar, bool isStatic) {
     // 声明方法只是在 vm->allMethodNames 声明方法名，不涉及方法体
     uint32_t methodIndex = declareMethod(cu, signatureString, signLen);
 
-    // 编译方法体，将编译出的指令流写入到自己的编译单元 methodCU
-    compileBody(&methodCU, sign.type == SIGN_CONSTRUCT);
+    if (lazyCompileEnabled) {
+        // 延迟编译：跳过方法体，只记录源码片段，等到方法第一次被调用时再编译
+        makeLazyMethod(cu, &methodCU, sourceStart, sourceLineNo);
+    } else {
+        // 编译方法体，将编译出的指令流写入到自己的编译单元 methodCU
+        compileBody(&methodCU, sign.type == SIGN_CONSTRUCT);
+    }
 
-#if DEBUG
-    endCompileUnit(&methodCU, "", 0);
-#else
     // 结束编译，并生成方法闭包，并压入到运行时栈顶（由操作码为 OPCODE_CREATE_CLOSURE 的指令实现）
     endCompileUnit(&methodCU);
-#endif
 
     // 定义方法
     // 即将索引 methodIndex 对应的方法闭包存储到变量 classVar 指向的类的 class->methods[methodIndex] 中，methodIndex 就是该方法名在 vm->allMethodNames 中的索引
@@ -2665,6 +3172,7 @@ static void compileClassDefinition(CompileUnit *cu) {
     StringBufferInit(&classBK.fields);
     IntBufferInit(&classBK.instantMethods);
     IntBufferInit(&classBK.staticMethods);
+    classBK.lazyClassInfo = NULL;
 
     // 此时 cu 是模块的编译单元，负责跟踪当前编译的类
     // 注：类没有编译单元
@@ -2688,6 +3196,11 @@ static void compileClassDefinition(CompileUnit *cu) {
     // 现在类已经编译完了，回填正确的属性个数
     cu->fn->instrStream.datas[fieldNumIndex] = classBK.fields.count;
 
+    // 如果类中有延迟编译的方法，则保存这些方法编译时需要的类信息
+    if (classBK.lazyClassInfo != NULL) {
+        fillLazyClassInfo(cu, &classBK);
+    }
+
     // classBK 用于在编译类的过程记录一些类的信息，例如 classBK.fields 收集属性，classBK.staticMethods 收集类的静态方法 等，
     // 方便在编译类的过程中做类似判断是否命名冲突等逻辑，等到类的编译结束时，就会回收分配给 classBK 的内存
     symbolTableClear(cu->curLexer->vm, &classBK.fields);
@@ -2702,6 +3215,45 @@ static void compileClassDefinition(CompileUnit *cu) {
     leaveScope(cu);
 }
 
+// 声明 fun 关键字形式的函数定义中的形参
+// 调用此函数时 curToken 为函数名后面的 (，执行后已读入函数体的 {
+static void compileFnParaList(CompileUnit *fnCU) {
+    // 创建临时方法签名，用于后续 processParaList 声明函数参数时，记录参数个数
+    Signature temFnSign = {SIGN_METHOD, "", 0, 0};
+
+    // 函数名后面需要是小括号 (
+    assertCurToken(fnCU->curLexer, TOKEN_LEFT_PAREN, "expect '(' after function name!");
+
+    // 如果后面没有小括号 )，说明该函数有参数需要声明
+    if (!matchToken(fnCU->curLexer, TOKEN_RIGHT_PAREN)) {
+        // 声明函数参数为该函数的局部变量
+        processParaList(fnCU, &temFnSign);
+        // 参数后面需要是小括号 )
+        assertCurToken(fnCU->curLexer, TOKEN_RIGHT_PAREN, "expect ')' after parameter list!");
+    }
+
+    // 将 processParaList 函数中记录的参数个数保存到 fn->argNum 中
+    fnCU->fn->argNum = temFnSign.argNum;
+
+    // 小括号 ) 后面需要是大括号 {
+    assertCurToken(fnCU->curLexer, TOKEN_LEFT_BRACE, "expect '{' at the beginning of method body.");
+}
+
+// 判断 fun 定义的函数体能否延迟编译
+// 模块作用域中 for 循环的循环变量等会成为模块编译单元的局部变量，函数体可能将其引用为 upvalue，
+// 延迟编译时已经无法还原这些局部变量，所以此时不延迟编译
+// 类的静态属性名中有空格，函数体中不可能引用到，不影响延迟编译
+static bool canLazyCompileFn(CompileUnit *cu) {
+    uint32_t idx = 0;
+    while (idx < cu->localVarNum) {
+        if (memchr(cu->localVars[idx].name, ' ', cu->localVars[idx].length) == NULL) {
+            return false;
+        }
+        idx++;
+    }
+    return true;
+}
+
 // 编译 fun 关键字形式的函数定义
 // 本语言完全面向对象,
 // (一)
@@ -2741,37 +3293,26 @@ static void compileFunctionDefinition(CompileUnit *cu) {
 
     // 初始化函数编译单元 fnCU，用于存储编译函数得到的指令流
     CompileUnit fnCU;
-    initCompileUnit(cu->curLexer, &fnCU, cu, false);
+    initCompileUnit(cu->curLexer, &fnCU, cu, false, NULL);
 
-    // 创建临时方法签名，用于后续 processParaList 声明函数参数时，记录参数个数
-    Signature temFnSign = {SIGN_METHOD, "", 0, 0};
+    // 延迟编译时需要记录函数的源码片段，从函数名后面的 ( 开始
+    const char *sourceStart = cu->curLexer->curToken.start;
+    int sourceLineNo = cu->curLexer->curToken.lineNo;
 
-    // 函数名后面需要是小括号 (
-    assertCurToken(cu->curLexer, TOKEN_LEFT_PAREN, "expect '(' after function name!");
+    // 声明函数参数，执行后已读入函数体的 {
+    compileFnParaList(&fnCU);
 
-    // 如果后面没有小括号 )，说明该函数有参数需要声明
-    if (!matchToken(cu->curLexer, TOKEN_RIGHT_PAREN)) {
-        // 声明函数参数为该函数的局部变量
-        processParaList(&fnCU, &temFnSign);
-        // 参数后面需要是小括号 )
-        assertCurToken(cu->curLexer, TOKEN_RIGHT_PAREN, "expect ')' after parameter list!");
+    if (lazyCompileEnabled && canLazyCompileFn(cu)) {
+        // 延迟编译：跳过函数体，只记录源码片段，等到函数第一次被调用时再编译
+        skipBlock(cu->curLexer);
+        fnCU.fn->lazyBody = newLazyBody(cu->curLexer->vm, sourceStart, cu->curLexer->preToken.start + 1, sourceLineNo);
+    } else {
+        // 编译函数体，将指令流写入该函数对应的编译单元 fnCU
+        compileBody(&fnCU, false);
     }
 
-    // 将 processParaList 函数中记录的参数个数保存到 fn->argNum 中
-    fnCU.fn->argNum = temFnSign.argNum;
-
-    // 小括号 ) 后面需要是大括号 {
-    assertCurToken(cu->curLexer, TOKEN_LEFT_BRACE, "expect '{' at the beginning of method body.");
-
-    // 编译函数体，将指令流写入该函数对应的编译单元 fnCU
-    compileBody(&fnCU, false);
-
-#if DEBUG
-    endCompileUnit(&fnCU, fnName, strlen(fnName));
-#else
     // 终止编译，为函数体生成闭包，并压入到运行时栈顶
     endCompileUnit(&fnCU);
-#endif
     // 将运行时栈顶的函数体闭包，保存到索引为 fnNameIndex 的模块变量中
     // 即函数名保存到 curModule->moduleVarName，函数体保存到 curModule->moduleVarValue
     defineVariable(cu, fnNameIndex);
@@ -2885,8 +3426,26 @@ static void compileProgram(CompileUnit *cu) {
     }
 }
 
+// 检查编译 [moduleVarNumBefore, count) 期间新增的模块变量是否都已定义
+// 使用了但尚未定义的模块变量，其值是以行号表示的 VT_NUM，详见 compileModule 中的注释
+static void checkUndefinedModuleVar(Lexer *lexer, ObjModule *objModule, uint32_t moduleVarNumBefore) {
+    uint32_t idx = moduleVarNumBefore;
+    while (idx < objModule->moduleVarValue.count) {
+        if (VALUE_IS_NUM(objModule->moduleVarValue.datas[idx])) {
+            char *str = objModule->moduleVarName.datas[idx].str;
+            uint32_t lineNo = VALUE_TO_NUM(objModule->moduleVarValue.datas[idx]);
+            COMPILE_ERROR(lexer, "line:%d, variable \'%s\' not defined!", lineNo, str);
+        }
+        idx++;
+    }
+}
+
 // 编译模块
-ObjFn *compileModule(VM *vm, ObjModule *objModule, const char *moduleCode) {
+ObjFn *compileModule(VM *vm, ObjModule *objModule, const char *moduleCode, size_t codeLength) {
+    // 编译到一半时不能跳回虚拟机，词法分析器和编译单元会停在半途，所以编译期间 memManager 不拒绝申请，超出堆上限只做标记
+    jmp_buf *allocFailJump = vm->allocFailJump;
+    vm->allocFailJump = NULL;
+
     // 每个模块（文件）都需要一个单独的词法分析器进行编译
     Lexer lexer;
     lexer.parent = vm->curLexer;
@@ -2895,16 +3454,25 @@ ObjFn *compileModule(VM *vm, ObjModule *objModule, const char *moduleCode) {
     // 初始化词法分析器
     if (objModule->name == NULL) {
         // 核心模块对应的词法分析器用 core.script.inc 作为模块名进行初始化
-        initLexer(vm, &lexer, "core.script.inc", moduleCode, objModule);
+        initLexer(vm, &lexer, "core.script.inc", moduleCode, codeLength, objModule);
     } else {
         // 其余模块对应的词法分析器用该模块名进行初始化
-        initLexer(vm, &lexer, (const char *)objModule->name->value.start, moduleCode, objModule);
+        initLexer(vm, &lexer, (const char *)objModule->name->value.start, moduleCode, codeLength, objModule);
     }
 
+    // 时间线中的编译区间，词法分析穿插在编译中，结束时附上区间内累计的词法分析时间
+    uint64_t lexTimeBefore = tracer == NULL ? 0 : tracer->lexTime;
+    TRACE_BEGIN("compileModule", "module", lexer.file)
+    // 编译统计按模块累计编译时间、词法分析时间以及新加入 allMethodNames 的方法名个数
+    uint64_t statsStartTime = compileStats == NULL ? 0 : traceNow();
+    uint64_t statsLexTimeBefore = compileStats == NULL ? 0 : compileStats->lexTime;
+    uint32_t methodNameNumBefore = vm->allMethodNames.count;
+    PROBE_COMPILE_START(objModule, 1)
+
     // 初始化编译单元（模块也有编译单元）
     // 有编译单元的：模块、函数、方法
     CompileUnit moduleCU;
-    initCompileUnit(&lexer, &moduleCU, NULL, false);
+    initCompileUnit(&lexer, &moduleCU, NULL, false, NULL);
 
     //记录当前编译模块的变量数量，后面检查预定义模块变量时可减少遍历，也就是在下面编译之前，就已经在 moduleVarValue 中的变量，无需遍历检查是否声明过
     uint32_t moduleVarNumBefore = objModule->moduleVarValue.count;
@@ -2940,23 +3508,144 @@ ObjFn *compileModule(VM *vm, ObjModule *objModule, const char *moduleCode) {
 
     // 所以此处检测本次编译得到的 moduleVarValue 中的变量值是否还是存 VT_NUM 类型，也就是变量尚未声明的，如果有就直接报错
     // 注：在本次编译之前，就已经在 moduleVarValue 中的变量，无需遍历检查是否声明过
-    uint32_t idx = moduleVarNumBefore;
-    while (idx < objModule->moduleVarValue.count) {
-        if (VALUE_IS_NUM(objModule->moduleVarValue.datas[idx])) {
-            char *str = objModule->moduleVarName.datas[idx].str;
-            uint32_t lineNo = VALUE_TO_NUM(objModule->moduleVarValue.datas[idx]);
-            COMPILE_ERROR(&lexer, "line:%d, variable \'%s\' not defined!", lineNo, str);
-        }
-        idx++;
-    }
+    checkUndefinedModuleVar(&lexer, objModule, moduleVarNumBefore);
 
     // 模块编译完成后，置空当前编译单元
     vm->curLexer->curCompileUnit = NULL;
     vm->curLexer = vm->curLexer->parent;
 
-#if DEBUG
-    return endCompileUnit(&moduleCU, "(script)", 8);
-#else
-    return endCompileUnit(&moduleCU);
-#endif
+    ObjFn *fn = endCompileUnit(&moduleCU);
+    if (compileStats != NULL) {
+        recordModuleCompile(objModule, traceNow() - statsStartTime, compileStats->lexTime - statsLexTimeBefore,
+                            vm->allMethodNames.count - methodNameNumBefore, false);
+    }
+    TRACE_END("lexNs", tracer->lexTime - lexTimeBefore)
+    PROBE_COMPILE_DONE(objModule, 1)
+    vm->allocFailJump = allocFailJump;
+    return fn;
+}
+
+// 编译延迟编译的函数体，在函数第一次被调用之前执行
+// 对编译模块时记录下来的源码片段重新做词法分析，并还原出当时的编译环境（模块编译单元中的静态属性、类的编译信息），
+// 使编译结果与编译模块时直接编译一致，指令流直接写入原来的 fn 中，已经创建的闭包无需改动
+void compileLazyFn(VM *vm, ObjFn *fn) {
+    LazyBody *lazyBody = fn->lazyBody;
+    ObjModule *objModule = fn->module;
+    // 和 compileModule 一样，编译期间 memManager 不拒绝申请
+    jmp_buf *allocFailJump = vm->allocFailJump;
+    vm->allocFailJump = NULL;
+
+    Lexer lexer;
+    lexer.parent = vm->curLexer;
+    vm->curLexer = &lexer;
+    initLexer(vm, &lexer, objModule->name == NULL ? "core.script.inc" : objModule->name->value.start, lazyBody->source, lazyBody->length, objModule);
+    lexer.curToken.lineNo = lazyBody->lineNo;
+
+    uint64_t lexTimeBefore = tracer == NULL ? 0 : tracer->lexTime;
+    TRACE_BEGIN("compileLazyFn", "module", lexer.file)
+    uint64_t statsStartTime = compileStats == NULL ? 0 : traceNow();
+    uint64_t statsLexTimeBefore = compileStats == NULL ? 0 : compileStats->lexTime;
+    uint32_t methodNameNumBefore = vm->allMethodNames.count;
+    PROBE_COMPILE_START(objModule, lazyBody->lineNo)
+    getNextToken(&lexer);
+
+    // 还原模块编译单元，只用于查找类的静态属性，不生成指令
+    CompileUnit moduleCU;
+    moduleCU.curLexer = &lexer;
+    moduleCU.enclosingUnit = NULL;
+    moduleCU.enclosingClassBK = NULL;
+    moduleCU.curLoop = NULL;
+    moduleCU.scopeDepth = 0;
+    moduleCU.localVarNum = 0;
+    moduleCU.stackSlotNum = 0;
+    moduleCU.fn = NULL;
+
+    uint32_t moduleVarNumBefore = objModule->moduleVarValue.count;
+
+    CompileUnit fnCU;
+    ClassBookKeep classBK;
+    // 方法签名在编译方法体时还会通过 classBK.signature 用到，不能定义在下面的分支中
+    Signature sign;
+    bool isConstruct = false;
+    if (lazyBody->isMethod) {
+        LazyClassInfo *classInfo = lazyBody->classInfo;
+
+        // 还原类的编译信息，方法体中只能看到在它之前定义的实例属性
+        classBK.name = classInfo->name;
+        classBK.fields = classInfo->fields;
+        classBK.fields.count = lazyBody->fieldNum;
+        classBK.isStatic = lazyBody->isStatic;
+        IntBufferInit(&classBK.instantMethods);
+        IntBufferInit(&classBK.staticMethods);
+        classBK.lazyClassInfo = NULL;
+        moduleCU.enclosingClassBK = &classBK;
+
+        // 将静态属性按原来的索引还原为模块编译单元的局部变量，其余的局部变量用空名占位
+        uint32_t idx = 0;
+        while (idx < lazyBody->staticFieldNum) {
+            uint32_t varIndex = classInfo->staticFieldIndex.datas[idx];
+            while (moduleCU.localVarNum <= varIndex) {
+                moduleCU.localVars[moduleCU.localVarNum].name = NULL;
+                moduleCU.localVars[moduleCU.localVarNum].length = 0;
+                moduleCU.localVars[moduleCU.localVarNum].scopeDepth = 0;
+                moduleCU.localVars[moduleCU.localVarNum].isUpvalue = false;
+                moduleCU.localVarNum++;
+            }
+            moduleCU.localVars[varIndex].name = classInfo->staticFields.datas[idx].str;
+            moduleCU.localVars[varIndex].length = classInfo->staticFields.datas[idx].length;
+            idx++;
+        }
+
+        // 以下流程与 compileMethod 一致，此时 curToken 为方法名
+        methodSignatureFn methodSign = Rules[lexer.curToken.type].methodSign;
+        sign.name = lexer.curToken.start;
+        sign.length = lexer.curToken.length;
+        sign.argNum = 0;
+        classBK.signature = &sign;
+        getNextToken(&lexer);
+
+        initCompileUnit(&lexer, &fnCU, &moduleCU, true, fn);
+        methodSign(&fnCU, &sign);
+        assertCurToken(&lexer, TOKEN_LEFT_BRACE, "expect '{' at the beginning of method body.");
+        isConstruct = sign.type == SIGN_CONSTRUCT;
+
+        // 恢复编译模块时预先引用的 upvalue，顺序与 makeLazyMethod 中的一致
+        idx = 0;
+        while (idx < lazyBody->staticFieldNum) {
+            fnCU.upvalues[idx].isEnclosingLocalVar = true;
+            fnCU.upvalues[idx].index = classInfo->staticFieldIndex.datas[idx];
+            idx++;
+        }
+    } else {
+        // fun 定义的函数，此时 curToken 为函数名后面的 (
+        initCompileUnit(&lexer, &fnCU, &moduleCU, false, fn);
+        compileFnParaList(&fnCU);
+    }
+
+    compileBody(&fnCU, isConstruct);
+    // 生成【标识编译单元编译结束】的指令，闭包已经在编译模块时创建，无需 endCompileUnit 中的其余步骤
+    writeOpCode(&fnCU, OPCODE_END);
+    markFieldAccessor(fn);
+    lineTableSeal(vm, &fn->lineTable);
+    if (compileStats != NULL) {
+        recordCompileUnitStats(&fnCU);
+    }
+
+    checkUndefinedModuleVar(&lexer, objModule, moduleVarNumBefore);
+
+    vm->curLexer = lexer.parent;
+
+    // 类的方法需要像 bindMethodAndPatch 中一样修正操作数
+    fn->lazyBody = NULL;
+    if (lazyBody->class != NULL) {
+        patchOperand(lazyBody->class, fn);
+    }
+    if (compileStats != NULL) {
+        recordModuleCompile(objModule, traceNow() - statsStartTime, compileStats->lexTime - statsLexTimeBefore,
+                            vm->allMethodNames.count - methodNameNumBefore, true);
+    }
+    PROBE_COMPILE_DONE(objModule, lazyBody->lineNo)
+    freeLazyBody(vm, lazyBody);
+    TRACE_END("lexNs", tracer->lexTime - lexTimeBefore)
+    vm->allocFailJump = allocFailJump;
 }
@@ -76,8 +76,33 @@ typedef struct
     IntBuffer instantMethods; // 实例方法的集合，只保存方法对应的索引，不保存方法体
     IntBuffer staticMethods; // 静态方法的集合，只保存方法对应的索引，不保存方法体
     Signature *signature;     // 当前正在编译的方法的签名
+    struct lazyClassInfo *lazyClassInfo; // 类中延迟编译的方法所共享的类信息，没有延迟编译的方法时为 NULL
 } ClassBookKeep;
 
+// 延迟编译的方法所需的类信息，同一个类中所有延迟编译的方法共享一份
+// 在类编译结束时填充，最后一个引用它的方法编译完成后释放
+typedef struct lazyClassInfo {
+    ObjString *name;             // 类名
+    SymbolTable fields;          // 类的实例属性符号表，即类编译结束时 ClassBookKeep 中的 fields
+    SymbolTable staticFields;    // 类的静态属性名，形式为 “Cls类名 静态属性名”
+    IntBuffer staticFieldIndex;  // 类的静态属性在模块编译单元中的局部变量索引，与 staticFields 一一对应
+    uint32_t refCount;           // 引用该信息的尚未编译的方法数量
+} LazyClassInfo;
+
+// 延迟编译的函数体
+// 编译模块时只记录函数/方法的源码片段及签名，直到第一次调用时才编译到对应的 ObjFn 中
+struct lazyBody {
+    char *source;                // 源码片段的副本：方法从方法名开始、函数从 ( 开始，到函数体的 } 结束
+    uint32_t length;             // 源码片段的长度
+    int lineNo;                  // 源码片段首行在模块中的行号，用于报错
+    bool isMethod;               // 是否是类的方法，否则是 fun 定义的函数
+    bool isStatic;               // 是否是类的静态方法
+    LazyClassInfo *classInfo;    // 方法所属类的信息，函数为 NULL
+    uint32_t fieldNum;           // 定义该方法时类中已定义的实例属性数量
+    uint32_t staticFieldNum;     // 定义该方法时类中已定义的静态属性数量，也是该方法预先引用的 upvalue 数量
+    Class *class;                // 方法所绑定的类，在绑定方法时设置，编译后用于修正操作数
+};
+
 // 定义编译单元的结构，具体定义在 compiler.c 文件中
 typedef struct compileUnit CompileUnit;
 
@@ -85,9 +110,20 @@ typedef struct compileUnit CompileUnit;
 int defineModuleVar(VM *vm, ObjModule *objModule, const char *name, uint32_t length, Value value);
 
 // 编译模块 objModule 的方法
-ObjFn *compileModule(VM *vm, ObjModule *objModule, const char *moduleCode);
+ObjFn *compileModule(VM *vm, ObjModule *objModule, const char *moduleCode, size_t codeLength);
 
 // 获取 ip 所指向的操作码的操作数占用的字节数
 uint32_t getBytesOfOperands(const Byte *instrStream, Value *constants, int ip);
 
+// 是否延迟编译函数/方法体，默认关闭，由 di --lazy-compile 开启
+// 延迟编译只在编译模块时跳过函数体，不检查其中的语法，所以从未调用的函数中的语法错误不会报告，
+// 被调用的函数中的语法错误到第一次调用时才报告，此时之前的代码已经执行过了
+extern bool lazyCompileEnabled;
+
+// 编译延迟编译的函数体，在函数第一次被调用之前执行
+void compileLazyFn(VM *vm, ObjFn *fn);
+
+// 释放尚未编译的函数体
+void freeLazyBody(VM *vm, LazyBody *lazyBody);
+
 #endif
@@ -1,18 +1,59 @@
 #include "compiler.h"
 #include "obj_list.h"
+#include "flight_recorder.h"
+
+// 获取对象 obj 自身占用的内存大小（浅大小），不含其指向的缓冲区
+// 与创建对象时 ALLOCATE/ALLOCATE_EXTRA 申请的大小一致
+uint32_t getObjectSize(ObjHeader *obj) {
+    switch (obj->type) {
+        case OT_CLASS:
+            return sizeof(Class);
+        case OT_LIST:
+            return sizeof(ObjList);
+        case OT_MAP:
+            return sizeof(ObjMap);
+        case OT_MODULE:
+            return sizeof(ObjModule);
+        case OT_RANGE:
+            return sizeof(ObjRange);
+        case OT_STRING:
+            // 字符串内容存放在柔性数组中，多出的 1 个字节是结尾的 \0
+            return sizeof(ObjString) + ((ObjString *)obj)->value.length + 1;
+        case OT_UPVALUE:
+            return sizeof(ObjUpvalue);
+        case OT_FUNCTION:
+            return sizeof(ObjFn);
+        case OT_CLOSURE:
+            return sizeof(ObjClosure) + sizeof(ObjUpvalue *) * ((ObjClosure *)obj)->fn->upvalueNum;
+        case OT_INSTANCE:
+            return sizeof(ObjInstance) + sizeof(Value) * obj->class->fieldNum;
+        case OT_THREAD:
+            return sizeof(ObjThread);
+    }
+    NOT_REACHED()
+    return 0;
+}
 
 // 释放 obj 自身及其占用的内存
+// 注意：闭包和实例的大小依赖其函数和类，所以它们要先于所依赖的对象释放（allObjects 中新对象在前，正好满足）
 void freeObject(VM *vm, ObjHeader *obj) {
+    // 飞行记录中可能还有引用函数、线程和模块的事件，转储时不能再访问它们
+    if (vm->flightRecorder != NULL &&
+        (obj->type == OT_FUNCTION || obj->type == OT_THREAD || obj->type == OT_MODULE)) {
+        forgetFlightObject(vm->flightRecorder, obj);
+    }
+
     // 根据对象类型分别处理
     switch (obj->type) {
         case OT_CLASS:
             MethodBufferClear(vm, &((Class *)obj)->methods);
+            DEALLOCATE_ARRAY(vm, ((Class *)obj)->ancestors, ((Class *)obj)->depth + 1);
             break;
 
         case OT_THREAD: {
             ObjThread *objThread = (ObjThread *)obj;
-            DEALLOCATE(vm, objThread->frames);
-            DEALLOCATE(vm, objThread->stack);
+            DEALLOCATE_ARRAY(vm, objThread->frames, objThread->frameCapacity);
+            DEALLOCATE_ARRAY(vm, objThread->stack, objThread->stackCapacity);
             break;
         }
 
@@ -20,6 +61,10 @@ void freeObject(VM *vm, ObjHeader *obj) {
             ObjFn *fn = (ObjFn *)obj;
             ValueBufferClear(vm, &fn->constants);
             ByteBufferClear(vm, &fn->instrStream);
+            lineTableClear(vm, &fn->lineTable);
+            if (fn->lazyBody != NULL) {
+                freeLazyBody(vm, fn->lazyBody);
+            }
             break;
         }
 
@@ -28,11 +73,11 @@ void freeObject(VM *vm, ObjHeader *obj) {
             break;
 
         case OT_MAP:
-            DEALLOCATE(vm, ((ObjMap *)obj)->entries);
+            DEALLOCATE_ARRAY(vm, ((ObjMap *)obj)->entries, ((ObjMap *)obj)->capacity);
             break;
 
         case OT_MODULE:
-            StringBufferClear(vm, &((ObjModule *)obj)->moduleVarName);
+            symbolTableClear(vm, &((ObjModule *)obj)->moduleVarName);
             ValueBufferClear(vm, &((ObjModule *)obj)->moduleVarValue);
             break;
 
@@ -45,5 +90,8 @@ void freeObject(VM *vm, ObjHeader *obj) {
     }
 
     // 最后再释放自己
-    DEALLOCATE(vm, obj);
+    uint32_t objSize = getObjectSize(obj);
+    vm->objectCounts[obj->type]--;
+    vm->objectBytes[obj->type] -= objSize;
+    memManager(vm, obj, objSize, 0);
 }
@@ -1,4 +1,8 @@
 #ifndef _GC_GC_H
 #define _GC_GC_H
+// 获取对象 obj 自身占用的内存大小
+uint32_t getObjectSize(ObjHeader *obj);
+
+// 释放 obj 自身及其占用的内存
 void freeObject(VM *vm, ObjHeader *obj);
 #endif
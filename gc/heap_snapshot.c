@@ -0,0 +1,348 @@
+#include "heap_snapshot.h"
+#include "gc.h"
+#include "obj_list.h"
+#include "obj_range.h"
+#include <string.h>
+
+// 写文件时使用的缓冲区大小，较大的缓冲区可以减少写大快照时的系统调用次数
+#define SNAPSHOT_IO_BUFFER_SIZE (1 << 20)
+
+// 加上尖括号的对象类型名的缓冲区大小，足以容纳最长的 <function> 和 <instance>
+#define MAX_OBJ_TYPE_NAME_LEN 16
+
+// 类表中的一项
+typedef struct {
+    Class *class; // 为 NULL 时表示不属于任何类的对象
+    uint32_t instanceNum;
+    uint64_t shallowBytes;
+} ClassCensus;
+
+// 写快照过程中的状态
+typedef struct {
+    FILE *file;
+    ClassCensus *census;    // 类表
+    uint32_t censusNum;     // 类表的项数
+    uint32_t *classSlots;   // 以类的地址为键的开放寻址散列表，值为类在类表中的索引加 1，0 表示空槽位
+    uint32_t slotCapacity;  // 散列表容量，是 2 的幂
+    uint32_t edgeNum;       // 当前对象的引用数
+    uint64_t totalEdgeNum;  // 所有对象的引用总数
+    bool isWritingEdges;    // 为 false 时只统计引用数，为 true 时写入引用
+} Snapshot;
+
+static void writeU8(Snapshot *snapshot, uint8_t value) {
+    fwrite(&value, sizeof(value), 1, snapshot->file);
+}
+
+static void writeU32(Snapshot *snapshot, uint32_t value) {
+    fwrite(&value, sizeof(value), 1, snapshot->file);
+}
+
+static void writeU64(Snapshot *snapshot, uint64_t value) {
+    fwrite(&value, sizeof(value), 1, snapshot->file);
+}
+
+// 对象的 id 就是其地址
+static uint64_t objectId(ObjHeader *obj) {
+    return (uint64_t)(uintptr_t)obj;
+}
+
+// 计算类地址在散列表中的起始槽位
+static uint32_t classSlot(Snapshot *snapshot, Class *class) {
+    uint64_t hash = ((uint64_t)(uintptr_t)class >> 3) * 0x9e3779b97f4a7c15ULL;
+    return (uint32_t)(hash >> 32) & (snapshot->slotCapacity - 1);
+}
+
+// 获取对象所属类在类表中的索引
+static uint32_t getCensusIndex(Snapshot *snapshot, ObjHeader *obj) {
+    if (obj->class == NULL) {
+        return obj->type;
+    }
+    uint32_t slot = classSlot(snapshot, obj->class);
+    while (snapshot->classSlots[slot] != 0) {
+        uint32_t index = snapshot->classSlots[slot] - 1;
+        if (snapshot->census[index].class == obj->class) {
+            return index;
+        }
+        slot = (slot + 1) & (snapshot->slotCapacity - 1);
+    }
+    // 所有类都在 buildCensus 中预先加入了散列表
+    NOT_REACHED()
+    return 0;
+}
+
+// 建立类表并统计各类的实例个数和浅大小
+static void buildCensus(VM *vm, Snapshot *snapshot) {
+    // 先统计类的个数，以确定类表和散列表的大小
+    uint32_t classNum = 0;
+    ObjHeader *obj = vm->allObjects;
+    while (obj != NULL) {
+        if (obj->type == OT_CLASS) {
+            classNum++;
+        }
+        obj = obj->next;
+    }
+
+    snapshot->censusNum = OBJ_TYPE_NUM + classNum;
+    snapshot->census = (ClassCensus *)calloc(snapshot->censusNum, sizeof(ClassCensus));
+    // 散列表的装载因子不超过 0.5
+    snapshot->slotCapacity = ceilToPowerOf2(classNum * 2 + 1);
+    snapshot->classSlots = (uint32_t *)calloc(snapshot->slotCapacity, sizeof(uint32_t));
+    if (snapshot->census == NULL || snapshot->classSlots == NULL) {
+        MEM_ERROR("allocate heap snapshot census failed!");
+    }
+
+    uint32_t index = OBJ_TYPE_NUM;
+    obj = vm->allObjects;
+    while (obj != NULL) {
+        if (obj->type == OT_CLASS) {
+            snapshot->census[index].class = (Class *)obj;
+            uint32_t slot = classSlot(snapshot, (Class *)obj);
+            while (snapshot->classSlots[slot] != 0) {
+                slot = (slot + 1) & (snapshot->slotCapacity - 1);
+            }
+            snapshot->classSlots[slot] = index + 1;
+            index++;
+        }
+        obj = obj->next;
+    }
+
+    obj = vm->allObjects;
+    while (obj != NULL) {
+        ClassCensus *census = &snapshot->census[getCensusIndex(snapshot, obj)];
+        census->instanceNum++;
+        census->shallowBytes += getObjectSize(obj);
+        obj = obj->next;
+    }
+}
+
+// 记录一条指向 target 的引用
+static void visitObject(Snapshot *snapshot, ObjHeader *target) {
+    if (target == NULL) {
+        return;
+    }
+    if (snapshot->isWritingEdges) {
+        writeU64(snapshot, objectId(target));
+    }
+    snapshot->edgeNum++;
+}
+
+// 值为对象时记录一条引用
+static void visitValue(Snapshot *snapshot, Value value) {
+    if (VALUE_IS_OBJ(value)) {
+        visitObject(snapshot, VALUE_TO_OBJ(value));
+    }
+}
+
+static void visitValues(Snapshot *snapshot, Value *values, uint32_t count) {
+    uint32_t idx = 0;
+    while (idx < count) {
+        visitValue(snapshot, values[idx]);
+        idx++;
+    }
+}
+
+// 遍历对象 obj 引用的所有对象
+static void visitReferences(Snapshot *snapshot, ObjHeader *obj) {
+    visitObject(snapshot, (ObjHeader *)obj->class);
+
+    switch (obj->type) {
+        case OT_CLASS: {
+            Class *class = (Class *)obj;
+            visitObject(snapshot, (ObjHeader *)class->superClass);
+            visitObject(snapshot, (ObjHeader *)class->name);
+            uint32_t idx = 0;
+            while (idx < class->methods.count) {
+                if (class->methods.datas[idx].type == MT_SCRIPT || class->methods.datas[idx].type == MT_CONSTRUCT) {
+                    visitObject(snapshot, (ObjHeader *)class->methods.datas[idx].obj);
+                }
+                idx++;
+            }
+            break;
+        }
+
+        case OT_LIST: {
+            ObjList *objList = (ObjList *)obj;
+            visitValues(snapshot, objList->elements.datas, objList->elements.count);
+            break;
+        }
+
+        case OT_MAP: {
+            ObjMap *objMap = (ObjMap *)obj;
+            uint32_t idx = 0;
+            while (idx < objMap->capacity) {
+                Entry *entry = &objMap->entries[idx];
+                if (!VALUE_IS_UNDEFINED(entry->key)) {
+                    visitValue(snapshot, entry->key);
+                    visitValue(snapshot, entry->value);
+                }
+                idx++;
+            }
+            break;
+        }
+
+        case OT_MODULE: {
+            ObjModule *objModule = (ObjModule *)obj;
+            visitObject(snapshot, (ObjHeader *)objModule->name);
+            visitValues(snapshot, objModule->moduleVarValue.datas, objModule->moduleVarValue.count);
+            break;
+        }
+
+        case OT_UPVALUE: {
+            ObjUpvalue *objUpvalue = (ObjUpvalue *)obj;
+            // 只有关闭的 upvalue 才持有值，打开的 upvalue 的值还在线程的运行时栈中
+            if (objUpvalue->localVarPtr == &objUpvalue->closedUpvalue) {
+                visitValue(snapshot, objUpvalue->closedUpvalue);
+            }
+            break;
+        }
+
+        case OT_FUNCTION: {
+            ObjFn *objFn = (ObjFn *)obj;
+            visitObject(snapshot, (ObjHeader *)objFn->module);
+            visitValues(snapshot, objFn->constants.datas, objFn->constants.count);
+            break;
+        }
+
+        case OT_CLOSURE: {
+            ObjClosure *objClosure = (ObjClosure *)obj;
+            visitObject(snapshot, (ObjHeader *)objClosure->fn);
+            uint32_t idx = 0;
+            while (idx < objClosure->fn->upvalueNum) {
+                visitObject(snapshot, (ObjHeader *)objClosure->upvalues[idx]);
+                idx++;
+            }
+            break;
+        }
+
+        case OT_INSTANCE: {
+            ObjInstance *objInstance = (ObjInstance *)obj;
+            visitValues(snapshot, objInstance->fields, obj->class->fieldNum);
+            break;
+        }
+
+        case OT_THREAD: {
+            ObjThread *objThread = (ObjThread *)obj;
+            visitValues(snapshot, objThread->stack, (uint32_t)(objThread->esp - objThread->stack));
+            uint32_t idx = 0;
+            while (idx < objThread->usedFrameNum) {
+                visitObject(snapshot, (ObjHeader *)objThread->frames[idx].closure);
+                idx++;
+            }
+            ObjUpvalue *upvalue = objThread->openUpvalues;
+            while (upvalue != NULL) {
+                visitObject(snapshot, (ObjHeader *)upvalue);
+                upvalue = upvalue->next;
+            }
+            visitObject(snapshot, (ObjHeader *)objThread->caller);
+            visitValue(snapshot, objThread->errorObj);
+            break;
+        }
+
+        case OT_RANGE:
+        case OT_STRING:
+            break;
+    }
+}
+
+// 写入文件头，edgeNum 在写完节点表后才能确定，届时再回写
+static void writeHeader(Snapshot *snapshot, uint32_t rootNum, uint64_t nodeNum) {
+    fwrite(HEAP_SNAPSHOT_MAGIC, 1, 8, snapshot->file);
+    writeU32(snapshot, snapshot->censusNum);
+    writeU32(snapshot, rootNum);
+    writeU64(snapshot, nodeNum);
+    writeU64(snapshot, snapshot->totalEdgeNum);
+}
+
+static void writeCensus(Snapshot *snapshot) {
+    uint32_t idx = 0;
+    while (idx < snapshot->censusNum) {
+        ClassCensus *census = &snapshot->census[idx];
+        const char *name;
+        uint32_t nameLength;
+        // 不属于任何类的对象按类型归类，以加上尖括号的类型名命名，例如 <upvalue>
+        char typeName[MAX_OBJ_TYPE_NAME_LEN];
+        if (census->class == NULL) {
+            nameLength = snprintf(typeName, sizeof(typeName), "<%s>", objTypeNames[idx]);
+            name = typeName;
+        } else {
+            name = census->class->name->value.start;
+            nameLength = census->class->name->value.length;
+        }
+        writeU32(snapshot, census->instanceNum);
+        writeU64(snapshot, census->shallowBytes);
+        writeU32(snapshot, nameLength);
+        fwrite(name, 1, nameLength, snapshot->file);
+        idx++;
+    }
+}
+
+// 将 vm 中所有对象的快照写入 path，成功则返回写入的对象个数，无法打开或写入文件则返回 -1
+// 各处写入时不逐一检查结果，出错后文件的错误标记会一直保留，最后统一通过 ferror 和 fclose 的结果判断
+int64_t writeHeapSnapshot(VM *vm, const char *path) {
+    Snapshot snapshot;
+    snapshot.file = fopen(path, "wb");
+    if (snapshot.file == NULL) {
+        return -1;
+    }
+    // 快照本身使用的内存直接向系统申请，不计入虚拟机的堆，以免统计失真或在堆快满时触发堆上限
+    char *ioBuffer = (char *)malloc(SNAPSHOT_IO_BUFFER_SIZE);
+    if (ioBuffer != NULL) {
+        setvbuf(snapshot.file, ioBuffer, _IOFBF, SNAPSHOT_IO_BUFFER_SIZE);
+    }
+    snapshot.totalEdgeNum = 0;
+    buildCensus(vm, &snapshot);
+
+    // 根是所有模块和当前线程，其余对象都应该能从根出发访问到
+    ObjHeader *roots[2];
+    uint32_t rootNum = 0;
+    roots[rootNum++] = (ObjHeader *)vm->allModules;
+    if (vm->curThread != NULL) {
+        roots[rootNum++] = (ObjHeader *)vm->curThread;
+    }
+
+    uint64_t nodeNum = 0;
+    ObjHeader *obj = vm->allObjects;
+    while (obj != NULL) {
+        nodeNum++;
+        obj = obj->next;
+    }
+
+    writeHeader(&snapshot, rootNum, nodeNum);
+    writeCensus(&snapshot);
+    uint32_t idx = 0;
+    while (idx < rootNum) {
+        writeU64(&snapshot, objectId(roots[idx]));
+        idx++;
+    }
+
+    // 每个节点先遍历一遍统计引用数，再遍历一遍写入引用，这样不必为引用申请缓冲区
+    obj = vm->allObjects;
+    while (obj != NULL) {
+        writeU64(&snapshot, objectId(obj));
+        writeU32(&snapshot, getCensusIndex(&snapshot, obj));
+        writeU8(&snapshot, (uint8_t)obj->type);
+        writeU32(&snapshot, getObjectSize(obj));
+
+        snapshot.isWritingEdges = false;
+        snapshot.edgeNum = 0;
+        visitReferences(&snapshot, obj);
+        writeU32(&snapshot, snapshot.edgeNum);
+        snapshot.totalEdgeNum += snapshot.edgeNum;
+
+        snapshot.isWritingEdges = true;
+        visitReferences(&snapshot, obj);
+        obj = obj->next;
+    }
+
+    // 回写文件头中的引用总数
+    bool isFailed = fseek(snapshot.file, 8 + sizeof(uint32_t) * 2 + sizeof(uint64_t), SEEK_SET) != 0;
+    writeU64(&snapshot, snapshot.totalEdgeNum);
+    isFailed = ferror(snapshot.file) || isFailed;
+    // 缓冲区中的数据在 fclose 时才真正写入，磁盘已满等错误可能到这时才出现
+    isFailed = fclose(snapshot.file) != 0 || isFailed;
+
+    free(ioBuffer);
+    free(snapshot.census);
+    free(snapshot.classSlots);
+    return isFailed ? -1 : (int64_t)nodeNum;
+}
@@ -0,0 +1,35 @@
+#ifndef _GC_HEAP_SNAPSHOT_H
+#define _GC_HEAP_SNAPSHOT_H
+#include "vm.h"
+
+// 堆快照文件的魔数
+#define HEAP_SNAPSHOT_MAGIC "DIHEAP01"
+
+// 堆快照用于离线分析内存泄漏，文件为二进制格式，所有整数都按本机字节序写入
+// 1. 文件头
+//    char     magic[8]   固定为 HEAP_SNAPSHOT_MAGIC
+//    uint32_t classNum   类表的项数
+//    uint32_t rootNum    根表的项数
+//    uint64_t nodeNum    节点表的项数，即对象个数
+//    uint64_t edgeNum    所有节点的引用总数
+// 2. 类表，按类统计实例个数和浅大小（对象自身占用的内存），共 classNum 项
+//    uint32_t instanceNum
+//    uint64_t shallowBytes
+//    uint32_t nameLength
+//    char     name[nameLength]   不含结尾的 \0
+//    前 OBJ_TYPE_NUM 项按 ObjType 的顺序对应不属于任何类的对象，例如模块和 upvalue，名字形如 <module>
+// 3. 根表，共 rootNum 项
+//    uint64_t id
+// 4. 节点表，共 nodeNum 项
+//    uint64_t id                 对象的地址，引用也用该地址表示
+//    uint32_t classIndex         对象所属类在类表中的索引
+//    uint8_t  objType            ObjType
+//    uint32_t shallowSize
+//    uint32_t edgeNum
+//    uint64_t edges[edgeNum]     该对象引用的对象的 id
+// 有了节点和引用，就可以离线计算支配树和各对象的保留大小（retained size）
+
+// 将 vm 中所有对象的快照写入 path，成功则返回写入的对象个数，无法打开或写入文件则返回 -1
+int64_t writeHeapSnapshot(VM *vm, const char *path);
+
+#endif
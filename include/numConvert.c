@@ -0,0 +1,592 @@
+#include "numConvert.h"
+#include "powersOfFive.inc"
+#include "ryuPowersOfFive.inc"
+#include "utils.h"
+#include <math.h>
+#include <string.h>
+
+// 不依赖 locale 的数字字符判断
+#define IS_DIGIT(c) ((c) >= '0' && (c) <= '9')
+
+// 十进制尾数最多保留 19 位有效数字，uint64_t 能容纳任意 19 位十进制数
+#define MAX_MANTISSA_DIGITS 19
+
+// double 能精确表示的最大整数 2^53
+#define MAX_EXACT_INT (1ULL << 53)
+
+// 能被 double 精确表示的 10 的幂，最大为 10^22
+#define MAX_EXACT_POW10 22
+
+// 慢速路径中源码片段的栈上缓冲区大小，超出时改用堆内存
+#define SLOW_PATH_BUF_SIZE 64
+
+// double 的尾数位数、指数偏移
+#define DOUBLE_MANTISSA_BITS 52
+#define DOUBLE_EXPONENT_BIAS 1023
+
+// 十进制指数在 [MIN_FIXED_EXP, MAX_FIXED_EXP) 之间时用普通写法输出，否则用科学计数法
+#define MIN_FIXED_EXP (-4)
+#define MAX_FIXED_EXP 17
+
+static const double exactPowersOf10[MAX_EXACT_POW10 + 1] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+// 返回字符 c 作为数字的值，非数字字符返回 16 以上的值，调用方与进制比较即可
+static uint32_t digitValue(char c) {
+    if (IS_DIGIT(c)) {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return 255;
+}
+
+// 计算两个 64 位无符号整数相乘的 128 位结果，高 64 位写入 hi，低 64 位写入 lo
+static void mul128(uint64_t a, uint64_t b, uint64_t *hi, uint64_t *lo) {
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 product = (unsigned __int128)a * b;
+    *hi = (uint64_t)(product >> 64);
+    *lo = (uint64_t)product;
+#else
+    // 不支持 128 位整数时，拆成 32 位分段相乘
+    uint64_t aLo = (uint32_t)a, aHi = a >> 32;
+    uint64_t bLo = (uint32_t)b, bHi = b >> 32;
+    uint64_t loLo = aLo * bLo;
+    uint64_t hiLo = aHi * bLo;
+    uint64_t loHi = aLo * bHi;
+    uint64_t hiHi = aHi * bHi;
+    uint64_t cross = (loLo >> 32) + (uint32_t)hiLo + loHi;
+    *hi = hiHi + (hiLo >> 32) + (cross >> 32);
+    *lo = (cross << 32) | (uint32_t)loLo;
+#endif
+}
+
+// 解析 radix 进制（2/8/16）的整数，ptr 指向第一个数字
+// 没有数字时返回 NULL
+static const char *parseRadixInt(const char *ptr, uint32_t radix, double *num) {
+    const char *digitStart = ptr;
+    uint64_t value = 0;
+    // 超出 uint64_t 范围后改用 double 累加
+    double bigValue = 0;
+    bool isBig = false;
+
+    uint32_t digit;
+    while ((digit = digitValue(*ptr)) < radix) {
+        if (!isBig && value > (UINT64_MAX - digit) / radix) {
+            isBig = true;
+            bigValue = (double)value;
+        }
+        if (isBig) {
+            bigValue = bigValue * radix + digit;
+        } else {
+            value = value * radix + digit;
+        }
+        ptr++;
+        // 跳过数字之间的分隔符 _
+        if (*ptr == '_' && digitValue(ptr[1]) < radix) {
+            ptr++;
+        }
+    }
+
+    if (ptr == digitStart) {
+        return NULL;
+    }
+    *num = isBig ? bigValue : (double)value;
+    return ptr;
+}
+
+// Eisel-Lemire 算法：计算 w * 10^q 最接近的 double
+// 用 w 与 128 位的 5^q 近似值相乘，从乘积的高位直接得到尾数和指数
+// 结果为非规格化数或超出范围时返回 false，由调用方退回到 strtod
+static bool eiselLemire(uint64_t w, int64_t q, double *num) {
+    if (q < SMALLEST_POWER_OF_FIVE || q > LARGEST_POWER_OF_FIVE) {
+        return false;
+    }
+
+    // 将 w 规整到最高位为 1
+    int leadingZeros = __builtin_clzll(w);
+    w <<= leadingZeros;
+
+    uint32_t index = 2 * (uint32_t)(q - SMALLEST_POWER_OF_FIVE);
+    uint64_t hi, lo;
+    mul128(w, powersOfFive128[index], &hi, &lo);
+
+    // 高 64 位中低 9 位全为 1 时，低位可能向上进位，需要再乘上近似值的低 64 位修正
+    if ((hi & 0x1FF) == 0x1FF) {
+        uint64_t secondHi, secondLo;
+        mul128(w, powersOfFive128[index + 1], &secondHi, &secondLo);
+        lo += secondHi;
+        if (secondHi > lo) {
+            hi++;
+        }
+    }
+
+    // 取乘积最高的 54 位（52 位尾数 + 隐含的 1 + 1 位用于舍入）
+    int upperBit = (int)(hi >> 63);
+    int shift = upperBit + 9;
+    uint64_t mantissa = hi >> shift;
+    // (152170 + 65536) / 2^16 约等于 log2(10)，由此得到二进制指数，再加上 1023 的偏移
+    int32_t power2 = (int32_t)((((152170 + 65536) * q) >> 16) + 63 + upperBit - leadingZeros + 1023);
+
+    if (power2 <= 0) {
+        return false;
+    }
+
+    // 恰好处于两个 double 中间时，按照向偶数舍入的规则向下舍入
+    if (lo <= 1 && q >= -4 && q <= 23 && (mantissa & 3) == 1 && (mantissa << shift) == hi) {
+        mantissa &= ~1ULL;
+    }
+
+    // 舍入到 53 位
+    mantissa += mantissa & 1;
+    mantissa >>= 1;
+    if (mantissa >= (2ULL << 52)) {
+        // 舍入后进位到了第 54 位
+        mantissa = 1ULL << 52;
+        power2++;
+    }
+    // 去掉隐含的最高位
+    mantissa &= ~(1ULL << 52);
+
+    if (power2 >= 0x7FF) {
+        return false;
+    }
+
+    uint64_t bits = mantissa | ((uint64_t)power2 << 52);
+    memcpy(num, &bits, sizeof(double));
+    return true;
+}
+
+// 计算 mantissa * 10^exp10 对应的 double，无法精确快速计算时返回 false
+static bool decimalToDouble(uint64_t mantissa, int64_t exp10, double *num) {
+    if (mantissa == 0) {
+        *num = 0;
+        return true;
+    }
+
+    if (mantissa <= MAX_EXACT_INT) {
+        // 整数直接转换
+        if (exp10 == 0) {
+            *num = (double)mantissa;
+            return true;
+        }
+        // 尾数和 10 的幂都能被 double 精确表示时，一次乘除法的结果就是正确舍入的（Clinger 快速路径）
+        if (exp10 > 0 && exp10 <= MAX_EXACT_POW10) {
+            *num = (double)mantissa * exactPowersOf10[exp10];
+            return true;
+        }
+        if (exp10 < 0 && exp10 >= -MAX_EXACT_POW10) {
+            *num = (double)mantissa / exactPowersOf10[-exp10];
+            return true;
+        }
+    }
+
+    return eiselLemire(mantissa, exp10, num);
+}
+
+// 慢速路径：去掉分隔符 _ 后交给 strtod 解析 [start, end) 之间的十进制数
+static double parseDecimalSlow(const char *start, const char *end) {
+    char stackBuf[SLOW_PATH_BUF_SIZE];
+    uint32_t length = (uint32_t)(end - start);
+    char *buf = length < SLOW_PATH_BUF_SIZE ? stackBuf : (char *)malloc(length + 1);
+    if (buf == NULL) {
+        MEM_ERROR("Couldn't allocate memory for parsing number.");
+    }
+
+    uint32_t count = 0;
+    const char *ptr = start;
+    while (ptr < end) {
+        if (*ptr != '_') {
+            buf[count++] = *ptr;
+        }
+        ptr++;
+    }
+    buf[count] = '\0';
+
+    double num = strtod(buf, NULL);
+    if (buf != stackBuf) {
+        free(buf);
+    }
+    return num;
+}
+
+// 解析十进制数，ptr 指向第一个数字
+static const char *parseDecimal(const char *start, double *num) {
+    const char *ptr = start;
+    uint64_t mantissa = 0;
+    // 已计入 mantissa 的有效数字个数，不包括前导 0
+    uint32_t digitNum = 0;
+    int64_t exp10 = 0;
+    // 有效数字超出 19 位且被舍弃的部分不为 0 时，快速路径无法保证精确
+    bool isTruncated = false;
+
+    // 整数部分
+    while (true) {
+        uint32_t digit = *ptr - '0';
+        if (digitNum < MAX_MANTISSA_DIGITS) {
+            mantissa = mantissa * 10 + digit;
+            if (mantissa != 0) {
+                digitNum++;
+            }
+        } else {
+            // 舍弃的整数位需要体现在指数上
+            exp10++;
+            isTruncated |= digit != 0;
+        }
+        ptr++;
+        if (*ptr == '_' && IS_DIGIT(ptr[1])) {
+            ptr++;
+        } else if (!IS_DIGIT(*ptr)) {
+            break;
+        }
+    }
+
+    // 小数部分，小数点后必须有数字，以免和 1..3 或 1.abs 冲突
+    if (*ptr == '.' && IS_DIGIT(ptr[1])) {
+        ptr++;
+        while (true) {
+            uint32_t digit = *ptr - '0';
+            if (digitNum < MAX_MANTISSA_DIGITS) {
+                mantissa = mantissa * 10 + digit;
+                exp10--;
+                if (mantissa != 0) {
+                    digitNum++;
+                }
+            } else {
+                isTruncated |= digit != 0;
+            }
+            ptr++;
+            if (*ptr == '_' && IS_DIGIT(ptr[1])) {
+                ptr++;
+            } else if (!IS_DIGIT(*ptr)) {
+                break;
+            }
+        }
+    }
+
+    // 指数部分，e 后面必须有数字（可带符号）
+    if (*ptr == 'e' || *ptr == 'E') {
+        const char *expPtr = ptr + 1;
+        bool isExpNegative = false;
+        if (*expPtr == '+' || *expPtr == '-') {
+            isExpNegative = *expPtr == '-';
+            expPtr++;
+        }
+        if (IS_DIGIT(*expPtr)) {
+            int64_t expValue = 0;
+            while (IS_DIGIT(*expPtr)) {
+                // 指数过大时结果必然上溢或下溢，限制其大小以免溢出
+                if (expValue < 100000) {
+                    expValue = expValue * 10 + (*expPtr - '0');
+                }
+                expPtr++;
+            }
+            exp10 += isExpNegative ? -expValue : expValue;
+            ptr = expPtr;
+        }
+    }
+
+    if (isTruncated || !decimalToDouble(mantissa, exp10, num)) {
+        *num = parseDecimalSlow(start, ptr);
+    }
+    return ptr;
+}
+
+// 从 start 开始解析一个非负的数字
+const char *parseNum(const char *start, bool isLeadingZeroOctal, double *num) {
+    if (!IS_DIGIT(*start)) {
+        return NULL;
+    }
+
+    if (start[0] == '0') {
+        if (start[1] == 'x' || start[1] == 'X') {
+            return parseRadixInt(start + 2, 16, num);
+        }
+        if (start[1] == 'b' || start[1] == 'B') {
+            return parseRadixInt(start + 2, 2, num);
+        }
+        if (isLeadingZeroOctal && IS_DIGIT(start[1])) {
+            return parseRadixInt(start + 1, 8, num);
+        }
+    }
+
+    return parseDecimal(start, num);
+}
+
+// 以下是 Ryu 算法（Ulf Adams, 2018）：求 double 最短的、能精确还原的十进制表示
+// 思路是计算出 double 的舍入区间 [vm, vp] 和值本身 vr 在 10 的某次幂下的整数表示，
+// 然后不断去掉三者共同的末位数字，直到再去掉一位区间内就没有整数了
+
+// 计算 5^e 的二进制位数，e 在 [0, 3528] 之间时等于 ceil(log2(5^e))
+static int32_t pow5bits(int32_t e) {
+    return (int32_t)(((uint32_t)e * 1217359) >> 19) + 1;
+}
+
+// 计算 floor(log10(2^e))
+static uint32_t log10Pow2(int32_t e) {
+    return ((uint32_t)e * 78913) >> 18;
+}
+
+// 计算 floor(log10(5^e))
+static uint32_t log10Pow5(int32_t e) {
+    return ((uint32_t)e * 732923) >> 20;
+}
+
+// 判断 value 是否是 5^p 的倍数
+static bool multipleOfPowerOf5(uint64_t value, uint32_t p) {
+    uint32_t count = 0;
+    while (value % 5 == 0) {
+        value /= 5;
+        count++;
+    }
+    return count >= p;
+}
+
+// 判断 value 是否是 2^p 的倍数
+static bool multipleOfPowerOf2(uint64_t value, uint32_t p) {
+    return (value & ((1ULL << p) - 1)) == 0;
+}
+
+// 计算 m 与 125 位的 mul 相乘后右移 j 位的结果，j 在 (64, 128) 之间
+static uint64_t mulShift64(uint64_t m, const uint64_t *mul, int32_t j) {
+    uint64_t high0, low0, high1, low1;
+    mul128(m, mul[0], &high0, &low0);
+    mul128(m, mul[1], &high1, &low1);
+
+    uint64_t sum = high0 + low1;
+    if (sum < high0) {
+        high1++;
+    }
+    uint32_t dist = (uint32_t)(j - 64);
+    return (high1 << (64 - dist)) | (sum >> dist);
+}
+
+// 计算 v 的十进制位数，v 小于 10^17
+static uint32_t decimalLength(uint64_t v) {
+    uint32_t length = 1;
+    while (v >= 10) {
+        v /= 10;
+        length++;
+    }
+    return length;
+}
+
+// 求正数 num 的最短十进制表示，即 num 约等于 digits * 10^exp10
+static void shortestDecimal(uint64_t ieeeMantissa, uint32_t ieeeExponent, uint64_t *digits, int32_t *exp10) {
+    // 先将 double 表示为 m2 * 2^e2，额外减 2 是为了下面用 4 * m2 表示区间的中点
+    int32_t e2;
+    uint64_t m2;
+    if (ieeeExponent == 0) {
+        // 非规格化数
+        e2 = 1 - DOUBLE_EXPONENT_BIAS - DOUBLE_MANTISSA_BITS - 2;
+        m2 = ieeeMantissa;
+    } else {
+        e2 = (int32_t)ieeeExponent - DOUBLE_EXPONENT_BIAS - DOUBLE_MANTISSA_BITS - 2;
+        m2 = (1ULL << DOUBLE_MANTISSA_BITS) | ieeeMantissa;
+    }
+    // 尾数为偶数时区间的端点也会舍入到 num，即区间是闭区间
+    bool acceptBounds = (m2 & 1) == 0;
+
+    // 舍入区间为 [mv - 1 - mmShift, mv + 2] * 2^e2
+    // 尾数为 0 时（2 的整数次幂）下方相邻 double 的间距只有一半，因此下界更近
+    uint64_t mv = 4 * m2;
+    uint32_t mmShift = ieeeMantissa != 0 || ieeeExponent <= 1;
+
+    // 将 mv 及区间上下界转换到以 10^e10 为单位，分别得到 vr、vp、vm
+    uint64_t vr, vp, vm;
+    int32_t e10;
+    // 转换时被截掉的部分是否全为 0
+    bool vmIsTrailingZeros = false;
+    bool vrIsTrailingZeros = false;
+
+    if (e2 >= 0) {
+        uint32_t q = log10Pow2(e2) - (e2 > 3);
+        e10 = (int32_t)q;
+        int32_t k = POW5_INV_BITCOUNT + pow5bits(q) - 1;
+        int32_t i = -e2 + (int32_t)q + k;
+        vr = mulShift64(4 * m2, pow5InvSplit[q], i);
+        vp = mulShift64(4 * m2 + 2, pow5InvSplit[q], i);
+        vm = mulShift64(4 * m2 - 1 - mmShift, pow5InvSplit[q], i);
+
+        if (q <= 21) {
+            // 只有 q 较小时，截掉的部分才可能全为 0
+            if (mv % 5 == 0) {
+                vrIsTrailingZeros = multipleOfPowerOf5(mv, q);
+            } else if (acceptBounds) {
+                vmIsTrailingZeros = multipleOfPowerOf5(mv - 1 - mmShift, q);
+            } else {
+                // 上界不属于区间，若其恰好可以整除则需要排除
+                vp -= multipleOfPowerOf5(mv + 2, q);
+            }
+        }
+    } else {
+        uint32_t q = log10Pow5(-e2) - (-e2 > 1);
+        e10 = (int32_t)q + e2;
+        int32_t i = -e2 - (int32_t)q;
+        int32_t k = pow5bits(i) - POW5_BITCOUNT;
+        int32_t j = (int32_t)q - k;
+        vr = mulShift64(4 * m2, pow5Split[i], j);
+        vp = mulShift64(4 * m2 + 2, pow5Split[i], j);
+        vm = mulShift64(4 * m2 - 1 - mmShift, pow5Split[i], j);
+
+        if (q <= 1) {
+            // mv 至少有 2 个末尾的二进制 0，因此 vr 是精确的
+            vrIsTrailingZeros = true;
+            if (acceptBounds) {
+                vmIsTrailingZeros = mmShift == 1;
+            } else {
+                vp--;
+            }
+        } else if (q < 63) {
+            vrIsTrailingZeros = multipleOfPowerOf2(mv, q);
+        }
+    }
+
+    // 去掉区间内多余的末位数字
+    int32_t removed = 0;
+    uint8_t lastRemovedDigit = 0;
+    uint64_t output;
+
+    if (vmIsTrailingZeros || vrIsTrailingZeros) {
+        // 少见的情况：需要精确处理恰好在区间端点或恰好在两数中间的情况
+        while (vp / 10 > vm / 10) {
+            vmIsTrailingZeros &= vm % 10 == 0;
+            vrIsTrailingZeros &= lastRemovedDigit == 0;
+            lastRemovedDigit = (uint8_t)(vr % 10);
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+        if (vmIsTrailingZeros) {
+            while (vm % 10 == 0) {
+                vrIsTrailingZeros &= lastRemovedDigit == 0;
+                lastRemovedDigit = (uint8_t)(vr % 10);
+                vr /= 10;
+                vp /= 10;
+                vm /= 10;
+                removed++;
+            }
+        }
+        if (vrIsTrailingZeros && lastRemovedDigit == 5 && vr % 2 == 0) {
+            // 恰好在两数中间时向偶数舍入
+            lastRemovedDigit = 4;
+        }
+        output = vr + ((vr == vm && (!acceptBounds || !vmIsTrailingZeros)) || lastRemovedDigit >= 5);
+    } else {
+        // 常见的情况
+        bool roundUp = false;
+        while (vp / 10 > vm / 10) {
+            roundUp = vr % 10 >= 5;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+        output = vr + (vr == vm || roundUp);
+    }
+
+    *digits = output;
+    *exp10 = e10 + removed;
+}
+
+// 将 length 位的整数 value 写入 buf
+static void writeDigits(char *buf, uint64_t value, uint32_t length) {
+    char *ptr = buf + length;
+    while (ptr > buf) {
+        *--ptr = (char)('0' + value % 10);
+        value /= 10;
+    }
+}
+
+// 将 num 转换为最短的、能精确还原的十进制字符串写入 buf
+uint32_t num2chars(double num, char *buf) {
+    // NaN 不是一个确定的值,因此 NaN 和 NaN 是不相等的
+    if (num != num) {
+        memcpy(buf, "NaN", 3);
+        return 3;
+    }
+    if (num == INFINITY) {
+        memcpy(buf, "infinity", 8);
+        return 8;
+    }
+    if (num == -INFINITY) {
+        memcpy(buf, "-infinity", 9);
+        return 9;
+    }
+
+    uint64_t bits;
+    memcpy(&bits, &num, sizeof(double));
+    char *ptr = buf;
+    // 符号位，-0 也输出负号
+    if (bits >> 63) {
+        *ptr++ = '-';
+        num = -num;
+    }
+
+    if (num == 0) {
+        *ptr++ = '0';
+        return (uint32_t)(ptr - buf);
+    }
+
+    uint64_t digits;
+    int32_t exp10;
+    if (num < (double)MAX_EXACT_INT && trunc(num) == num) {
+        // 整数的快速路径：直接输出
+        digits = (uint64_t)num;
+        exp10 = 0;
+    } else {
+        shortestDecimal(bits & ((1ULL << DOUBLE_MANTISSA_BITS) - 1),
+                        (uint32_t)(bits >> DOUBLE_MANTISSA_BITS) & 0x7FF, &digits, &exp10);
+    }
+
+    uint32_t length = decimalLength(digits);
+    // 最高位数字对应的十进制指数
+    int32_t leadingExp = exp10 + (int32_t)length - 1;
+
+    if (leadingExp < MIN_FIXED_EXP || leadingExp >= MAX_FIXED_EXP) {
+        // 科学计数法，例如 1.5e-07，与 printf 的 %g 一样指数至少两位
+        writeDigits(ptr + 1, digits, length);
+        ptr[0] = ptr[1];
+        if (length > 1) {
+            ptr[1] = '.';
+            ptr += length + 1;
+        } else {
+            ptr++;
+        }
+        *ptr++ = 'e';
+        *ptr++ = leadingExp < 0 ? '-' : '+';
+        uint32_t absExp = leadingExp < 0 ? -leadingExp : leadingExp;
+        uint32_t expLength = absExp < 10 ? 2 : decimalLength(absExp);
+        writeDigits(ptr, absExp, expLength);
+        ptr += expLength;
+    } else if (exp10 >= 0) {
+        // 整数，末尾补 0
+        writeDigits(ptr, digits, length);
+        ptr += length;
+        memset(ptr, '0', exp10);
+        ptr += exp10;
+    } else if (leadingExp >= 0) {
+        // 小数点在数字中间
+        uint32_t intLength = (uint32_t)leadingExp + 1;
+        writeDigits(ptr + 1, digits, length);
+        memmove(ptr, ptr + 1, intLength);
+        ptr[intLength] = '.';
+        ptr += length + 1;
+    } else {
+        // 纯小数，前面补 0
+        uint32_t zeroNum = (uint32_t)(-leadingExp - 1);
+        *ptr++ = '0';
+        *ptr++ = '.';
+        memset(ptr, '0', zeroNum);
+        ptr += zeroNum;
+        writeDigits(ptr, digits, length);
+        ptr += length;
+    }
+    return (uint32_t)(ptr - buf);
+}
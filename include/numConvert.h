@@ -0,0 +1,25 @@
+#ifndef _INCLUDE_NUM_CONVERT_H
+#define _INCLUDE_NUM_CONVERT_H
+#include "common.h"
+
+// 从 start 开始解析一个非负的数字，词法分析器和 Num.fromString 共用
+// 支持的格式：
+// 1. 十进制：整数、小数（小数点后必须有数字）及指数形式，例如 12、3.14、1e10、2.5E-3
+// 2. 十六进制：0x 或 0X 开头，例如 0xff
+// 3. 二进制：0b 或 0B 开头，例如 0b1010
+// 4. 八进制：当 isLeadingZeroOctal 为 true 时，以 0 开头的整数按八进制解析，例如 017
+// 数字之间可以用 _ 分隔以便阅读，例如 1_000_000、0xffff_ffff
+// 解析成功则将结果写入 num，并返回数字之后第一个字符的地址；若 start 处不是合法的数字则返回 NULL
+// 超出 double 表示范围时与 strtod 一样设置 errno 为 ERANGE
+const char *parseNum(const char *start, bool isLeadingZeroOctal, double *num);
+
+// num2chars 输出的最大长度，例如 -2.2250738585072014e-308 共 24 个字符
+#define MAX_NUM_CHARS_LEN 24
+
+// 将 num 转换为最短的、能被 parseNum 精确还原的十进制字符串，直接写入 buf，返回写入的字符数（不写入结尾的 \0）
+// buf 至少要有 MAX_NUM_CHARS_LEN 个字节
+// 十进制指数小于 -4 或不小于 17 时使用科学计数法，例如 1e+21、1.5e-07，否则使用普通写法，例如 0.1、100
+// NaN、正负无穷分别输出 NaN、infinity、-infinity
+uint32_t num2chars(double num, char *buf);
+
+#endif
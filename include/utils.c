@@ -1,5 +1,7 @@
 #include "utils.h"
+#include "flight_recorder.h"
 #include "lexer.h"
+#include "trace.h"
 #include "vm.h"
 #include <stdarg.h>
 #include <stdlib.h>
@@ -10,9 +12,40 @@
 // 2.释放内存 free：当 ptr 不为 NULL 且 newSize 为 0 时，调用 free 进行释放内存
 // 3.修改空间大小 realloc：当 ptr 不为 NULL 且 newSize 不为 0 时，则执行 realloc(ptr, newSize)
 // 相当于修改空间大小，可能是在原内存空间继续分配新的空间，或者是重新分配一个新的内存空间
-void *memManager(VM *vm, void *ptr, uint32_t oldSize, uint32_t newSize) {
+void *memManager(VM *vm, void *ptr, size_t oldSize, size_t newSize) {
+    // 虚拟机执行指令期间，会超出堆上限的申请直接拒绝，不调用 realloc，跳回虚拟机以错误结束当前线程
+    // 这样单次申请超过上限（或超过系统能提供的内存）时不会先在 realloc 中失败而退出进程
+    // 用减法比较，以免特别大的申请使加法溢出
+    size_t allowedBytes = vm->heapLimit + vm->heapLimitSlack;
+    if (newSize > oldSize && vm->heapLimit != 0 && vm->allocFailJump != NULL &&
+        (vm->allocatedBytes > allowedBytes || newSize - oldSize > allowedBytes - vm->allocatedBytes)) {
+        vm->refusedBytes = newSize - oldSize;
+        longjmp(*vm->allocFailJump, ALLOC_FAIL_HEAP_LIMIT);
+    }
+
     // 记录系统分配的内存总和
-    vm->allocatedBytes += newSize - oldSize;
+    // size_t 是无符号数，newSize 小于 oldSize 时不能直接加上 newSize - oldSize，要分开计算
+    if (newSize >= oldSize) {
+        vm->allocatedBytes += newSize - oldSize;
+        if (vm->allocatedBytes > vm->peakAllocatedBytes) {
+            vm->peakAllocatedBytes = vm->allocatedBytes;
+        }
+        // 不能跳回虚拟机时（例如编译期间）超出堆上限只做标记，本次分配照常进行，由虚拟机在安全点检查该标记并抛出运行时错误
+        // 这样调用 memManager 的地方都不必处理分配失败
+        if (vm->heapLimit != 0 && vm->allocatedBytes > vm->heapLimit + vm->heapLimitSlack) {
+            vm->isHeapLimitExceeded = true;
+        }
+        // 飞行记录器记录大块内存的申请，例如大列表、大字符串的扩容
+        if (newSize - oldSize >= FLIGHT_ALLOC_SPIKE_BYTES) {
+            FLIGHT_ALLOC_SPIKE(vm, newSize - oldSize)
+        }
+        // 追踪时记录大块内存的申请，例如大列表、大字符串的扩容
+        if (newSize - oldSize >= TRACE_LARGE_ALLOC_BYTES) {
+            TRACE_INSTANT("large allocation", "bytes", newSize - oldSize)
+        }
+    } else {
+        vm->allocatedBytes -= oldSize - newSize;
+    }
 
     // 避免 realloc(NULL, 0) 来定义新地址，该地址不能被释放
     if (newSize == 0) {
@@ -20,10 +53,29 @@ void *memManager(VM *vm, void *ptr, uint32_t oldSize, uint32_t newSize) {
         return NULL;
     }
 
+    // 新申请的内存大小留给 initObjHeader 按对象类型统计
+    if (ptr == NULL) {
+        vm->lastAllocatedBytes = newSize;
+    }
+
     // 将 ptr 指向的内存大小调整到 newSize
     // 如果将 realloc 的返回的地址直接赋给原指针变量，当 realloc 申请内存失败（内存不足等）则会返回 NULL，
     // 这样原指针变量就会被 NULL 替换，丢失原地址空间，无法释放而产生内存泄漏
-    return realloc(ptr, newSize);
+    void *newPtr = realloc(ptr, newSize);
+    if (newPtr == NULL) {
+        // 失败的申请不计入用量，能跳回虚拟机时和超出堆上限一样以错误结束当前线程
+        if (newSize >= oldSize) {
+            vm->allocatedBytes -= newSize - oldSize;
+        } else {
+            vm->allocatedBytes += oldSize - newSize;
+        }
+        if (vm->allocFailJump != NULL) {
+            vm->refusedBytes = newSize > oldSize ? newSize - oldSize : 0;
+            longjmp(*vm->allocFailJump, ALLOC_FAIL_OUT_OF_MEMORY);
+        }
+        MEM_ERROR("allocate %zu bytes failed, %zu bytes in use!", newSize, vm->allocatedBytes);
+    }
+    return newPtr;
 }
 
 // 找出大于等于 v 的最小的 2 次幂
@@ -49,7 +101,8 @@ DEFINE_BUFFER_METHOD(Byte)
 void symbolTableClear(VM *vm, SymbolTable *buffer) {
     uint32_t idx = 0;
     while (idx < buffer->count) {
-        memManager(vm, buffer->datas[idx++].str, 0, 0);
+        memManager(vm, buffer->datas[idx].str, buffer->datas[idx].length + 1, 0);
+        idx++;
     }
     StringBufferClear(vm, buffer);
 }
@@ -76,6 +129,7 @@ void errorReport(void *lexer, ErrorType errorType, const char *fmt, ...) {
             break;
         case ERROR_RUNTIME:
             fprintf(stderr, "%s\n", buffer);
+            dumpFlightRecorderOnError(buffer);
             break;
         default:
             NOT_REACHED()
@@ -5,7 +5,8 @@
 //  第一部分：内存分配
 
 // 定义内存管理函数 memManager 原型
-void *memManager(VM *vm, void *ptr, uint32_t oldSize, uint32_t newSize);
+// oldSize 必须是 ptr 原有的大小，否则 vm->allocatedBytes 的统计会出错
+void *memManager(VM *vm, void *ptr, size_t oldSize, size_t newSize);
 
 // 给类型为 type 的数据申请内存
 #define ALLOCATE(vmPtr, type) \
@@ -17,15 +18,16 @@ void *memManager(VM *vm, void *ptr, uint32_t oldSize, uint32_t newSize);
 
 // 为数组申请内存
 #define ALLOCATE_ARRAY(vmPtr, type, count) \
-    (type *)memManager(vmPtr, NULL, 0, sizeof(type) * count)
+    (type *)memManager(vmPtr, NULL, 0, sizeof(type) * (count))
 
 // 释放数组占用的内存
 #define DEALLOCATE_ARRAY(vmPtr, arrayPtr, count) \
-    memManager(vmPtr, arrayPtr, sizeof(arrayPtr[0]) * count, 0)
+    memManager(vmPtr, arrayPtr, sizeof(arrayPtr[0]) * (count), 0)
 
-// 释放内存
+// 释放 memPtr 指向的单个数据，其大小由 memPtr 的类型决定
+// 柔性数组等大小不定的数据需直接调用 memManager 并传入实际大小
 #define DEALLOCATE(vmPtr, memPtr) \
-    memManager(vmPtr, memPtr, 0, 0)
+    memManager(vmPtr, memPtr, sizeof(*(memPtr)), 0)
 
 // 第二部分：查找满足条件数的方法
 
@@ -1,6 +1,9 @@
 #include "lexer.h"
 #include "common.h"
+#include "numConvert.h"
 #include "obj_string.h"
+#include "profiler.h"
+#include "trace.h"
 #include "unicodeUtf8.h"
 #include "utils.h"
 #include <ctype.h>
@@ -37,25 +40,131 @@ struct keywordToken keywordsToken[] = {
     {NULL, 0, TOKEN_UNKNOWN},
 };
 
-// 判断以 start 开头，长度为 length 的单词是否是关键字，然后返回相应的 TokenType
-static TokenType keywordOrId(const char *start, uint32_t length) {
+// 关键字哈希表的大小，必须是 2 的幂
+#define KEYWORD_HASH_SIZE 64
+
+// 关键字的哈希函数：只取单词的首尾两个字符计算
+// 对 keywordsToken 中的关键字来说没有冲突，即是完美哈希，查找时只需比较一次
+// 新增关键字后若产生冲突，buildLexTables 会报告冲突的关键字并中止进程（发布构建中也是如此），需要调整系数
+#define KEYWORD_HASH(start, length) \
+    (((uint8_t)(start)[0] * 5 + (uint8_t)(start)[(length)-1] * 2) & (KEYWORD_HASH_SIZE - 1))
+
+// 关键字哈希表，下标为关键字的哈希值
+static struct keywordToken *keywordHashTable[KEYWORD_HASH_SIZE];
+
+// 字符分类表中的标记位
+#define CHAR_ID 0x1    // 可以出现在变量名中的字符：字母、数字和 _
+#define CHAR_BLANK 0x2 // 空白字符
+
+// 字符分类表，用查表代替 isalnum/isspace 等函数调用
+static uint8_t charClass[256];
+
+#define IS_ID_CHAR(c) (charClass[(uint8_t)(c)] & CHAR_ID)
+#define IS_BLANK_CHAR(c) (charClass[(uint8_t)(c)] & CHAR_BLANK)
+
+// 构建关键字哈希表和字符分类表，只需构建一次
+static void buildLexTables(void) {
+    static bool isBuilt = false;
+    if (isBuilt) {
+        return;
+    }
+
     uint32_t idx = 0;
     while (keywordsToken[idx].keyword != NULL) {
-        // 遍历关键字 Token 数组，查看和 start 开头，长度为 length 的单词是否相同
-        // memcmp 比较 keywordsToken[idx].keyword 指向的字符串 和 start 指向的字符串的前 length 个字符
-        // 如果返回 0，则说明两者相等
-        if (keywordsToken[idx].length == length &&
-            memcmp(keywordsToken[idx].keyword, start, length) == 0) {
-            // 找到则返回该 Token 的类型
-            return keywordsToken[idx].token;
+        uint32_t slot = KEYWORD_HASH(keywordsToken[idx].keyword, keywordsToken[idx].length);
+        // 冲突时后加入的关键字会覆盖前一个，使其被当作变量名，所以不能用发布构建中会去掉的 ASSERT
+        // 每次运行都会在词法分析核心模块之前构建该表，冲突在第一次运行时就会暴露
+        if (keywordHashTable[slot] != NULL) {
+            fprintf(stderr, "keyword hash conflict: \"%s\" and \"%s\", adjust KEYWORD_HASH!\n",
+                    keywordHashTable[slot]->keyword, keywordsToken[idx].keyword);
+            abort();
         }
+        keywordHashTable[slot] = &keywordsToken[idx];
         idx++;
     }
 
+    // 只处理 ASCII 字符，与原先在 C locale 下调用 isalnum/isspace 的结果一致
+    int c = 0;
+    while (c < 128) {
+        if (isalnum(c) || c == '_') {
+            charClass[c] |= CHAR_ID;
+        }
+        if (isspace(c)) {
+            charClass[c] |= CHAR_BLANK;
+        }
+        c++;
+    }
+    isBuilt = true;
+}
+
+// 判断以 start 开头，长度为 length 的单词是否是关键字，然后返回相应的 TokenType
+static TokenType keywordOrId(const char *start, uint32_t length) {
+    // 通过哈希直接定位到唯一可能相同的关键字
+    struct keywordToken *keyword = keywordHashTable[KEYWORD_HASH(start, length)];
+    // memcmp 比较 keyword->keyword 指向的字符串 和 start 指向的字符串的前 length 个字符
+    // 如果返回 0，则说明两者相等
+    if (keyword != NULL && keyword->length == length &&
+        memcmp(keyword->keyword, start, length) == 0) {
+        // 找到则返回该 Token 的类型
+        return keyword->token;
+    }
+
     // 找不到则返回变量名类型
     return TOKEN_ID;
 }
 
+// 以下是按机器字批量扫描字符的工具，即 SWAR（SIMD within a register）
+// 每次读入 8 个字符，用位运算同时判断其中是否有要找的字符
+
+// 每个字节都是 0x01 的机器字
+#define WORD_ONES 0x0101010101010101ULL
+// 每个字节都是 0x80 的机器字
+#define WORD_HIGHS 0x8080808080808080ULL
+
+// 判断机器字 word 中是否有字节为 0
+#define WORD_HAS_ZERO(word) (((word)-WORD_ONES) & ~(word)&WORD_HIGHS)
+
+// 判断机器字 word 中是否有字节为 c
+#define WORD_HAS_BYTE(word, c) WORD_HAS_ZERO((word) ^ (WORD_ONES * (uint8_t)(c)))
+
+// 从 ptr 开始查找第一个属于 stops 的字符，返回其地址
+// end 指向源码结尾的 \0，即使 stops 中不含 \0，遇到 \0 也会停下
+// 先以机器字为单位跳过不含 stops 中字符的部分，再逐字符确认
+static const char *scanToAny(const char *ptr, const char *end, const char *stops) {
+    while (ptr + sizeof(uint64_t) <= end) {
+        uint64_t word;
+        // 用 memcpy 读入，避免未对齐访问
+        memcpy(&word, ptr, sizeof(uint64_t));
+
+        const char *stop = stops;
+        while (*stop != '\0' && !WORD_HAS_BYTE(word, *stop)) {
+            stop++;
+        }
+        if (*stop != '\0') {
+            // 这 8 个字符中有要找的字符
+            break;
+        }
+        ptr += sizeof(uint64_t);
+    }
+
+    // strchr 对 \0 会返回 stops 的结尾，因此遇到 \0 也会退出循环
+    while (strchr(stops, *ptr) == NULL) {
+        ptr++;
+    }
+    return ptr;
+}
+
+// 统计 [start, end) 之间的换行符个数
+static uint32_t countNewlines(const char *start, const char *end) {
+    uint32_t count = 0;
+    const char *ptr = start;
+    while ((ptr = memchr(ptr, '\n', end - ptr)) != NULL) {
+        count++;
+        ptr++;
+    }
+    return count;
+}
+
 // 向前看一个字符
 static char lookAheadChar(Lexer *lexer) {
     return *lexer->nextCharPtr;
@@ -67,6 +176,12 @@ static void getNextChar(Lexer *lexer) {
     lexer->curChar = *lexer->nextCharPtr++;
 }
 
+// 将 ptr 所指的字符设为当前字符，用于批量扫描后同步词法分析器的状态
+static void seekChar(Lexer *lexer, const char *ptr) {
+    lexer->curChar = *ptr;
+    lexer->nextCharPtr = ptr + 1;
+}
+
 // 匹配下一个字符，如果匹配则读进该字符并返回 true，否则直接返回 false
 static bool matchNextChar(Lexer *lexer, char expectedChar) {
     if (lookAheadChar(lexer) == expectedChar) {
@@ -78,24 +193,29 @@ static bool matchNextChar(Lexer *lexer, char expectedChar) {
 
 // 跳过空白字符
 static void skipBlanks(Lexer *lexer) {
-    while (isspace(lexer->curChar)) {
-        if (lexer->curChar == '\n') {
+    // 直接在源码上查表扫描，最后再同步 curChar 和 nextCharPtr
+    const char *ptr = lexer->nextCharPtr - 1;
+    while (IS_BLANK_CHAR(*ptr)) {
+        if (*ptr == '\n') {
             lexer->curToken.lineNo++;
         }
-        getNextChar(lexer);
+        ptr++;
     }
+    seekChar(lexer, ptr);
 }
 
 // 解析关键字
 static void lexId(Lexer *lexer, TokenType type) {
-    // 判断当前字符 curChar 是否是字母/数字/_，如果是则继续读下个字符
-    while (isalnum(lexer->curChar) || lexer->curChar == '_') {
-        getNextChar(lexer);
+    // 判断当前字符是否是字母/数字/_，如果是则继续扫描下个字符
+    const char *ptr = lexer->nextCharPtr - 1;
+    while (IS_ID_CHAR(*ptr)) {
+        ptr++;
     }
+    seekChar(lexer, ptr);
 
-    // 将指向下一个字符地址的 nextCharPtr 值减去 curToken 的 start 再减去 1（nextCharPtr 所指的字符不满足条件），即可得到当前读进的字符数
+    // ptr 指向第一个不满足条件的字符，减去 curToken 的 start 即可得到当前读进的字符数
     // 注意 curToken 是调用本函数的函数，在调用本函数之前已经设置好的
-    uint32_t length = (uint32_t)(lexer->nextCharPtr - lexer->curToken.start - 1);
+    uint32_t length = (uint32_t)(ptr - lexer->curToken.start);
 
     lexer->curToken.length = length;
 
@@ -107,65 +227,19 @@ static void lexId(Lexer *lexer, TokenType type) {
     }
 }
 
-// 解析十六进制数字
-static void lexHexNum(Lexer *lexer) {
-    // 判断当前字符是否是合法的十六进制数字
-    while (isxdigit(lexer->curChar)) {
-        getNextChar(lexer);
-    }
-}
-
-// 解析十进制数字
-static void lexDecNum(Lexer *lexer) {
-    // 判断当前字符是否是合法的十进制数字
-    while (isdigit(lexer->curChar)) {
-        getNextChar(lexer);
-    }
-
-    if (lexer->curChar == '.' && isdigit(lookAheadChar(lexer))) {
-        getNextChar(lexer);
-        while (isdigit(lexer->curChar)) {
-            // 遇到小数点，则跳过小数点解析后面的数字
-            getNextChar(lexer);
-        }
-    }
-}
-
-// 解析八进制数字
-static void lexOctNum(Lexer *lexer) {
-    // 判断当前字符是否是合法的八进制数字
-    while (lexer->curChar >= '0' && lexer->curChar < '8') {
-        getNextChar(lexer);
-    }
-}
-
 // 解析数字
+// 支持十进制（含小数和指数）、0x 十六进制、0b 二进制、0 开头的八进制，数字之间可用 _ 分隔
 static void lexNum(Lexer *lexer) {
-    // 十六进制以 0x 开头
-    if (lexer->curChar == '0' && matchNextChar(lexer, 'x')) {
-        // 跳过 x
-        getNextChar(lexer);
-        // 解析十六进制数字
-        lexHexNum(lexer);
-        // strtol 方法是将 lexer->curToken.start 指向的字符串转成数字
-        // 第三个参数 16 表示是转成十六进制数字
-        // 第二个参数 NULL 表示不需要返回转换失败的字符串地址
-        lexer->curToken.value = NUM_TO_VALUE(strtol(lexer->curToken.start, NULL, 16));
-    } else if (lexer->curChar == '0' && isdigit(lookAheadChar(lexer))) {
-        // 解析八进制数字
-        lexOctNum(lexer);
-        // strtol 同上
-        lexer->curToken.value = NUM_TO_VALUE(strtol(lexer->curToken.start, NULL, 8));
-    } else {
-        // 解析十进制数字
-        lexDecNum(lexer);
-        // strtod 方法是将 lexer->curToken.start 指向的字符串转成十进制数字
-        // 第二个参数 NULL 表示不需要返回转换失败的字符串地址
-        lexer->curToken.value = NUM_TO_VALUE(strtod(lexer->curToken.start, NULL));
+    double num;
+    const char *end = parseNum(lexer->curToken.start, true, &num);
+    if (end == NULL) {
+        LEX_ERROR(lexer, "invalid number literal!");
     }
+    seekChar(lexer, end);
 
-    // nextCharPtr 会指向第一个不合法字符的下一个字符，所以需要再减 1
-    lexer->curToken.length = (uint32_t)(lexer->nextCharPtr - lexer->curToken.start - 1);
+    // 能用小整数表示的字面量直接用 VT_INT 表示
+    lexer->curToken.value = numToValue(num);
+    lexer->curToken.length = (uint32_t)(end - lexer->curToken.start);
     lexer->curToken.type = TOKEN_NUM;
 }
 
@@ -224,6 +298,17 @@ static void lexString(Lexer *lexer) {
         // 循环扫描下一个字符
         getNextChar(lexer);
 
+        // 字符串中大部分是普通字符，先批量找到下一个 "、\、% 或 \0，将中间的字符一次性写入
+        const char *runStart = lexer->nextCharPtr - 1;
+        const char *runEnd = scanToAny(runStart, lexer->sourceEnd, "\"\\%");
+        if (runEnd > runStart) {
+            uint32_t runLength = (uint32_t)(runEnd - runStart);
+            // 同 lexUnicodeCodePoint，先占位确保空间足够再直接复制
+            ByteBufferFillWrite(lexer->vm, &str, 0, runLength);
+            memcpy(str.datas + str.count - runLength, runStart, runLength);
+            seekChar(lexer, runEnd);
+        }
+
         // 如果在遇到右双引号 “"” 之前遇到字符串结束符 \0，说明字符串是不完整的
         if (lexer->curChar == '\0') {
             LEX_ERROR(lexer, "unterminated string!");
@@ -312,60 +397,49 @@ static void lexString(Lexer *lexer) {
 
 // 跳过一行
 static void skipAline(Lexer *lexer) {
-    getNextChar(lexer);
-    while (lexer->curChar != '\0') {
-        if (lexer->curChar == '\n') {
-            lexer->curToken.lineNo++;
-            getNextChar(lexer);
-            break;
-        }
-        getNextChar(lexer);
+    // 直接找到行尾的换行符
+    const char *ptr = scanToAny(lexer->nextCharPtr, lexer->sourceEnd, "\n");
+    if (*ptr == '\n') {
+        lexer->curToken.lineNo++;
+        ptr++;
     }
+    seekChar(lexer, ptr);
 }
 
 // 跳过行注释和区块注释
 static void skipComment(Lexer *lexer) {
-    char nextChar = lookAheadChar(lexer);
     if (lexer->curChar == '/') {
         // 行注释
         skipAline(lexer);
     } else {
-        // 区块注释
-        // TODO: 该逻辑可能有 bug，当在注释中有 * 作为注释的内容时，
-        // 不应该简单的跳出循环，然后判断下一个字符是不是 /
-        // 后续完善
-        while (nextChar != '*' && nextChar != '\0') {
-            // 不停地读入注释中下一个字符
-            getNextChar(lexer);
-
-            // 如果注释有换行，则更新 lineNo
-            // 主要是为了当某段代码报错时，能准确报出出错行数
-            if (lexer->curChar == '\n') {
-                lexer->curToken.lineNo++;
+        // 区块注释，此时 curChar 为 /* 中的 *
+        const char *ptr = lexer->nextCharPtr;
+        while (true) {
+            // 批量跳到下一个 * 或换行符
+            ptr = scanToAny(ptr, lexer->sourceEnd, "*\n");
+            if (*ptr == '\0') {
+                LEX_ERROR(lexer, "expect '*/' before comment end!");
             }
-            // 获取下一个字符，用作下一个循环的判断
-            nextChar = lookAheadChar(lexer);
-        }
 
-        // 循环退出后，下一个字符要么是 * 要么是 \0
-        // 如果下一个字符是 *，再判断下下个字符是不是 /
-        // 如果是，则说明注释结束，读取下个字符
-        if (matchNextChar(lexer, '*')) {
-            if (!matchNextChar(lexer, '/')) {
-                LEX_ERROR(lexer, "expect '/' after '*'!");
+            if (*ptr == '\n') {
+                // 如果注释有换行，则更新 lineNo
+                // 主要是为了当某段代码报错时，能准确报出出错行数
+                lexer->curToken.lineNo++;
+            } else if (ptr[1] == '/') {
+                // 遇到 */ 说明注释结束，注释内容中单独的 * 会被跳过
+                break;
             }
-            getNextChar(lexer);
-        } else {
-            // 如果下一个字符是 \0，则报错
-            LEX_ERROR(lexer, "expect '*/' before comment end!");
+            ptr++;
         }
+        // 跳过 */
+        seekChar(lexer, ptr + 2);
     }
     // 注释之后可能会有空白符
     skipBlanks(lexer);
 }
 
 // 获取 Token 方法
-void getNextToken(Lexer *lexer) {
+static void lexNextToken(Lexer *lexer) {
     // 将 curToken 备份到 preToken
     lexer->preToken = lexer->curToken;
     // 跳过待识别单词之前的空格
@@ -527,6 +601,27 @@ void getNextToken(Lexer *lexer) {
     }
 }
 
+// 累计词法分析的时间
+static void addLexTime(uint64_t elapsed) {
+    if (tracer != NULL) {
+        tracer->lexTime += elapsed;
+    }
+    if (compileStats != NULL) {
+        compileStats->lexTime += elapsed;
+    }
+}
+
+// 获取下一个 token，开启追踪或编译统计时累计词法分析的时间
+void getNextToken(Lexer *lexer) {
+    if (tracer == NULL && compileStats == NULL) {
+        lexNextToken(lexer);
+        return;
+    }
+    uint64_t start = traceNow();
+    lexNextToken(lexer);
+    addLexTime(traceNow() - start);
+}
+
 // 如果当前 token 类型为期望类型，则读入下一个 token 并返回 true
 // 否则直接返回 false
 bool matchToken(Lexer *lexer, TokenType expectTokenType) {
@@ -545,13 +640,135 @@ void assertCurToken(Lexer *lexer, TokenType expectTokenType, const char *errMsg)
     getNextToken(lexer);
 }
 
+// 跳过字符串的原始字符，start 指向 " 后面的第一个字符，返回字符串结尾 " 后面的字符地址
+// 只做字符级的扫描，不生成字符串对象，供 skipBlock 使用
+static const char *skipRawString(Lexer *lexer, const char *start, int *lineNo) {
+    const char *ptr = start;
+    while (true) {
+        // 批量跳过普通字符
+        ptr = scanToAny(ptr, lexer->sourceEnd, "\"\\%\n");
+        if (*ptr == '"') {
+            break;
+        }
+        if (*ptr == '\0') {
+            LEX_ERROR(lexer, "unterminated string!");
+        }
+        if (*ptr == '\n') {
+            (*lineNo)++;
+        }
+
+        if (*ptr == '\\' && ptr[1] != '\0') {
+            // 转义字符连同其后的字符一起跳过，避免把 \" 当作字符串结尾
+            ptr += 2;
+            continue;
+        }
+
+        if (*ptr == '%' && ptr[1] == '(') {
+            // 内嵌表达式 %(...) 中可能还有字符串，需要按括号配对跳过
+            int parenNum = 1;
+            ptr += 2;
+            while (parenNum > 0) {
+                if (*ptr == '\0') {
+                    LEX_ERROR(lexer, "expect ')' after interpolation!");
+                }
+                if (*ptr == '\n') {
+                    (*lineNo)++;
+                }
+
+                if (*ptr == '"') {
+                    ptr = skipRawString(lexer, ptr + 1, lineNo);
+                    continue;
+                }
+                if (*ptr == '(') {
+                    parenNum++;
+                } else if (*ptr == ')') {
+                    parenNum--;
+                }
+                ptr++;
+            }
+            continue;
+        }
+        ptr++;
+    }
+    return ptr + 1;
+}
+
+// 跳过代码块，用于延迟编译函数体
+// 调用该函数时已经读入了 {，即 curToken 为代码块中的第一个 token
+// 从 curToken 开始只按字符匹配大括号（跳过字符串和注释中的大括号），不做完整的词法分析
+// 执行后 preToken 为与 { 配对的 }，curToken 为 } 后面的 token，与 compileBlock 编译完代码块后的状态一致
+static void skipBlockChars(Lexer *lexer) {
+    const char *ptr = lexer->curToken.start;
+    int lineNo = lexer->curToken.lineNo;
+    int braceNum = 1;
+
+    while (true) {
+        // 批量跳到下一个可能影响大括号配对或行号的字符
+        ptr = scanToAny(ptr, lexer->sourceEnd, "\n\"/{}");
+        char c = *ptr;
+        if (c == '\0') {
+            LEX_ERROR(lexer, "expect '}' at the end of block!");
+        }
+
+        if (c == '\n') {
+            lineNo++;
+        } else if (c == '"') {
+            ptr = skipRawString(lexer, ptr + 1, &lineNo);
+            continue;
+        } else if (c == '/' && ptr[1] == '/') {
+            // 行注释，换行符留给下一轮循环统计行号
+            ptr = scanToAny(ptr, lexer->sourceEnd, "\n");
+            continue;
+        } else if (c == '/' && ptr[1] == '*') {
+            // 区块注释
+            const char *commentEnd = strstr(ptr + 2, "*/");
+            if (commentEnd == NULL) {
+                LEX_ERROR(lexer, "expect '*/' before comment end!");
+            }
+            lineNo += countNewlines(ptr + 2, commentEnd);
+            ptr = commentEnd + 2;
+            continue;
+        } else if (c == '{') {
+            braceNum++;
+        } else if (c == '}' && --braceNum == 0) {
+            break;
+        }
+        ptr++;
+    }
+
+    // 此时 ptr 指向配对的 }，将其设置成 curToken，然后读入下一个 token
+    lexer->curToken.type = TOKEN_RIGHT_BRACE;
+    lexer->curToken.start = ptr;
+    lexer->curToken.length = 1;
+    lexer->curToken.lineNo = lineNo;
+    lexer->curToken.value = VT_TO_VALUE(VT_UNDEFINED);
+    // 函数体只会出现在类体或模块中，不可能处于内嵌表达式中
+    lexer->interpolationExpectRightParenNum = 0;
+    seekChar(lexer, ptr + 1);
+    lexNextToken(lexer);
+}
+
+// 跳过代码块，开启追踪或编译统计时累计词法分析的时间
+void skipBlock(Lexer *lexer) {
+    if (tracer == NULL && compileStats == NULL) {
+        skipBlockChars(lexer);
+        return;
+    }
+    uint64_t start = traceNow();
+    skipBlockChars(lexer);
+    addLexTime(traceNow() - start);
+}
+
 // 初始化词法分析器
-void initLexer(VM *vm, Lexer *lexer, const char *file, const char *sourceCode, ObjModule *objModule) {
+void initLexer(VM *vm, Lexer *lexer, const char *file, const char *sourceCode, size_t sourceLength, ObjModule *objModule) {
+    buildLexTables();
     // 由于 sourceCode 未必源自文件
     // 当源码是直接输入的，则 file 只是个字符串
     lexer->file = file;
     // sourceCode 本身就是源码串中首字符地址
     lexer->sourceCode = sourceCode;
+    ASSERT(sourceCode[sourceLength] == '\0', "sourceCode is not terminated!");
+    lexer->sourceEnd = sourceCode + sourceLength;
     lexer->curChar = *lexer->sourceCode;
     lexer->nextCharPtr = lexer->sourceCode + 1;
     lexer->curToken.lineNo = 1;
@@ -100,6 +100,7 @@ typedef struct
 struct lexer {
     const char *file;        // 该指针指向源码文件名，用于标记当前正在编译哪个文件
     const char *sourceCode;  // 该指针指向源码字符串，将源码读出来后存储到某缓冲区，然后 sourceCode 指向该缓冲区
+    const char *sourceEnd;   // 该指针指向源码串结尾的 \0，按机器字批量扫描时用于判断边界
     const char *nextCharPtr; // 该指针指向 sourceCode 中下一个字符
     char curChar;            // 保存 sourceCode 中当前字符
     Token curToken;
@@ -122,7 +123,11 @@ bool matchToken(Lexer *lexer, TokenType expectTokenType);
 // 断言当前 token 类型为期望类型，并读取下一个 token，否则报错
 void assertCurToken(Lexer *lexer, TokenType expectTokenType, const char *errMsg);
 
-// 初始化词法分析器
-void initLexer(VM *vm, Lexer *lexer, const char *file, const char *sourceCode, ObjModule *objModule);
+// 跳过代码块，即从 curToken 开始匹配到与已读入的 { 配对的 } 为止，用于延迟编译函数体
+void skipBlock(Lexer *lexer);
+
+// 初始化词法分析器，sourceCode 是长度为 sourceLength 并以 \0 结尾的源码串
+// 长度由调用方传入，调用方读入源码时已经知道长度，不必再用 strlen 扫描一遍
+void initLexer(VM *vm, Lexer *lexer, const char *file, const char *sourceCode, size_t sourceLength, ObjModule *objModule);
 
 #endif
\ No newline at end of file
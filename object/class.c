@@ -4,22 +4,26 @@
 #include "core.h"
 #include "obj_range.h"
 #include "string.h"
+#include <math.h>
 
 // TODO: 待后续解释
 DEFINE_BUFFER_METHOD(Method)
 
 // 判断 a 和 b 是否相等
 bool valueIsEqual(Value a, Value b) {
+    // 小整数和 double 都是数字，按数值比较
+    if (VALUE_IS_NUM(a) && VALUE_IS_NUM(b)) {
+        if (VALUE_IS_INT(a) && VALUE_IS_INT(b)) {
+            return VALUE_TO_INT(a) == VALUE_TO_INT(b);
+        }
+        return VALUE_TO_NUM(a) == VALUE_TO_NUM(b);
+    }
+
     // 类型不同则不相等
     if (a.type != b.type) {
         return false;
     }
 
-    // 类型为数字则比较数值
-    if (a.type == VT_NUM) {
-        return a.num == b.num;
-    }
-
     // 指向同一个对象头则相等
     if (a.objHeader == b.objHeader) {
         return true;
@@ -53,6 +57,16 @@ bool valueIsEqual(Value a, Value b) {
     return false;
 }
 
+// 将 double 转成 Value 结构，能用小整数精确表示时用 VT_INT 表示
+Value numToValue(double num) {
+    // 范围检查在前，保证转换成 int32_t 时不会溢出；NaN 会在范围检查时被排除
+    if (num >= SMALL_INT_MIN && num <= SMALL_INT_MAX && (double)(int32_t)num == num &&
+        !(num == 0 && signbit(num))) {
+        return INT_TO_VALUE((int32_t)num);
+    }
+    return NUM_TO_VALUE(num);
+}
+
 // 新建名字为 name，属性个数为 fieldNum 的裸类（裸类即没有归属的类，其对象头的 class 指针为空）
 Class *newRawClass(VM *vm, const char *name, uint32_t fieldNum) {
     // 申请内存
@@ -71,6 +85,11 @@ Class *newRawClass(VM *vm, const char *name, uint32_t fieldNum) {
     class->superClass = NULL; // 默认没有基类
     MethodBufferInit(&class->methods);
 
+    // 没有基类时祖先表中只有类本身，绑定基类时会重建
+    class->depth = 0;
+    class->ancestors = ALLOCATE_ARRAY(vm, Class *, 1);
+    class->ancestors[0] = class;
+
     return class;
 }
 
@@ -112,6 +131,7 @@ Class *getClassOfObj(VM *vm, Value object) {
         case VT_FALSE:
             return vm->boolClass;
         case VT_NUM:
+        case VT_INT:
             return vm->numClass;
         case VT_OBJ:
             return VALUE_TO_OBJ(object)->class;
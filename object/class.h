@@ -13,9 +13,15 @@ typedef enum {
     MT_NONE,      // 空方法
     MT_PRIMITIVE, // 用 C 实现的原生方法
     MT_SCRIPT,    // 脚本语言中实现的方法
-    MT_FN_CALL    // 关于函数对象的调用方法，用于实现函数重载，如 fun1.call()
+    MT_FN_CALL,   // 关于函数对象的调用方法，用于实现函数重载，如 fun1.call()
+    MT_CONSTRUCT  // 类的静态方法 new，obj 指向 emitCreateInstance 生成的构造方法，虚拟机会直接创建实例并调用实例方法 new
 } MethodType;
 
+// 判断 class 是否为 baseClass 或其子类
+// 若 baseClass 是 class 的祖先，它一定位于 class 的祖先表中与其深度相同的位置，所以只需一次比较
+#define IS_SUBCLASS_OF(class, baseClass) \
+    ((class)->depth >= (baseClass)->depth && (class)->ancestors[(baseClass)->depth] == (baseClass))
+
 /** 值结构转换 **/
 
 // 将类型为 vt 的值转成 Value 结构
@@ -34,9 +40,32 @@ typedef enum {
 #define NUM_TO_VALUE(num) \
     ((Value){VT_NUM, {num}})
 
-// 将 Value结构转成 Number 结构
+// 将 Value结构转成 Number 结构，小整数也转成 double
 #define VALUE_TO_NUM(value) \
-    (value.num)
+    (value.type == VT_INT ? (double)value.intNum : value.num)
+
+// 小整数的取值范围
+#define SMALL_INT_MIN INT32_MIN
+#define SMALL_INT_MAX INT32_MAX
+
+// 将整数转成 Value 结构
+// 在小整数范围内则用 VT_INT 表示，否则提升为 double
+#define INT_TO_VALUE(integer) ({                            \
+    int64_t _int = (int64_t)(integer);                      \
+    Value val;                                              \
+    if (_int >= SMALL_INT_MIN && _int <= SMALL_INT_MAX) {   \
+        val.type = VT_INT;                                  \
+        val.intNum = (int32_t)_int;                         \
+    } else {                                                \
+        val.type = VT_NUM;                                  \
+        val.num = (double)_int;                             \
+    }                                                       \
+    val;                                                    \
+})
+
+// 将 Value 结构转成小整数，调用前需确保其类型为 VT_INT
+#define VALUE_TO_INT(value) \
+    (value.intNum)
 
 // 将 Object 结构转成 Value 结构
 #define OBJ_TO_VALUE(objPtr) ({              \
@@ -104,8 +133,12 @@ typedef enum {
 #define VALUE_IS_FALSE(value) \
     (value.type == VT_FALSE)
 
+// 小整数也是数字
 #define VALUE_IS_NUM(value) \
-    (value.type == VT_NUM)
+    (value.type == VT_NUM || value.type == VT_INT)
+
+#define VALUE_IS_INT(value) \
+    (value.type == VT_INT)
 
 #define VALUE_IS_OBJ(value) \
     (value.type == VT_OBJ)
@@ -129,6 +162,12 @@ typedef enum {
 #define VALUE_IS_OBJRANGE(value) \
     (VALUE_IS_CERTAIN_OBJ(value, OT_RANGE))
 
+#define VALUE_IS_OBJLIST(value) \
+    (VALUE_IS_CERTAIN_OBJ(value, OT_LIST))
+
+#define VALUE_IS_OBJMAP(value) \
+    (VALUE_IS_CERTAIN_OBJ(value, OT_MAP))
+
 #define VALUE_IS_CLASS(value) \
     (VALUE_IS_CERTAIN_OBJ(value, OT_CLASS))
 
@@ -167,6 +206,10 @@ struct class {
     struct class *superClass;
     // 类中属性的数量，此数量包括了从基类继承的属性
     uint32_t fieldNum;
+    // 类在继承链中的深度，没有基类的类深度为 0
+    uint32_t depth;
+    // 祖先表，ancestors[i] 为深度为 i 的祖先，ancestors[depth] 为类本身，共 depth + 1 项
+    struct class **ancestors;
     // 存储所有的实例方法
     MethodBuffer methods;
     // 类的名称
@@ -189,6 +232,9 @@ typedef union {
 // 判断 a 和 b 是否相等
 bool valueIsEqual(Value a, Value b);
 
+// 将 double 转成 Value 结构，若能用小整数精确表示（包括不是 -0）则用 VT_INT 表示
+Value numToValue(double num);
+
 // 新建名字为 name，属性个数为 fieldNum 的裸类（裸类即没有归属的类，其对象头的 class 指针为空）
 Class *newRawClass(VM *vm, const char *name, uint32_t fieldNum);
 
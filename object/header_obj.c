@@ -1,9 +1,17 @@
 #include "header_obj.h"
 #include "class.h"
+#include "probes.h"
+#include "profiler.h"
+#include "vm.h"
 
 // TODO: 待后续解释
 DEFINE_BUFFER_METHOD(Value)
 
+// 各对象类型的名字，顺序与 ObjType 一致
+const char *objTypeNames[OBJ_TYPE_NUM] = {
+    "class", "list", "map", "module", "range", "string",
+    "upvalue", "function", "closure", "instance", "thread"};
+
 // 初始化对象头
 void initObjHeader(VM *vm, ObjHeader *objHeader, ObjType objType, Class *class) {
     objHeader->type = objType;
@@ -16,4 +24,10 @@ void initObjHeader(VM *vm, ObjHeader *objHeader, ObjType objType, Class *class)
     // 然后再将初始化的 objHeader 设为当前所有已分配对象链表的首节点
     // 这两步操作就是为了将初始化的 objHeader 插入到已分配对象链表的表头
     vm->allObjects = objHeader;
+
+    // 按类型统计对象个数和对象自身占用的内存，对象刚由 memManager 申请，其大小就是最近一次申请的大小
+    vm->objectCounts[objType]++;
+    vm->objectBytes[objType] += vm->lastAllocatedBytes;
+    PROFILE_ALLOCATION(vm, objType, class, vm->lastAllocatedBytes)
+    PROBE_OBJECT_ALLOC(class, vm->lastAllocatedBytes)
 }
@@ -16,6 +16,13 @@ typedef enum {
     OT_THREAD    // 线程
 } ObjType;
 
+// 对象类型的个数，用于按类型统计内存
+#define OBJ_TYPE_NUM (OT_THREAD + 1)
+
+// 各对象类型的名字，顺序与 ObjType 一致，例如 "list"
+// 用于 System.memoryStats，分配剖析和堆快照用它命名没有类的对象时加上尖括号，例如 <list>
+extern const char *objTypeNames[OBJ_TYPE_NUM];
+
 // 对象头，用于记录元信息和垃圾回收
 typedef struct objHeader {
     ObjType type;           // 对象类型
@@ -31,6 +38,7 @@ typedef enum {
     VT_FALSE,     // 布尔假
     VT_TRUE,      // 布尔真
     VT_NUM,       // 数字
+    VT_INT,       // 小整数，和 VT_NUM 同属数字，运算结果超出 int32_t 范围时自动提升为 VT_NUM
     VT_OBJ        // 对象
 } ValueType;
 
@@ -41,6 +49,7 @@ typedef struct {
     ValueType type; // 值类型
     union {
         double num;
+        int32_t intNum;
         ObjHeader *objHeader;
     };
 } Value;
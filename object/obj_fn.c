@@ -54,10 +54,22 @@ ObjFn *newObjFn(VM *vm, ObjModule *objModule, uint32_t slotNum) {
 
     // 函数所引用的自由变量 upvalue 的数量
     objFn->upvalueNum = 0;
+    objFn->cachedClosure = NULL;
+    objFn->fieldAccessor = FA_NONE;
 
     // 函数在运行时栈中所需的最大空间
     objFn->maxStackSlotUsedNum = slotNum;
 
+    // 默认函数体已经编译，延迟编译的函数由编译器另行设置
+    objFn->lazyBody = NULL;
+
+    // 行号表，编译器每写入 1 字节指令就记录一次行号
+    lineTableInit(&objFn->lineTable);
+
+#ifdef OPCODE_PROFILE
+    objFn->executedInstrNum = 0;
+#endif
+
     return objFn;
 }
 
@@ -88,3 +100,159 @@ ObjClosure *newObjClosure(VM *vm, ObjFn *objFn) {
 
     return objClosure;
 }
+
+DEFINE_BUFFER_METHOD(LineCheckpoint)
+
+// 初始化空的行号表
+void lineTableInit(LineTable *table) {
+    ByteBufferInit(&table->runs);
+    LineCheckpointBufferInit(&table->checkpoints);
+    table->runNum = 0;
+    table->firstLine = 0;
+    table->lastLine = 0;
+    table->encodedLength = 0;
+    table->pendingLine = 0;
+    table->pendingLength = 0;
+}
+
+// 以变长整数写入 value，每字节 7 位，最高位为 1 表示后面还有字节
+static void writeVarint(VM *vm, ByteBuffer *runs, uint32_t value) {
+    while (value >= 0x80) {
+        ByteBufferAdd(vm, runs, (uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    ByteBufferAdd(vm, runs, (uint8_t)value);
+}
+
+// 从 runs 的 *pos 处读出变长整数，并将 *pos 移到其后
+static uint32_t readVarint(const Byte *runs, uint32_t *pos) {
+    uint32_t value = 0;
+    uint32_t shift = 0;
+    Byte byte;
+    do {
+        byte = runs[(*pos)++];
+        value |= (uint32_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return value;
+}
+
+// 将正在累计的段编码到 runs 中
+static void encodePendingRun(VM *vm, LineTable *table) {
+    // 第 0 段从 firstLine 开始解码，不需要检查点
+    if (table->runNum > 0 && table->runNum % LINE_CHECKPOINT_INTERVAL == 0) {
+        LineCheckpoint checkpoint = {table->encodedLength, table->lastLine, table->runs.count};
+        LineCheckpointBufferAdd(vm, &table->checkpoints, checkpoint);
+    }
+
+    uint32_t length = table->pendingLength;
+    // 行号可能回退（例如 for 循环在循环体之后生成的跳转指令属于循环头所在的行），所以增量是有符号的
+    int32_t lineDelta = (int32_t)(table->pendingLine - table->lastLine);
+    if (length <= LINE_RUN_MAX_LENGTH && lineDelta >= 0 && lineDelta <= LINE_RUN_MAX_DELTA) {
+        ByteBufferAdd(vm, &table->runs, (uint8_t)(length << LINE_RUN_DELTA_BITS | lineDelta));
+    } else {
+        ByteBufferAdd(vm, &table->runs, 0);
+        writeVarint(vm, &table->runs, length);
+        // zigzag 编码，使绝对值小的负数也只占 1 字节
+        writeVarint(vm, &table->runs, ((uint32_t)lineDelta << 1) ^ (uint32_t)-(lineDelta < 0));
+    }
+
+    table->runNum++;
+    table->lastLine = table->pendingLine;
+    table->encodedLength += length;
+    table->pendingLength = 0;
+}
+
+// 记录指令流中新写入的 1 字节所在的行号
+void lineTableAdd(VM *vm, LineTable *table, uint32_t line) {
+    if (table->pendingLength > 0) {
+        if (line == table->pendingLine) {
+            table->pendingLength++;
+            return;
+        }
+        encodePendingRun(vm, table);
+    } else if (table->encodedLength == 0) {
+        // 第 1 个字节，以其行号作为基准，这样第 0 段的行号增量为 0，也能编码成 1 字节
+        table->firstLine = line;
+        table->lastLine = line;
+    }
+    table->pendingLine = line;
+    table->pendingLength = 1;
+}
+
+// 编码尚未编码的段，并把缓冲区收缩到实际大小
+// 编译期间缓冲区按 2 的幂增长，收缩后行号表只占编码本身的大小
+void lineTableSeal(VM *vm, LineTable *table) {
+    if (table->pendingLength > 0) {
+        encodePendingRun(vm, table);
+    }
+
+    ByteBuffer *runs = &table->runs;
+    if (runs->capacity > runs->count) {
+        runs->datas = memManager(vm, runs->datas, runs->capacity, runs->count);
+        runs->capacity = runs->count;
+    }
+    LineCheckpointBuffer *checkpoints = &table->checkpoints;
+    if (checkpoints->capacity > checkpoints->count) {
+        checkpoints->datas = memManager(vm, checkpoints->datas, checkpoints->capacity * sizeof(LineCheckpoint),
+                                        checkpoints->count * sizeof(LineCheckpoint));
+        checkpoints->capacity = checkpoints->count;
+    }
+}
+
+// 释放行号表的内存
+void lineTableClear(VM *vm, LineTable *table) {
+    ByteBufferClear(vm, &table->runs);
+    LineCheckpointBufferClear(vm, &table->checkpoints);
+    lineTableInit(table);
+}
+
+// 返回指令流中偏移为 offset 的字节所在的行号，没有记录时返回 0
+uint32_t getLineOfOffset(const LineTable *table, uint32_t offset) {
+    // 超出已编码部分的字节属于正在累计的段
+    if (offset >= table->encodedLength) {
+        return table->pendingLength > 0 ? table->pendingLine : table->lastLine;
+    }
+
+    // 二分查找 offset 不大于所查偏移的检查点个数，即最后一个这样的检查点之后的位置
+    const LineCheckpoint *checkpoints = table->checkpoints.datas;
+    uint32_t low = 0;
+    uint32_t high = table->checkpoints.count;
+    while (low < high) {
+        uint32_t mid = (low + high) / 2;
+        if (checkpoints[mid].offset <= offset) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    // 从该检查点（没有时从第 0 段）开始逐段解码，直到所查偏移落在某一段中
+    uint32_t start = 0;
+    uint32_t line = table->firstLine;
+    uint32_t pos = 0;
+    if (low > 0) {
+        start = checkpoints[low - 1].offset;
+        line = checkpoints[low - 1].line;
+        pos = checkpoints[low - 1].pos;
+    }
+    const Byte *runs = table->runs.datas;
+    while (true) {
+        uint32_t length;
+        int32_t lineDelta;
+        Byte byte = runs[pos++];
+        if (byte != 0) {
+            length = byte >> LINE_RUN_DELTA_BITS;
+            lineDelta = byte & LINE_RUN_MAX_DELTA;
+        } else {
+            length = readVarint(runs, &pos);
+            uint32_t zigzag = readVarint(runs, &pos);
+            lineDelta = (int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 1);
+        }
+        line += lineDelta;
+        start += length;
+        if (offset < start) {
+            return line;
+        }
+    }
+}
@@ -16,11 +16,41 @@
 // 独立的指令集合单元成为指令流单元，例如模块就是最大的指令流单元，函数、类中的每个方法、代码块、闭包都是指令流单元
 // 只要是指令流单元就可以用 ObjFn 表示，因此 ObjFn 泛指一切指令流单元
 
-// 定义函数中的调试的结构体
+// 延迟编译的函数体，定义在 compiler.h 中
+typedef struct lazyBody LazyBody;
+
+// 行号表
+// 编译时每写入 1 字节指令就记录其所在的源码行号，相邻且行号相同的字节合并成一段（run），
+// 每段按与上一段的差值编码：段长 1~31 且行号增量 0~7 时编码成 1 字节（高 5 位段长，低 3 位行号增量），
+// 否则写入 0 后接段长和 zigzag 编码的行号增量，二者都是变长整数（每字节 7 位，最高位为 1 表示后面还有字节）
+// 一行源码通常生成 8 字节左右的指令，多数行只占 1 字节，按 examples/manager.di 统计，行号表约为指令流的 18%
+// 每隔 LINE_CHECKPOINT_INTERVAL 段记录一个检查点，查找时先二分查找检查点，再从检查点开始最多解码这么多段
+#define LINE_CHECKPOINT_INTERVAL 16
+
+// 1 字节编码中行号增量所占的位数，其余高位为段长
+#define LINE_RUN_DELTA_BITS 3
+#define LINE_RUN_MAX_DELTA ((1 << LINE_RUN_DELTA_BITS) - 1)
+#define LINE_RUN_MAX_LENGTH ((1 << (8 - LINE_RUN_DELTA_BITS)) - 1)
+
+// 行号表的检查点，记录解码某一段之前的状态
 typedef struct {
-    char *fnName;
-    IntBuffer lineNo;
-} FnDebug;
+    uint32_t offset; // 该段第一个字节在指令流中的偏移
+    uint32_t line;   // 上一段的行号，即解码该段时的基准
+    uint32_t pos;    // 该段在 runs 中的位置
+} LineCheckpoint;
+
+DECLARE_BUFFER_TYPE(LineCheckpoint)
+
+typedef struct {
+    ByteBuffer runs;                   // 编码后的各段
+    LineCheckpointBuffer checkpoints;  // 检查点，按 offset 递增
+    uint32_t runNum;                   // 已编码的段数
+    uint32_t firstLine;                // 第 1 个字节的行号，即解码第 0 段时的基准
+    uint32_t lastLine;                 // 最后一个已编码段的行号
+    uint32_t encodedLength;            // 已编码的段覆盖的指令字节数
+    uint32_t pendingLine;              // 正在累计、尚未编码的段的行号
+    uint32_t pendingLength;            // 正在累计的段的字节数
+} LineTable;
 
 // 定义自由变量 upvalue 对象的结构体
 typedef struct upvalue {
@@ -54,16 +84,35 @@ typedef struct {
     uint32_t upvalueNum;
     // 函数参数的个数
     uint8_t argNum;
+    // 延迟编译时保存函数体的源码等信息，函数体在第一次被调用时才编译，编译后置为 NULL
+    LazyBody *lazyBody;
+    // 最近一次为该函数创建的闭包，OPCODE_CREATE_CLOSURE 要引用的自由变量与它完全相同时直接复用，
+    // 不引用自由变量的函数因此只有一个闭包，闭包本身没有可变的状态，共用不影响语义
+    struct objClosure *cachedClosure;
+    // 方法体是否只是存取一个实例属性（FieldAccessor），是的话调用处直接存取属性，不必为其创建帧栈
+    uint8_t fieldAccessor;
 
-#if DEBUG
-    // 只有在 debug 模式下才添加
-    FnDebug *debug;
+#ifdef OPCODE_PROFILE
+    // 该函数执行过的指令数，只在指令级剖析的构建中添加
+    uint64_t executedInstrNum;
 #endif
+
+    // 指令流中每个字节对应的源码行号，供运行时报错和剖析使用
+    LineTable lineTable;
 } ObjFn;
 
+// 只存取一个实例属性的方法，由编译器在方法体编译完成后根据指令流判定
+// 属性在实例中的索引就是指令流中 LOAD_THIS_FIELD 或 STORE_THIS_FIELD 的操作数，绑定到类时已经修正过
+typedef enum {
+    FA_NONE,          // 其他函数
+    FA_GETTER,        // 指令流以 LOAD_THIS_FIELD n、RETURN 开头，返回属性 n
+    FA_SETTER,        // 指令流以 LOAD_LOCAL_VAR 1、STORE_THIS_FIELD n、POP、PUSH_NULL、RETURN 开头，将第 1 个参数写入属性 n 并返回 null
+    FA_SETTER_RETURN  // 指令流以 LOAD_LOCAL_VAR 1、STORE_THIS_FIELD n、RETURN 开头，将第 1 个参数写入属性 n 并返回该参数
+} FieldAccessor;
+
 // 定义闭包对象的结构体
 // 闭包：引用自由变量的内部函数 + 引用的自由变量集合
-typedef struct {
+typedef struct objClosure {
     ObjHeader objHeader;
     // 引用自由变量的内部函数
     ObjFn *fn;
@@ -79,6 +128,10 @@ typedef struct {
     ObjClosure *closure;
     // 函数运行时栈的起始地址
     Value *stackStart;
+    // 以下供调用剖析使用，时间是所在线程的运行时间（纳秒），不含线程被挂起的时间
+    uint64_t enterTime;    // 进入该帧时的时间
+    uint64_t childTime;    // 该帧调用的函数和原生方法花费的时间总和
+    uint32_t profileIndex; // 该帧的函数在剖析数据中的索引，为 UINT32_MAX 表示进入该帧时没有剖析
 } Frame;
 
 // 线程中初始化的函数调用帧栈数量
@@ -93,4 +146,19 @@ ObjClosure *newObjClosure(VM *vm, ObjFn *objFn);
 // 新建函数对象
 ObjFn *newObjFn(VM *vm, ObjModule *objModule, uint32_t maxStackSlotUsedNum);
 
+// 初始化空的行号表
+void lineTableInit(LineTable *table);
+
+// 记录指令流中新写入的 1 字节所在的行号
+void lineTableAdd(VM *vm, LineTable *table, uint32_t line);
+
+// 编码尚未编码的段，并把缓冲区收缩到实际大小，在函数编译结束时调用
+void lineTableSeal(VM *vm, LineTable *table);
+
+// 释放行号表的内存
+void lineTableClear(VM *vm, LineTable *table);
+
+// 返回指令流中偏移为 offset 的字节所在的行号，没有记录时返回 0
+uint32_t getLineOfOffset(const LineTable *table, uint32_t offset);
+
 #endif
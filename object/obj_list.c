@@ -1,4 +1,5 @@
 #include "obj_list.h"
+#include <string.h>
 
 // 新建元素个数为 elementNum 的 list 对象
 ObjList *newObjList(VM *vm, uint32_t elementNum) {
@@ -78,3 +79,14 @@ Value removeElement(VM *vm, ObjList *objList, uint32_t index) {
 
     return valueRemoved;
 }
+
+// 复制 list 对象，元素本身不复制
+// 新 list 的容量恰好等于元素个数，用于由常量构成的 list 字面量每次求值时得到一个新的 list
+ObjList *copyObjList(VM *vm, ObjList *objList) {
+    uint32_t elementNum = objList->elements.count;
+    ObjList *copy = newObjList(vm, elementNum);
+    if (elementNum > 0) {
+        memcpy(copy->elements.datas, objList->elements.datas, sizeof(Value) * elementNum);
+    }
+    return copy;
+}
@@ -18,4 +18,7 @@ void insertElement(VM *vm, ObjList *objList, uint32_t index, Value value);
 // 删除 objList 中索引为 index 处的元素，即删除 objList[index]
 Value removeElement(VM *vm, ObjList *objList, uint32_t index);
 
+// 复制 list 对象，元素本身不复制
+ObjList *copyObjList(VM *vm, ObjList *objList);
+
 #endif
@@ -2,6 +2,7 @@
 #include "class.h"
 #include "obj_range.h"
 #include "obj_string.h"
+#include <string.h>
 
 // 新建 map 对象
 ObjMap *newObjMap(VM *vm) {
@@ -65,6 +66,9 @@ static uint32_t hashValue(Value value) {
             return 2;
         case VT_NUM:
             return hashNum(value.num);
+        case VT_INT:
+            // 与值相等的 double 哈希值相同，保证 1 和 1.0 是同一个 key
+            return hashNum((double)value.intNum);
         case VT_OBJ:
             return hashObj(value.objHeader);
         default:
@@ -173,7 +177,7 @@ static void resizeMap(VM *vm, ObjMap *objMap, uint32_t newCapacity) {
     }
 
     // 3. 将老的 entries 数组所占内存回收
-    DEALLOCATE_ARRAY(vm, objMap->entries, objMap->count);
+    DEALLOCATE_ARRAY(vm, objMap->entries, objMap->capacity);
 
     objMap->entries = newEntries;   // 更新 entry 数组
     objMap->capacity = newCapacity; // 更新容量
@@ -247,7 +251,40 @@ Value removeKey(VM *vm, ObjMap *objMap, Value key) {
 
 // 删除 map 对象，即收回 map 对象占用的内存
 void clearMap(VM *vm, ObjMap *objMap) {
-    DEALLOCATE_ARRAY(vm, objMap->entries, objMap->count);
+    DEALLOCATE_ARRAY(vm, objMap->entries, objMap->capacity);
     objMap->entries = NULL;
     objMap->count = objMap->capacity = 0;
 }
+
+// 为 objMap 预留空间，使其容纳 entryNum 个 entry 时不必扩容
+// 与 mapSet 的扩容条件对应，容量要保证 entryNum 不超过容量的 MAP_LOAD_PERCENT
+void mapReserve(VM *vm, ObjMap *objMap, uint32_t entryNum) {
+    uint32_t newCapacity = (uint32_t)(entryNum / MAP_LOAD_PERCENT) + 1;
+    if (entryNum > 0 && newCapacity > objMap->capacity) {
+        resizeMap(vm, objMap, newCapacity);
+    }
+}
+
+// 复制 map 对象，键和值本身不复制
+// 新 map 与原 map 容量相同，所以各个 entry 可以原样复制到相同的槽位，不必重新计算哈希值
+ObjMap *copyObjMap(VM *vm, ObjMap *objMap) {
+    ObjMap *copy = newObjMap(vm);
+    if (objMap->capacity > 0) {
+        copy->entries = ALLOCATE_ARRAY(vm, Entry, objMap->capacity);
+        memcpy(copy->entries, objMap->entries, sizeof(Entry) * objMap->capacity);
+        copy->capacity = objMap->capacity;
+        copy->count = objMap->count;
+    }
+    return copy;
+}
+
+// key 是否可以作为 map 的键，即是否为值类型
+bool isValidKey(Value key) {
+    return VALUE_IS_TRUE(key) ||
+           VALUE_IS_FALSE(key) ||
+           VALUE_IS_NULL(key) ||
+           VALUE_IS_NUM(key) ||
+           VALUE_IS_OBJSTR(key) ||
+           VALUE_IS_OBJRANGE(key) ||
+           VALUE_IS_CLASS(key);
+}
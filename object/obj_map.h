@@ -34,4 +34,13 @@ Value removeKey(VM *vm, ObjMap *objMap, Value key);
 // 删除 map 对象
 void clearMap(VM *vm, ObjMap *objMap);
 
+// 为 objMap 预留空间，使其容纳 entryNum 个 entry 时不必扩容
+void mapReserve(VM *vm, ObjMap *objMap, uint32_t entryNum);
+
+// 复制 map 对象，键和值本身不复制
+ObjMap *copyObjMap(VM *vm, ObjMap *objMap);
+
+// key 是否可以作为 map 的键，即是否为值类型
+bool isValidKey(Value key);
+
 #endif
@@ -1,5 +1,6 @@
 #include "obj_thread.h"
 #include "class.h"
+#include "trace.h"
 
 // 为线程 objThread 中运行的闭包函数 objClosure 准备堆栈框架，即闭包（函数或方法）的运行资源，包括如下：
 // 1.运行时栈    2.待运行的指令流    3.当前运行的指令地址 ip
@@ -17,6 +18,10 @@ void prepareFrame(ObjThread *objThread, ObjClosure *objClosure, Value *stackStar
     frame->closure = objClosure;
     // 指令起始地址是闭包中函数的指令流的起始地址
     frame->ip = objClosure->fn->instrStream.datas;
+    // 线程的第一个帧栈不经过 createFrame，进入时间就是线程运行时间的起点 0
+    frame->enterTime = 0;
+    frame->childTime = 0;
+    frame->profileIndex = UINT32_MAX;
 }
 
 // 重置线程对象，即为闭包 objClosure 中的函数初始化运行时栈
@@ -27,6 +32,8 @@ void resetThread(ObjThread *objThread, ObjClosure *objClosure) {
     objThread->caller = NULL;
     objThread->errorObj = VT_TO_VALUE(VT_NULL);
     objThread->usedFrameNum = 0;
+    objThread->profileRunTime = 0;
+    objThread->profileResumedAt = 0;
 
     // 闭包 objClosure 为空则报错
     ASSERT(objClosure != NULL, "objClosure is NULL in function resetThread");
@@ -69,5 +76,19 @@ ObjThread *newObjThread(VM *vm, ObjClosure *objClosure) {
 
     // 重置线程对象，即为闭包 objClosure 中的函数初始化运行时栈
     resetThread(objThread, objClosure);
+
+    // 开启追踪时为线程分配时间线上的轨道
+    objThread->traceId = 0;
+    TRACE_THREAD_CREATED(objThread)
+
+    // 新建的线程使用虚拟机设置的执行预算
+    setThreadBudget(objThread, vm->threadBudget);
+    objThread->isPreempted = false;
     return objThread;
 }
+
+// 设置线程的执行预算并重新获得完整的预算
+void setThreadBudget(ObjThread *objThread, uint64_t budget) {
+    objThread->budget = budget;
+    objThread->budgetLeft = budget == 0 ? UINT64_MAX : budget;
+}
@@ -19,6 +19,17 @@ typedef struct objThread {
     struct objThread *caller; // 当前线程（thread）对象的调用者，若当前线程退出，则将控制权交回调用者（调用者本身也是一个线程对象）
 
     Value errorObj; // 导致运行时错误的对象会放在这里，否则为空
+
+    uint64_t profileRunTime;   // 调用剖析时该线程累计运行的时间（纳秒）
+    uint64_t profileResumedAt; // 调用剖析时该线程最近一次开始运行的时刻
+
+    uint32_t traceId; // 线程在追踪时间线中的轨道编号，为 0 表示创建时没有开启追踪
+
+    // 执行预算：循环回跳和方法调用各消耗 1，两次检查之间执行的指令数不超过所在函数的长度，所以预算限制了线程执行的指令数
+    // 耗尽时按 vm->budgetAction 结束线程或让出给主调线程，让出的线程再次运行时重新获得完整的预算，由此实现时间片轮转
+    uint64_t budget;     // 预算，为 0 表示不限制
+    uint64_t budgetLeft; // 剩余的预算，不限制时从 UINT64_MAX 开始递减，实际上不会耗尽，虚拟机因此只需判断是否减到 0
+    bool isPreempted;    // 是否因预算耗尽而让出，此时栈顶是线程自己的数据，再次被调用时不能写入 call 的参数
 } ObjThread;
 
 // 为线程 objThread 中运行的闭包函数 objClosure 准备运行时栈
@@ -30,4 +41,7 @@ void resetThread(ObjThread *objThread, ObjClosure *objClosure);
 // 新建线程对象，线程中运行的是闭包 objClosure 中的函数
 ObjThread *newObjThread(VM *vm, ObjClosure *objClosure);
 
+// 设置线程的执行预算并重新获得完整的预算，budget 为 0 表示不限制
+void setThreadBudget(ObjThread *objThread, uint64_t budget);
+
 #endif
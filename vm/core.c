@@ -1,13 +1,21 @@
 #include "core.h"
 #include "compiler.h"
 #include "core.script.inc"
+#include "flight_recorder.h"
+#include "heap_snapshot.h"
+#include "numConvert.h"
+#include "probes.h"
+#include "trace.h"
 #include "unicodeUtf8.h"
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <math.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
 // 源码文件所在的根目录，其值是在 cli.c 文件中设置的
 // 解释器运行时会获得源码文件所在路径并写入 rootDir
@@ -29,6 +37,8 @@ char *rootDir = NULL;
 #define RET_OBJ(objPtr) RET_VALUE(OBJ_TO_VALUE(objPtr))
 #define RET_BOOL(boolean) RET_VALUE(BOOL_TO_VALUE(boolean))
 #define RET_NUM(num) RET_VALUE(NUM_TO_VALUE(num))
+// 返回整数，在小整数范围内时不必经过 double
+#define RET_INT(integer) RET_VALUE(INT_TO_VALUE(integer))
 #define RET_NULL RET_VALUE(VT_TO_VALUE(VT_NULL))
 #define RET_TRUE RET_VALUE(VT_TO_VALUE(VT_TRUE))
 #define RET_FALSE RET_VALUE(VT_TO_VALUE(VT_FALSE))
@@ -64,8 +74,8 @@ char *rootDir = NULL;
     }
 
 // 读取源码文件的方法
-// path 为源码路径
-char *readFile(const char *path) {
+// path 为源码路径，fileSize 用于返回源码的长度
+char *readFile(const char *path, size_t *fileSize) {
     //获取源码文件的句柄 file
     FILE *file = fopen(path, "r");
     if (file == NULL) {
@@ -74,43 +84,71 @@ char *readFile(const char *path) {
 
     struct stat fileStat;
     stat(path, &fileStat);
-    size_t fileSize = fileStat.st_size;
+    *fileSize = fileStat.st_size;
 
     // 获取源码文件大小后，为源码字符串申请内存，多申请的1个字节是为了字符串结尾 \0
-    char *fileContent = (char *)malloc(fileSize + 1);
+    char *fileContent = (char *)malloc(*fileSize + 1);
     if (fileContent == NULL) {
         MEM_ERROR("Couldn't allocate memory for reading file \"%s\".\n", path);
     }
 
-    size_t numRead = fread(fileContent, sizeof(char), fileSize, file);
-    if (numRead < fileSize) {
+    size_t numRead = fread(fileContent, sizeof(char), *fileSize, file);
+    if (numRead < *fileSize) {
         IO_ERROR("Couldn't read file \"%s\".\n", path);
     }
     // 字符串要以 \0 结尾
-    fileContent[fileSize] = '\0';
+    fileContent[*fileSize] = '\0';
 
     fclose(file);
     return fileContent;
 }
 
-// 将数字转换为字符串
-static ObjString *num2str(VM *vm, double num) {
-    // NaN 不是一个确定的值,因此 NaN 和 NaN 是不相等的
-    if (num != num) {
-        return newObjString(vm, "NaN", 3);
+// 以只读方式将源码文件映射到内存，词法分析直接在映射区上进行，省去读入时的复制
+// 映射区中文件末尾到页边界之间由内核填 0，正好作为源码串结尾的 \0
+// 若文件为空或大小恰好是页大小的整数倍（末尾没有空余的 \0），则退化为 readFile
+// fileSize 用于返回源码的长度，mappedSize 用于返回映射区的大小，为 0 表示源码是由 readFile 读入的
+char *mapFile(const char *path, size_t *fileSize, size_t *mappedSize) {
+    *mappedSize = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        IO_ERROR("Couldn't open file \"%s\".\n", path);
+    }
+
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) == -1 || fileStat.st_size == 0 ||
+        fileStat.st_size % sysconf(_SC_PAGESIZE) == 0) {
+        close(fd);
+        return readFile(path, fileSize);
     }
 
-    if (num == INFINITY) {
-        return newObjString(vm, "infinity", 8);
+    char *fileContent = (char *)mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // 映射建立后即可关闭文件句柄，不影响映射区
+    close(fd);
+    if (fileContent == MAP_FAILED) {
+        return readFile(path, fileSize);
     }
 
-    if (num == -INFINITY) {
-        return newObjString(vm, "-infinity", 9);
+    *fileSize = fileStat.st_size;
+    *mappedSize = fileStat.st_size;
+    return fileContent;
+}
+
+// 释放由 mapFile 得到的源码
+void unmapFile(char *fileContent, size_t mappedSize) {
+    if (mappedSize == 0) {
+        free(fileContent);
+    } else {
+        munmap(fileContent, mappedSize);
     }
+}
 
-    // 以下 24 字节的缓冲区足以容纳双精度到字符串的转换
-    char buf[24] = {'\0'};
-    int len = sprintf(buf, "%.14g", num);
+// 将数字转换为字符串
+// 使用最短且能精确还原的十进制表示，转换结果先写入栈上的 buf 再复制到字符串对象中
+// 转换完成前不知道长度，若直接写入字符串对象，只能按 MAX_NUM_CHARS_LEN 申请再缩小（多一次 memManager 调用），
+// 或者让每个数字字符串多占 20 字节左右并计入 GC 的内存统计，都比复制最多 24 字节的代价大
+static ObjString *num2str(VM *vm, double num) {
+    char buf[MAX_NUM_CHARS_LEN];
+    uint32_t len = num2chars(num, buf);
     return newObjString(vm, buf, len);
 }
 
@@ -149,6 +187,11 @@ static bool validateIntValue(VM *vm, double value) {
 
 // 判断 arg 是否为整数
 static bool validateInt(VM *vm, Value arg) {
+    // 小整数无需再校验
+    if (VALUE_IS_INT(arg)) {
+        return true;
+    }
+
     // 首先得是数字
     if (!validateNum(vm, arg)) {
         return false;
@@ -183,18 +226,24 @@ static uint32_t validateIndexValue(VM *vm, double index, uint32_t length) {
 
 // 校验 index 合法性
 static uint32_t validateIndex(VM *vm, Value index, uint32_t length) {
+    // 小整数索引直接做整数运算，无需转换和判断是否为整数
+    if (VALUE_IS_INT(index)) {
+        int64_t intIndex = VALUE_TO_INT(index);
+        if (intIndex < 0) {
+            intIndex += length;
+        }
+        if (intIndex >= 0 && intIndex < length) {
+            return (uint32_t)intIndex;
+        }
+        vm->curThread->errorObj = OBJ_TO_VALUE(newObjString(vm, "index out of bound!", 19));
+        return UINT32_MAX;
+    }
     return validateIndexValue(vm, VALUE_TO_NUM(index), length);
 }
 
 // 校验 key 合法性
 static bool validateKey(VM *vm, Value arg) {
-    if (VALUE_IS_TRUE(arg) ||
-        VALUE_IS_FALSE(arg) ||
-        VALUE_IS_NULL(arg) ||
-        VALUE_IS_NUM(arg) ||
-        VALUE_IS_OBJSTR(arg) ||
-        VALUE_IS_OBJRANGE(arg) ||
-        VALUE_IS_CLASS(arg)) {
+    if (isValidKey(arg)) {
         return true;
     }
     SET_ERROR_FALSE(vm, "key must be value type!")
@@ -386,8 +435,8 @@ static ObjModule *getModule(VM *vm, Value moduleName) {
     return (ObjModule *)(value.objHeader);
 }
 
-// 加载名为 moduleName 的模块并进行编译
-static ObjThread *loadModule(VM *vm, Value moduleName, const char *moduleCode) {
+// 加载名为 moduleName 的模块并进行编译，moduleCode 的长度为 codeLength
+static ObjThread *loadModule(VM *vm, Value moduleName, const char *moduleCode, size_t codeLength) {
     // 先在 vm->allModules 中查找是否存在 moduleName
     // 如果存在，说明对应模块已经加载，以避免重复加载
     ObjModule *module = getModule(vm, moduleName);
@@ -415,10 +464,15 @@ static ObjThread *loadModule(VM *vm, Value moduleName, const char *moduleCode) {
         }
     }
 
-    ObjFn *fn = compileModule(vm, module, moduleCode);
+    FLIGHT_MODULE_LOAD(vm, module)
+    PROBE_MODULE_LOAD_START(module)
+    ObjFn *fn = compileModule(vm, module, moduleCode, codeLength);
     // 单独创建一个线程运行编译后的模块
     ObjClosure *objClosure = newObjClosure(vm, fn);
     ObjThread *moduleThread = newObjThread(vm, objClosure);
+    // 时间线中以模块名命名该线程的轨道
+    TRACE_NAME_THREAD(moduleThread, module->name == NULL ? "core module" : module->name->value.start)
+    PROBE_MODULE_LOAD_DONE(module)
     return moduleThread;
 }
 
@@ -440,10 +494,10 @@ static char *getFilePath(const char *moduleName) {
     return path;
 }
 
-// 读取名为 moduleName 的模块
-static char *readModule(const char *moduleName) {
+// 读取名为 moduleName 的模块，fileSize 和 mappedSize 的含义同 mapFile
+static char *readModule(const char *moduleName, size_t *fileSize, size_t *mappedSize) {
     char *modulePath = getFilePath(moduleName);
-    char *moduleCode = readFile(modulePath);
+    char *moduleCode = mapFile(modulePath, fileSize, mappedSize);
     free(modulePath);
     return moduleCode;
 }
@@ -463,10 +517,14 @@ static Value importModule(VM *vm, Value moduleName) {
     }
     ObjString *objString = VALUE_TO_OBJSTR(moduleName);
     // 读取名为 moduleName 的模块
-    const char *sourceCode = readModule(objString->value.start);
+    size_t sourceLength;
+    size_t mappedSize;
+    char *sourceCode = readModule(objString->value.start, &sourceLength, &mappedSize);
 
     // 加载名为 moduleName 的模块并进行编译
-    ObjThread *moduleThread = loadModule(vm, moduleName, sourceCode);
+    ObjThread *moduleThread = loadModule(vm, moduleName, sourceCode, sourceLength);
+    // 模块编译完成后不再需要源码（延迟编译的函数体已复制了各自的源码）
+    unmapFile(sourceCode, mappedSize);
     return OBJ_TO_VALUE(moduleThread);
 }
 
@@ -540,17 +598,8 @@ static bool primObjectIs(VM *vm, Value *args) {
     Class *thisClass = getClassOfObj(vm, args[0]);
     Class *baseClass = (Class *)(args[1].objHeader);
 
-    // 可能是多级继承，所以需要自下而上遍历基类链
-    while (baseClass != NULL) {
-        // 如果某一级基类匹配到，就设置返回值为 VT_TRUE 并返回
-        if (thisClass == baseClass) {
-            RET_VALUE(VT_TO_VALUE(VT_TRUE))
-        }
-        baseClass = baseClass->superClass;
-    }
-
-    // 若未找到满足条件的基类，则设置返回值为 VT_FALSE 并返回
-    RET_VALUE(VT_TO_VALUE(VT_FALSE))
+    // 可能是多级继承，借助祖先表判断 baseClass 是否为 thisClass 或其祖先
+    RET_BOOL(IS_SUBCLASS_OF(thisClass, baseClass))
 }
 
 // args[0].toString: 返回 args[0] 所属的 class 的名字
@@ -633,6 +682,12 @@ static bool primThreadNew(VM *vm, Value *args) {
         return false;
     }
 
+    // 新建线程时需要根据函数的 maxStackSlotUsedNum 分配栈，延迟编译的函数需要先编译
+    ObjFn *fn = VALUE_TO_OBJCLOSURE(args[1])->fn;
+    if (fn->lazyBody != NULL) {
+        compileLazyFn(vm, fn);
+    }
+
     ObjThread *objThread = newObjThread(vm, VALUE_TO_OBJCLOSURE(args[1]));
 
     // 使stack[0]为接收者,保持栈平衡
@@ -749,7 +804,12 @@ static bool switchThread(VM *vm, ObjThread *nextThread, Value *args, bool withAr
     // 线程 nextThread 如果之前通过 yield 让出了 CUP 使用权给主调方 curThread，
     // 这次主调方 curThread 又通过 nextThread.call(arg) 使 nextThread 恢复运行
     // 那么 nextThread.call(arg) 中的 arg 将作为返回值存储到 nextThread 的栈顶
-    nextThread->esp[-1] = withArg ? args[1] : VT_TO_VALUE(VT_NULL);
+    // 因执行预算耗尽而让出的线程停在循环回跳或调用之后，栈顶是它自己的数据，arg 被丢弃
+    if (nextThread->isPreempted) {
+        nextThread->isPreempted = false;
+    } else {
+        nextThread->esp[-1] = withArg ? args[1] : VT_TO_VALUE(VT_NULL);
+    }
 
     // 虚拟机是根据 vm->curThread 来确定当前运行的线程，设置当前线程为 nextThread
     vm->curThread = nextThread;
@@ -783,6 +843,30 @@ static bool primThreadIsDone(VM *vm UNUSED, Value *args) {
     RET_BOOL(objThread->usedFrameNum == 0 || !VALUE_IS_NULL(objThread->errorObj))
 }
 
+// objThread.error：返回使线程出错退出的对象（Thread.abort 的参数或运行时错误的信息），没有出错时返回 null
+static bool primThreadError(VM *vm UNUSED, Value *args) {
+    RET_VALUE(VALUE_TO_OBJTHREAD(args[0])->errorObj)
+}
+
+// objThread.budget：返回线程的执行预算（循环回跳和方法调用的次数），0 表示不限制
+static bool primThreadBudget(VM *vm UNUSED, Value *args) {
+    RET_NUM((double)VALUE_TO_OBJTHREAD(args[0])->budget)
+}
+
+// objThread.budget = n：设置线程的执行预算并重新获得完整的预算，0 表示不限制
+// 预算耗尽时的处理方式由虚拟机决定（di --budget-action），默认以错误结束线程
+static bool primThreadSetBudget(VM *vm, Value *args) {
+    if (!validateInt(vm, args[1])) {
+        return false;
+    }
+    double budget = VALUE_TO_NUM(args[1]);
+    if (budget < 0) {
+        SET_ERROR_FALSE(vm, "budget must not be negative!")
+    }
+    setThreadBudget(VALUE_TO_OBJTHREAD(args[0]), (uint64_t)budget);
+    RET_VALUE(args[1])
+}
+
 /**
  * Fn 类的原生方法
 **/
@@ -836,14 +920,40 @@ static bool primNumFromString(VM *vm, Value *args) {
     ASSERT(objString->value.start[objString->value.length] == '\0', "objString don`t terminate!");
 
     errno = 0;
-    char *endPtr;
-
-    // 将字符串转换为 double 型, 它会自动跳过前面的空白
-    double num = strtod(objString->value.start, &endPtr);
+    const char *start = objString->value.start;
+    const char *endPtr;
+    double num;
+
+    // 跳过前面的空白和正负号后，按与数字字面量相同的规则解析
+    const char *ptr = start;
+    while (isspace((unsigned char)*ptr)) {
+        ptr++;
+    }
+    bool isNegative = *ptr == '-';
+    if (*ptr == '-' || *ptr == '+') {
+        ptr++;
+    }
+
+    const char *end = start + objString->value.length;
+    endPtr = parseNum(ptr, false, &num);
+    if (endPtr != NULL) {
+        num = isNegative ? -num : num;
+        while (*endPtr != '\0' && isspace((unsigned char)*endPtr)) {
+            endPtr++;
+        }
+    }
 
-    // 以 endPtr 是否等于 start+length 来判断不能转换的字符之后是否全是空白
-    while (*endPtr != '\0' && isspace((unsigned char)*endPtr)) {
-        endPtr++;
+    // 不是数字字面量的格式，或者按字面量的规则解析后还剩下非空白的字符，交给 strtod 处理
+    // 前者例如 inf、nan，后者例如 5. 和 1.e5：字面量的小数点后必须有数字，以免和 1..3 或 1.abs 冲突，字符串中则没有这个限制
+    if (endPtr == NULL || endPtr < end) {
+        errno = 0;
+        char *strtodEnd;
+        num = strtod(start, &strtodEnd);
+        endPtr = strtodEnd;
+        // 以 endPtr 是否等于 start+length 来判断不能转换的字符之后是否全是空白
+        while (*endPtr != '\0' && isspace((unsigned char)*endPtr)) {
+            endPtr++;
+        }
     }
 
     if (errno == ERANGE) {
@@ -851,12 +961,12 @@ static bool primNumFromString(VM *vm, Value *args) {
     }
 
     // 如果字符串中不能转换的字符不全是空白，则字符串非法，返回 NULL
-    if (endPtr < objString->value.start + objString->value.length) {
+    if (endPtr < end) {
         RET_NULL
     }
 
-    // 至此，检查通过，返回正确结果
-    RET_NUM(num)
+    // 至此，检查通过，返回正确结果，整数和字面量一样用小整数表示，例如解析 CSV 或 JSON 得到的整数
+    RET_VALUE(numToValue(num))
 }
 
 // 返回圆周率
@@ -868,33 +978,85 @@ static bool primNumPi(VM *vm UNUSED, Value *args UNUSED) {
 // 定义 Num 相关中缀运算符的宏，共性如下：
 // 先校验数字的合法性，然后再用 args[0] 和 args[1] 做中追运算符表示的运算
 // 例如 1 + 2，args[0] 是 1，args[1] 是 2，中缀运算符 operator 是 +，那么表达式的计算公式即 args[0] operator args[1]
-#define PRIM_NUM_INFIX(name, operator, type)                              \
-    static bool name(VM *vm, Value *args) {                               \
-        if (!validateNum(vm, args[1])) {                                  \
-            return false;                                                 \
-        }                                                                 \
-        RET_##type(VALUE_TO_NUM(args[0]) operator VALUE_TO_NUM(args[1])); \
-    }
-
-PRIM_NUM_INFIX(primNumPlus, +, NUM)
-PRIM_NUM_INFIX(primNumMinus, -, NUM)
-PRIM_NUM_INFIX(primNumMul, *, NUM)
-PRIM_NUM_INFIX(primNumDiv, /, NUM)
-PRIM_NUM_INFIX(primNumGt, >, BOOL)
-PRIM_NUM_INFIX(primNumGe, >=, BOOL)
-PRIM_NUM_INFIX(primNumLt, <, BOOL)
-PRIM_NUM_INFIX(primNumLe, <=, BOOL)
-#undef PRIM_NUM_INFIX
+// 两个操作数都是小整数时直接用 int64_t 运算，不会溢出，结果超出小整数范围时由 RET_INT 提升为 double
+#define PRIM_NUM_ARITH(name, operator)                                       \
+    static bool name(VM *vm, Value *args) {                                  \
+        if (VALUE_IS_INT(args[0]) && VALUE_IS_INT(args[1])) {                \
+            RET_INT((int64_t)VALUE_TO_INT(args[0]) operator VALUE_TO_INT(args[1])) \
+        }                                                                    \
+        if (!validateNum(vm, args[1])) {                                     \
+            return false;                                                    \
+        }                                                                    \
+        RET_NUM(VALUE_TO_NUM(args[0]) operator VALUE_TO_NUM(args[1]));       \
+    }
+
+PRIM_NUM_ARITH(primNumPlus, +)
+PRIM_NUM_ARITH(primNumMinus, -)
+#undef PRIM_NUM_ARITH
+
+// 定义 Num 相关比较运算符的宏，原理和上面一样
+#define PRIM_NUM_COMPARE(name, operator)                                    \
+    static bool name(VM *vm, Value *args) {                                 \
+        if (VALUE_IS_INT(args[0]) && VALUE_IS_INT(args[1])) {               \
+            RET_BOOL(VALUE_TO_INT(args[0]) operator VALUE_TO_INT(args[1]))  \
+        }                                                                   \
+        if (!validateNum(vm, args[1])) {                                    \
+            return false;                                                   \
+        }                                                                   \
+        RET_BOOL(VALUE_TO_NUM(args[0]) operator VALUE_TO_NUM(args[1]));     \
+    }
+
+PRIM_NUM_COMPARE(primNumGt, >)
+PRIM_NUM_COMPARE(primNumGe, >=)
+PRIM_NUM_COMPARE(primNumLt, <)
+PRIM_NUM_COMPARE(primNumLe, <=)
+#undef PRIM_NUM_COMPARE
+
+// 数字相乘
+// 该方法是脚本中调用 num1*num2 所执行的原生方法，该方法为实例方法
+static bool primNumMul(VM *vm, Value *args) {
+    if (VALUE_IS_INT(args[0]) && VALUE_IS_INT(args[1])) {
+        int64_t result = (int64_t)VALUE_TO_INT(args[0]) * VALUE_TO_INT(args[1]);
+        // 结果为 0 且有负数时 double 的结果是 -0，交给下面的 double 运算
+        if (result != 0 || (VALUE_TO_INT(args[0]) >= 0 && VALUE_TO_INT(args[1]) >= 0)) {
+            RET_INT(result)
+        }
+    }
+    if (!validateNum(vm, args[1])) {
+        return false;
+    }
+    RET_NUM(VALUE_TO_NUM(args[0]) * VALUE_TO_NUM(args[1]))
+}
+
+// 数字相除
+// 该方法是脚本中调用 num1/num2 所执行的原生方法，该方法为实例方法
+static bool primNumDiv(VM *vm, Value *args) {
+    if (VALUE_IS_INT(args[0]) && VALUE_IS_INT(args[1])) {
+        int64_t dividend = VALUE_TO_INT(args[0]);
+        int64_t divisor = VALUE_TO_INT(args[1]);
+        // 只有能整除时结果才是整数，0 除以负数的结果是 -0，同样交给 double 运算
+        if (divisor != 0 && dividend % divisor == 0 && (dividend != 0 || divisor > 0)) {
+            RET_INT(dividend / divisor)
+        }
+    }
+    if (!validateNum(vm, args[1])) {
+        return false;
+    }
+    RET_NUM(VALUE_TO_NUM(args[0]) / VALUE_TO_NUM(args[1]))
+}
 
 // 定义 Num 相关位操作的宏，原理和上面一样
-#define PRIM_NUM_BIT(name, operator)                   \
-    static bool name(VM *vm, Value *args) {            \
-        if (!validateNum(vm, args[1])) {               \
-            return false;                              \
-        }                                              \
-        uint32_t leftOperand = VALUE_TO_NUM(args[0]);  \
-        uint32_t rightOperand = VALUE_TO_NUM(args[1]); \
-        RET_NUM(leftOperand operator rightOperand);    \
+// 位运算在 32 位无符号整数上进行，小整数直接转换，无需经过 double
+#define PRIM_NUM_BIT(name, operator)                                                         \
+    static bool name(VM *vm, Value *args) {                                                  \
+        if (!validateNum(vm, args[1])) {                                                     \
+            return false;                                                                    \
+        }                                                                                    \
+        uint32_t leftOperand = VALUE_IS_INT(args[0]) ? (uint32_t)VALUE_TO_INT(args[0])       \
+                                                     : (uint32_t)VALUE_TO_NUM(args[0]);      \
+        uint32_t rightOperand = VALUE_IS_INT(args[1]) ? (uint32_t)VALUE_TO_INT(args[1])      \
+                                                      : (uint32_t)VALUE_TO_NUM(args[1]);     \
+        RET_INT(leftOperand operator rightOperand);                                          \
     }
 
 PRIM_NUM_BIT(primNumBitAnd, &)
@@ -909,22 +1071,66 @@ PRIM_NUM_BIT(primNumBitShiftLeft, <<)
         RET_NUM(mathFn(VALUE_TO_NUM(args[0])));    \
     }
 
-PRIM_NUM_MATH_FN(primNumAbs, fabs)
 PRIM_NUM_MATH_FN(primNumAcos, acos)
 PRIM_NUM_MATH_FN(primNumAsin, asin)
 PRIM_NUM_MATH_FN(primNumAtan, atan)
-PRIM_NUM_MATH_FN(primNumCeil, ceil)
 PRIM_NUM_MATH_FN(primNumCos, cos)
-PRIM_NUM_MATH_FN(primNumFloor, floor)
-PRIM_NUM_MATH_FN(primNumNegate, -)
 PRIM_NUM_MATH_FN(primNumSin, sin)
 PRIM_NUM_MATH_FN(primNumSqrt, sqrt)
 PRIM_NUM_MATH_FN(primNumTan, tan)
 #undef PRIM_NUM_MATH_FN
 
+// 取整的宏，小整数取整后就是其本身，double 取整后能用小整数表示时转为小整数
+#define PRIM_NUM_ROUND_FN(name, mathFn)                           \
+    static bool name(VM *vm UNUSED, Value *args) {                \
+        if (VALUE_IS_INT(args[0])) {                              \
+            RET_VALUE(args[0])                                    \
+        }                                                         \
+        RET_VALUE(numToValue(mathFn(VALUE_TO_NUM(args[0]))))      \
+    }
+
+PRIM_NUM_ROUND_FN(primNumCeil, ceil)
+PRIM_NUM_ROUND_FN(primNumFloor, floor)
+// 取数字的整数部分
+// 该方法是脚本中调用 num.truncate 所执行的原生方法，该方法为实例方法
+PRIM_NUM_ROUND_FN(primNumTruncate, trunc)
+#undef PRIM_NUM_ROUND_FN
+
+// 数字的绝对值
+// 该方法是脚本中调用 num.abs 所执行的原生方法，该方法为实例方法
+static bool primNumAbs(VM *vm UNUSED, Value *args) {
+    if (VALUE_IS_INT(args[0])) {
+        int64_t operand = VALUE_TO_INT(args[0]);
+        RET_INT(operand < 0 ? -operand : operand)
+    }
+    RET_NUM(fabs(VALUE_TO_NUM(args[0])))
+}
+
+// 数字取负
+// 该方法是脚本中调用 -num 所执行的原生方法，该方法为实例方法
+static bool primNumNegate(VM *vm UNUSED, Value *args) {
+    // 0 取负是 -0，只能用 double 表示
+    if (VALUE_IS_INT(args[0]) && VALUE_TO_INT(args[0]) != 0) {
+        RET_INT(-(int64_t)VALUE_TO_INT(args[0]))
+    }
+    RET_NUM(-VALUE_TO_NUM(args[0]))
+}
+
 // 数字取模
 // 该方法是脚本中调用 num1%num2 所执行的原生方法，该方法为实例方法
 static bool primNumMod(VM *vm UNUSED, Value *args) {
+    if (VALUE_IS_INT(args[0]) && VALUE_IS_INT(args[1])) {
+        int64_t dividend = VALUE_TO_INT(args[0]);
+        int64_t divisor = VALUE_TO_INT(args[1]);
+        // C 的 % 和 fmod 一样，结果的符号与被除数相同
+        // 但除数为 0 时 fmod 返回 NaN，负数整除时 fmod 返回 -0，这两种情况交给 fmod
+        if (divisor != 0) {
+            int64_t result = dividend % divisor;
+            if (result != 0 || dividend >= 0) {
+                RET_INT(result)
+            }
+        }
+    }
     if (!validateNum(vm, args[1])) {
         return false;
     }
@@ -934,7 +1140,8 @@ static bool primNumMod(VM *vm UNUSED, Value *args) {
 // 数字取反
 // 该方法是脚本中调用 ~num 所执行的原生方法，该方法为实例方法
 static bool primNumBitNot(VM *vm UNUSED, Value *args) {
-    RET_NUM(~(uint32_t)VALUE_TO_NUM(args[0]))
+    uint32_t operand = VALUE_IS_INT(args[0]) ? (uint32_t)VALUE_TO_INT(args[0]) : (uint32_t)VALUE_TO_NUM(args[0]);
+    RET_INT(~operand)
 }
 
 // 数字获取范围
@@ -949,14 +1156,6 @@ static bool primNumRange(VM *vm UNUSED, Value *args) {
     RET_OBJ(newObjRange(vm, from, to))
 }
 
-// 取数字的整数部分
-// 该方法是脚本中调用 num.truncate 所执行的原生方法，该方法为实例方法
-static bool primNumTruncate(VM *vm UNUSED, Value *args) {
-    double integer;
-    modf(VALUE_TO_NUM(args[0]), &integer);
-    RET_NUM(integer)
-}
-
 // 返回小数部分
 // 该方法是脚本中调用 num.fraction 所执行的原生方法，该方法为实例方法
 static bool primNumFraction(VM *vm UNUSED, Value *args) {
@@ -973,6 +1172,9 @@ static bool primNumIsInfinity(VM *vm UNUSED, Value *args) {
 // 判断是否为整数
 // 该方法是脚本中调用 num.isInteger 所执行的原生方法，该方法为实例方法
 static bool primNumIsInteger(VM *vm UNUSED, Value *args) {
+    if (VALUE_IS_INT(args[0])) {
+        RET_TRUE
+    }
     double num = VALUE_TO_NUM(args[0]);
     // 如果是 NaN (不是一个数字)或无限大的数字就返回 false
     if (isnan(num) || isinf(num)) {
@@ -993,9 +1195,50 @@ static bool primNumToString(VM *vm UNUSED, Value *args) {
     RET_OBJ(num2str(vm, VALUE_TO_NUM(args[0])))
 }
 
+// toStringFixed 和 toStringExp 允许的最大小数位数
+#define MAX_FRACTION_DIGITS 100
+
+// 按 fmt（%.*f 或 %.*e）将 args[0] 保留 args[1] 位小数后转换为字符串
+static bool numToStringWithDigits(VM *vm, Value *args, const char *fmt) {
+    if (!validateInt(vm, args[1])) {
+        return false;
+    }
+
+    double digits = VALUE_TO_NUM(args[1]);
+    if (digits < 0 || digits > MAX_FRACTION_DIGITS) {
+        SET_ERROR_FALSE(vm, "digits must be between 0 and 100!")
+    }
+
+    double num = VALUE_TO_NUM(args[0]);
+    // NaN 和无穷与 toString 的输出保持一致
+    if (isnan(num) || isinf(num)) {
+        RET_OBJ(num2str(vm, num))
+    }
+
+    // 最长的情况是 -1.79e308 按 %.100f 输出，共 1 + 309 + 1 + 100 个字符
+    char buf[512];
+    int len = snprintf(buf, sizeof(buf), fmt, (int)digits, num);
+    RET_OBJ(newObjString(vm, buf, len))
+}
+
+// 将数字保留 digits 位小数后转换为字符串，例如 3.14159.toStringFixed(2) 为 3.14
+// 该方法是脚本中调用 num.toStringFixed(digits) 所执行的原生方法，该方法为实例方法
+static bool primNumToStringFixed(VM *vm, Value *args) {
+    return numToStringWithDigits(vm, args, "%.*f");
+}
+
+// 将数字用科学计数法表示，尾数保留 digits 位小数，例如 12345.toStringExp(2) 为 1.23e+04
+// 该方法是脚本中调用 num.toStringExp(digits) 所执行的原生方法，该方法为实例方法
+static bool primNumToStringExp(VM *vm, Value *args) {
+    return numToStringWithDigits(vm, args, "%.*e");
+}
+
 // 判断两个数字是否相等
 // 该方法是脚本中调用 num1 == num2 所执行的原生方法，该方法为实例方法
 static bool primNumEqual(VM *vm UNUSED, Value *args) {
+    if (VALUE_IS_INT(args[0]) && VALUE_IS_INT(args[1])) {
+        RET_BOOL(VALUE_TO_INT(args[0]) == VALUE_TO_INT(args[1]))
+    }
     if (!validateNum(vm, args[1])) {
         RET_FALSE
     }
@@ -1006,6 +1249,9 @@ static bool primNumEqual(VM *vm UNUSED, Value *args) {
 // 判断两个数字是否不等
 // 该方法是脚本中调用 num1 != num2 所执行的原生方法，该方法为实例方法
 static bool primNumNotEqual(VM *vm UNUSED, Value *args) {
+    if (VALUE_IS_INT(args[0]) && VALUE_IS_INT(args[1])) {
+        RET_BOOL(VALUE_TO_INT(args[0]) != VALUE_TO_INT(args[1]))
+    }
     if (!validateNum(vm, args[1])) {
         RET_TRUE
     }
@@ -1116,14 +1362,14 @@ static bool primStringByteAt(VM *vm UNUSED, Value *args) {
         return false;
     }
     // 如果索引合法，则返回对应字符的数字形式
-    RET_NUM((uint8_t)objString->value.start[index])
+    RET_INT((uint8_t)objString->value.start[index])
 }
 
 // 获取字符串对应的字节数
 // 该方法是脚本中调用 objString.byteCount_ 所执行的原生方法，该方法为实例方法
 static bool primStringByteCount(VM *vm UNUSED, Value *args) {
     ObjString *objString = VALUE_TO_OBJSTR(args[0]);
-    RET_NUM(objString->value.length)
+    RET_INT(objString->value.length)
 }
 
 // 获取字符串中指定索引的字符对应的码点
@@ -1140,11 +1386,11 @@ static bool primStringCodePointAt(VM *vm UNUSED, Value *args) {
     if ((bytes[index] & 0xc0) == 0x80) {
         // 如果 index 指向的并不是 UTF-8 编码的最高字节
         // 而是后面的低字节,返回 -1 提示用户
-        RET_NUM(-1)
+        RET_INT(-1)
     }
 
     // 调用 decodeUtf8 解码对应字符并返回
-    RET_NUM(decodeUtf8((uint8_t *)objString->value.start + index, objString->value.length - index))
+    RET_INT(decodeUtf8((uint8_t *)objString->value.start + index, objString->value.length - index))
 }
 
 // 判断字符串 args[0] 中是否包含子字符串 args[1]
@@ -1180,7 +1426,7 @@ static bool primStringIndexOf(VM *vm UNUSED, Value *args) {
 
     // 否则调用 findString 来检索字符串 args[0] 中子串 args[1] 的起始下标
     int index = findString(objString, pattern);
-    RET_NUM(index)
+    RET_INT(index)
 }
 
 // 判断字符串 args[0] 是否以字符串 args[1] 为开始
@@ -1240,7 +1486,7 @@ static bool primStringIterate(VM *vm UNUSED, Value *args) {
         if (objString->value.length == 0) {
             RET_FALSE
         }
-        RET_NUM(0)
+        RET_INT(0)
     }
 
     // 迭代器必须是正整数
@@ -1264,7 +1510,7 @@ static bool primStringIterate(VM *vm UNUSED, Value *args) {
         // 读取连续的数据字节，直到下一个 UTF-8 的高字节
     } while ((objString->value.start[index] & 0xc0) == 0x80);
 
-    RET_NUM(index)
+    RET_INT(index)
 }
 
 // 迭代索引，内部使用
@@ -1277,7 +1523,7 @@ static bool primStringIterateByte(VM *vm UNUSED, Value *args) {
         if (objString->value.length == 0) {
             RET_FALSE
         }
-        RET_NUM(0)
+        RET_INT(0)
     }
 
     // 迭代器必须是正整数
@@ -1298,7 +1544,7 @@ static bool primStringIterateByte(VM *vm UNUSED, Value *args) {
         RET_FALSE
     }
 
-    RET_NUM(index)
+    RET_INT(index)
 }
 
 // 返回迭代器对应的value
@@ -1444,7 +1690,7 @@ static bool primListClear(VM *vm, Value *args) {
 // 该方法是脚本中调用 objList.count 所执行的原生方法，该方法为实例方法
 static bool primListCount(VM *vm UNUSED, Value *args) {
     ObjList *objList = VALUE_TO_OBJLIST(args[0]);
-    RET_NUM(objList->elements.count)
+    RET_INT(objList->elements.count)
 }
 
 // 迭代 list 中的元素
@@ -1457,7 +1703,7 @@ static bool primListIterate(VM *vm, Value *args) {
         if (objList->elements.count == 0) {
             RET_FALSE
         }
-        RET_NUM(0)
+        RET_INT(0)
     }
 
     // 确保迭代器是整数
@@ -1471,7 +1717,7 @@ static bool primListIterate(VM *vm, Value *args) {
         RET_FALSE
     }
     //返回下一个
-    RET_NUM(iter + 1)
+    RET_INT((int64_t)iter + 1)
 }
 
 // 返回迭代值
@@ -1587,7 +1833,7 @@ static bool primMapContainsKey(VM *vm, Value *args) {
 // 该方法是脚本中调用 objMap.count 所执行的原生方法，该方法为实例方法
 static bool primMapCount(VM *vm UNUSED, Value *args) {
     ObjMap *objMap = VALUE_TO_OBJMAP(args[0]);
-    RET_NUM(objMap->count)
+    RET_INT(objMap->count)
 }
 
 // 迭代 map 中的 entry，即 key-value 对
@@ -1633,7 +1879,7 @@ static bool primMapIterate(VM *vm, Value *args) {
         // 哈希值散布在这些槽中并不连续，因此逐个判断槽位是否在用
         if (!VALUE_IS_UNDEFINED(objMap->entries[index].key)) {
             // 返回 entry 索引
-            RET_NUM(index)
+            RET_INT(index)
         }
         index++;
     }
@@ -1719,7 +1965,7 @@ static bool primRangeIterate(VM *vm, Value *args) {
 
     // 若未提供 iter 说明是第一次迭代，因此返回 range->from
     if (VALUE_IS_NULL(args[1])) {
-        RET_NUM(objRange->from)
+        RET_VALUE(numToValue(objRange->from))
     }
 
     // 迭代器必须是数字
@@ -1727,7 +1973,7 @@ static bool primRangeIterate(VM *vm, Value *args) {
         return false;
     }
 
-    // 获得迭代器
+    // 获得迭代器，迭代器为小整数时返回的也是小整数，循环变量可以一直保持整数
     double iter = VALUE_TO_NUM(args[1]);
 
     // 若是正方向
@@ -1744,7 +1990,7 @@ static bool primRangeIterate(VM *vm, Value *args) {
         }
     }
 
-    RET_NUM(iter)
+    RET_VALUE(numToValue(iter))
 }
 
 // range 的迭代就是 range 中从 from 到 to 之间的值，因此直接返回迭代器就是range的值
@@ -1778,6 +2024,83 @@ static bool primSystemClock(VM *vm UNUSED, Value *args UNUSED) {
     RET_NUM((double)time(NULL))
 }
 
+// 以字符串 key 为键向 objMap 中添加统计项
+static void setStat(VM *vm, ObjMap *objMap, const char *key, Value value) {
+    mapSet(vm, objMap, OBJ_TO_VALUE(newObjString(vm, key, strlen(key))), value);
+}
+
+// 返回虚拟机的内存统计
+// 该方法是脚本中调用 System.memoryStats 所执行的原生方法，该方法为类方法
+// 结果是一个 map，例如 {"allocatedBytes": 1024, "peakBytes": 2048, "heapLimit": 0, "objectCount": 10, "objectBytes": 512,
+// "types": {"string": {"count": 6, "bytes": 320}, ...}}，其中 heapLimit 为 0 表示不限制
+static bool primSystemMemoryStats(VM *vm, Value *args) {
+    // 创建结果本身也会申请内存，所以先备份统计数据
+    size_t allocatedBytes = vm->allocatedBytes;
+    size_t peakBytes = vm->peakAllocatedBytes;
+    uint32_t objectCounts[OBJ_TYPE_NUM];
+    size_t objectBytes[OBJ_TYPE_NUM];
+    memcpy(objectCounts, vm->objectCounts, sizeof(objectCounts));
+    memcpy(objectBytes, vm->objectBytes, sizeof(objectBytes));
+
+    ObjMap *stats = newObjMap(vm);
+    // 先将 stats 放到 args[0] 中，即运行时栈上，作为返回值
+    args[0] = OBJ_TO_VALUE(stats);
+
+    ObjMap *types = newObjMap(vm);
+    setStat(vm, stats, "types", OBJ_TO_VALUE(types));
+
+    double totalCount = 0;
+    double totalBytes = 0;
+    uint32_t idx = 0;
+    while (idx < OBJ_TYPE_NUM) {
+        ObjMap *typeStats = newObjMap(vm);
+        setStat(vm, types, objTypeNames[idx], OBJ_TO_VALUE(typeStats));
+        setStat(vm, typeStats, "count", numToValue(objectCounts[idx]));
+        setStat(vm, typeStats, "bytes", numToValue(objectBytes[idx]));
+        totalCount += objectCounts[idx];
+        totalBytes += objectBytes[idx];
+        idx++;
+    }
+
+    setStat(vm, stats, "allocatedBytes", numToValue(allocatedBytes));
+    setStat(vm, stats, "peakBytes", numToValue(peakBytes));
+    setStat(vm, stats, "heapLimit", numToValue(vm->heapLimit));
+    setStat(vm, stats, "objectCount", numToValue(totalCount));
+    setStat(vm, stats, "objectBytes", numToValue(totalBytes));
+    return true;
+}
+
+// 将堆快照写入文件 args[1]，返回写入的对象个数
+// 该方法是脚本中调用 System.heapSnapshot(args[1]) 所执行的原生方法，该方法为类方法
+// 快照格式见 heap_snapshot.h
+static bool primSystemHeapSnapshot(VM *vm, Value *args) {
+    if (!validateString(vm, args[1])) {
+        return false;
+    }
+    int64_t nodeNum = writeHeapSnapshot(vm, VALUE_TO_OBJSTR(args[1])->value.start);
+    if (nodeNum < 0) {
+        SET_ERROR_FALSE(vm, "couldn't write heap snapshot file!")
+    }
+    RET_NUM((double)nodeNum)
+}
+
+// 将飞行记录写入文件 args[1]，返回写入的事件个数
+// 该方法是脚本中调用 System.dumpFlightRecorder(args[1]) 所执行的原生方法，该方法为类方法
+// 记录格式见 flight_recorder.h
+static bool primSystemDumpFlightRecorder(VM *vm, Value *args) {
+    if (!validateString(vm, args[1])) {
+        return false;
+    }
+    if (vm->flightRecorder == NULL) {
+        SET_ERROR_FALSE(vm, "flight recorder is disabled!")
+    }
+    int64_t eventNum = writeFlightRecorder(vm, VALUE_TO_OBJSTR(args[1])->value.start, "System.dumpFlightRecorder");
+    if (eventNum < 0) {
+        SET_ERROR_FALSE(vm, "couldn't write flight recorder file!")
+    }
+    RET_NUM((double)eventNum)
+}
+
 // 启动 gc
 // 该方法是脚本中调用 System.gc() 所执行的原生方法，该方法为类方法
 static bool primSystemGC(VM *vm, Value *args) {
@@ -1851,10 +2174,17 @@ static bool primSystemWriteString(VM *vm UNUSED, Value *args) {
  * 至此，原生方法定义部分结束
 **/
 
-// 执行名为 moduleName 代码为 moduleCode 的模块
-VMResult executeModule(VM *vm, Value moduleName, const char *moduleCode) {
-    ObjThread *objThread = loadModule(vm, moduleName, moduleCode);
-    return executeInstruction(vm, objThread);
+// 执行名为 moduleName 代码为 moduleCode 的模块，codeLength 为代码的长度
+VMResult executeModule(VM *vm, Value moduleName, const char *moduleCode, size_t codeLength) {
+    TRACE_BEGIN("executeModule", "module", VALUE_IS_NULL(moduleName) ? "core" : VALUE_TO_OBJSTR(moduleName)->value.start)
+    ObjThread *objThread = loadModule(vm, moduleName, moduleCode, codeLength);
+    VMResult result = executeInstruction(vm, objThread);
+    // 模块执行完毕，不再有线程运行
+    FLIGHT_THREAD_SWITCH(vm, NULL)
+    TRACE_THREAD_SWITCH(NULL)
+    PROBE_THREAD_SWITCH(NULL)
+    TRACE_END(NULL, 0)
+    return result;
 }
 
 // 在 table 中查找符号 symbol，找到后返回索引，否则返回 -1
@@ -1927,6 +2257,13 @@ void bindMethod(VM *vm, Class *class, uint32_t index, Method method) {
 void bindSuperClass(VM *vm, Class *subClass, Class *superClass) {
     subClass->superClass = superClass;
 
+    // 祖先表为基类的祖先表再加上类本身
+    DEALLOCATE_ARRAY(vm, subClass->ancestors, subClass->depth + 1);
+    subClass->depth = superClass->depth + 1;
+    subClass->ancestors = ALLOCATE_ARRAY(vm, Class *, subClass->depth + 1);
+    memcpy(subClass->ancestors, superClass->ancestors, sizeof(Class *) * superClass->depth + sizeof(Class *));
+    subClass->ancestors[subClass->depth] = subClass;
+
     // 继承基类的属性个数
     subClass->fieldNum += superClass->fieldNum;
 
@@ -1995,7 +2332,7 @@ void buildCore(VM *vm) {
     vm->classOfClass->objHeader.class = vm->classOfClass;
 
     //执行核心模块
-    executeModule(vm, CORE_MODULE, coreModuleCode);
+    executeModule(vm, CORE_MODULE, coreModuleCode, sizeof(coreModuleCode) - 1);
 
     /* Bool 类定义在 core.script.inc，将其挂载到 vm->boolClass，并绑定原生方法 */
     vm->boolClass = VALUE_TO_CLASS(getCoreClassValue(coreModule, "Bool"));
@@ -2015,6 +2352,9 @@ void buildCore(VM *vm) {
     PRIM_METHOD_BIND(vm->threadClass, "call()", primThreadCallWithoutArg)
     PRIM_METHOD_BIND(vm->threadClass, "call(_)", primThreadCallWithArg)
     PRIM_METHOD_BIND(vm->threadClass, "isDone", primThreadIsDone)
+    PRIM_METHOD_BIND(vm->threadClass, "error", primThreadError)
+    PRIM_METHOD_BIND(vm->threadClass, "budget", primThreadBudget)
+    PRIM_METHOD_BIND(vm->threadClass, "budget=(_)", primThreadSetBudget)
 
     /* Fn 类定义在 core.script.inc，将其挂载到 vm->fnClass，并绑定原生方法 */
     vm->fnClass = VALUE_TO_CLASS(getCoreClassValue(coreModule, "Fn"));
@@ -2082,6 +2422,8 @@ void buildCore(VM *vm) {
     PRIM_METHOD_BIND(vm->numClass, "isInteger", primNumIsInteger)
     PRIM_METHOD_BIND(vm->numClass, "isNan", primNumIsNan)
     PRIM_METHOD_BIND(vm->numClass, "toString", primNumToString)
+    PRIM_METHOD_BIND(vm->numClass, "toStringFixed(_)", primNumToStringFixed)
+    PRIM_METHOD_BIND(vm->numClass, "toStringExp(_)", primNumToStringExp)
     PRIM_METHOD_BIND(vm->numClass, "==(_)", primNumEqual)
     PRIM_METHOD_BIND(vm->numClass, "!=(_)", primNumNotEqual)
 
@@ -2137,6 +2479,19 @@ void buildCore(VM *vm) {
     PRIM_METHOD_BIND(vm->mapClass, "keyIteratorValue_(_)", primMapKeyIteratorValue)
     PRIM_METHOD_BIND(vm->mapClass, "valueIteratorValue_(_)", primMapValueIteratorValue)
 
+    // 记录内联指令 OPCODE_INTRINSICx 所代替的原生方法，虚拟机只在接收者的类仍绑定着这些方法时直接完成其工作
+    vm->intrinsicPrims[IP_LIST_COUNT] = primListCount;
+    vm->intrinsicPrims[IP_STRING_COUNT] = primStringByteCount;
+    vm->intrinsicPrims[IP_MAP_COUNT] = primMapCount;
+    vm->intrinsicPrims[IP_NUM_ABS] = primNumAbs;
+    vm->intrinsicPrims[IP_NUM_SQRT] = primNumSqrt;
+    vm->intrinsicPrims[IP_NUM_FLOOR] = primNumFloor;
+    vm->intrinsicPrims[IP_NUM_IS_INTEGER] = primNumIsInteger;
+    vm->intrinsicPrims[IP_NUM_TO_STRING] = primNumToString;
+    vm->intrinsicPrims[IP_STRING_TO_STRING] = primStringToString;
+    vm->intrinsicPrims[IP_MAP_CONTAINS_KEY] = primMapContainsKey;
+    vm->intrinsicPrims[IP_OBJECT_IS] = primObjectIs;
+
     /* range 类定义在 core.script.inc，将其挂载到 vm->rangeClass，并绑定原生方法 */
     vm->rangeClass = VALUE_TO_CLASS(getCoreClassValue(coreModule, "Range"));
     // 以下是 range 实例方法
@@ -2152,6 +2507,9 @@ void buildCore(VM *vm) {
     // 以下是 System 类方法
     PRIM_METHOD_BIND(systemClass->objHeader.class, "clock", primSystemClock)
     PRIM_METHOD_BIND(systemClass->objHeader.class, "gc()", primSystemGC)
+    PRIM_METHOD_BIND(systemClass->objHeader.class, "memoryStats", primSystemMemoryStats)
+    PRIM_METHOD_BIND(systemClass->objHeader.class, "heapSnapshot(_)", primSystemHeapSnapshot)
+    PRIM_METHOD_BIND(systemClass->objHeader.class, "dumpFlightRecorder(_)", primSystemDumpFlightRecorder)
     PRIM_METHOD_BIND(systemClass->objHeader.class, "importModule(_)", primSystemImportModule)
     PRIM_METHOD_BIND(systemClass->objHeader.class, "getModuleVariable(_,_)", primSystemGetModuleVariable)
     PRIM_METHOD_BIND(systemClass->objHeader.class, "writeString_(_)", primSystemWriteString)
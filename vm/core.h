@@ -5,11 +5,17 @@
 // 源码文件所在的根目录
 extern char *rootDir;
 
-// 读取源码文件的方法
-char *readFile(const char *sourceFile);
+// 读取源码文件的方法，fileSize 返回源码的长度
+char *readFile(const char *sourceFile, size_t *fileSize);
 
-// 执行模块
-VMResult executeModule(VM *vm, Value moduleName, const char *sourceCode);
+// 将源码文件映射到内存，fileSize 返回源码的长度，mappedSize 返回映射区大小，为 0 表示退化为 readFile 读入
+char *mapFile(const char *path, size_t *fileSize, size_t *mappedSize);
+
+// 释放由 mapFile 得到的源码
+void unmapFile(char *fileContent, size_t mappedSize);
+
+// 执行模块，sourceCode 是长度为 sourceLength 并以 \0 结尾的源码串
+VMResult executeModule(VM *vm, Value moduleName, const char *sourceCode, size_t sourceLength);
 
 // 编译核心模块
 void buildCore(VM *vm);
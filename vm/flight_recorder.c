@@ -0,0 +1,265 @@
+#include "flight_recorder.h"
+#include "obj_fn.h"
+#include "profiler.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// 新建的虚拟机是否开启飞行记录器
+bool flightRecorderEnabled = true;
+
+// 最近开启飞行记录器的虚拟机，供 SIGUSR1 的处理函数和拿不到虚拟机的 errorReport 使用
+static VM *recordingVM = NULL;
+
+// SIGUSR1 的处理函数，只做异步信号安全的操作：累计转储请求并通知虚拟机，写文件留给虚拟机在循环回跳或方法调用之后完成
+static void onFlightDumpSignal(int signum) {
+    (void)signum;
+    VM *vm = recordingVM;
+    if (vm != NULL) {
+        vm->flightRecorder->dumpRequests++;
+        vm->isSignalPending = 1;
+    }
+}
+
+// 为 vm 开启飞行记录器
+void startFlightRecorder(VM *vm) {
+    if (!flightRecorderEnabled) {
+        vm->flightRecorder = NULL;
+        return;
+    }
+    // 记录器不属于虚拟机的堆，用 calloc 申请，不计入虚拟机的内存统计
+    FlightRecorder *recorder = calloc(1, sizeof(FlightRecorder));
+    if (recorder == NULL) {
+        MEM_ERROR("allocate flight recorder failed!");
+    }
+    recorder->clockCountdown = FLIGHT_CLOCK_COUNTDOWN;
+    vm->flightRecorder = recorder;
+    recordingVM = vm;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onFlightDumpSignal;
+    sigemptyset(&action.sa_mask);
+    // 被信号打断的系统调用（例如读取标准输入）自动重新执行
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &action, NULL);
+}
+
+// 释放飞行记录器
+void freeFlightRecorder(VM *vm) {
+    if (recordingVM == vm) {
+        recordingVM = NULL;
+    }
+    free(vm->flightRecorder);
+    vm->flightRecorder = NULL;
+}
+
+// 插入一个时钟并重置读时钟的倒计数
+void recordFlightClock(FlightRecorder *recorder) {
+    FlightEvent *event = &recorder->events[recorder->eventNum++ & (FLIGHT_RECORDER_SIZE - 1)];
+    event->data.time = flightNow();
+    event->info = FLIGHT_INFO(FE_CLOCK, 0);
+    recorder->clockNum++;
+    recorder->clockCountdown = FLIGHT_CLOCK_COUNTDOWN;
+}
+
+// 记录一个带时间的事件
+void recordTimedFlightEvent(FlightRecorder *recorder, FlightEventType type, void *ptr, uint64_t bytes) {
+    recordFlightClock(recorder);
+    FlightEvent *event = &recorder->events[recorder->eventNum++ & (FLIGHT_RECORDER_SIZE - 1)];
+    if (type == FE_ALLOC_SPIKE) {
+        event->data.bytes = bytes;
+    } else {
+        event->data.ptr = ptr;
+    }
+    event->info = FLIGHT_INFO(type, 0);
+}
+
+// 将引用对象 obj 的事件标记为 FLIGHT_FREED
+// 事件中只保存对象的指针，记录时不必多做任何事情，代价是释放函数、线程和模块时要扫描一遍缓冲区
+void forgetFlightObject(FlightRecorder *recorder, ObjHeader *obj) {
+    uint32_t idx = 0;
+    while (idx < FLIGHT_RECORDER_SIZE) {
+        FlightEvent *event = &recorder->events[idx];
+        uint32_t type = FLIGHT_INFO_TYPE(event->info);
+        if (event->data.ptr == obj && type != FE_CLOCK && type != FE_ALLOC_SPIKE) {
+            event->data.ptr = NULL;
+            event->info |= FLIGHT_FREED;
+        }
+        idx++;
+    }
+}
+
+// 函数所属模块的名字，核心模块没有名字
+static const char *getModuleName(ObjModule *module) {
+    return module == NULL || module->name == NULL ? "core" : module->name->value.start;
+}
+
+// 输出函数的名字及其定义所在的位置，例如 Foo.bar(_) (manager.di:12)
+static void writeFnName(FILE *file, FnNameTable *table, ObjFn *fn) {
+    FnName *fnName = findFnName(table, fn);
+    fprintf(file, "%s (%s:%u)", fnName == NULL ? "?" : getFnName(table, fnName),
+            getModuleName(fn->module), getLineOfOffset(&fn->lineTable, 0));
+}
+
+// 将 vm 的飞行记录按时间顺序输出到 file
+uint32_t dumpFlightRecorder(VM *vm, FILE *file, const char *reason) {
+    FlightRecorder *recorder = vm->flightRecorder;
+    uint64_t now = flightNow();
+    uint32_t count = recorder->eventNum < FLIGHT_RECORDER_SIZE ? (uint32_t)recorder->eventNum : FLIGHT_RECORDER_SIZE;
+    uint64_t firstIdx = recorder->eventNum - count;
+
+    // 缓冲区中的时钟不单独输出，不计入事件个数
+    uint32_t clockCount = 0;
+    uint64_t idx = firstIdx;
+    while (idx < recorder->eventNum) {
+        if (FLIGHT_INFO_TYPE(recorder->events[idx & (FLIGHT_RECORDER_SIZE - 1)].info) == FE_CLOCK) {
+            clockCount++;
+        }
+        idx++;
+    }
+
+    struct timespec resolution;
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_getres(CLOCK_MONOTONIC_COARSE, &resolution);
+#else
+    clock_getres(CLOCK_MONOTONIC, &resolution);
+#endif
+    fprintf(file, "# flight recorder: %s\n", reason);
+    fprintf(file, "# last %u of %llu events, oldest first, time in ms before the dump, blank if not sampled (clock resolution %.3f ms)\n",
+            count - clockCount, (unsigned long long)(recorder->eventNum - recorder->clockNum),
+            (double)resolution.tv_sec * 1000.0 + (double)resolution.tv_nsec / 1000000.0);
+
+    FnNameTable table;
+    buildFnNameTable(vm, &table);
+    // 上一个时钟的时间，为 0 表示下一个事件没有时间
+    uint64_t time = 0;
+    idx = firstIdx;
+    while (idx < recorder->eventNum) {
+        FlightEvent *event = &recorder->events[idx & (FLIGHT_RECORDER_SIZE - 1)];
+        idx++;
+        uint32_t type = FLIGHT_INFO_TYPE(event->info);
+        if (type == FE_CLOCK) {
+            time = event->data.time;
+            continue;
+        }
+        if (time == 0) {
+            fprintf(file, "%12s  ", "");
+        } else {
+            fprintf(file, "%12.3f  ", (double)(int64_t)(time - now) / 1000000.0);
+            time = 0;
+        }
+        // 引用的对象已经释放的事件只输出类型
+        if ((event->info & FLIGHT_FREED) != 0) {
+            static const char *freedNames[] = {
+                [FE_CALL] = "call    (freed function)",
+                [FE_RETURN] = "return  (freed function)",
+                [FE_THREAD_SWITCH] = "switch  (freed thread)",
+                [FE_MODULE_LOAD] = "load    (freed module)"
+            };
+            fprintf(file, "%s", freedNames[type]);
+            if (type == FE_CALL || type == FE_RETURN) {
+                fprintf(file, " depth %u", FLIGHT_INFO_ARG(event->info));
+            }
+            fputc('\n', file);
+            continue;
+        }
+        switch (type) {
+            case FE_CALL:
+                fprintf(file, "call    ");
+                writeFnName(file, &table, (ObjFn *)event->data.ptr);
+                fprintf(file, " depth %u\n", FLIGHT_INFO_ARG(event->info));
+                break;
+            case FE_RETURN:
+                fprintf(file, "return  ");
+                writeFnName(file, &table, (ObjFn *)event->data.ptr);
+                fprintf(file, " depth %u\n", FLIGHT_INFO_ARG(event->info));
+                break;
+            case FE_THREAD_SWITCH:
+                if (event->data.ptr == NULL) {
+                    fprintf(file, "switch  (no thread)\n");
+                } else {
+                    // 线程以其最外层的函数命名，即 Thread.new 的参数或模块的顶层代码
+                    // 已经运行结束的线程不再引用其帧栈中的闭包，闭包可能已经释放，只输出地址
+                    ObjThread *objThread = (ObjThread *)event->data.ptr;
+                    fprintf(file, "switch  thread %p", (void *)objThread);
+                    if (objThread->usedFrameNum > 0) {
+                        fputc(' ', file);
+                        writeFnName(file, &table, objThread->frames[0].closure->fn);
+                    } else {
+                        fprintf(file, " (finished)");
+                    }
+                    fputc('\n', file);
+                }
+                break;
+            case FE_MODULE_LOAD:
+                fprintf(file, "load    module %s\n", getModuleName((ObjModule *)event->data.ptr));
+                break;
+            case FE_ALLOC_SPIKE:
+                fprintf(file, "alloc   %llu bytes\n", (unsigned long long)event->data.bytes);
+                break;
+            default:
+                NOT_REACHED()
+        }
+    }
+    freeFnNameTable(&table);
+    return count - clockCount;
+}
+
+// 将 vm 的飞行记录写入文件 path
+int64_t writeFlightRecorder(VM *vm, const char *path, const char *reason) {
+    // 可能在 exit 之前调用，所以不能用会再次 exit 的 IO_ERROR
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        return -1;
+    }
+    uint32_t eventNum = dumpFlightRecorder(vm, file, reason);
+    // 磁盘写满等写入错误只会在 ferror 或 fclose 中体现
+    bool isFailed = ferror(file) != 0;
+    if (fclose(file) != 0 || isFailed) {
+        return -1;
+    }
+    return eventNum;
+}
+
+// 处理 SIGUSR1 请求的转储，两次处理之间收到的多个请求只转储一次
+void handleFlightDumpRequests(VM *vm) {
+    FlightRecorder *recorder = vm->flightRecorder;
+    if (recorder == NULL) {
+        return;
+    }
+    sig_atomic_t requests = recorder->dumpRequests;
+    if (requests == recorder->handledDumpRequests) {
+        return;
+    }
+    recorder->handledDumpRequests = requests;
+
+    // 写入临时目录而不是当前目录，避免在脚本的工作目录中留下文件
+    const char *dir = getenv("TMPDIR");
+    if (dir == NULL || *dir == '\0') {
+        dir = "/tmp";
+    }
+    char path[DEFAULT_BUFFER_SIZE];
+    int len = snprintf(path, sizeof(path), "%s/di-flight-%ld.log", dir, (long)getpid());
+    // 路径被截断时不写入截断后的路径
+    if (len >= (int)sizeof(path) || writeFlightRecorder(vm, path, "SIGUSR1") < 0) {
+        fprintf(stderr, "Couldn't write flight recorder \"%s\".\n", path);
+    } else {
+        fprintf(stderr, "flight recorder written to %s\n", path);
+    }
+}
+
+// 运行时错误退出前转储最近开启飞行记录器的虚拟机的记录
+// 只在设置了 errorDumpPath 时写入，写入成功时不输出任何内容，stderr 上仍然只有错误信息和调用栈
+void dumpFlightRecorderOnError(const char *message) {
+    VM *vm = recordingVM;
+    if (vm == NULL || vm->flightRecorder->errorDumpPath == NULL) {
+        return;
+    }
+    const char *path = vm->flightRecorder->errorDumpPath;
+    char reason[DEFAULT_BUFFER_SIZE + 16];
+    snprintf(reason, sizeof(reason), "runtime error: %s", message);
+    if (writeFlightRecorder(vm, path, reason) < 0) {
+        fprintf(stderr, "Couldn't write flight recorder \"%s\".\n", path);
+    }
+}
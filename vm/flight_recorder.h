@@ -0,0 +1,171 @@
+#ifndef _VM_FLIGHT_RECORDER_H
+#define _VM_FLIGHT_RECORDER_H
+#include "vm.h"
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// 飞行记录器：每个虚拟机默认开启的定长环形缓冲区，记录最近发生的事件，供事后分析卡顿和出错前的经过
+// 在 -O2 构建中记录调用和返回让 fib 这类调用密集的脚本慢约 7%，确定用不到记录时可以用 di --no-flight-recorder 关闭，
+// 关闭后 vm->flightRecorder 为 NULL，各个钩子只剩一次判断
+// 记录的事件有脚本函数的调用和返回、线程切换、模块加载以及大块内存分配，原生方法太频繁（例如 +）不记录
+// 以下情况会把缓冲区中的事件按时间顺序写入文件：
+//   1.进程收到 SIGUSR1 时，虚拟机在下一次循环回跳或方法调用之后写入 $TMPDIR/di-flight-<pid>.log（未设置 TMPDIR 时为 /tmp），
+//     例如 kill -USR1 <pid> 查看卡住的脚本在做什么
+//   2.脚本调用 System.dumpFlightRecorder(path) 时写入 path
+//   3.设置了 errorDumpPath（di --flight-dump=<path>）时，运行时错误退出之前写入该路径
+// 记录一个事件只是一次数组写入，不加锁也不申请内存，缓冲区写满后覆盖最旧的事件
+// 读时钟是记录中最贵的部分，所以时间不随每个事件保存，而是不时插入一个 FE_CLOCK 事件，它的时间就是其后事件的时间，
+// 转储时没有时间的事件发生在前后两个有时间的事件之间
+// 调用和返回是最频繁的事件，默认的未优化构建中每条多余的语句都有代价，所以返回只写入事件，
+// 调用除了写入事件只递减一个读时钟的倒计数，每 FLIGHT_CLOCK_CALLS 次调用（约 64 个事件）才插入一次时钟，其余事件每次都插入
+// 连续的调用和返回事件之间通常只隔几十纳秒，64 个事件远短于下面时钟的精度，所以少读时钟几乎不损失信息
+// 例外是不调用函数的长循环，所以循环回跳也递减同一个倒计数，回跳了 FLIGHT_CLOCK_LOOPS 次以后的第一次调用之前也插入时钟，
+// 这样长循环结束后的事件总有时间，卡在循环中的时长也能从最后一个事件的时间看出来
+// 时钟使用 CLOCK_MONOTONIC_COARSE，读取开销只有 CLOCK_MONOTONIC 的五分之一左右，代价是精度只有一个内核时钟节拍（通常 1~4 毫秒），
+// 对于定位几十毫秒以上的卡顿足够了，同一节拍内的事件仍然保持发生的先后顺序
+
+// 缓冲区中的事件个数，必须是 2 的幂
+#define FLIGHT_RECORDER_SIZE 4096
+
+// 每隔多少次调用插入一次时钟
+#define FLIGHT_CLOCK_CALLS 32
+
+// 循环回跳多少次以后的第一次调用之前要插入时钟，必须是 FLIGHT_CLOCK_CALLS 的倍数
+#define FLIGHT_CLOCK_LOOPS 256
+
+// 读时钟的倒计数的初始值，每次循环回跳减 1，每次调用减 FLIGHT_CLOCK_CALL_COST，减到 0 以下时插入时钟
+// 这样只有调用时每 FLIGHT_CLOCK_CALLS 次调用插入一次时钟，只有循环时回跳 FLIGHT_CLOCK_LOOPS 次以后插入
+#define FLIGHT_CLOCK_COUNTDOWN FLIGHT_CLOCK_LOOPS
+#define FLIGHT_CLOCK_CALL_COST (FLIGHT_CLOCK_LOOPS / FLIGHT_CLOCK_CALLS)
+
+// 分配的内存不少于该字节数时记录一个事件
+#define FLIGHT_ALLOC_SPIKE_BYTES (64 * 1024)
+
+// 事件类型
+typedef enum {
+    FE_CLOCK,         // 时钟，data.time 为单调时钟（纳秒），是下一个事件发生的时间，转储时不单独输出
+    FE_CALL,          // 进入脚本函数，data.ptr 为 ObjFn，参数为帧栈深度
+    FE_RETURN,        // 从脚本函数返回（包括尾调用前结束的帧栈），data.ptr 为 ObjFn，参数为返回前的帧栈深度
+    FE_THREAD_SWITCH, // 虚拟机切换到另一个线程运行，data.ptr 为 ObjThread，为 NULL 表示不再有线程运行
+    FE_MODULE_LOAD,   // 开始加载模块，data.ptr 为 ObjModule
+    FE_ALLOC_SPIKE    // 大块内存分配，data.bytes 为字节数
+} FlightEventType;
+
+// 事件的 info 中低 FLIGHT_TYPE_BITS 位为事件类型，其余位为参数
+#define FLIGHT_TYPE_BITS 3
+#define FLIGHT_INFO(type, arg)  ((uint32_t)(type) | ((uint32_t)(arg) << FLIGHT_TYPE_BITS))
+#define FLIGHT_INFO_TYPE(info)  ((info) & ((1u << FLIGHT_TYPE_BITS) - 1))
+#define FLIGHT_INFO_ARG(info)   (((info) & ~FLIGHT_FREED) >> FLIGHT_TYPE_BITS)
+
+// info 的最高位表示事件引用的对象已经释放，此时 data.ptr 为 NULL，见 forgetFlightObject
+#define FLIGHT_FREED (1u << 31)
+
+// 一个事件，16 字节，类型和参数合在 info 中是为了让调用和返回只需写入两次
+typedef struct {
+    union {
+        void *ptr;
+        uint64_t time;
+        uint64_t bytes;
+    } data;
+    uint32_t info;
+} FlightEvent;
+
+typedef struct flightRecorder {
+    uint64_t eventNum;                        // 累计记录的事件个数（包括时钟），最新事件位于 events[(eventNum - 1) % FLIGHT_RECORDER_SIZE]
+    uint64_t clockNum;                        // 累计插入的时钟个数
+    int64_t clockCountdown;                   // 读时钟的倒计数，见 FLIGHT_CLOCK_COUNTDOWN
+    volatile sig_atomic_t dumpRequests;       // SIGUSR1 的处理函数累计的转储请求次数，只由信号处理函数修改
+    sig_atomic_t handledDumpRequests;         // 虚拟机已经处理过的转储请求次数
+    const char *errorDumpPath;                // 运行时错误退出前写入记录的文件路径，为 NULL 表示不写入
+    FlightEvent events[FLIGHT_RECORDER_SIZE];
+} FlightRecorder;
+
+// 读取记录事件用的时钟（纳秒）
+static inline uint64_t flightNow(void) {
+    struct timespec now;
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+// 插入一个时钟并重置读时钟的倒计数
+void recordFlightClock(FlightRecorder *recorder);
+
+// 记录一个带时间的事件，用于线程切换等不频繁的事件，FE_ALLOC_SPIKE 使用 bytes，其余事件使用 ptr
+void recordTimedFlightEvent(FlightRecorder *recorder, FlightEventType type, void *ptr, uint64_t bytes);
+
+// 对象 obj 即将被释放，将引用它的事件标记为 FLIGHT_FREED，转储时不再访问它，由 freeObject 调用
+// 只有函数、线程和模块会被事件引用，释放其他对象时不必调用
+void forgetFlightObject(FlightRecorder *recorder, ObjHeader *obj);
+
+// 新建的虚拟机是否开启飞行记录器，默认开启
+extern bool flightRecorderEnabled;
+
+// flightRecorderEnabled 为真时为 vm 开启飞行记录器，由 initVM 调用，同时注册 SIGUSR1 的处理函数
+void startFlightRecorder(VM *vm);
+
+// 释放飞行记录器，由 freeVM 调用
+void freeFlightRecorder(VM *vm);
+
+// 将 vm 的飞行记录按时间顺序输出到 file，reason 是写在开头的转储原因，返回输出的事件个数（不包括时钟）
+uint32_t dumpFlightRecorder(VM *vm, FILE *file, const char *reason);
+
+// 将 vm 的飞行记录写入文件 path，返回写入的事件个数，无法打开或写入文件时返回 -1，调用前 vm 必须开启了飞行记录器
+int64_t writeFlightRecorder(VM *vm, const char *path, const char *reason);
+
+// 处理 SIGUSR1 请求的转储，由虚拟机在循环回跳和方法调用之后调用
+void handleFlightDumpRequests(VM *vm);
+
+// 运行时错误退出前将最近开启飞行记录器的虚拟机的记录写入其 errorDumpPath，message 为错误信息
+// errorReport 拿不到虚拟机，所以记录器的虚拟机由 startFlightRecorder 保存
+void dumpFlightRecorderOnError(const char *message);
+
+// 以下为虚拟机中记录事件的钩子，没有开启飞行记录器时什么都不做
+// 调用和返回写成宏而不是函数，未优化的构建不会内联函数，函数调用本身的开销和记录差不多
+// FLIGHT_WRITE 在 recorder 的环形缓冲区中写入一个事件
+#define FLIGHT_WRITE(recorder, eventType, eventPtr, eventArg)                             \
+    {                                                                                     \
+        FlightEvent *flightEvent = (recorder)->events + ((recorder)->eventNum++ & (FLIGHT_RECORDER_SIZE - 1)); \
+        flightEvent->data.ptr = eventPtr;                                                 \
+        flightEvent->info = FLIGHT_INFO(eventType, eventArg);                             \
+    }
+
+#define FLIGHT_CALL(vm, fn, depth)                                                        \
+    {                                                                                     \
+        FlightRecorder *flightRecorder = (vm)->flightRecorder;                            \
+        if (flightRecorder != NULL) {                                                     \
+            if ((flightRecorder->clockCountdown -= FLIGHT_CLOCK_CALL_COST) < 0) {         \
+                recordFlightClock(flightRecorder);                                        \
+            }                                                                             \
+            FLIGHT_WRITE(flightRecorder, FE_CALL, fn, depth)                              \
+        }                                                                                 \
+    }
+
+#define FLIGHT_RETURN(vm, fn, depth)                                                      \
+    {                                                                                     \
+        FlightRecorder *flightRecorder = (vm)->flightRecorder;                            \
+        if (flightRecorder != NULL) {                                                     \
+            FLIGHT_WRITE(flightRecorder, FE_RETURN, fn, depth)                            \
+        }                                                                                 \
+    }
+
+// 不频繁的事件直接调用 recordTimedFlightEvent
+#define FLIGHT_TIMED_EVENT(vm, eventType, eventPtr, eventBytes)                           \
+    if ((vm)->flightRecorder != NULL) {                                                   \
+        recordTimedFlightEvent((vm)->flightRecorder, eventType, eventPtr, eventBytes);    \
+    }
+
+#define FLIGHT_THREAD_SWITCH(vm, objThread)    FLIGHT_TIMED_EVENT(vm, FE_THREAD_SWITCH, objThread, 0)
+#define FLIGHT_MODULE_LOAD(vm, module)         FLIGHT_TIMED_EVENT(vm, FE_MODULE_LOAD, module, 0)
+#define FLIGHT_ALLOC_SPIKE(vm, bytes)          FLIGHT_TIMED_EVENT(vm, FE_ALLOC_SPIKE, NULL, bytes)
+#define FLIGHT_LOOP(vm)                                                                   \
+    if ((vm)->flightRecorder != NULL) {                                                   \
+        (vm)->flightRecorder->clockCountdown--;                                           \
+    }
+
+#endif
@@ -0,0 +1,133 @@
+#ifndef _VM_PROBES_H
+#define _VM_PROBES_H
+
+// USDT 静态探针，供 bpftrace、perf 等外部工具在不重新编译的情况下观察虚拟机
+// 只在定义了宏 USDT_PROBES 的构建中启用（cmake -DUSDT_PROBES=ON 或 make r CFLAGS=-DUSDT_PROBES），需要 systemtap 的 sys/sdt.h
+// 探针本身编译成一条 nop，参数的计算放在信号量判断之后，外部工具没有挂上探针时只多一次内存读取和判断
+// 普通构建中下面的 PROBE_XXX 宏展开为空
+//
+// 探针（provider 为 ditto）及其参数：
+//   function__entry(方法名, 模块名, 函数定义所在行, 帧栈深度)   进入脚本函数或方法
+//   function__return(模块名, 函数定义所在行, 帧栈深度)         从脚本函数或方法返回（包括尾调用前结束的帧栈）
+//   primitive__entry(方法名)、primitive__return(方法名, 是否正常返回)  调用原生方法
+//   module__load__start(模块名)、module__load__done(模块名)     加载模块（编译并创建运行模块的线程）
+//   compile__start(模块名, 行号)、compile__done(模块名, 行号)   编译模块（行号为 1）或延迟编译的函数体
+//   thread__switch(线程地址)                                    虚拟机切换到另一个线程运行，地址为 0 表示不再有线程运行
+//   object__alloc(类名, 字节数)                                 新建对象，类名为 NULL 时是虚拟机内部对象（如模块、upvalue）
+//   runtime__error(错误信息, 模块名, 行号)                      运行时错误，行号是出错线程正在执行的指令所在行
+// 例如：bpftrace -e 'usdt:./di:ditto:function__entry { @[str(arg0)] = count(); }'
+#ifdef USDT_PROBES
+
+#include "obj_string.h"
+#include "obj_thread.h"
+
+// 让 sys/sdt.h 为每个探针引用名为 ditto_<探针名>_semaphore 的信号量，外部工具挂上探针时会将其加 1
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+// 定义在 vm.c 中
+#define PROBE_SEMAPHORES(DO)  \
+    DO(function__entry)       \
+    DO(function__return)      \
+    DO(primitive__entry)      \
+    DO(primitive__return)     \
+    DO(module__load__start)   \
+    DO(module__load__done)    \
+    DO(compile__start)        \
+    DO(compile__done)         \
+    DO(thread__switch)        \
+    DO(object__alloc)         \
+    DO(runtime__error)
+
+#define DECLARE_PROBE_SEMAPHORE(name) extern unsigned short ditto_##name##_semaphore;
+PROBE_SEMAPHORES(DECLARE_PROBE_SEMAPHORE)
+#undef DECLARE_PROBE_SEMAPHORE
+
+#define PROBE_ENABLED(name) __builtin_expect(ditto_##name##_semaphore != 0, 0)
+
+// 函数所属模块的名字，核心模块没有名字
+static inline const char *getProbeModuleName(ObjModule *module) {
+    return module->name == NULL ? "core" : module->name->value.start;
+}
+
+// 函数定义所在行，即其第一条指令所在的行
+static inline uint32_t getProbeFnLine(ObjFn *fn) {
+    return getLineOfOffset(&fn->lineTable, 0);
+}
+
+#define PROBE_FUNCTION_ENTRY(vm, fn, methodIndex, depth)                                              \
+    if (PROBE_ENABLED(function__entry)) {                                                             \
+        DTRACE_PROBE4(ditto, function__entry, (vm)->allMethodNames.datas[methodIndex].str,            \
+                      getProbeModuleName((fn)->module), getProbeFnLine(fn), depth);                   \
+    }
+
+#define PROBE_FUNCTION_RETURN(fn, depth)                                                              \
+    if (PROBE_ENABLED(function__return)) {                                                            \
+        DTRACE_PROBE3(ditto, function__return, getProbeModuleName((fn)->module), getProbeFnLine(fn), depth); \
+    }
+
+#define PROBE_PRIMITIVE_ENTRY(vm, methodIndex)                                                        \
+    if (PROBE_ENABLED(primitive__entry)) {                                                            \
+        DTRACE_PROBE1(ditto, primitive__entry, (vm)->allMethodNames.datas[methodIndex].str);          \
+    }
+
+#define PROBE_PRIMITIVE_RETURN(vm, methodIndex, isOk)                                                 \
+    if (PROBE_ENABLED(primitive__return)) {                                                           \
+        DTRACE_PROBE2(ditto, primitive__return, (vm)->allMethodNames.datas[methodIndex].str, (int)(isOk)); \
+    }
+
+#define PROBE_MODULE_LOAD_START(module)                                                               \
+    if (PROBE_ENABLED(module__load__start)) {                                                         \
+        DTRACE_PROBE1(ditto, module__load__start, getProbeModuleName(module));                        \
+    }
+
+#define PROBE_MODULE_LOAD_DONE(module)                                                                \
+    if (PROBE_ENABLED(module__load__done)) {                                                          \
+        DTRACE_PROBE1(ditto, module__load__done, getProbeModuleName(module));                         \
+    }
+
+#define PROBE_COMPILE_START(module, line)                                                             \
+    if (PROBE_ENABLED(compile__start)) {                                                              \
+        DTRACE_PROBE2(ditto, compile__start, getProbeModuleName(module), line);                       \
+    }
+
+#define PROBE_COMPILE_DONE(module, line)                                                              \
+    if (PROBE_ENABLED(compile__done)) {                                                               \
+        DTRACE_PROBE2(ditto, compile__done, getProbeModuleName(module), line);                        \
+    }
+
+#define PROBE_THREAD_SWITCH(objThread)                                                                \
+    if (PROBE_ENABLED(thread__switch)) {                                                              \
+        DTRACE_PROBE1(ditto, thread__switch, (uintptr_t)(objThread));                                 \
+    }
+
+#define PROBE_OBJECT_ALLOC(class, bytes)                                                              \
+    if (PROBE_ENABLED(object__alloc)) {                                                               \
+        DTRACE_PROBE2(ditto, object__alloc, (class) == NULL ? NULL : (class)->name->value.start, bytes); \
+    }
+
+// 运行时错误的探针需要找出出错的位置，定义在 vm.c 中
+void fireRuntimeErrorProbe(ObjThread *objThread, const char *message);
+
+#define PROBE_RUNTIME_ERROR(objThread, message)                                                       \
+    if (PROBE_ENABLED(runtime__error)) {                                                              \
+        fireRuntimeErrorProbe(objThread, message);                                                    \
+    }
+
+#else
+
+#define PROBE_FUNCTION_ENTRY(vm, fn, methodIndex, depth)
+#define PROBE_FUNCTION_RETURN(fn, depth)
+#define PROBE_PRIMITIVE_ENTRY(vm, methodIndex)
+#define PROBE_PRIMITIVE_RETURN(vm, methodIndex, isOk)
+#define PROBE_MODULE_LOAD_START(module)
+#define PROBE_MODULE_LOAD_DONE(module)
+#define PROBE_COMPILE_START(module, line)
+#define PROBE_COMPILE_DONE(module, line)
+#define PROBE_THREAD_SWITCH(objThread)
+#define PROBE_OBJECT_ALLOC(class, bytes)
+#define PROBE_RUNTIME_ERROR(objThread, message)
+
+#endif
+
+#endif
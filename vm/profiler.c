@@ -0,0 +1,1250 @@
+#include "profiler.h"
+#include "class.h"
+#include "compiler.h"
+#include "obj_fn.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+// 输出的函数名的最大长度
+#define FN_NAME_LEN 128
+
+// 分配剖析报告中每张表输出的分配点个数
+#define TOP_ALLOC_SITE_NUM 20
+
+// 排序用的表项，按 count 从多到少排序
+typedef struct {
+    uint64_t count;
+    uint32_t first;
+    uint32_t second;
+    void *ptr;
+} RankEntry;
+
+// 按 count 从多到少排序，count 相同时按 first、second 排序，保证输出稳定
+static int compareRankEntry(const void *a, const void *b) {
+    const RankEntry *x = a;
+    const RankEntry *y = b;
+    if (x->count != y->count) {
+        return x->count < y->count ? 1 : -1;
+    }
+    if (x->first != y->first) {
+        return x->first < y->first ? -1 : 1;
+    }
+    return x->second < y->second ? -1 : (x->second > y->second);
+}
+
+// 计算 count 占 total 的百分比
+static double percent(uint64_t count, uint64_t total) {
+    return total == 0 ? 0 : count * 100.0 / total;
+}
+
+// 操作码的名字，与 OpCode 的顺序一致
+const char *opCodeNames[OPCODE_NUM] = {
+#define OPCODE_SLOTS(opcode, effect) #opcode,
+#include "opcode.inc"
+#undef OPCODE_SLOTS
+};
+
+static int compareFnName(const void *a, const void *b) {
+    const ObjFn *x = ((const FnName *)a)->fn;
+    const ObjFn *y = ((const FnName *)b)->fn;
+    return x < y ? -1 : (x > y);
+}
+
+FnName *findFnName(FnNameTable *table, ObjFn *fn) {
+    FnName key = {fn, NULL, NULL};
+    return bsearch(&key, table->datas, table->count, sizeof(FnName), compareFnName);
+}
+
+// 为 fn 设置名字，已有名字则保留原名字
+static void setFnName(FnNameTable *table, ObjFn *fn, const char *format, const char *prefix, const char *name) {
+    FnName *fnName = findFnName(table, fn);
+    if (fnName == NULL || fnName->name != NULL) {
+        return;
+    }
+    fnName->name = malloc(FN_NAME_LEN);
+    if (fnName->name == NULL) {
+        MEM_ERROR("allocate fn name failed!");
+    }
+    snprintf(fnName->name, FN_NAME_LEN, format, prefix, name);
+}
+
+// 将类 class 的方法 signature 的名字写入 buf，例如 Foo.bar(_)，静态方法写成 static Foo.bar(_)
+// buf 至少要有 FN_NAME_LEN 个字节
+static void formatMethodName(char *buf, Class *class, const char *signature) {
+    uint32_t classNameLen = class->name->value.length;
+    const char *prefix = "";
+    // meta 类的类名是在类名后面追加 " metaClass"
+    if (classNameLen > 10 && memcmp(class->name->value.start + classNameLen - 10, " metaClass", 10) == 0) {
+        classNameLen -= 10;
+        prefix = "static ";
+    }
+    snprintf(buf, FN_NAME_LEN, "%s%.*s.%s", prefix, (int)classNameLen, class->name->value.start, signature);
+}
+
+// 用类的方法名命名方法的函数
+static void nameMethods(VM *vm, FnNameTable *table, Class *class) {
+    uint32_t idx = 0;
+    while (idx < class->methods.count) {
+        Method *method = &class->methods.datas[idx];
+        // 继承自基类的方法留给基类命名
+        bool isInherited = class->superClass != NULL && idx < class->superClass->methods.count &&
+                           class->superClass->methods.datas[idx].obj == method->obj;
+        if ((method->type == MT_SCRIPT || method->type == MT_CONSTRUCT) && !isInherited) {
+            char methodName[FN_NAME_LEN];
+            formatMethodName(methodName, class, vm->allMethodNames.datas[idx].str);
+            setFnName(table, method->obj->fn, "%s%s", "", methodName);
+        }
+        idx++;
+    }
+}
+
+// 用模块变量名命名存放在模块变量中的函数，fun 定义的函数的变量名带有 "Fn " 前缀，去掉该前缀
+static void nameModuleVars(FnNameTable *table, ObjModule *objModule) {
+    uint32_t idx = 0;
+    while (idx < objModule->moduleVarValue.count) {
+        Value value = objModule->moduleVarValue.datas[idx];
+        if (VALUE_IS_OBJCLOSURE(value)) {
+            const char *varName = objModule->moduleVarName.datas[idx].str;
+            if (strncmp(varName, "Fn ", 3) == 0) {
+                varName += 3;
+            }
+            setFnName(table, VALUE_TO_OBJCLOSURE(value)->fn, "%s%s", "", varName);
+        }
+        idx++;
+    }
+}
+
+// 获取 fn 的名字，没有名字的函数用定义它的外层函数命名，例如 Foo.bar(_) {fn}，模块的顶层代码命名为 <module 模块名>
+const char *getFnName(FnNameTable *table, FnName *fnName) {
+    if (fnName->name == NULL) {
+        FnName *enclosing = fnName->enclosingFn == NULL ? NULL : findFnName(table, fnName->enclosingFn);
+        if (enclosing != NULL) {
+            setFnName(table, fnName->fn, "%s%s", getFnName(table, enclosing), " {fn}");
+        } else {
+            ObjString *moduleName = fnName->fn->module == NULL ? NULL : fnName->fn->module->name;
+            setFnName(table, fnName->fn, "<module %s%s>",
+                      moduleName == NULL ? "core" : moduleName->value.start, "");
+        }
+    }
+    return fnName->name;
+}
+
+// 收集 vm 中所有函数并确定各自的名字
+void buildFnNameTable(VM *vm, FnNameTable *table) {
+    table->count = 0;
+    ObjHeader *objHeader = vm->allObjects;
+    while (objHeader != NULL) {
+        table->count += objHeader->type == OT_FUNCTION;
+        objHeader = objHeader->next;
+    }
+    table->datas = calloc(table->count == 0 ? 1 : table->count, sizeof(FnName));
+    if (table->datas == NULL) {
+        MEM_ERROR("allocate fn name table failed!");
+    }
+
+    uint32_t fnIdx = 0;
+    for (objHeader = vm->allObjects; objHeader != NULL; objHeader = objHeader->next) {
+        if (objHeader->type == OT_FUNCTION) {
+            table->datas[fnIdx++].fn = (ObjFn *)objHeader;
+        }
+    }
+    qsort(table->datas, table->count, sizeof(FnName), compareFnName);
+
+    // 内层函数存放在外层函数的常量表中，由此记录每个函数的外层函数
+    for (fnIdx = 0; fnIdx < table->count; fnIdx++) {
+        ObjFn *fn = table->datas[fnIdx].fn;
+        uint32_t idx = 0;
+        while (idx < fn->constants.count) {
+            Value constant = fn->constants.datas[idx];
+            if (VALUE_IS_CERTAIN_OBJ(constant, OT_FUNCTION)) {
+                FnName *inner = findFnName(table, (ObjFn *)VALUE_TO_OBJ(constant));
+                if (inner != NULL) {
+                    inner->enclosingFn = fn;
+                }
+            }
+            idx++;
+        }
+    }
+
+    for (objHeader = vm->allObjects; objHeader != NULL; objHeader = objHeader->next) {
+        if (objHeader->type == OT_CLASS) {
+            nameMethods(vm, table, (Class *)objHeader);
+        } else if (objHeader->type == OT_MODULE) {
+            nameModuleVars(table, (ObjModule *)objHeader);
+        }
+    }
+}
+
+void freeFnNameTable(FnNameTable *table) {
+    uint32_t idx = 0;
+    while (idx < table->count) {
+        free(table->datas[idx].name);
+        idx++;
+    }
+    free(table->datas);
+}
+
+// 开启采样剖析的虚拟机，供信号处理函数使用
+static VM *sampledVM = NULL;
+
+// SIGPROF 的处理函数，只做异步信号安全的操作：累计定时次数并通知虚拟机
+static void onSampleTick(int signum) {
+    (void)signum;
+    VM *vm = sampledVM;
+    if (vm != NULL) {
+        vm->sampleProfile->ticks++;
+        vm->isSignalPending = 1;
+    }
+}
+
+// 按进程消耗的 CPU 时间每秒定时 hz 次，hz 为 0 表示停止定时
+static void setSampleTimer(uint32_t hz) {
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 0;
+    if (hz > 0) {
+        timer.it_interval.tv_usec = hz >= 1000000 ? 1 : 1000000 / hz;
+    }
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+// 为 vm 开启采样剖析
+void startSampleProfiler(VM *vm, uint32_t hz) {
+    ASSERT(sampledVM == NULL, "only one vm can be sampled at a time!");
+    SampleProfile *profile = calloc(1, sizeof(SampleProfile));
+    if (profile == NULL) {
+        MEM_ERROR("allocate SampleProfile failed!");
+    }
+    profile->hz = hz;
+    vm->sampleProfile = profile;
+    sampledVM = vm;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onSampleTick;
+    sigemptyset(&action.sa_mask);
+    // 被定时信号打断的系统调用（例如读取标准输入）自动重新执行
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGPROF, &action, NULL);
+    setSampleTimer(hz);
+}
+
+// 停止定时并释放采样剖析数据
+void stopSampleProfiler(VM *vm) {
+    SampleProfile *profile = vm->sampleProfile;
+    setSampleTimer(0);
+    // SIGPROF 的默认动作是结束进程，停止定时后可能还有未处理的信号，所以忽略它
+    signal(SIGPROF, SIG_IGN);
+    sampledVM = NULL;
+
+    uint32_t idx = 0;
+    while (idx < profile->stackCapacity) {
+        free(profile->stacks[idx].frames);
+        idx++;
+    }
+    free(profile->stacks);
+    free(profile->scratch);
+    free(profile);
+    vm->sampleProfile = NULL;
+}
+
+// 计算调用栈的哈希值（FNV-1a）
+static uint32_t hashStack(SampleFrame *frames, uint32_t depth) {
+    uint32_t hashCode = 2166136261u;
+    uint32_t idx = 0;
+    while (idx < depth) {
+        hashCode ^= (uint32_t)((uintptr_t)frames[idx].fn >> 3);
+        hashCode *= 16777619u;
+        hashCode ^= frames[idx].line;
+        hashCode *= 16777619u;
+        idx++;
+    }
+    return hashCode;
+}
+
+// 判断两个调用栈的帧是否相同
+// SampleFrame 在 line 之后有 4 字节填充，其内容不确定，所以逐个字段比较而不是用 memcmp
+static bool isSameFrames(SampleFrame *a, SampleFrame *b, uint32_t depth) {
+    uint32_t idx = 0;
+    while (idx < depth) {
+        if (a[idx].fn != b[idx].fn || a[idx].line != b[idx].line) {
+            return false;
+        }
+        idx++;
+    }
+    return true;
+}
+
+// 在容量为 capacity（2 的幂）的哈希表中查找调用栈，不存在则返回应插入的空槽
+static SampledStack *findStack(SampledStack *stacks, uint32_t capacity,
+                               uint32_t hashCode, SampleFrame *frames, uint32_t depth) {
+    uint32_t index = hashCode & (capacity - 1);
+    while (stacks[index].frames != NULL) {
+        SampledStack *stack = &stacks[index];
+        if (stack->hashCode == hashCode && stack->depth == depth &&
+            isSameFrames(stack->frames, frames, depth)) {
+            break;
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+    return &stacks[index];
+}
+
+// 调用栈的哈希表扩容为原来的 2 倍
+static void growStacks(SampleProfile *profile) {
+    uint32_t newCapacity = profile->stackCapacity == 0 ? 256 : profile->stackCapacity * 2;
+    SampledStack *newStacks = calloc(newCapacity, sizeof(SampledStack));
+    if (newStacks == NULL) {
+        MEM_ERROR("allocate sampled stacks failed!");
+    }
+    uint32_t idx = 0;
+    while (idx < profile->stackCapacity) {
+        SampledStack *stack = &profile->stacks[idx];
+        if (stack->frames != NULL) {
+            *findStack(newStacks, newCapacity, stack->hashCode, stack->frames, stack->depth) = *stack;
+        }
+        idx++;
+    }
+    free(profile->stacks);
+    profile->stacks = newStacks;
+    profile->stackCapacity = newCapacity;
+}
+
+// 记录 objThread 当前的调用栈
+void recordSample(VM *vm, ObjThread *objThread) {
+    SampleProfile *profile = vm->sampleProfile;
+    // 标记已由虚拟机先行清除，之后到达的定时会重新设置标记，不会丢失
+    uint32_t ticks = (uint32_t)profile->ticks;
+    uint32_t weight = ticks - (uint32_t)profile->drainedTicks;
+    profile->drainedTicks = (sig_atomic_t)ticks;
+    if (weight == 0) {
+        return;
+    }
+
+    uint32_t depth = objThread->usedFrameNum;
+    if (depth > profile->scratchCapacity) {
+        free(profile->scratch);
+        profile->scratchCapacity = ceilToPowerOf2(depth);
+        profile->scratch = malloc(sizeof(SampleFrame) * profile->scratchCapacity);
+        if (profile->scratch == NULL) {
+            MEM_ERROR("allocate sample frames failed!");
+        }
+    }
+    uint32_t idx = 0;
+    while (idx < depth) {
+        Frame *frame = &objThread->frames[idx];
+        ObjFn *fn = frame->closure->fn;
+        uint32_t offset = (uint32_t)(frame->ip - fn->instrStream.datas);
+        // 外层帧的 ip 指向调用指令之后，减 1 使偏移落在调用指令内
+        if (idx + 1 < depth && offset > 0) {
+            offset--;
+        }
+        profile->scratch[idx].fn = fn;
+        profile->scratch[idx].line = getLineOfOffset(&fn->lineTable, offset);
+        idx++;
+    }
+
+    if ((profile->stackCount + 1) * 4 > profile->stackCapacity * 3) {
+        growStacks(profile);
+    }
+    uint32_t hashCode = hashStack(profile->scratch, depth);
+    SampledStack *stack = findStack(profile->stacks, profile->stackCapacity, hashCode, profile->scratch, depth);
+    if (stack->frames == NULL) {
+        stack->frames = malloc(sizeof(SampleFrame) * (depth == 0 ? 1 : depth));
+        if (stack->frames == NULL) {
+            MEM_ERROR("allocate sampled stack failed!");
+        }
+        memcpy(stack->frames, profile->scratch, sizeof(SampleFrame) * depth);
+        stack->hashCode = hashCode;
+        stack->depth = depth;
+        profile->stackCount++;
+    }
+    stack->count += weight;
+    profile->sampleNum += weight;
+}
+
+// 将采样结果以折叠栈格式输出到 file，次数多的调用栈在前
+void dumpSampleProfile(VM *vm, FILE *file) {
+    SampleProfile *profile = vm->sampleProfile;
+    RankEntry *entries = malloc(sizeof(RankEntry) * (profile->stackCount == 0 ? 1 : profile->stackCount));
+    if (entries == NULL) {
+        MEM_ERROR("allocate stack entries failed!");
+    }
+    uint32_t entryNum = 0;
+    uint32_t idx = 0;
+    while (idx < profile->stackCapacity) {
+        SampledStack *stack = &profile->stacks[idx];
+        if (stack->frames != NULL) {
+            entries[entryNum++] = (RankEntry){stack->count, stack->hashCode, idx, stack};
+        }
+        idx++;
+    }
+    qsort(entries, entryNum, sizeof(RankEntry), compareRankEntry);
+
+    FnNameTable table;
+    buildFnNameTable(vm, &table);
+    idx = 0;
+    while (idx < entryNum) {
+        SampledStack *stack = entries[idx].ptr;
+        uint32_t frameIdx = 0;
+        while (frameIdx < stack->depth) {
+            SampleFrame *frame = &stack->frames[frameIdx];
+            FnName *fnName = findFnName(&table, frame->fn);
+            // 折叠栈格式用 ; 分隔各帧，最后一个空格之后是次数
+            fprintf(file, "%s%s:%u", frameIdx == 0 ? "" : ";",
+                    fnName == NULL ? "?" : getFnName(&table, fnName), frame->line);
+            frameIdx++;
+        }
+        fprintf(file, " %llu\n", (unsigned long long)stack->count);
+        idx++;
+    }
+    freeFnNameTable(&table);
+    free(entries);
+}
+
+// 当前时刻（纳秒），使用单调时钟，不受系统时间调整的影响
+static uint64_t nowNanos(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+// 为 vm 开启调用剖析
+void startCallProfiler(VM *vm, uint32_t top) {
+    CallProfile *profile = calloc(1, sizeof(CallProfile));
+    if (profile == NULL) {
+        MEM_ERROR("allocate CallProfile failed!");
+    }
+    profile->top = top;
+    vm->callProfile = profile;
+}
+
+// 释放调用剖析数据
+void freeCallProfile(CallProfile *profile) {
+    free(profile->stats);
+    free(profile->statsIndexes);
+    free(profile);
+}
+
+// 计算函数或原生方法的哈希值
+static uint32_t hashCallStats(ObjFn *fn, Primitive primFn, uint32_t methodIndex) {
+    uint64_t key = fn != NULL ? (uint64_t)(uintptr_t)fn : (uint64_t)(uintptr_t)primFn + methodIndex;
+    key *= 0x9e3779b97f4a7c15ULL;
+    return (uint32_t)(key >> 32);
+}
+
+// 在哈希表中查找函数或原生方法，返回其在 statsIndexes 中的槽位
+static uint32_t findStatsSlot(CallProfile *profile, ObjFn *fn, Primitive primFn, uint32_t methodIndex) {
+    uint32_t slot = hashCallStats(fn, primFn, methodIndex) & (profile->indexCapacity - 1);
+    while (profile->statsIndexes[slot] != UINT32_MAX) {
+        CallStats *stats = &profile->stats[profile->statsIndexes[slot]];
+        if (stats->fn == fn && stats->primFn == primFn && (fn != NULL || stats->methodIndex == methodIndex)) {
+            break;
+        }
+        slot = (slot + 1) & (profile->indexCapacity - 1);
+    }
+    return slot;
+}
+
+// 获取函数或原生方法的统计在 stats 中的索引，不存在则新建
+static uint32_t getStatsIndex(CallProfile *profile, ObjFn *fn, Primitive primFn, uint32_t methodIndex) {
+    // 哈希表的装载因子超过 1/2 时扩容
+    if ((profile->statsCount + 1) * 2 > profile->indexCapacity) {
+        uint32_t *oldIndexes = profile->statsIndexes;
+        uint32_t oldCapacity = profile->indexCapacity;
+        profile->indexCapacity = oldCapacity == 0 ? 256 : oldCapacity * 2;
+        profile->statsIndexes = malloc(sizeof(uint32_t) * profile->indexCapacity);
+        if (profile->statsIndexes == NULL) {
+            MEM_ERROR("allocate call stats indexes failed!");
+        }
+        memset(profile->statsIndexes, 0xff, sizeof(uint32_t) * profile->indexCapacity);
+        uint32_t idx = 0;
+        while (idx < profile->statsCount) {
+            CallStats *stats = &profile->stats[idx];
+            profile->statsIndexes[findStatsSlot(profile, stats->fn, stats->primFn, stats->methodIndex)] = idx;
+            idx++;
+        }
+        free(oldIndexes);
+    }
+
+    uint32_t slot = findStatsSlot(profile, fn, primFn, methodIndex);
+    if (profile->statsIndexes[slot] == UINT32_MAX) {
+        if (profile->statsCount == profile->statsCapacity) {
+            profile->statsCapacity = profile->statsCapacity == 0 ? 128 : profile->statsCapacity * 2;
+            profile->stats = realloc(profile->stats, sizeof(CallStats) * profile->statsCapacity);
+            if (profile->stats == NULL) {
+                MEM_ERROR("allocate call stats failed!");
+            }
+        }
+        CallStats *stats = &profile->stats[profile->statsCount];
+        memset(stats, 0, sizeof(CallStats));
+        stats->fn = fn;
+        stats->primFn = primFn;
+        stats->methodIndex = methodIndex;
+        profile->statsIndexes[slot] = profile->statsCount++;
+    }
+    return profile->statsIndexes[slot];
+}
+
+// 把到 now 为止的时间算到之前运行的线程上，并从 now 开始计算 objThread 的运行时间
+static void syncRunningThread(CallProfile *profile, ObjThread *objThread, uint64_t now) {
+    if (profile->runningThread != objThread) {
+        if (profile->runningThread != NULL) {
+            profile->runningThread->profileRunTime += now - profile->runningThread->profileResumedAt;
+        }
+        objThread->profileResumedAt = now;
+        profile->runningThread = objThread;
+    }
+}
+
+// objThread 到目前为止的运行时间
+static uint64_t getThreadTime(CallProfile *profile, ObjThread *objThread) {
+    uint64_t now = nowNanos();
+    syncRunningThread(profile, objThread, now);
+    return objThread->profileRunTime + (now - objThread->profileResumedAt);
+}
+
+// 虚拟机切换到 objThread 运行
+void switchThreadProfile(VM *vm, ObjThread *objThread) {
+    syncRunningThread(vm->callProfile, objThread, nowNanos());
+}
+
+// 记录进入 objThread 最新的帧栈
+void enterFrameProfile(VM *vm, ObjThread *objThread) {
+    CallProfile *profile = vm->callProfile;
+    Frame *frame = &objThread->frames[objThread->usedFrameNum - 1];
+    frame->profileIndex = getStatsIndex(profile, frame->closure->fn, NULL, 0);
+    profile->stats[frame->profileIndex].activeNum++;
+    frame->childTime = 0;
+    frame->enterTime = getThreadTime(profile, objThread);
+}
+
+// 记录从 objThread 最新的帧栈返回
+void exitFrameProfile(VM *vm, ObjThread *objThread) {
+    CallProfile *profile = vm->callProfile;
+    uint64_t exitTime = getThreadTime(profile, objThread);
+    Frame *frame = &objThread->frames[objThread->usedFrameNum - 1];
+    uint64_t totalTime = exitTime - frame->enterTime;
+
+    CallStats *stats;
+    if (frame->profileIndex != UINT32_MAX) {
+        stats = &profile->stats[frame->profileIndex];
+        stats->activeNum--;
+    } else {
+        // 线程的第一个帧栈不经过 createFrame，返回时才查找其统计
+        uint32_t statsIndex = getStatsIndex(profile, frame->closure->fn, NULL, 0);
+        stats = &profile->stats[statsIndex];
+    }
+    stats->callNum++;
+    stats->selfTime += totalTime - frame->childTime;
+    // 递归调用时内层的耗时已经包含在最外层中
+    if (stats->activeNum == 0) {
+        stats->totalTime += totalTime;
+    }
+
+    if (objThread->usedFrameNum > 1) {
+        frame[-1].childTime += totalTime;
+    }
+}
+
+// 调用原生方法并记录其耗时
+bool callPrimitiveProfile(VM *vm, ObjThread *objThread, Method *method, uint32_t methodIndex, Value *args) {
+    CallProfile *profile = vm->callProfile;
+    Class *class = getClassOfObj(vm, args[0]);
+    uint64_t startTime = getThreadTime(profile, objThread);
+    bool result = method->primFn(vm, args);
+    // 原生方法返回 false 时 vm->curThread 可能已经切换，但其耗时仍属于调用它的 objThread，
+    // 之后虚拟机切换线程时会调用 switchThreadProfile
+    uint64_t elapsed = getThreadTime(profile, objThread) - startTime;
+
+    // getStatsIndex 可能扩容 profile->stats，要先取得索引再取地址
+    uint32_t statsIndex = getStatsIndex(profile, NULL, method->primFn, methodIndex);
+    CallStats *stats = &profile->stats[statsIndex];
+    if (stats->class == NULL) {
+        stats->class = class;
+    }
+    stats->callNum++;
+    stats->selfTime += elapsed;
+    stats->totalTime += elapsed;
+    if (objThread->usedFrameNum > 0) {
+        objThread->frames[objThread->usedFrameNum - 1].childTime += elapsed;
+    }
+    return result;
+}
+
+// 原生方法可能被子类继承，用定义它的类命名
+static Class *getPrimitiveOwner(Class *class, Primitive primFn, uint32_t methodIndex) {
+    while (class->superClass != NULL && methodIndex < class->superClass->methods.count &&
+           class->superClass->methods.datas[methodIndex].type == MT_PRIMITIVE &&
+           class->superClass->methods.datas[methodIndex].primFn == primFn) {
+        class = class->superClass;
+    }
+    return class;
+}
+
+// 按自身耗时从多到少输出调用剖析结果到 file
+void dumpCallProfile(VM *vm, FILE *file) {
+    CallProfile *profile = vm->callProfile;
+    RankEntry *entries = malloc(sizeof(RankEntry) * (profile->statsCount == 0 ? 1 : profile->statsCount));
+    if (entries == NULL) {
+        MEM_ERROR("allocate call stats entries failed!");
+    }
+    uint64_t totalSelfTime = 0;
+    uint32_t idx = 0;
+    while (idx < profile->statsCount) {
+        entries[idx] = (RankEntry){profile->stats[idx].selfTime, idx, 0, &profile->stats[idx]};
+        totalSelfTime += profile->stats[idx].selfTime;
+        idx++;
+    }
+    qsort(entries, profile->statsCount, sizeof(RankEntry), compareRankEntry);
+
+    FnNameTable table;
+    buildFnNameTable(vm, &table);
+    fprintf(file, "== calls by self time (top %u of %u, %.3f ms) ==\n",
+            profile->top, profile->statsCount, totalSelfTime / 1e6);
+    fprintf(file, "%12s %12s %7s %12s %10s  %s\n", "calls", "self ms", "self%", "total ms", "self us/call", "method");
+    idx = 0;
+    while (idx < profile->statsCount && idx < profile->top) {
+        CallStats *stats = entries[idx].ptr;
+        char primName[FN_NAME_LEN];
+        const char *name;
+        if (stats->fn != NULL) {
+            FnName *fnName = findFnName(&table, stats->fn);
+            name = fnName == NULL ? "?" : getFnName(&table, fnName);
+        } else {
+            Class *owner = getPrimitiveOwner(stats->class, stats->primFn, stats->methodIndex);
+            formatMethodName(primName, owner, vm->allMethodNames.datas[stats->methodIndex].str);
+            name = primName;
+        }
+        fprintf(file, "%12llu %12.3f %6.2f%% %12.3f %10.3f  %s%s\n", (unsigned long long)stats->callNum,
+                stats->selfTime / 1e6, totalSelfTime == 0 ? 0 : stats->selfTime * 100.0 / totalSelfTime,
+                stats->totalTime / 1e6, stats->callNum == 0 ? 0 : stats->selfTime / 1e3 / stats->callNum,
+                name, stats->fn == NULL ? " [primitive]" : "");
+        idx++;
+    }
+    freeFnNameTable(&table);
+    free(entries);
+}
+
+// 为 vm 开启分配剖析
+void startAllocProfiler(VM *vm, uint32_t sampleBytes) {
+    AllocProfile *profile = calloc(1, sizeof(AllocProfile));
+    if (profile == NULL) {
+        MEM_ERROR("allocate AllocProfile failed!");
+    }
+    profile->sampleBytes = sampleBytes;
+    profile->bytesUntilSample = sampleBytes;
+    vm->allocProfile = profile;
+}
+
+// 释放分配剖析数据
+void freeAllocProfile(AllocProfile *profile) {
+    free(profile->sites);
+    free(profile);
+}
+
+// 计算分配点的哈希值
+static uint32_t hashAllocSite(ObjFn *fn, uint32_t offset, ObjType type, Class *class) {
+    uint64_t key = (uint64_t)(uintptr_t)fn ^ ((uint64_t)(uintptr_t)class << 16);
+    key += ((uint64_t)offset << 8 | type) * 0x9e3779b97f4a7c15ULL;
+    key ^= key >> 29;
+    return (uint32_t)key;
+}
+
+// 在容量为 capacity（2 的幂）的哈希表中查找分配点，不存在则返回应插入的空槽
+static AllocSite *findAllocSite(AllocSite *sites, uint32_t capacity, ObjFn *fn, uint32_t offset,
+                                ObjType type, Class *class) {
+    uint32_t index = hashAllocSite(fn, offset, type, class) & (capacity - 1);
+    while (sites[index].count > 0) {
+        AllocSite *site = &sites[index];
+        if (site->fn == fn && site->offset == offset && site->type == type && site->class == class) {
+            break;
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+    return &sites[index];
+}
+
+// 分配点的哈希表扩容为原来的 2 倍
+static void growAllocSites(AllocProfile *profile) {
+    uint32_t newCapacity = profile->siteCapacity == 0 ? 256 : profile->siteCapacity * 2;
+    AllocSite *newSites = calloc(newCapacity, sizeof(AllocSite));
+    if (newSites == NULL) {
+        MEM_ERROR("allocate alloc sites failed!");
+    }
+    uint32_t idx = 0;
+    while (idx < profile->siteCapacity) {
+        AllocSite *site = &profile->sites[idx];
+        if (site->count > 0) {
+            *findAllocSite(newSites, newCapacity, site->fn, site->offset, site->type, site->class) = *site;
+        }
+        idx++;
+    }
+    free(profile->sites);
+    profile->sites = newSites;
+    profile->siteCapacity = newCapacity;
+}
+
+// 记录一个新建的对象
+void recordAllocation(VM *vm, ObjType type, Class *class, size_t bytes) {
+    AllocProfile *profile = vm->allocProfile;
+    profile->totalBytes += bytes;
+    profile->totalCount++;
+    profile->bytesUntilSample -= (int64_t)bytes;
+    if (profile->bytesUntilSample > 0) {
+        return;
+    }
+    // 一次分配可能跨过多个采样间隔，每个间隔代表 sampleBytes 字节
+    uint64_t sampleNum = 1 + (uint64_t)(-profile->bytesUntilSample) / profile->sampleBytes;
+    profile->bytesUntilSample += (int64_t)(sampleNum * profile->sampleBytes);
+
+    ObjFn *fn = NULL;
+    uint32_t offset = 0;
+    ObjThread *objThread = vm->curThread;
+    if (objThread != NULL && objThread->usedFrameNum > 0) {
+        Frame *frame = &objThread->frames[objThread->usedFrameNum - 1];
+        fn = frame->closure->fn;
+        offset = (uint32_t)(frame->ip - fn->instrStream.datas);
+        // 保存的 ip 指向正在执行的指令之后，减 1 使偏移落在该指令内
+        if (offset > 0) {
+            offset--;
+        }
+    }
+
+    if ((profile->siteCount + 1) * 4 > profile->siteCapacity * 3) {
+        growAllocSites(profile);
+    }
+    AllocSite *site = findAllocSite(profile->sites, profile->siteCapacity, fn, offset, type, class);
+    if (site->count == 0) {
+        site->fn = fn;
+        site->offset = offset;
+        site->type = type;
+        site->class = class;
+        profile->siteCount++;
+    }
+    uint64_t sampledBytes = sampleNum * profile->sampleBytes;
+    site->bytes += sampledBytes;
+    site->count += bytes == 0 ? 1 : (double)sampledBytes / bytes;
+}
+
+// 输出一张分配点的表，isByCount 为 true 时按分配次数排序，否则按字节数排序
+static void dumpAllocSites(AllocProfile *profile, FnNameTable *table, bool isByCount, FILE *file) {
+    RankEntry *entries = malloc(sizeof(RankEntry) * (profile->siteCount == 0 ? 1 : profile->siteCount));
+    if (entries == NULL) {
+        MEM_ERROR("allocate alloc site entries failed!");
+    }
+    uint32_t entryNum = 0;
+    uint32_t idx = 0;
+    while (idx < profile->siteCapacity) {
+        AllocSite *site = &profile->sites[idx];
+        if (site->count > 0) {
+            uint64_t count = isByCount ? (uint64_t)(site->count + 0.5) : site->bytes;
+            entries[entryNum++] = (RankEntry){count, site->offset, idx, site};
+        }
+        idx++;
+    }
+    qsort(entries, entryNum, sizeof(RankEntry), compareRankEntry);
+
+    fprintf(file, "\n== allocation sites by %s (top %d of %u) ==\n",
+            isByCount ? "count" : "bytes", TOP_ALLOC_SITE_NUM, entryNum);
+    fprintf(file, "%14s %7s %12s %7s  %-16s %s\n", "bytes", "bytes%", "count", "count%", "type", "site");
+    idx = 0;
+    while (idx < entryNum && idx < TOP_ALLOC_SITE_NUM) {
+        AllocSite *site = entries[idx].ptr;
+        char typeName[FN_NAME_LEN];
+        if (site->class != NULL) {
+            snprintf(typeName, FN_NAME_LEN, "%.*s", (int)site->class->name->value.length, site->class->name->value.start);
+        } else {
+            snprintf(typeName, FN_NAME_LEN, "<%s>", objTypeNames[site->type]);
+        }
+        fprintf(file, "%14llu %6.2f%% %12.0f %6.2f%%  %-16s ", (unsigned long long)site->bytes,
+                profile->totalBytes == 0 ? 0 : site->bytes * 100.0 / profile->totalBytes, site->count,
+                profile->totalCount == 0 ? 0 : site->count * 100.0 / profile->totalCount, typeName);
+        if (site->fn == NULL) {
+            fprintf(file, "<vm>\n");
+        } else {
+            FnName *fnName = findFnName(table, site->fn);
+            fprintf(file, "%s:%u\n", fnName == NULL ? "?" : getFnName(table, fnName),
+                    getLineOfOffset(&site->fn->lineTable, site->offset));
+        }
+        idx++;
+    }
+    free(entries);
+}
+
+// 按字节数和分配次数分别输出分配最多的分配点到 file
+void dumpAllocProfile(VM *vm, FILE *file) {
+    AllocProfile *profile = vm->allocProfile;
+    fprintf(file, "== allocations: %llu objects, %llu bytes, sampled every %u bytes ==\n",
+            (unsigned long long)profile->totalCount, (unsigned long long)profile->totalBytes, profile->sampleBytes);
+    FnNameTable table;
+    buildFnNameTable(vm, &table);
+    dumpAllocSites(profile, &table, false, file);
+    dumpAllocSites(profile, &table, true, file);
+    freeFnNameTable(&table);
+}
+
+// 按次数从多到少输出各操作码的个数及其占比和累计占比，total 为各操作码个数之和
+static void dumpOpCodeCounts(const uint64_t *counts, uint64_t total, FILE *file) {
+    RankEntry entries[OPCODE_NUM];
+    uint32_t entryNum = 0;
+    uint32_t op = 0;
+    while (op < OPCODE_NUM) {
+        if (counts[op] > 0) {
+            entries[entryNum++] = (RankEntry){counts[op], op, 0, NULL};
+        }
+        op++;
+    }
+    qsort(entries, entryNum, sizeof(RankEntry), compareRankEntry);
+
+    uint64_t cumulative = 0;
+    uint32_t idx = 0;
+    while (idx < entryNum) {
+        cumulative += entries[idx].count;
+        fprintf(file, "%14llu %6.2f%% %6.2f%%  %s\n", (unsigned long long)entries[idx].count,
+                percent(entries[idx].count, total), percent(cumulative, total), opCodeNames[entries[idx].first]);
+        idx++;
+    }
+}
+
+// 编译统计的各函数表中最多输出的操作码个数
+#define TOP_FN_OPCODE_NUM 3
+
+CompileStats *compileStats = NULL;
+
+// 开启编译统计
+void startCompileStats(uint32_t top) {
+    compileStats = calloc(1, sizeof(CompileStats));
+    if (compileStats == NULL) {
+        MEM_ERROR("allocate compile stats failed!");
+    }
+    compileStats->top = top;
+}
+
+// 释放编译统计
+void stopCompileStats(void) {
+    if (compileStats == NULL) {
+        return;
+    }
+    free(compileStats->fnRecords);
+    free(compileStats->moduleRecords);
+    free(compileStats);
+    compileStats = NULL;
+}
+
+// 记录一个编译单元的一次编译
+void recordFnCompile(ObjFn *fn, uint64_t compileTime, uint64_t lexTime, uint32_t maxLocalVarNum) {
+    if (compileStats->fnRecordCount == compileStats->fnRecordCapacity) {
+        uint32_t newCapacity = compileStats->fnRecordCapacity == 0 ? 256 : compileStats->fnRecordCapacity * 2;
+        FnCompileRecord *newRecords = realloc(compileStats->fnRecords, sizeof(FnCompileRecord) * newCapacity);
+        if (newRecords == NULL) {
+            MEM_ERROR("allocate compile records failed!");
+        }
+        compileStats->fnRecords = newRecords;
+        compileStats->fnRecordCapacity = newCapacity;
+    }
+    compileStats->fnRecords[compileStats->fnRecordCount++] = (FnCompileRecord){fn, compileTime, lexTime, maxLocalVarNum};
+}
+
+// 记录一次模块编译或延迟编译，同一模块的多次编译累计到同一条记录中
+void recordModuleCompile(ObjModule *module, uint64_t compileTime, uint64_t lexTime, uint32_t methodNameNum, bool isLazy) {
+    // 模块只有几个，顺序查找即可
+    ModuleCompileRecord *record = NULL;
+    uint32_t idx = 0;
+    while (idx < compileStats->moduleRecordCount) {
+        if (compileStats->moduleRecords[idx].module == module) {
+            record = &compileStats->moduleRecords[idx];
+            break;
+        }
+        idx++;
+    }
+
+    if (record == NULL) {
+        if (compileStats->moduleRecordCount == compileStats->moduleRecordCapacity) {
+            uint32_t newCapacity = compileStats->moduleRecordCapacity == 0 ? 8 : compileStats->moduleRecordCapacity * 2;
+            ModuleCompileRecord *newRecords = realloc(compileStats->moduleRecords, sizeof(ModuleCompileRecord) * newCapacity);
+            if (newRecords == NULL) {
+                MEM_ERROR("allocate compile records failed!");
+            }
+            compileStats->moduleRecords = newRecords;
+            compileStats->moduleRecordCapacity = newCapacity;
+        }
+        record = &compileStats->moduleRecords[compileStats->moduleRecordCount++];
+        memset(record, 0, sizeof(ModuleCompileRecord));
+        record->module = module;
+    }
+
+    record->compileTime += compileTime;
+    record->lexTime += lexTime;
+    record->methodNameNum += methodNameNum;
+    if (isLazy) {
+        record->lazyCompileNum++;
+    } else {
+        record->compileNum++;
+    }
+}
+
+// 统计 fn 的指令流中各操作码的个数，累加到 counts 中，返回指令条数
+static uint64_t countStaticOpCodes(ObjFn *fn, uint64_t *counts) {
+    uint64_t instrNum = 0;
+    uint32_t ip = 0;
+    while (ip < fn->instrStream.count) {
+        OpCode opCode = (OpCode)fn->instrStream.datas[ip];
+        counts[opCode]++;
+        instrNum++;
+        // OPCODE_END 是指令流的最后一条指令
+        if (opCode == OPCODE_END) {
+            break;
+        }
+        ip += 1 + getBytesOfOperands(fn->instrStream.datas, fn->constants.datas, ip);
+    }
+    return instrNum;
+}
+
+// 输出函数中个数最多的几种操作码
+static void dumpFnTopOpCodes(ObjFn *fn, FILE *file) {
+    uint64_t counts[OPCODE_NUM] = {0};
+    countStaticOpCodes(fn, counts);
+
+    // 只需要前几名，逐个选出最大的即可
+    uint32_t rank = 0;
+    while (rank < TOP_FN_OPCODE_NUM) {
+        uint32_t maxOp = 0;
+        uint32_t op = 1;
+        while (op < OPCODE_NUM) {
+            if (counts[op] > counts[maxOp]) {
+                maxOp = op;
+            }
+            op++;
+        }
+        if (counts[maxOp] == 0) {
+            break;
+        }
+        fprintf(file, "%s%s %llu", rank == 0 ? "  " : ", ", opCodeNames[maxOp], (unsigned long long)counts[maxOp]);
+        counts[maxOp] = 0;
+        rank++;
+    }
+}
+
+// 函数所属模块的名字，核心模块没有名字
+static const char *getCompiledModuleName(ObjModule *module) {
+    return module->name == NULL ? "core" : module->name->value.start;
+}
+
+// 输出一个模块的编译统计，merged 是按 table 中的顺序合并后的各函数的编译记录，totalBytes 累计模块的指令字节数
+static void dumpModuleCompileStats(ModuleCompileRecord *record, FnNameTable *table, FnCompileRecord *merged,
+                                   uint64_t *totalBytes, FILE *file) {
+    RankEntry *entries = malloc(sizeof(RankEntry) * (table->count == 0 ? 1 : table->count));
+    if (entries == NULL) {
+        MEM_ERROR("allocate compile stats entries failed!");
+    }
+    uint64_t opcodeCounts[OPCODE_NUM] = {0};
+    uint64_t instrNum = 0;
+    uint64_t instrBytes = 0;
+    uint64_t constantNum = 0;
+    uint32_t lazyFnNum = 0;
+    uint32_t entryNum = 0;
+    uint32_t idx = 0;
+    while (idx < table->count) {
+        ObjFn *fn = table->datas[idx].fn;
+        if (fn->module == record->module) {
+            if (fn->lazyBody != NULL) {
+                // 尚未编译的函数只有占位指令，不计入统计
+                lazyFnNum++;
+            } else {
+                entries[entryNum++] = (RankEntry){fn->instrStream.count, idx, 0, &table->datas[idx]};
+                instrNum += countStaticOpCodes(fn, opcodeCounts);
+                instrBytes += fn->instrStream.count;
+                constantNum += fn->constants.count;
+            }
+        }
+        idx++;
+    }
+    qsort(entries, entryNum, sizeof(RankEntry), compareRankEntry);
+    *totalBytes += instrBytes;
+
+    fprintf(file, "== compile stats: module %s ==\n", getCompiledModuleName(record->module));
+    fprintf(file, "%u module compiles, %u lazy function compiles, lex %.3f ms, compile %.3f ms (including lex)\n",
+            record->compileNum, record->lazyCompileNum,
+            record->lexTime / 1000000.0, record->compileTime / 1000000.0);
+    fprintf(file, "%u functions, %llu instruction bytes, %llu instructions, %llu constants, %u method names added\n",
+            entryNum, (unsigned long long)instrBytes, (unsigned long long)instrNum,
+            (unsigned long long)constantNum, record->methodNameNum);
+    if (lazyFnNum > 0) {
+        fprintf(file, "%u functions never called and not compiled (run with --eager-compile to include them)\n", lazyFnNum);
+    }
+
+    fprintf(file, "\n-- functions by instruction bytes (top %u of %u), compile time includes lex --\n",
+            compileStats->top, entryNum);
+    fprintf(file, "%8s %7s %7s %7s %7s %10s %12s  %s\n",
+            "bytes", "consts", "locals", "upvals", "stack", "lex us", "compile us", "function (line)  top opcodes");
+    idx = 0;
+    while (idx < entryNum && idx < compileStats->top) {
+        FnName *fnName = entries[idx].ptr;
+        ObjFn *fn = fnName->fn;
+        FnCompileRecord *fnRecord = &merged[entries[idx].first];
+        fprintf(file, "%8u %7u %7u %7u %7u %10.1f %12.1f  %s (%u)", fn->instrStream.count, fn->constants.count,
+                fnRecord->maxLocalVarNum, fn->upvalueNum, fn->maxStackSlotUsedNum,
+                fnRecord->lexTime / 1000.0, fnRecord->compileTime / 1000.0,
+                getFnName(table, fnName), getLineOfOffset(&fn->lineTable, 0));
+        dumpFnTopOpCodes(fn, file);
+        fputc('\n', file);
+        idx++;
+    }
+
+    fprintf(file, "\n-- static opcodes (%llu instructions) --\n", (unsigned long long)instrNum);
+    dumpOpCodeCounts(opcodeCounts, instrNum, file);
+    fputc('\n', file);
+    free(entries);
+}
+
+// 按模块输出编译统计到 file
+void dumpCompileStats(VM *vm, FILE *file) {
+    FnNameTable table;
+    buildFnNameTable(vm, &table);
+
+    // 按函数合并编译记录，merged 与 table 中的函数一一对应
+    FnCompileRecord *merged = calloc(table.count == 0 ? 1 : table.count, sizeof(FnCompileRecord));
+    if (merged == NULL) {
+        MEM_ERROR("allocate compile records failed!");
+    }
+    uint32_t idx = 0;
+    while (idx < compileStats->fnRecordCount) {
+        FnCompileRecord *fnRecord = &compileStats->fnRecords[idx];
+        FnName *fnName = findFnName(&table, fnRecord->fn);
+        if (fnName != NULL) {
+            FnCompileRecord *target = &merged[fnName - table.datas];
+            target->compileTime += fnRecord->compileTime;
+            target->lexTime += fnRecord->lexTime;
+            if (fnRecord->maxLocalVarNum > target->maxLocalVarNum) {
+                target->maxLocalVarNum = fnRecord->maxLocalVarNum;
+            }
+        }
+        idx++;
+    }
+
+    uint64_t totalBytes = 0;
+    uint64_t totalLexTime = 0;
+    uint64_t totalCompileTime = 0;
+    uint32_t totalMethodNameNum = 0;
+    idx = 0;
+    while (idx < compileStats->moduleRecordCount) {
+        ModuleCompileRecord *record = &compileStats->moduleRecords[idx];
+        dumpModuleCompileStats(record, &table, merged, &totalBytes, file);
+        totalLexTime += record->lexTime;
+        totalCompileTime += record->compileTime;
+        totalMethodNameNum += record->methodNameNum;
+        idx++;
+    }
+
+    // 方法名总数还包括核心模块中原生方法的名字
+    fprintf(file, "== compile stats: %u modules, %llu instruction bytes, lex %.3f ms, compile %.3f ms, "
+                  "%u method names added by compiling (%u in total) ==\n",
+            compileStats->moduleRecordCount, (unsigned long long)totalBytes,
+            totalLexTime / 1000000.0, totalCompileTime / 1000000.0,
+            totalMethodNameNum, vm->allMethodNames.count);
+
+    free(merged);
+    freeFnNameTable(&table);
+}
+
+#ifdef OPCODE_PROFILE
+
+// 各表最多输出的行数，操作码表全部输出
+#define TOP_PAIR_NUM 30
+#define TOP_FN_NUM 20
+#define TOP_CALL_SITE_NUM 30
+
+// 新建指令级剖析数据
+OpcodeProfile *newOpcodeProfile(void) {
+    OpcodeProfile *profile = calloc(1, sizeof(OpcodeProfile));
+    if (profile == NULL) {
+        MEM_ERROR("allocate OpcodeProfile failed!");
+    }
+    profile->prevOpCode = -1;
+    return profile;
+}
+
+// 释放指令级剖析数据
+void freeOpcodeProfile(OpcodeProfile *profile) {
+    free(profile->callSites);
+    free(profile);
+}
+
+// 计算调用点的哈希值
+static uint32_t hashCallSite(ObjFn *fn, uint32_t offset) {
+    uint64_t key = (uint64_t)(uintptr_t)fn + offset * 0x9e3779b97f4a7c15ULL;
+    key ^= key >> 29;
+    return (uint32_t)key;
+}
+
+// 在容量为 capacity（2 的幂）的哈希表中查找调用点，不存在则返回应插入的空槽
+static CallSiteProfile *findCallSite(CallSiteProfile *callSites, uint32_t capacity, ObjFn *fn, uint32_t offset) {
+    uint32_t index = hashCallSite(fn, offset) & (capacity - 1);
+    while (callSites[index].fn != NULL &&
+           (callSites[index].fn != fn || callSites[index].offset != offset)) {
+        index = (index + 1) & (capacity - 1);
+    }
+    return &callSites[index];
+}
+
+// 哈希表扩容为原来的 2 倍
+static void growCallSites(OpcodeProfile *profile) {
+    uint32_t newCapacity = profile->callSiteCapacity == 0 ? 64 : profile->callSiteCapacity * 2;
+    CallSiteProfile *newCallSites = calloc(newCapacity, sizeof(CallSiteProfile));
+    if (newCallSites == NULL) {
+        MEM_ERROR("allocate call sites failed!");
+    }
+    uint32_t idx = 0;
+    while (idx < profile->callSiteCapacity) {
+        CallSiteProfile *callSite = &profile->callSites[idx];
+        if (callSite->fn != NULL) {
+            *findCallSite(newCallSites, newCapacity, callSite->fn, callSite->offset) = *callSite;
+        }
+        idx++;
+    }
+    free(profile->callSites);
+    profile->callSites = newCallSites;
+    profile->callSiteCapacity = newCapacity;
+}
+
+// 记录一次调用
+void recordCallSite(OpcodeProfile *profile, ObjFn *fn, uint32_t offset, uint32_t methodIndex, MethodType type) {
+    // 装载因子超过 3/4 时扩容
+    if ((profile->callSiteCount + 1) * 4 > profile->callSiteCapacity * 3) {
+        growCallSites(profile);
+    }
+    CallSiteProfile *callSite = findCallSite(profile->callSites, profile->callSiteCapacity, fn, offset);
+    if (callSite->fn == NULL) {
+        callSite->fn = fn;
+        callSite->offset = offset;
+        callSite->methodIndex = methodIndex;
+        profile->callSiteCount++;
+    }
+    callSite->counts[type]++;
+}
+
+// 输出各操作码的执行次数
+static void dumpOpCodes(OpcodeProfile *profile, uint64_t total, FILE *file) {
+    fprintf(file, "== opcodes (%llu instructions) ==\n", (unsigned long long)total);
+    dumpOpCodeCounts(profile->opcodeCounts, total, file);
+}
+
+// 输出执行次数最多的相邻指令对，是合并指令（superinstruction）的候选
+static void dumpOpCodePairs(OpcodeProfile *profile, uint64_t total, FILE *file) {
+    RankEntry *entries = malloc(sizeof(RankEntry) * OPCODE_NUM * OPCODE_NUM);
+    if (entries == NULL) {
+        MEM_ERROR("allocate opcode pairs failed!");
+    }
+    uint32_t entryNum = 0;
+    uint32_t prev, next;
+    for (prev = 0; prev < OPCODE_NUM; prev++) {
+        for (next = 0; next < OPCODE_NUM; next++) {
+            if (profile->pairCounts[prev][next] > 0) {
+                entries[entryNum++] = (RankEntry){profile->pairCounts[prev][next], prev, next, NULL};
+            }
+        }
+    }
+    qsort(entries, entryNum, sizeof(RankEntry), compareRankEntry);
+
+    fprintf(file, "\n== opcode pairs (top %d of %u) ==\n", TOP_PAIR_NUM, entryNum);
+    uint32_t idx = 0;
+    while (idx < entryNum && idx < TOP_PAIR_NUM) {
+        fprintf(file, "%14llu %6.2f%%  %s -> %s\n", (unsigned long long)entries[idx].count,
+                percent(entries[idx].count, total),
+                opCodeNames[entries[idx].first], opCodeNames[entries[idx].second]);
+        idx++;
+    }
+    free(entries);
+}
+
+// 输出执行指令数最多的函数
+static void dumpFns(FnNameTable *table, uint64_t total, FILE *file) {
+    RankEntry *entries = malloc(sizeof(RankEntry) * (table->count == 0 ? 1 : table->count));
+    if (entries == NULL) {
+        MEM_ERROR("allocate fn entries failed!");
+    }
+    uint32_t entryNum = 0;
+    uint32_t idx = 0;
+    while (idx < table->count) {
+        FnName *fnName = &table->datas[idx];
+        if (fnName->fn->executedInstrNum > 0) {
+            entries[entryNum++] = (RankEntry){fnName->fn->executedInstrNum, idx, 0, fnName};
+        }
+        idx++;
+    }
+    qsort(entries, entryNum, sizeof(RankEntry), compareRankEntry);
+
+    fprintf(file, "\n== functions by instructions (top %d of %u) ==\n", TOP_FN_NUM, entryNum);
+    idx = 0;
+    while (idx < entryNum && idx < TOP_FN_NUM) {
+        fprintf(file, "%14llu %6.2f%%  %s\n", (unsigned long long)entries[idx].count,
+                percent(entries[idx].count, total), getFnName(table, entries[idx].ptr));
+        idx++;
+    }
+    free(entries);
+}
+
+// 输出调用次数最多的调用点，以及各调用点实际调用的方法类型
+static void dumpCallSites(VM *vm, OpcodeProfile *profile, FnNameTable *table, FILE *file) {
+    RankEntry *entries = malloc(sizeof(RankEntry) * (profile->callSiteCount == 0 ? 1 : profile->callSiteCount));
+    if (entries == NULL) {
+        MEM_ERROR("allocate call site entries failed!");
+    }
+    uint32_t entryNum = 0;
+    uint32_t idx = 0;
+    while (idx < profile->callSiteCapacity) {
+        CallSiteProfile *callSite = &profile->callSites[idx];
+        if (callSite->fn != NULL) {
+            uint64_t count = 0;
+            int type = 0;
+            while (type <= MT_CONSTRUCT) {
+                count += callSite->counts[type++];
+            }
+            entries[entryNum++] = (RankEntry){count, callSite->offset, idx, callSite};
+        }
+        idx++;
+    }
+    qsort(entries, entryNum, sizeof(RankEntry), compareRankEntry);
+
+    fprintf(file, "\n== call sites (top %d of %u) ==\n", TOP_CALL_SITE_NUM, entryNum);
+    fprintf(file, "%14s %12s %12s %12s %12s  %s\n", "calls", "primitive", "script", "fn-call", "construct", "method @ site");
+    idx = 0;
+    while (idx < entryNum && idx < TOP_CALL_SITE_NUM) {
+        CallSiteProfile *callSite = entries[idx].ptr;
+        FnName *fnName = findFnName(table, callSite->fn);
+        fprintf(file, "%14llu %12llu %12llu %12llu %12llu  %s @ %s:%u\n", (unsigned long long)entries[idx].count,
+                (unsigned long long)callSite->counts[MT_PRIMITIVE], (unsigned long long)callSite->counts[MT_SCRIPT],
+                (unsigned long long)callSite->counts[MT_FN_CALL], (unsigned long long)callSite->counts[MT_CONSTRUCT],
+                vm->allMethodNames.datas[callSite->methodIndex].str,
+                fnName == NULL ? "?" : getFnName(table, fnName),
+                getLineOfOffset(&callSite->fn->lineTable, callSite->offset));
+        idx++;
+    }
+    free(entries);
+}
+
+// 将剖析结果按次数从多到少输出到 file
+void dumpOpcodeProfile(VM *vm, FILE *file) {
+    OpcodeProfile *profile = vm->opcodeProfile;
+    uint64_t total = 0;
+    uint32_t op = 0;
+    while (op < OPCODE_NUM) {
+        total += profile->opcodeCounts[op++];
+    }
+
+    FnNameTable table;
+    buildFnNameTable(vm, &table);
+
+    dumpOpCodes(profile, total, file);
+    dumpOpCodePairs(profile, total, file);
+    dumpFns(&table, total, file);
+    dumpCallSites(vm, profile, &table, file);
+
+    freeFnNameTable(&table);
+}
+
+#endif
@@ -0,0 +1,317 @@
+#ifndef _VM_PROFILER_H
+#define _VM_PROFILER_H
+#include "vm.h"
+#include <signal.h>
+#include <stdio.h>
+
+// 函数及其名字，按函数地址排序后二分查找，供各剖析报告和飞行记录器为函数命名
+typedef struct {
+    ObjFn *fn;
+    ObjFn *enclosingFn; // 常量表中包含该函数的外层函数，即定义该函数的位置
+    char *name;         // 为 NULL 表示还没有确定名字
+} FnName;
+
+typedef struct {
+    FnName *datas;
+    uint32_t count;
+} FnNameTable;
+
+// 收集 vm 中所有函数并确定各自的名字，用完后须调用 freeFnNameTable 释放
+void buildFnNameTable(VM *vm, FnNameTable *table);
+
+// 查找 fn 的表项，不在表中时返回 NULL
+FnName *findFnName(FnNameTable *table, ObjFn *fn);
+
+// 获取表项的名字，方法命名为 Foo.bar(_)，没有名字的函数用定义它的外层函数命名，模块的顶层代码命名为 <module 模块名>
+const char *getFnName(FnNameTable *table, FnName *fnName);
+
+void freeFnNameTable(FnNameTable *table);
+
+// 采样剖析的默认频率（Hz）
+#define DEFAULT_SAMPLE_HZ 1000
+
+// 采样得到的一个帧栈，line 为该帧正在执行的指令所在的行号
+typedef struct {
+    ObjFn *fn;
+    uint32_t line;
+} SampleFrame;
+
+// 一种调用栈及其被采样到的次数，frames[0] 为最外层（栈底）的帧
+typedef struct {
+    uint32_t hashCode;
+    uint32_t depth;
+    uint64_t count;
+    SampleFrame *frames;
+} SampledStack;
+
+// 采样剖析数据
+// 定时信号 SIGPROF 的处理函数只递增 ticks 并设置 vm->isSignalPending，
+// 虚拟机在循环回跳和方法调用之后看到 isSignalPending 再记录当前线程的调用栈，此时帧栈都是一致的
+// 不必在每条指令之前检查标记，代价是没有循环和调用的一段代码中到达的采样会记到它之后的安全点上
+typedef struct sampleProfile {
+    volatile sig_atomic_t ticks; // 信号处理函数累计的定时次数，只由信号处理函数修改
+    sig_atomic_t drainedTicks;   // 虚拟机已经记录过的定时次数
+    uint32_t hz;                 // 采样频率
+    uint64_t sampleNum;          // 记录的样本总数（按定时次数加权）
+    SampledStack *stacks;        // 调用栈的开放寻址哈希表
+    uint32_t stackCapacity;
+    uint32_t stackCount;
+    SampleFrame *scratch;        // 记录样本时暂存帧栈的缓冲区
+    uint32_t scratchCapacity;
+} SampleProfile;
+
+// 为 vm 开启采样剖析，以 hz 的频率按进程消耗的 CPU 时间定时，同一时刻只能有一个虚拟机开启
+void startSampleProfiler(VM *vm, uint32_t hz);
+
+// 停止定时并释放采样剖析数据，由 freeVM 调用
+void stopSampleProfiler(VM *vm);
+
+// 记录 objThread 当前的调用栈，调用前当前帧的 ip 必须已经保存到帧栈中，且 vm->isSignalPending 已经清除
+void recordSample(VM *vm, ObjThread *objThread);
+
+// 将采样结果以折叠栈（collapsed stacks）格式输出到 file，每行形如 "外层函数:行号;内层函数:行号 次数"，可直接交给 flamegraph.pl
+void dumpSampleProfile(VM *vm, FILE *file);
+
+// 调用剖析报告默认输出的方法个数
+#define DEFAULT_CALL_PROFILE_TOP 30
+
+// 一个函数或原生方法的调用统计
+typedef struct {
+    ObjFn *fn;              // 脚本函数，原生方法时为 NULL
+    Primitive primFn;       // 原生方法，脚本函数时为 NULL
+    Class *class;           // 第一次调用原生方法时接收者所属的类，用于命名
+    uint32_t methodIndex;   // 原生方法在 vm->allMethodNames 中的索引
+    uint32_t activeNum;     // 尚未返回的帧栈个数，递归调用时只在最外层返回时累计 totalTime
+    uint64_t callNum;       // 调用次数
+    uint64_t selfTime;      // 自身花费的时间（纳秒），不含调用的其他函数
+    uint64_t totalTime;     // 包含调用的其他函数在内的时间（纳秒）
+} CallStats;
+
+// 调用剖析数据
+// 每个帧栈在进入时记录所在线程的运行时间，返回时计算耗时并累计到对应的 CallStats 和上一层帧栈的 childTime 中
+// 时间按线程分别计算，线程被挂起（例如 Thread.yield）的时间不会算到挂起时正在执行的函数上
+typedef struct callProfile {
+    CallStats *stats;           // 统计数组，帧栈中的 profileIndex 是该数组的索引
+    uint32_t statsCount;
+    uint32_t statsCapacity;
+    uint32_t *statsIndexes;     // 由函数或原生方法查找 stats 索引的开放寻址哈希表，UINT32_MAX 表示空槽
+    uint32_t indexCapacity;
+    ObjThread *runningThread;   // 最近一次记录时正在运行的线程
+    uint32_t top;               // 报告中输出的方法个数
+} CallProfile;
+
+// 为 vm 开启调用剖析，报告中输出耗时最多的 top 个方法
+void startCallProfiler(VM *vm, uint32_t top);
+
+// 释放调用剖析数据，由 freeVM 调用
+void freeCallProfile(CallProfile *profile);
+
+// 记录进入 objThread 最新的帧栈
+void enterFrameProfile(VM *vm, ObjThread *objThread);
+
+// 记录从 objThread 最新的帧栈返回，须在 usedFrameNum 减 1 之前调用
+void exitFrameProfile(VM *vm, ObjThread *objThread);
+
+// 虚拟机切换到 objThread 运行，此后的时间算到 objThread 上
+void switchThreadProfile(VM *vm, ObjThread *objThread);
+
+// 调用原生方法并记录其耗时，methodIndex 为方法在 vm->allMethodNames 中的索引
+bool callPrimitiveProfile(VM *vm, ObjThread *objThread, Method *method, uint32_t methodIndex, Value *args);
+
+// 按自身耗时从多到少输出调用剖析结果到 file
+void dumpCallProfile(VM *vm, FILE *file);
+
+// 虚拟机中的调用剖析钩子，未开启调用剖析时只多一次判断
+#define PROFILE_FRAME_ENTER(vm, objThread)           \
+    if ((vm)->callProfile != NULL) {                 \
+        enterFrameProfile(vm, objThread);            \
+    }
+
+#define PROFILE_FRAME_EXIT(vm, objThread)            \
+    if ((vm)->callProfile != NULL) {                 \
+        exitFrameProfile(vm, objThread);             \
+    }
+
+#define PROFILE_THREAD_SWITCH(vm, objThread)         \
+    if ((vm)->callProfile != NULL) {                 \
+        switchThreadProfile(vm, objThread);          \
+    }
+
+// 调用原生方法，开启调用剖析时同时记录耗时
+#define CALL_PRIMITIVE(vm, objThread, method, methodIndex, args) \
+    ((vm)->callProfile == NULL ? (method)->primFn(vm, args)       \
+                               : callPrimitiveProfile(vm, objThread, method, methodIndex, args))
+
+// 分配剖析默认的采样间隔（字节），为 1 表示记录每一次分配
+#define DEFAULT_ALLOC_SAMPLE_BYTES 1
+
+// 分配点的统计，分配点由分配时正在执行的函数、指令偏移及所分配对象的类型确定
+typedef struct {
+    ObjFn *fn;          // 分配时正在执行的脚本函数，为 NULL 表示不在脚本中（例如虚拟机初始化）
+    uint32_t offset;    // 分配时正在执行的指令在 fn 的指令流中的偏移，原生方法中的分配算在调用它的指令上
+    ObjType type;
+    Class *class;       // 所分配对象的类，为 NULL 时用 type 命名
+    uint64_t bytes;     // 按采样估计的分配字节数
+    double count;       // 按采样估计的分配次数
+} AllocSite;
+
+// 分配剖析数据
+// 每分配 sampleBytes 字节采样一次，被采到的分配代表 sampleBytes 字节，所以各分配点的统计是无偏的估计值
+typedef struct allocProfile {
+    uint32_t sampleBytes;       // 采样间隔（字节）
+    int64_t bytesUntilSample;   // 距离下一次采样还要分配的字节数
+    uint64_t totalBytes;        // 分配的总字节数（精确值）
+    uint64_t totalCount;        // 分配的对象总数（精确值）
+    AllocSite *sites;           // 分配点的开放寻址哈希表
+    uint32_t siteCapacity;
+    uint32_t siteCount;
+} AllocProfile;
+
+// 为 vm 开启分配剖析，每分配 sampleBytes 字节采样一次
+void startAllocProfiler(VM *vm, uint32_t sampleBytes);
+
+// 释放分配剖析数据，由 freeVM 调用
+void freeAllocProfile(AllocProfile *profile);
+
+// 记录一个新建的对象，由 initObjHeader 调用
+void recordAllocation(VM *vm, ObjType type, Class *class, size_t bytes);
+
+// 按字节数和分配次数分别输出分配最多的分配点到 file
+void dumpAllocProfile(VM *vm, FILE *file);
+
+#define PROFILE_ALLOCATION(vm, type, class, bytes)   \
+    if ((vm)->allocProfile != NULL) {                \
+        recordAllocation(vm, type, class, bytes);    \
+    }
+
+// 操作码的个数，每个 OPCODE_SLOTS 展开为 +1
+enum {
+    OPCODE_NUM = 0
+#define OPCODE_SLOTS(opcode, effect) +1
+#include "opcode.inc"
+#undef OPCODE_SLOTS
+};
+
+// 操作码的名字，与 OpCode 的顺序一致
+extern const char *opCodeNames[OPCODE_NUM];
+
+// 编译统计报告中每个模块默认输出的函数个数
+#define DEFAULT_COMPILE_STATS_TOP 20
+
+// 一个编译单元（模块的顶层代码、函数或方法）一次编译的统计
+// 延迟编译的函数在编译模块时和第一次调用前各记录一次，输出时按函数合并
+typedef struct {
+    ObjFn *fn;
+    uint64_t compileTime;    // 自身的编译时间（纳秒），包括其中的词法分析，不含内层编译单元
+    uint64_t lexTime;        // 自身的词法分析时间（纳秒）
+    uint32_t maxLocalVarNum; // 同时存在的局部变量的最大个数（包括参数和第 0 个局部变量）
+} FnCompileRecord;
+
+// 一个模块的编译统计，包括编译模块和延迟编译其中的函数
+typedef struct {
+    ObjModule *module;
+    uint64_t compileTime;    // 编译时间（纳秒），包括其中的词法分析
+    uint64_t lexTime;        // 词法分析时间（纳秒）
+    uint32_t methodNameNum;  // 编译时新加入 vm->allMethodNames 的方法名个数
+    uint32_t compileNum;     // 编译模块的次数，命令行模式下每一行都编译一次
+    uint32_t lazyCompileNum; // 延迟编译函数的次数
+} ModuleCompileRecord;
+
+// 编译统计（di --compile-stats）
+// 编译器在每个编译单元开始和结束时读时钟，结束时记录一条 FnCompileRecord，
+// 进程结束前再按函数合并，并从函数的指令流统计字节数和各操作码的静态个数
+// 核心模块在创建虚拟机时就已编译，所以统计和追踪一样是全局的，不属于某个虚拟机
+typedef struct compileStats {
+    uint32_t top;                        // 报告中每个模块输出的函数个数
+    uint64_t lexTime;                    // 累计的词法分析时间（纳秒），由 getNextToken 和 skipBlock 累计
+    FnCompileRecord *fnRecords;
+    uint32_t fnRecordCount;
+    uint32_t fnRecordCapacity;
+    ModuleCompileRecord *moduleRecords;  // 按第一次编译的顺序排列
+    uint32_t moduleRecordCount;
+    uint32_t moduleRecordCapacity;
+} CompileStats;
+
+// 正在进行的编译统计，为 NULL 表示没有开启
+extern CompileStats *compileStats;
+
+// 开启编译统计，报告中每个模块输出编译结果最大的 top 个函数，须在创建虚拟机之前调用才能统计核心模块
+void startCompileStats(uint32_t top);
+
+// 释放编译统计
+void stopCompileStats(void);
+
+// 记录一个编译单元的一次编译
+void recordFnCompile(ObjFn *fn, uint64_t compileTime, uint64_t lexTime, uint32_t maxLocalVarNum);
+
+// 记录一次模块编译（isLazy 为 false）或延迟编译（isLazy 为 true）
+void recordModuleCompile(ObjModule *module, uint64_t compileTime, uint64_t lexTime, uint32_t methodNameNum, bool isLazy);
+
+// 按模块输出编译统计到 file
+void dumpCompileStats(VM *vm, FILE *file);
+
+// 指令级剖析只在定义了宏 OPCODE_PROFILE 的构建中可用（cmake -DOPCODE_PROFILE=ON 或 make r CFLAGS=-DOPCODE_PROFILE）
+// 普通构建中下面的 PROFILE_XXX 宏展开为空，虚拟机的指令循环中不会留下任何统计代码
+#ifdef OPCODE_PROFILE
+
+// 调用点的统计，调用点由所在函数和调用指令在指令流中的偏移确定
+typedef struct {
+    ObjFn *fn;                          // 调用指令所在的函数，为 NULL 表示空槽
+    uint32_t offset;                    // 调用指令在指令流中的偏移
+    uint32_t methodIndex;               // 被调用方法在 vm->allMethodNames 中的索引
+    uint64_t counts[MT_CONSTRUCT + 1];  // 按被调用方法的类型（MethodType）统计的调用次数
+} CallSiteProfile;
+
+// 指令级剖析数据
+typedef struct opcodeProfile {
+    uint64_t opcodeCounts[OPCODE_NUM];              // 各操作码的执行次数
+    uint64_t pairCounts[OPCODE_NUM][OPCODE_NUM];    // 相邻两条指令的执行次数，pairCounts[前一条][后一条]
+    int prevOpCode;                                 // 上一条执行的指令，-1 表示还没有执行过指令
+    CallSiteProfile *callSites;                     // 调用点的开放寻址哈希表
+    uint32_t callSiteCapacity;
+    uint32_t callSiteCount;
+} OpcodeProfile;
+
+// 新建剖析数据，用 calloc 申请内存，不计入虚拟机的内存统计
+OpcodeProfile *newOpcodeProfile(void);
+
+// 释放剖析数据
+void freeOpcodeProfile(OpcodeProfile *profile);
+
+// 记录一次调用，offset 为调用指令在 fn 的指令流中的偏移
+void recordCallSite(OpcodeProfile *profile, ObjFn *fn, uint32_t offset, uint32_t methodIndex, MethodType type);
+
+// 将剖析结果按次数从多到少输出到 file
+void dumpOpcodeProfile(VM *vm, FILE *file);
+
+// 记录一条即将执行的指令，每条指令都会调用，所以定义成内联函数
+static inline void recordOpCode(OpcodeProfile *profile, ObjFn *fn, OpCode opCode) {
+    profile->opcodeCounts[opCode]++;
+    if (profile->prevOpCode >= 0) {
+        profile->pairCounts[profile->prevOpCode][opCode]++;
+    }
+    profile->prevOpCode = opCode;
+    fn->executedInstrNum++;
+}
+
+// 在指令循环读入操作码之后记录该指令
+#define PROFILE_OPCODE(vm, fn, opCode)                      \
+    if ((vm)->opcodeProfile != NULL) {                      \
+        recordOpCode((vm)->opcodeProfile, fn, opCode);      \
+    }
+
+// 在查到被调用方法之后记录调用点，此时 ip 指向调用指令之后，instrLength 为调用指令的长度
+#define PROFILE_CALL_SITE(vm, fn, ip, instrLength, methodIndex, type)                               \
+    if ((vm)->opcodeProfile != NULL) {                                                              \
+        recordCallSite((vm)->opcodeProfile, fn,                                                     \
+                       (uint32_t)((ip) - (fn)->instrStream.datas) - (instrLength), methodIndex, type); \
+    }
+
+#else
+
+#define PROFILE_OPCODE(vm, fn, opCode)
+#define PROFILE_CALL_SITE(vm, fn, ip, instrLength, methodIndex, type)
+
+#endif
+
+#endif
@@ -0,0 +1,234 @@
+#include "trace.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+Tracer *tracer = NULL;
+
+// 读取单调时钟（纳秒）
+uint64_t traceNow(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+// 追加一个事件，argString 由调用方复制
+static void addEvent(const char *name, char phase, uint32_t tid,
+                     const char *argName, char *argString, uint64_t argNum) {
+    if (tracer->eventCount == tracer->eventCapacity) {
+        uint32_t newCapacity = tracer->eventCapacity == 0 ? 1024 : tracer->eventCapacity * 2;
+        TraceEvent *newEvents = realloc(tracer->events, sizeof(TraceEvent) * newCapacity);
+        if (newEvents == NULL) {
+            MEM_ERROR("allocate trace events failed!");
+        }
+        tracer->events = newEvents;
+        tracer->eventCapacity = newCapacity;
+    }
+    TraceEvent *event = &tracer->events[tracer->eventCount++];
+    event->name = name;
+    event->phase = phase;
+    event->tid = tid;
+    event->time = traceNow() - tracer->startTime;
+    event->argName = argName;
+    event->argString = argString;
+    event->argNum = argNum;
+}
+
+// 复制字符串参数
+static char *copyString(const char *str) {
+    size_t length = strlen(str);
+    char *copy = malloc(length + 1);
+    if (copy == NULL) {
+        MEM_ERROR("allocate trace argument failed!");
+    }
+    memcpy(copy, str, length + 1);
+    return copy;
+}
+
+// 以 JSON 字符串的格式输出 str
+static void writeJsonString(FILE *file, const char *str) {
+    fputc('"', file);
+    while (*str != '\0') {
+        unsigned char c = (unsigned char)*str++;
+        if (c == '"' || c == '\\') {
+            fprintf(file, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(file, "\\u%04x", c);
+        } else {
+            fputc(c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+// 输出轨道名的元数据事件
+static void writeThreadName(FILE *file, uint32_t tid, const char *name) {
+    fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":", tid);
+    writeJsonString(file, name);
+    fprintf(file, "}}");
+}
+
+// 输出时间线，时间戳的单位是微秒
+static void writeTrace(FILE *file) {
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"di\"}}");
+    writeThreadName(file, 0, "vm");
+    uint32_t idx = 0;
+    while (idx < tracer->threadNum) {
+        char name[32];
+        const char *threadName = tracer->threadNames[idx];
+        if (threadName == NULL) {
+            snprintf(name, sizeof(name), "Thread %u", idx + 1);
+            threadName = name;
+        }
+        writeThreadName(file, idx + 1, threadName);
+        idx++;
+    }
+
+    idx = 0;
+    while (idx < tracer->eventCount) {
+        TraceEvent *event = &tracer->events[idx];
+        fprintf(file, ",\n{");
+        if (event->name != NULL) {
+            fprintf(file, "\"name\":\"%s\",", event->name);
+        }
+        fprintf(file, "\"cat\":\"vm\",\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":1,\"tid\":%u", event->phase,
+                (unsigned long long)(event->time / 1000), (unsigned)(event->time % 1000), event->tid);
+        if (event->phase == 'i') {
+            // 瞬时事件只画在所在轨道上
+            fprintf(file, ",\"s\":\"t\"");
+        }
+        if (event->argName != NULL) {
+            fprintf(file, ",\"args\":{\"%s\":", event->argName);
+            if (event->argString != NULL) {
+                writeJsonString(file, event->argString);
+            } else {
+                fprintf(file, "%llu", (unsigned long long)event->argNum);
+            }
+            fputc('}', file);
+        }
+        fputc('}', file);
+        idx++;
+    }
+    fprintf(file, "\n]}\n");
+}
+
+// 进程退出时写入时间线，脚本运行出错时会直接 exit
+static void stopTracerAtExit(void) {
+    stopTracer();
+}
+
+// 开启追踪
+void startTracer(const char *path) {
+    tracer = calloc(1, sizeof(Tracer));
+    if (tracer == NULL) {
+        MEM_ERROR("allocate tracer failed!");
+    }
+    tracer->path = path;
+    tracer->startTime = traceNow();
+    atexit(stopTracerAtExit);
+}
+
+// 把时间线写入文件并结束追踪
+void stopTracer(void) {
+    if (tracer == NULL) {
+        return;
+    }
+
+    // 补上尚未结束的区间，例如运行出错退出时正在执行的模块和线程
+    if (tracer->runningTid != 0) {
+        addEvent(NULL, 'E', tracer->runningTid, NULL, NULL, 0);
+    }
+    while (tracer->openSpanNum > 0) {
+        addEvent(NULL, 'E', 0, NULL, NULL, 0);
+        tracer->openSpanNum--;
+    }
+
+    // 可能在 exit 的过程中调用，所以不能用会再次 exit 的 IO_ERROR
+    FILE *file = fopen(tracer->path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Couldn't write trace \"%s\".\n", tracer->path);
+    } else {
+        writeTrace(file);
+        fclose(file);
+    }
+
+    uint32_t idx = 0;
+    while (idx < tracer->eventCount) {
+        free(tracer->events[idx].argString);
+        idx++;
+    }
+    idx = 0;
+    while (idx < tracer->threadNum) {
+        free(tracer->threadNames[idx]);
+        idx++;
+    }
+    free(tracer->events);
+    free(tracer->threadNames);
+    free(tracer);
+    tracer = NULL;
+}
+
+// 在虚拟机轨道上开始一个区间
+void traceBegin(const char *name, const char *argName, const char *argString) {
+    addEvent(name, 'B', 0, argName, argName == NULL ? NULL : copyString(argString), 0);
+    tracer->openSpanNum++;
+}
+
+// 结束虚拟机轨道上最近开始的区间
+void traceEnd(const char *argName, uint64_t argNum) {
+    if (tracer->openSpanNum == 0) {
+        return;
+    }
+    addEvent(NULL, 'E', 0, argName, NULL, argNum);
+    tracer->openSpanNum--;
+}
+
+// 在虚拟机轨道上记录一个瞬时事件
+void traceInstant(const char *name, const char *argName, uint64_t argNum) {
+    addEvent(name, 'i', 0, argName, NULL, argNum);
+}
+
+// 为新建的线程分配轨道
+void traceThreadCreated(ObjThread *objThread) {
+    if (tracer->threadNum == tracer->threadCapacity) {
+        uint32_t newCapacity = tracer->threadCapacity == 0 ? 16 : tracer->threadCapacity * 2;
+        char **newNames = realloc(tracer->threadNames, sizeof(char *) * newCapacity);
+        if (newNames == NULL) {
+            MEM_ERROR("allocate trace thread names failed!");
+        }
+        tracer->threadNames = newNames;
+        tracer->threadCapacity = newCapacity;
+    }
+    tracer->threadNames[tracer->threadNum++] = NULL;
+    objThread->traceId = tracer->threadNum;
+    addEvent("Thread.new", 'i', 0, "thread", NULL, objThread->traceId);
+}
+
+// 设置线程轨道的名字
+void traceNameThread(ObjThread *objThread, const char *name) {
+    // 开启追踪之前创建的线程没有轨道
+    if (objThread->traceId == 0) {
+        return;
+    }
+    char **threadName = &tracer->threadNames[objThread->traceId - 1];
+    free(*threadName);
+    *threadName = copyString(name);
+}
+
+// 虚拟机切换到 objThread 运行
+void traceThreadSwitch(ObjThread *objThread) {
+    uint32_t tid = objThread == NULL ? 0 : objThread->traceId;
+    if (tid == tracer->runningTid) {
+        return;
+    }
+    if (tracer->runningTid != 0) {
+        addEvent(NULL, 'E', tracer->runningTid, NULL, NULL, 0);
+    }
+    if (tid != 0) {
+        addEvent("run", 'B', tid, NULL, NULL, 0);
+    }
+    tracer->runningTid = tid;
+}
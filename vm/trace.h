@@ -0,0 +1,102 @@
+#ifndef _VM_TRACE_H
+#define _VM_TRACE_H
+#include "obj_thread.h"
+#include <stdint.h>
+
+// 时间线追踪（di --trace out.json）
+// 记录虚拟机各阶段的起止时刻，输出 Chrome trace event 格式的 JSON，可用 chrome://tracing 或 ui.perfetto.dev 打开
+// 事件先缓存在内存中，进程结束前才写入文件，追踪期间每个事件只多一次读时钟和一次数组写入
+// 时间线中编号为 0 的轨道是虚拟机本身（编译、buildCore、模块执行、大块内存分配等），
+// 其余每个线程（Thread）占一条轨道，显示该线程各次运行的区间
+
+// 分配的内存不少于该字节数时记录一个瞬时事件
+#define TRACE_LARGE_ALLOC_BYTES (64 * 1024)
+
+// 一个追踪事件
+typedef struct {
+    const char *name;    // 事件名，必须是字符串常量，为 NULL 时不输出（结束事件可以不带名字）
+    char phase;          // 'B' 区间开始，'E' 区间结束，'i' 瞬时事件
+    uint32_t tid;        // 所在轨道，0 为虚拟机，其余为线程的 traceId
+    uint64_t time;       // 距开始追踪的时间（纳秒）
+    const char *argName; // 参数名，必须是字符串常量，为 NULL 表示没有参数
+    char *argString;     // 复制的字符串参数，为 NULL 时参数是数值 argNum
+    uint64_t argNum;
+} TraceEvent;
+
+typedef struct tracer {
+    const char *path;        // 输出文件的路径
+    uint64_t startTime;      // 开始追踪的时刻（CLOCK_MONOTONIC，纳秒）
+    TraceEvent *events;
+    uint32_t eventCount;
+    uint32_t eventCapacity;
+    char **threadNames;      // 各线程轨道的名字，threadNames[traceId - 1]，为 NULL 时按编号命名
+    uint32_t threadNum;      // 已分配的 traceId 个数
+    uint32_t threadCapacity;
+    uint32_t runningTid;     // 正在运行的线程的 traceId，为 0 表示没有线程在运行
+    uint32_t openSpanNum;    // 虚拟机轨道上尚未结束的区间个数，写文件时补上结束事件
+    uint64_t lexTime;        // 累计的词法分析时间（纳秒），词法分析穿插在编译中，所以按编译区间统计
+} Tracer;
+
+// 正在进行的追踪，为 NULL 表示没有开启追踪
+// 追踪的是整个进程的时间线（包括创建虚拟机时的 buildCore），所以是全局的而不属于某个虚拟机
+extern Tracer *tracer;
+
+// 开启追踪，进程退出前（包括运行出错 exit 时）把时间线写入 path
+void startTracer(const char *path);
+
+// 把时间线写入文件并结束追踪，重复调用时什么也不做
+void stopTracer(void);
+
+// 读取单调时钟（纳秒）
+uint64_t traceNow(void);
+
+// 在虚拟机轨道上开始一个区间，argName 不为 NULL 时以字符串 argString 作为参数
+void traceBegin(const char *name, const char *argName, const char *argString);
+
+// 结束虚拟机轨道上最近开始的区间，argName 不为 NULL 时以数值 argNum 作为参数（与开始事件的参数合并显示）
+void traceEnd(const char *argName, uint64_t argNum);
+
+// 在虚拟机轨道上记录一个带数值参数的瞬时事件
+void traceInstant(const char *name, const char *argName, uint64_t argNum);
+
+// 为新建的线程分配轨道，并在虚拟机轨道上记录创建事件
+void traceThreadCreated(ObjThread *objThread);
+
+// 设置线程轨道的名字，name 会被复制
+void traceNameThread(ObjThread *objThread, const char *name);
+
+// 虚拟机切换到 objThread 运行，结束上一个线程的运行区间并开始 objThread 的，objThread 为 NULL 表示不再有线程运行
+void traceThreadSwitch(ObjThread *objThread);
+
+// 以下钩子在未开启追踪时只多一次判断
+#define TRACE_BEGIN(name, argName, argString)      \
+    if (tracer != NULL) {                          \
+        traceBegin(name, argName, argString);      \
+    }
+
+#define TRACE_END(argName, argNum)                 \
+    if (tracer != NULL) {                          \
+        traceEnd(argName, argNum);                 \
+    }
+
+#define TRACE_INSTANT(name, argName, argNum)       \
+    if (tracer != NULL) {                          \
+        traceInstant(name, argName, argNum);       \
+    }
+
+#define TRACE_THREAD_CREATED(objThread)            \
+    if (tracer != NULL) {                          \
+        traceThreadCreated(objThread);             \
+    }
+
+#define TRACE_NAME_THREAD(objThread, name)         \
+    if (tracer != NULL) {                          \
+        traceNameThread(objThread, name);          \
+    }
+
+#define TRACE_THREAD_SWITCH(objThread)             \
+    if (tracer != NULL) {                          \
+        traceThreadSwitch(objThread);              \
+    }
+
+#endif
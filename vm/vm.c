@@ -1,21 +1,53 @@
 #include "vm.h"
 #include "compiler.h"
 #include "core.h"
+#include "flight_recorder.h"
 #include "gc.h"
+#include "probes.h"
+#include "profiler.h"
+#include "trace.h"
+#include <math.h>
+#include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
 
 // 初始化虚拟机
 void initVM(VM *vm) {
     // 记录已经分配的内存总和
     vm->allocatedBytes = 0;
+    vm->peakAllocatedBytes = 0;
+    vm->lastAllocatedBytes = 0;
+    // 默认不限制堆内存
+    vm->heapLimit = 0;
+    vm->isHeapLimitExceeded = false;
+    vm->heapLimitSlack = 0;
+    // 虚拟机开始执行指令之前，memManager 不能拒绝申请
+    vm->allocFailJump = NULL;
+    vm->refusedBytes = 0;
+    // 默认不限制线程的执行预算
+    vm->threadBudget = 0;
+    vm->budgetAction = BUDGET_ABORT;
+    memset(vm->objectCounts, 0, sizeof(vm->objectCounts));
+    memset(vm->objectBytes, 0, sizeof(vm->objectBytes));
     // 当前词法分析器初始化为 NULL
     vm->curLexer = NULL;
+    vm->isSignalPending = 0;
+    // 飞行记录器默认开启，要在申请任何内存之前准备好，memManager 会记录大块内存分配
+    startFlightRecorder(vm);
+    vm->sampleProfile = NULL;
+    vm->callProfile = NULL;
+    vm->allocProfile = NULL;
+#ifdef OPCODE_PROFILE
+    vm->opcodeProfile = NULL;
+#endif
     // 指向所有已分配对象链表的首节点，用于垃圾回收
     vm->allObjects = NULL;
     // 初始化模块集合
     vm->allModules = newObjMap(vm);
     // 初始化类的方法集合
     StringBufferInit(&vm->allMethodNames);
+    // 在 buildCore 绑定原生方法之前，内联指令一律照常调用方法
+    memset(vm->intrinsicPrims, 0, sizeof(vm->intrinsicPrims));
 }
 
 // 新建虚拟机
@@ -31,7 +63,9 @@ VM *newVM() {
     // 调用 initVM 对虚拟机进行初始化
     initVM(vm);
     // 编译核心模块
+    TRACE_BEGIN("buildCore", NULL, NULL)
     buildCore(vm);
+    TRACE_END(NULL, 0)
     return vm;
 }
 
@@ -39,6 +73,9 @@ VM *newVM() {
 void freeVM(VM *vm) {
     ASSERT(vm->allMethodNames.count > 0, "VM have already been freed!");
 
+    // 先释放飞行记录器，之后释放对象时不必再逐个扫描记录
+    freeFlightRecorder(vm);
+
     // 释放所有的对象（都存放在链表中）
     ObjHeader *objHeader = vm->allObjects;
     while (objHeader != NULL) {
@@ -48,8 +85,23 @@ void freeVM(VM *vm) {
         objHeader = next;
     }
 
-    StringBufferClear(vm, &vm->allMethodNames);
-    DEALLOCATE(vm, vm);
+    symbolTableClear(vm, &vm->allMethodNames);
+    if (vm->sampleProfile != NULL) {
+        stopSampleProfiler(vm);
+    }
+    if (vm->callProfile != NULL) {
+        freeCallProfile(vm->callProfile);
+    }
+    if (vm->allocProfile != NULL) {
+        freeAllocProfile(vm->allocProfile);
+    }
+#ifdef OPCODE_PROFILE
+    if (vm->opcodeProfile != NULL) {
+        freeOpcodeProfile(vm->opcodeProfile);
+    }
+#endif
+    // vm 是由 newVM 直接用 malloc 申请的，不经过 memManager
+    free(vm);
 }
 
 // 确保栈的容量及数据有效
@@ -108,7 +160,8 @@ void ensureStack(VM *vm, ObjThread *objThread, uint32_t needSlots) {
 
 // 为线程 objThread 中运行的闭包函数 objClosure 准备帧栈 Frame，即闭包（函数或方法）的运行资源，包括如下：
 // 1.运行时栈    2.待运行的指令流    3.当前运行的指令地址 ip
-inline static void createFrame(VM *vm, ObjThread *objThread, ObjClosure *objClosure, int argNum) {
+// methodIndex 为调用的方法在 vm->allMethodNames 中的索引，只用于 USDT 探针
+inline static void createFrame(VM *vm, ObjThread *objThread, ObjClosure *objClosure, int argNum, uint32_t methodIndex) {
     // 如果当前使用的 frame 数量（算上这次使用的一个）大于 frame 的总容量，则将总容量扩大二倍
     if (objThread->usedFrameNum + 1 > objThread->frameCapacity) {
         uint32_t newCapacity = objThread->frameCapacity * 2;
@@ -118,6 +171,11 @@ inline static void createFrame(VM *vm, ObjThread *objThread, ObjClosure *objClos
         objThread->frameCapacity = newCapacity;
     }
 
+    // 延迟编译的函数/方法，在第一次调用时才编译函数体
+    if (objClosure->fn->lazyBody != NULL) {
+        compileLazyFn(vm, objClosure->fn);
+    }
+
     // 先计算目前 “大栈” 的大小：栈顶地址 - 栈底地址
     uint32_t stackSlots = (uint32_t)(objThread->esp - objThread->stack);
     // 再加上函数/方法执行时需要的最大的栈数，就是创建这次帧栈需要的栈的总大小
@@ -129,6 +187,9 @@ inline static void createFrame(VM *vm, ObjThread *objThread, ObjClosure *objClos
     // 第三个参数是被调用函数的帧栈在整个 “大栈” 中的起始地址
     // 减去参数个数，是为了函数闭包 objClosure 可以访问到栈中自己的参数（TODO: 暂未搞懂，后续回填）
     prepareFrame(objThread, objClosure, objThread->esp - argNum);
+    PROFILE_FRAME_ENTER(vm, objThread)
+    FLIGHT_CALL(vm, objClosure->fn, objThread->usedFrameNum)
+    PROBE_FUNCTION_ENTRY(vm, objClosure->fn, methodIndex, objThread->usedFrameNum)
 }
 
 // 背景知识：
@@ -200,13 +261,70 @@ static ObjUpvalue *createOpenUpvalue(VM *vm, ObjThread *objThread, Value *localV
     return newUpvalue;
 }
 
+#ifdef USDT_PROBES
+// USDT 探针的信号量，放在 .probes 段中，外部工具挂上探针时将其加 1
+#define DEFINE_PROBE_SEMAPHORE(name) unsigned short ditto_##name##_semaphore __attribute__((section(".probes")));
+PROBE_SEMAPHORES(DEFINE_PROBE_SEMAPHORE)
+#undef DEFINE_PROBE_SEMAPHORE
+
+// 触发 runtime__error 探针，位置取 objThread 最新的帧栈正在执行的指令，调用前当前帧的 ip 必须已经保存到帧栈中
+void fireRuntimeErrorProbe(ObjThread *objThread, const char *message) {
+    const char *moduleName = NULL;
+    uint32_t line = 0;
+    if (objThread->usedFrameNum > 0) {
+        Frame *frame = &objThread->frames[objThread->usedFrameNum - 1];
+        ObjFn *fn = frame->closure->fn;
+        uint32_t offset = (uint32_t)(frame->ip - fn->instrStream.datas);
+        moduleName = getProbeModuleName(fn->module);
+        line = getLineOfOffset(&fn->lineTable, offset > 0 ? offset - 1 : 0);
+    }
+    DTRACE_PROBE3(ditto, runtime__error, message, moduleName, line);
+}
+#endif
+
+// 向 stderr 输出线程 objThread 的调用栈，最内层的帧在前，每帧给出所在模块和正在执行的指令的行号
+// 调用前当前帧的 ip 必须已经保存到帧栈中
+static void printStackTrace(ObjThread *objThread) {
+    uint32_t idx = objThread->usedFrameNum;
+    while (idx > 0) {
+        idx--;
+        ObjFn *fn = objThread->frames[idx].closure->fn;
+        // ip 指向下一条指令，减 1 使偏移落在正在执行的指令内
+        uint32_t offset = (uint32_t)(objThread->frames[idx].ip - fn->instrStream.datas);
+        if (offset > 0) {
+            offset--;
+        }
+        ObjString *moduleName = fn->module->name;
+        fprintf(stderr, "    at %s:%u\n", moduleName == NULL ? "core.script.inc" : moduleName->value.start,
+                getLineOfOffset(&fn->lineTable, offset));
+    }
+}
+
+// 报告运行时错误并退出，和 RUN_ERROR 一样输出错误信息，之后再输出当前线程的调用栈
+// 调用前当前帧的 ip 必须已经保存到帧栈中
+static void runtimeError(VM *vm, const char *fmt, ...) {
+    char buffer[DEFAULT_BUFFER_SIZE] = {'\0'};
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buffer, DEFAULT_BUFFER_SIZE, fmt, ap);
+    va_end(ap);
+
+    fprintf(stderr, "%s\n", buffer);
+    if (vm->curThread != NULL) {
+        PROBE_RUNTIME_ERROR(vm->curThread, buffer)
+        printStackTrace(vm->curThread);
+    }
+    dumpFlightRecorderOnError(buffer);
+    exit(1);
+}
+
 // 校验基类合法性
 // classNameValue 为子类类名，fieldNum 为子类的实例属性数量，superClassValue 为基类
 static void validateSuperClass(VM *vm, Value classNameValue, uint32_t fieldNum, Value superClassValue) {
     // 首先确保 superClass 类型是 class
     if (!VALUE_IS_CLASS(superClassValue)) {
         ObjString *classNameString = VALUE_TO_OBJSTR(classNameValue);
-        RUN_ERROR("class \"%s\" 's superClass is not a valid class!", classNameString->value.start);
+        runtimeError(vm, "class \"%s\" 's superClass is not a valid class!", classNameString->value.start);
     }
 
     Class *superClass = VALUE_TO_CLASS(superClassValue);
@@ -221,17 +339,17 @@ static void validateSuperClass(VM *vm, Value classNameValue, uint32_t fieldNum,
         superClass == vm->numClass ||
         superClass == vm->fnClass ||
         superClass == vm->threadClass) {
-        RUN_ERROR("superClass mustn't be a builtin class!");
+        runtimeError(vm, "superClass mustn't be a builtin class!");
     }
 
     // 因为子类也会继承父类的实例属性，所以 子类本身的实例属性数量 + 基类的实例属性数量 不能超过 MAX_FIELD_NUM
     if (superClass->fieldNum + fieldNum > MAX_FIELD_NUM) {
-        RUN_ERROR("number of field including super exceed %d!", MAX_FIELD_NUM);
+        runtimeError(vm, "number of field including super exceed %d!", MAX_FIELD_NUM);
     }
 }
 
 // 修正部分指令的操作数
-static void patchOperand(Class *class, ObjFn *fn) {
+void patchOperand(Class *class, ObjFn *fn) {
     int ip = 0;
     OpCode opCode;
 
@@ -319,6 +437,24 @@ static void patchOperand(Class *class, ObjFn *fn) {
     }
 }
 
+// 闭包 objClosure 引用的自由变量是否与 OPCODE_CREATE_CLOSURE 在帧栈 frame 中将要引用的完全相同，operands 指向成对的 {isEnclosingLocalVar, index}
+// 指向外层函数局部变量的 upvalue 在作用域结束时关闭，关闭后 localVarPtr 指向其自身的 closedUpvalue，
+// 所以仍指向同一个栈槽的 upvalue 一定还是打开的，正是 createOpenUpvalue 会返回的那个
+static bool isClosureReusable(ObjClosure *objClosure, const uint8_t *operands, Frame *frame) {
+    uint32_t idx = 0;
+    while (idx < objClosure->fn->upvalueNum) {
+        uint8_t isEnclosingLocalVar = operands[idx * 2];
+        uint8_t index = operands[idx * 2 + 1];
+        ObjUpvalue *upvalue = objClosure->upvalues[idx];
+        if (isEnclosingLocalVar ? upvalue->localVarPtr != frame->stackStart + index
+                                : upvalue != frame->closure->upvalues[index]) {
+            return false;
+        }
+        idx++;
+    }
+    return true;
+}
+
 // 背景知识：
 // 各类自己的 methods 数组和 vm->allMethodNames 长度保持一致，进而 vm->allMethodNames 中的方法名和各个类的 methods 数组对应方法体的索引值相等，
 // 这样就可以通过相同的索引获取到方法体或者方法名
@@ -340,7 +476,19 @@ static void bindMethodAndPatch(VM *vm, OpCode opCode, Class *class, uint32_t met
     method.obj = VALUE_TO_OBJCLOSURE(methodValue);
 
     // 修正方法对应指令流中的操作数
-    patchOperand(class, method.obj->fn);
+    // 延迟编译的方法此时还没有指令流，先记下所属类，等编译之后再修正
+    if (method.obj->fn->lazyBody != NULL) {
+        method.obj->fn->lazyBody->class = class;
+    } else {
+        patchOperand(class, method.obj->fn);
+    }
+
+    // emitCreateInstance 生成的静态方法 new 以 OPCODE_CONSTRUCT 开头，标记为 MT_CONSTRUCT
+    // 调用时虚拟机直接创建实例并进入实例方法 new，不必再为该静态方法创建帧栈
+    if (opCode == OPCODE_STATIC_METHOD && method.obj->fn->instrStream.count > 0 &&
+        method.obj->fn->instrStream.datas[0] == OPCODE_CONSTRUCT) {
+        method.type = MT_CONSTRUCT;
+    }
 
     // 然后绑定方法到指定类上
     // 即将 method 插入到 class->methods.datas 数组中，索引为 methodIndex
@@ -348,14 +496,255 @@ static void bindMethodAndPatch(VM *vm, OpCode opCode, Class *class, uint32_t met
     bindMethod(vm, class, methodIndex, method);
 }
 
+// 以错误信息 errMsg 结束线程 objThread，并将控制权交还给主调线程
+// 错误信息和 Thread.abort 一样记录在 objThread->errorObj 中，主调线程可以通过 isDone 和 error 得知该线程已出错退出，
+// 由主调线程决定如何处理，所以这里不输出错误信息
+// 没有主调线程（例如模块的顶层代码）时没有谁能处理该错误，和其他运行时错误一样输出调用栈并退出进程
+// 返回主调线程
+static ObjThread *abortThread(VM *vm, ObjThread *objThread, const char *errMsg, int len) {
+    ObjThread *callerThread = objThread->caller;
+    if (callerThread == NULL) {
+        runtimeError(vm, "%s", errMsg);
+    }
+
+    // 创建错误信息也要申请内存，此时堆内存可能已经超限，memManager 不能再拒绝申请并跳回虚拟机
+    jmp_buf *allocFailJump = vm->allocFailJump;
+    vm->allocFailJump = NULL;
+    objThread->errorObj = OBJ_TO_VALUE(newObjString(vm, errMsg, len));
+    vm->allocFailJump = allocFailJump;
+    PROBE_RUNTIME_ERROR(objThread, errMsg)
+
+    vm->curThread = callerThread;
+    // 和线程正常返回一样，主调线程的栈顶用于存放被调线程的返回值，出错时返回 null
+    callerThread->esp[-1] = VT_TO_VALUE(VT_NULL);
+    return callerThread;
+}
+
+// 主调线程处理堆内存超限的错误时可以继续申请的内存，为 heapLimit 的 1/HEAP_LIMIT_HEADROOM_RATIO
+#define HEAP_LIMIT_HEADROOM_RATIO 4
+
+// 堆内存超出 vm->heapLimit 时，以错误结束线程 objThread，返回主调线程
+// refusedBytes 不为 0 时表示 memManager 拒绝了一次会超出上限的申请，这次申请增加的字节数为 refusedBytes
+static ObjThread *abortThreadOnHeapLimit(VM *vm, ObjThread *objThread, size_t refusedBytes) {
+    char errMsg[DEFAULT_BUFFER_SIZE];
+    int len;
+    if (refusedBytes == 0) {
+        len = snprintf(errMsg, DEFAULT_BUFFER_SIZE, "heap limit exceeded: %zu bytes allocated, limit is %zu bytes!",
+                       vm->allocatedBytes, vm->heapLimit);
+    } else {
+        len = snprintf(errMsg, DEFAULT_BUFFER_SIZE, "heap limit exceeded: %zu more bytes requested, %zu bytes allocated, limit is %zu bytes!",
+                       refusedBytes, vm->allocatedBytes, vm->heapLimit);
+    }
+    TRACE_INSTANT("heap limit exceeded", "bytes", vm->allocatedBytes)
+    ObjThread *callerThread = abortThread(vm, objThread, errMsg, len);
+    // 没有垃圾回收，已分配的内存不会减少，若仍以 heapLimit 为上限，主调线程的下一次申请就会再次超限，
+    // 所以在当前用量（包括上面创建错误信息的申请）之上留出余量，超出余量后才再次报错
+    // 被拒绝的申请没有计入用量，此时用量可能仍低于 heapLimit
+    size_t overBytes = vm->allocatedBytes > vm->heapLimit ? vm->allocatedBytes - vm->heapLimit : 0;
+    vm->heapLimitSlack = overBytes + vm->heapLimit / HEAP_LIMIT_HEADROOM_RATIO;
+    vm->isHeapLimitExceeded = false;
+    return callerThread;
+}
+
+// realloc 申请 refusedBytes 字节失败时，以错误结束线程 objThread，返回主调线程
+static ObjThread *abortThreadOnOutOfMemory(VM *vm, ObjThread *objThread, size_t refusedBytes) {
+    char errMsg[DEFAULT_BUFFER_SIZE];
+    int len = snprintf(errMsg, DEFAULT_BUFFER_SIZE, "out of memory: allocate %zu more bytes failed, %zu bytes in use!",
+                       refusedBytes, vm->allocatedBytes);
+    TRACE_INSTANT("out of memory", "bytes", refusedBytes)
+    return abortThread(vm, objThread, errMsg, len);
+}
+
+// 线程 objThread 的执行预算耗尽时，按 vm->budgetAction 让出给主调线程或以错误结束线程
+// 没有主调线程可让出时（例如模块的顶层代码）也以错误结束线程，此时由 abortThread 报错退出
+// 返回接下来运行的线程
+static ObjThread *exhaustThreadBudget(VM *vm, ObjThread *objThread) {
+    ObjThread *callerThread = objThread->caller;
+    if (vm->budgetAction == BUDGET_YIELD && callerThread != NULL) {
+        TRACE_INSTANT("preempt", "budget", objThread->budget)
+        // 与 Thread.yield() 一样断开与主调线程的调用关系，主调线程的 call 返回 null
+        setThreadBudget(objThread, objThread->budget);
+        objThread->isPreempted = true;
+        objThread->caller = NULL;
+        callerThread->esp[-1] = VT_TO_VALUE(VT_NULL);
+        vm->curThread = callerThread;
+        return callerThread;
+    }
+
+    char errMsg[DEFAULT_BUFFER_SIZE];
+    int len = snprintf(errMsg, DEFAULT_BUFFER_SIZE, "budget exhausted: %llu loop iterations and calls!",
+                       (unsigned long long)objThread->budget);
+    TRACE_INSTANT("budget exhausted", "budget", objThread->budget)
+    return abortThread(vm, objThread, errMsg, len);
+}
+
+// 尾调用：结束当前帧栈，并把位于栈顶的 argNum 个参数 args 滑动到当前帧栈的运行时栈底 stackStart
+// 之后再调用 createFrame 时，被调用方法的帧栈就会占用当前帧栈的位置，其返回值直接返回给当前帧栈的调用方
+static void dropFrameForTailCall(VM *vm, ObjThread *objThread, Value *stackStart, Value *args, int argNum) {
+    PROFILE_FRAME_EXIT(vm, objThread)
+    FLIGHT_RETURN(vm, objThread->frames[objThread->usedFrameNum - 1].closure->fn, objThread->usedFrameNum)
+    PROBE_FUNCTION_RETURN(objThread->frames[objThread->usedFrameNum - 1].closure->fn, objThread->usedFrameNum)
+    // 和 OPCODE_RETURN 一样，当前帧栈的局部变量即将被覆盖，要先关闭引用它们的自由变量
+    closedUpvalue(objThread, stackStart);
+    memmove(stackStart, args, sizeof(Value) * argNum);
+    objThread->esp = stackStart + argNum;
+    objThread->usedFrameNum--;
+}
+
 // 背景知识：
 // 线程中的 “大栈” 被在其中运行的所有函数闭包的运行时栈所占用，各自分一块作为自己的运行时栈，各分块不重合，但互相接壤
 // “大栈” 的栈底是 ObjThread->stack，栈顶是 ObjThread->esp，而线程中各个闭包函数自己的运行时栈的栈底是 stackStart
 // stackStart 记录了本运行时栈在 “大栈” 中的起始地址
 
-// 执行指令
-VMResult executeInstruction(VM *vm, register ObjThread *curThread) {
+// 处理信号处理函数留给虚拟机的工作，调用前当前帧的 ip 必须已经保存到帧栈中
+static void handlePendingSignals(VM *vm, ObjThread *objThread) {
+    // 先清除标记再处理，之后到达的信号会重新设置标记，不会丢失
+    vm->isSignalPending = 0;
+    if (vm->sampleProfile != NULL) {
+        recordSample(vm, objThread);
+    }
+    handleFlightDumpRequests(vm);
+}
+
+// OPCODE_BUILD_LIST：取走 objThread 运行时栈顶的 elementNum 个元素，按顺序建成 list 并压入栈顶，list 的容量恰好等于元素个数
+// 以下三个指令不常执行，放在 executeInstruction 之外，不影响其主循环的代码生成
+static void buildList(VM *vm, ObjThread *objThread, uint32_t elementNum) {
+    ObjList *objList = newObjList(vm, elementNum);
+    objThread->esp -= elementNum;
+    if (elementNum > 0) {
+        memcpy(objList->elements.datas, objThread->esp, sizeof(Value) * elementNum);
+    }
+    *objThread->esp++ = OBJ_TO_VALUE(objList);
+}
+
+// OPCODE_BUILD_MAP：取走 objThread 运行时栈顶的 entryNum 个键值对，按顺序建成 map 并压入栈顶
+// 键和值在运行时栈中交替存放，map 预先分配好容纳这些键值对的容量
+static void buildMap(VM *vm, ObjThread *objThread, uint32_t entryNum) {
+    ObjMap *objMap = newObjMap(vm);
+    mapReserve(vm, objMap, entryNum);
+    Value *entries = objThread->esp - entryNum * 2;
+    uint32_t idx = 0;
+    while (idx < entryNum) {
+        if (!isValidKey(entries[idx * 2])) {
+            runtimeError(vm, "key must be value type!");
+        }
+        mapSet(vm, objMap, entries[idx * 2], entries[idx * 2 + 1]);
+        idx++;
+    }
+    objThread->esp = entries;
+    *objThread->esp++ = OBJ_TO_VALUE(objMap);
+}
+
+// OPCODE_COPY_CONSTANT：复制常量表中由常量构成的 list 或 map
+static Value copyLiteral(VM *vm, Value literal) {
+    if (VALUE_IS_OBJLIST(literal)) {
+        return OBJ_TO_VALUE(copyObjList(vm, VALUE_TO_OBJLIST(literal)));
+    }
+    return OBJ_TO_VALUE(copyObjMap(vm, VALUE_TO_OBJMAP(literal)));
+}
+
+// 判断类 class 中索引为 index 的方法是否仍是 buildCore 绑定的原生方法 vm->intrinsicPrims[prim]
+#define IS_INTRINSIC_BOUND(class, index, prim)                                    \
+    ((index) < (class)->methods.count &&                                          \
+     (class)->methods.datas[index].type == MT_PRIMITIVE &&                        \
+     (class)->methods.datas[index].primFn == vm->intrinsicPrims[prim])
+
+// OPCODE_INTRINSICx：接收者 args[0] 是 intrinsic 所对应的核心类的对象，且其类中索引为 index 的方法仍是原来的原生方法时，
+// 直接完成该原生方法的工作，结果写入 args[0] 并返回 true；否则返回 false，由调用方照常调用方法
+// 除了 num.toString 直接调用原生方法之外，其余的结果都与对应的原生方法一致，且不会出错
+static bool callIntrinsic(VM *vm, Intrinsic intrinsic, uint32_t index, Value *args) {
+    Value receiver = args[0];
+    switch (intrinsic) {
+        case INTRINSIC_COUNT:
+            if (VALUE_IS_OBJLIST(receiver) && IS_INTRINSIC_BOUND(vm->listClass, index, IP_LIST_COUNT)) {
+                args[0] = INT_TO_VALUE(VALUE_TO_OBJLIST(receiver)->elements.count);
+                return true;
+            }
+            if (VALUE_IS_OBJSTR(receiver) && IS_INTRINSIC_BOUND(vm->stringClass, index, IP_STRING_COUNT)) {
+                args[0] = INT_TO_VALUE(VALUE_TO_OBJSTR(receiver)->value.length);
+                return true;
+            }
+            if (VALUE_IS_OBJMAP(receiver) && IS_INTRINSIC_BOUND(vm->mapClass, index, IP_MAP_COUNT)) {
+                args[0] = INT_TO_VALUE(VALUE_TO_OBJMAP(receiver)->count);
+                return true;
+            }
+            return false;
+
+        case INTRINSIC_ABS:
+            if (!VALUE_IS_NUM(receiver) || !IS_INTRINSIC_BOUND(vm->numClass, index, IP_NUM_ABS)) {
+                return false;
+            }
+            if (VALUE_IS_INT(receiver)) {
+                int64_t operand = VALUE_TO_INT(receiver);
+                args[0] = INT_TO_VALUE(operand < 0 ? -operand : operand);
+            } else {
+                args[0] = NUM_TO_VALUE(fabs(VALUE_TO_NUM(receiver)));
+            }
+            return true;
+
+        case INTRINSIC_SQRT:
+            if (!VALUE_IS_NUM(receiver) || !IS_INTRINSIC_BOUND(vm->numClass, index, IP_NUM_SQRT)) {
+                return false;
+            }
+            args[0] = NUM_TO_VALUE(sqrt(VALUE_TO_NUM(receiver)));
+            return true;
+
+        case INTRINSIC_FLOOR:
+            if (!VALUE_IS_NUM(receiver) || !IS_INTRINSIC_BOUND(vm->numClass, index, IP_NUM_FLOOR)) {
+                return false;
+            }
+            // 小整数取整后就是其本身
+            if (!VALUE_IS_INT(receiver)) {
+                args[0] = numToValue(floor(VALUE_TO_NUM(receiver)));
+            }
+            return true;
+
+        case INTRINSIC_IS_INTEGER:
+            if (!VALUE_IS_NUM(receiver) || !IS_INTRINSIC_BOUND(vm->numClass, index, IP_NUM_IS_INTEGER)) {
+                return false;
+            }
+            if (VALUE_IS_INT(receiver)) {
+                args[0] = VT_TO_VALUE(VT_TRUE);
+            } else {
+                double num = VALUE_TO_NUM(receiver);
+                // NaN 和无穷都不是整数
+                args[0] = BOOL_TO_VALUE(!isnan(num) && !isinf(num) && trunc(num) == num);
+            }
+            return true;
+
+        case INTRINSIC_TO_STRING:
+            if (VALUE_IS_OBJSTR(receiver) && IS_INTRINSIC_BOUND(vm->stringClass, index, IP_STRING_TO_STRING)) {
+                return true;
+            }
+            // 数字格式化的开销远大于方法调用，这里只是省去方法查找，直接调用原生方法
+            if (VALUE_IS_NUM(receiver) && IS_INTRINSIC_BOUND(vm->numClass, index, IP_NUM_TO_STRING)) {
+                return vm->intrinsicPrims[IP_NUM_TO_STRING](vm, args);
+            }
+            return false;
+
+        case INTRINSIC_CONTAINS_KEY:
+            // 不合法的 key 交给原生方法报错
+            if (!VALUE_IS_OBJMAP(receiver) || !isValidKey(args[1]) || !IS_INTRINSIC_BOUND(vm->mapClass, index, IP_MAP_CONTAINS_KEY)) {
+                return false;
+            }
+            args[0] = BOOL_TO_VALUE(!VALUE_IS_UNDEFINED(mapGet(VALUE_TO_OBJMAP(receiver), args[1])));
+            return true;
+    }
+    return false;
+}
+#undef IS_INTRINSIC_BOUND
+
+// 虚拟机切换到 objThread 运行时通知调用剖析、飞行记录器、时间线追踪和 USDT 探针
+#define NOTIFY_THREAD_SWITCH(objThread)     \
+    PROFILE_THREAD_SWITCH(vm, objThread)    \
+    FLIGHT_THREAD_SWITCH(vm, objThread)     \
+    TRACE_THREAD_SWITCH(objThread)          \
+    PROBE_THREAD_SWITCH(objThread)
+
+// 执行指令，由 executeInstruction 调用
+static VMResult runInstructions(VM *vm, register ObjThread *curThread) {
     vm->curThread = curThread;  // 当前正在执行的线程
+    NOTIFY_THREAD_SWITCH(curThread)
     register Frame *curFrame;   // 当前帧栈 frame
     register Value *stackStart; // 当前帧栈 frame 对应的运行时栈的起始地址（栈底）
     register uint8_t *ip;       // 程序计数器，用于存储即将执行的下一条指令在指令流中的地址
@@ -388,11 +777,41 @@ VMResult executeInstruction(VM *vm, register ObjThread *curThread) {
     ip = curFrame->ip;                                          \
     fn = curFrame->closure->fn;
 
+// 在安全点检查堆内存是否超出上限，超出则以错误结束当前线程，切换到主调线程继续执行，没有主调线程时报错退出
+// 只在原生方法返回后和循环回跳时检查，不必在每次申请内存时处理错误
+#define CHECK_HEAP_LIMIT()                                     \
+    if (vm->isHeapLimitExceeded) {                             \
+        STORE_CUR_FRAME();                                     \
+        curThread = abortThreadOnHeapLimit(vm, curThread, 0);  \
+        NOTIFY_THREAD_SWITCH(curThread)                        \
+        LOAD_CUR_FRAME()                                       \
+    }
+
+// 在循环回跳和方法调用之后扣减当前线程的执行预算，耗尽时让出或结束当前线程
+// 没有设置预算时只多一次递减和判断
+#define CHARGE_BUDGET()                                        \
+    if (--curThread->budgetLeft == 0) {                        \
+        STORE_CUR_FRAME();                                     \
+        curThread = exhaustThreadBudget(vm, curThread);        \
+        NOTIFY_THREAD_SWITCH(curThread)                        \
+        LOAD_CUR_FRAME()                                       \
+    }
+
+// 处理采样定时或转储飞行记录的信号留下的工作
+// 和上面两个检查一样只在循环回跳和方法调用之后进行，不必在每条指令之前读一次 isSignalPending
+#define CHECK_PENDING_SIGNALS()                                \
+    if (vm->isSignalPending) {                                 \
+        STORE_CUR_FRAME();                                     \
+        handlePendingSignals(vm, curThread);                   \
+    }
+
     LOAD_CUR_FRAME()
 // loopStart 标号作用：当执行完一条指令后，会直接 goto 到此标号，以减少 CPU 跳出各分支的消耗，以提升虚拟机速度
 loopStart:
     // 读入指令流中的操作码
     opCode = READ_BYTE();
+    // 指令级剖析的统计，普通构建中展开为空
+    PROFILE_OPCODE(vm, fn, opCode)
     switch (opCode) {
         case OPCODE_POP:
             //【弹出栈顶】
@@ -448,6 +867,8 @@ loopStart:
             stackStart[READ_BYTE()] = PEEK();
             goto loopStart;
 
+        // OPCODE_SUBSCRIPT_GET、OPCODE_SUBSCRIPT_SET、OPCODE_IS 和 OPCODE_INTRINSICx 不能直接完成时，把 opCode 换成相应的 OPCODE_CALLx 跳转到这里调用方法
+        invokeMethod:
         case OPCODE_CALL0:
         case OPCODE_CALL1:
         case OPCODE_CALL2:
@@ -464,15 +885,37 @@ loopStart:
         case OPCODE_CALL13:
         case OPCODE_CALL14:
         case OPCODE_CALL15:
-        case OPCODE_CALL16: {
+        case OPCODE_CALL16:
+        case OPCODE_TAIL_CALL0:
+        case OPCODE_TAIL_CALL1:
+        case OPCODE_TAIL_CALL2:
+        case OPCODE_TAIL_CALL3:
+        case OPCODE_TAIL_CALL4:
+        case OPCODE_TAIL_CALL5:
+        case OPCODE_TAIL_CALL6:
+        case OPCODE_TAIL_CALL7:
+        case OPCODE_TAIL_CALL8:
+        case OPCODE_TAIL_CALL9:
+        case OPCODE_TAIL_CALL10:
+        case OPCODE_TAIL_CALL11:
+        case OPCODE_TAIL_CALL12:
+        case OPCODE_TAIL_CALL13:
+        case OPCODE_TAIL_CALL14:
+        case OPCODE_TAIL_CALL15:
+        case OPCODE_TAIL_CALL16: {
             Class *class;   // 方法所属类
             int index;      // 方法在 class->methods 缓冲区中的索引
             Method *method; // 方法
             Value *args;    // 方法参数
             int argNum;     // 方法参数个数
+            ObjClosure *objClosure;
+            bool isPrimitiveOk; // 原生方法是否正常返回
+
+            // 是否为尾调用，尾调用的操作码紧跟在普通调用的操作码之后
+            bool isTailCall = opCode >= OPCODE_TAIL_CALL0;
 
             // 方法参数个数
-            argNum = opCode - OPCODE_CALL0 + 1;
+            argNum = opCode - (isTailCall ? OPCODE_TAIL_CALL0 : OPCODE_CALL0) + 1;
 
             // 在调用方法之前，会提前将参数压入到运行时栈中，压入顺序是先压入前面的参数
             // 因此 curThread->esp - argNum 指向的是第 0 个参数
@@ -490,20 +933,29 @@ loopStart:
             method = &class->methods.datas[index];
 
             // 如果方法不存在，则报错
-            if ((uint32_t)index > class->methods.count || method->type == MT_NONE) {
-                RUN_ERROR("method \"%s\" not found!", vm->allMethodNames.datas[index].str);
+            // 索引超出 methods 的个数时 method 指向的是缓冲区之外未初始化的内存，要先判断索引再读取 type
+            if ((uint32_t)index >= class->methods.count || method->type == MT_NONE) {
+                STORE_CUR_FRAME();
+                runtimeError(vm, "method \"%s\" not found!", vm->allMethodNames.datas[index].str);
             }
+            PROFILE_CALL_SITE(vm, fn, ip, 3, index, method->type)
             switch (method->type) {
                 // 用 C 实现的原生方法
                 case MT_PRIMITIVE:
                     // 执行原生方法
-                    if (method->primFn(vm, args)) {
+                    // 先保存 ip，原生方法中新建的对象在分配剖析中算在这条调用指令上
+                    STORE_CUR_FRAME();
+                    PROBE_PRIMITIVE_ENTRY(vm, index)
+                    isPrimitiveOk = CALL_PRIMITIVE(vm, curThread, method, index, args);
+                    PROBE_PRIMITIVE_RETURN(vm, index, isPrimitiveOk)
+                    if (isPrimitiveOk) {
                         // 如果返回结果为 true，说明原生方法执行正常，则回收该方法参数在运行时栈的空间
                         // argNum 减 1 是为了避免回收第一个参数 args[0]
                         // 因为被调用的方法用 args[0] 存储返回值，并由于主调方和被调方的运行时栈接壤，
                         // 所以主调方才能在自己的栈顶（即此处的 args[0]）获取被调用方法的执行结果
                         // 注意：args[0] 所在的 slot 就是 stackStart[0]，即本方法运行时栈的起始
                         curThread->esp -= argNum - 1;
+                        CHECK_HEAP_LIMIT()
                     } else {
                         // 如果返回结果为 false，则有两种情况：
                         // 1. 方法执行出错，无法运行下去（例如 primThreadAbort 使线程报错或无错退出）
@@ -519,6 +971,7 @@ loopStart:
                             if (VALUE_IS_OBJSTR(curThread->errorObj)) {
                                 ObjString *err = VALUE_TO_OBJSTR(curThread->errorObj);
                                 printf("%s", err->value.start);
+                                PROBE_RUNTIME_ERROR(curThread, err->value.start)
                             }
                             // 并将该方法的错误返回值（位于第一个参数 args[0] 中，即运行时栈顶），置为 NULL
                             PEEK() = VT_TO_VALUE(VT_NULL);
@@ -531,6 +984,7 @@ loopStart:
 
                         // 切换到下一个线程
                         curThread = vm->curThread;
+                        NOTIFY_THREAD_SWITCH(curThread)
 
                         // 加载 curThread->frames 中最新的帧栈 frame
                         LOAD_CUR_FRAME()
@@ -539,25 +993,79 @@ loopStart:
 
                     // 用脚本语言实现的方法
                 case MT_SCRIPT:
+                    // 只存取一个实例属性的方法（见 markFieldAccessor），直接在调用处存取属性，不必创建帧栈
+                    // 调用剖析要为帧栈记账，开启时仍然走下面的正常流程
+                    // 飞行记录器和 USDT 探针照常记录一次调用和返回，深度就是创建帧栈时的深度
+                    if (method->obj->fn->fieldAccessor != FA_NONE && vm->callProfile == NULL && VALUE_IS_OBJINSTANCE(args[0])) {
+                        ObjFn *accessorFn = method->obj->fn;
+                        FLIGHT_CALL(vm, accessorFn, curThread->usedFrameNum + 1)
+                        PROBE_FUNCTION_ENTRY(vm, accessorFn, index, curThread->usedFrameNum + 1)
+                        ObjInstance *objInstance = VALUE_TO_OBJINSTANCE(args[0]);
+                        // 属性索引是指令流中 LOAD_THIS_FIELD 或 STORE_THIS_FIELD 的操作数，已经由 patchOperand 修正过
+                        uint8_t fieldIndex = accessorFn->instrStream.datas[accessorFn->fieldAccessor == FA_GETTER ? 1 : 3];
+                        ASSERT(fieldIndex < objInstance->objHeader.class->fieldNum, "out of bounds field!");
+                        if (accessorFn->fieldAccessor == FA_GETTER) {
+                            args[0] = objInstance->fields[fieldIndex];
+                        } else {
+                            objInstance->fields[fieldIndex] = args[1];
+                            args[0] = accessorFn->fieldAccessor == FA_SETTER ? VT_TO_VALUE(VT_NULL) : args[1];
+                        }
+                        FLIGHT_RETURN(vm, accessorFn, curThread->usedFrameNum + 1)
+                        PROBE_FUNCTION_RETURN(accessorFn, curThread->usedFrameNum + 1)
+                        curThread->esp -= argNum - 1;
+                        break;
+                    }
                     // 备份当前帧栈 frame 对应的指令流进度指针 ip
                     STORE_CUR_FRAME();
+                    if (isTailCall) {
+                        dropFrameForTailCall(vm, curThread, stackStart, args, argNum);
+                    }
                     // 为线程 objThread 中运行的函数闭包 objClosure 准备帧栈 Frame，即闭包（函数或方法）的运行资源
                     // 该函数执行完之后，该函数创建的帧栈就是 curThread->frames 中最新的帧栈
-                    createFrame(vm, curThread, (ObjClosure *)method->obj, argNum);
+                    createFrame(vm, curThread, (ObjClosure *)method->obj, argNum, index);
                     // 加载 curThread->frames 中最新的帧栈 frame
                     LOAD_CUR_FRAME()
                     break;
 
+                    // 类的静态方法 new，即 Foo.new(...)
+                case MT_CONSTRUCT: {
+                    // 构造方法的指令流为 OPCODE_CONSTRUCT、OPCODE_CALLx 实例方法 new 的索引、OPCODE_RETURN
+                    // 这里直接完成前两条指令的工作：创建实例替换 args[0] 中的类，再为实例方法 new 创建帧栈，
+                    // 实例方法 new 最后返回实例本身，正好作为 Foo.new(...) 的返回值，所以省去了构造方法自身的帧栈
+                    Class *instanceClass = VALUE_TO_CLASS(args[0]);
+                    ObjFn *constructFn = method->obj->fn;
+                    uint32_t initIndex = (constructFn->instrStream.datas[2] << 8) | constructFn->instrStream.datas[3];
+                    STORE_CUR_FRAME();
+                    if (initIndex < instanceClass->methods.count && instanceClass->methods.datas[initIndex].type == MT_SCRIPT) {
+                        args[0] = OBJ_TO_VALUE(newObjInstance(vm, instanceClass));
+                        objClosure = instanceClass->methods.datas[initIndex].obj;
+                    } else {
+                        // 实例方法 new 不存在时，执行构造方法本身，由其报错
+                        objClosure = method->obj;
+                    }
+                    if (isTailCall) {
+                        dropFrameForTailCall(vm, curThread, stackStart, args, argNum);
+                    }
+                    createFrame(vm, curThread, objClosure, argNum, index);
+                    LOAD_CUR_FRAME()
+                    break;
+                }
+
                     // 关于函数对象的调用方法，用于实现函数重载，如 fun1.call()
                 case MT_FN_CALL:
                     // 该类型的方法，实例对象本身就是待调用的函数（即第一个参数 args[0] 就是待调用的函数闭包）
                     ASSERT(VALUE_IS_OBJCLOSURE(args[0]), "instance must be a closure!");
                     // 备份当前帧栈 frame 对应的指令流进度指针 ip
                     STORE_CUR_FRAME();
+                    // 注意：该类型的方法，实例对象本身就是待调用的函数（即第一个参数 args[0] 就是待调用的函数闭包）
+                    // 尾调用滑动参数之后 args[0] 的位置就变了，所以先取出闭包
+                    objClosure = VALUE_TO_OBJCLOSURE(args[0]);
+                    if (isTailCall) {
+                        dropFrameForTailCall(vm, curThread, stackStart, args, argNum);
+                    }
                     // 为线程 objThread 中运行的函数闭包 objClosure 准备帧栈 Frame，即闭包（函数或方法）的运行资源
                     // 该函数执行完之后，该函数创建的帧栈就是 curThread->frames 中最新的帧栈
-                    // 注意：该类型的方法，实例对象本身就是待调用的函数（即第一个参数 args[0] 就是待调用的函数闭包）
-                    createFrame(vm, curThread, VALUE_TO_OBJCLOSURE(args[0]), argNum);
+                    createFrame(vm, curThread, objClosure, argNum, index);
                     // 加载 curThread->frames 中最新的帧栈 frame
                     LOAD_CUR_FRAME()
                     break;
@@ -566,6 +1074,8 @@ loopStart:
                     NOT_REACHED()
             }
 
+            CHARGE_BUDGET()
+            CHECK_PENDING_SIGNALS()
             goto loopStart;
         }
 
@@ -591,6 +1101,7 @@ loopStart:
             Method *method; // 方法
             Value *args;    // 方法参数
             int argNum;     // 方法参数个数
+            bool isPrimitiveOk; // 原生方法是否正常返回
 
             // 方法参数个数
             argNum = opCode - OPCODE_SUPER0 + 1;
@@ -616,20 +1127,29 @@ loopStart:
             method = &class->methods.datas[index];
 
             // 如果方法不存在，则报错
-            if ((uint32_t)index > class->methods.count || method->type == MT_NONE) {
-                RUN_ERROR("method \"%s\" not found!", vm->allMethodNames.datas[index].str);
+            // 索引超出 methods 的个数时 method 指向的是缓冲区之外未初始化的内存，要先判断索引再读取 type
+            if ((uint32_t)index >= class->methods.count || method->type == MT_NONE) {
+                STORE_CUR_FRAME();
+                runtimeError(vm, "method \"%s\" not found!", vm->allMethodNames.datas[index].str);
             }
+            PROFILE_CALL_SITE(vm, fn, ip, 5, index, method->type)
             switch (method->type) {
                 // 用 C 实现的原生方法
                 case MT_PRIMITIVE:
                     // 执行原生方法
-                    if (method->primFn(vm, args)) {
+                    // 先保存 ip，原生方法中新建的对象在分配剖析中算在这条调用指令上
+                    STORE_CUR_FRAME();
+                    PROBE_PRIMITIVE_ENTRY(vm, index)
+                    isPrimitiveOk = CALL_PRIMITIVE(vm, curThread, method, index, args);
+                    PROBE_PRIMITIVE_RETURN(vm, index, isPrimitiveOk)
+                    if (isPrimitiveOk) {
                         // 如果返回结果为 true，说明原生方法执行正常，则回收该方法参数在运行时栈的空间
                         // argNum 减 1 是为了避免回收第一个参数 args[0]
                         // 因为被调用的方法用 args[0] 存储返回值，并由于主调方和被调方的运行时栈接壤，
                         // 所以主调方才能在自己的栈顶（即此处的 args[0]）获取被调用方法的执行结果
                         // 注意：args[0] 所在的 slot 就是 stackStart[0]，即本方法运行时栈的起始
                         curThread->esp -= argNum - 1;
+                        CHECK_HEAP_LIMIT()
                     } else {
                         // 如果返回结果为 false，则有两种情况：
                         // 1. 方法执行出错，无法运行下去（例如 primThreadAbort 使线程报错或无错退出）
@@ -645,6 +1165,7 @@ loopStart:
                             if (VALUE_IS_OBJSTR(curThread->errorObj)) {
                                 ObjString *err = VALUE_TO_OBJSTR(curThread->errorObj);
                                 printf("%s", err->value.start);
+                                PROBE_RUNTIME_ERROR(curThread, err->value.start)
                             }
                             // 并将该方法的错误返回值（位于第一个参数 args[0] 中，即运行时栈顶），置为 NULL
                             PEEK() = VT_TO_VALUE(VT_NULL);
@@ -657,6 +1178,7 @@ loopStart:
 
                         // 切换到下一个线程
                         curThread = vm->curThread;
+                        NOTIFY_THREAD_SWITCH(curThread)
 
                         // 加载 curThread->frames 中最新的帧栈 frame
                         LOAD_CUR_FRAME()
@@ -664,12 +1186,14 @@ loopStart:
                     break;
 
                     // 用脚本语言实现的方法
+                    // 通过 super 调用的静态方法 new 直接执行构造方法本身
+                case MT_CONSTRUCT:
                 case MT_SCRIPT:
                     // 备份当前帧栈 frame 对应的指令流进度指针 ip
                     STORE_CUR_FRAME();
                     // 为线程 objThread 中运行的函数闭包 objClosure 准备帧栈 Frame，即闭包（函数或方法）的运行资源
                     // 该函数执行完之后，该函数创建的帧栈就是 curThread->frames 中最新的帧栈
-                    createFrame(vm, curThread, (ObjClosure *)method->obj, argNum);
+                    createFrame(vm, curThread, (ObjClosure *)method->obj, argNum, index);
                     // 加载 curThread->frames 中最新的帧栈 frame
                     LOAD_CUR_FRAME()
                     break;
@@ -683,7 +1207,7 @@ loopStart:
                     // 为线程 objThread 中运行的函数闭包 objClosure 准备帧栈 Frame，即闭包（函数或方法）的运行资源
                     // 该函数执行完之后，该函数创建的帧栈就是 curThread->frames 中最新的帧栈
                     // 注意：该类型的方法，实例对象本身就是待调用的函数（即第一个参数 args[0] 就是待调用的函数闭包）
-                    createFrame(vm, curThread, VALUE_TO_OBJCLOSURE(args[0]), argNum);
+                    createFrame(vm, curThread, VALUE_TO_OBJCLOSURE(args[0]), argNum, index);
                     // 加载 curThread->frames 中最新的帧栈 frame
                     LOAD_CUR_FRAME()
                     break;
@@ -692,6 +1216,8 @@ loopStart:
                     NOT_REACHED()
             }
 
+            CHARGE_BUDGET()
+            CHECK_PENDING_SIGNALS()
             goto loopStart;
         }
 
@@ -793,6 +1319,18 @@ loopStart:
         case OPCODE_LOOP: {
             //【程序计数器 ip 向回跳，偏移量为 offset】
             // 操作数为偏移量 offset，占 2 个字节
+            FLIGHT_LOOP(vm)
+            // 循环回跳是安全点，需要停下时先不回跳，而是把 ip 退回本条 LOOP 指令的操作码再检查：
+            // 出错时调用栈报告的是循环体内的行，而不是循环之前的指令；线程被让出后恢复执行时重新执行本条指令，回跳到循环开头
+            // 只因为信号停下时本条指令会重新执行，多扣一次预算
+            if (vm->isHeapLimitExceeded || curThread->budgetLeft == 1 || vm->isSignalPending) {
+                ip--;
+                CHECK_HEAP_LIMIT()
+                CHARGE_BUDGET()
+                CHECK_PENDING_SIGNALS()
+                goto loopStart;
+            }
+            curThread->budgetLeft--;
             int16_t offset = READ_SHORT();
             // 偏移量必须为正数
             ASSERT(offset > 0, "OPCODE_LOOP's operand must be positive!");
@@ -873,6 +1411,7 @@ loopStart:
             ASSERT(VALUE_IS_CLASS(stackStart[0]), "stackStart[0] should be a class for OPCODE_CONSTRUCT!");
 
             // 基于该类创建实例对象
+            STORE_CUR_FRAME();
             ObjInstance *objInstance = newObjInstance(vm, VALUE_TO_CLASS(stackStart[0]));
 
             // 将创建的实例对象存储到栈底 stackStart[0]
@@ -880,11 +1419,34 @@ loopStart:
             goto loopStart;
         }
 
+        case OPCODE_IS: {
+            //【判断次栈顶的值是否为栈顶的类或其子类的实例，并用结果替换这两个值】
+            // 操作数为方法 is(_) 在 vm->allMethodNames 中的索引，占 2 个字节，只在调用方法时使用
+            // 次栈顶的值所属的类中 is(_) 仍是 Object 的原生方法时直接借助祖先表判断，
+            // 否则（类重新定义了 is(_)，或栈顶不是类）和 OPCODE_CALL1 一样调用方法 is(_)，由其返回结果或报错
+            Value baseClassValue = PEEK();
+            Class *thisClass = getClassOfObj(vm, PEEK2());
+            uint32_t isIndex = (ip[0] << 8) | ip[1];
+            if (VALUE_IS_CLASS(baseClassValue) && isIndex < thisClass->methods.count &&
+                thisClass->methods.datas[isIndex].type == MT_PRIMITIVE &&
+                thisClass->methods.datas[isIndex].primFn == vm->intrinsicPrims[IP_OBJECT_IS]) {
+                ip += 2;
+                DROP();
+                PEEK() = BOOL_TO_VALUE(IS_SUBCLASS_OF(thisClass, VALUE_TO_CLASS(baseClassValue)));
+                goto loopStart;
+            }
+            opCode = OPCODE_CALL1;
+            goto invokeMethod;
+        }
+
         case OPCODE_RETURN: {
             //【结束函数的运行，并将栈顶的值作为返回值】
             // 通过 POP 从栈顶获取函数的执行结果，并作为返回值
             Value retVal = POP();
 
+            PROFILE_FRAME_EXIT(vm, curThread)
+            FLIGHT_RETURN(vm, fn, curThread->usedFrameNum)
+            PROBE_FUNCTION_RETURN(fn, curThread->usedFrameNum)
             // usedFrameNum 自减 1，结束该函数对应的帧栈 frame
             curThread->usedFrameNum--;
 
@@ -911,6 +1473,7 @@ loopStart:
                 // 将当前线程变量改为主调用方线程
                 curThread = callerThread;
                 vm->curThread = callerThread;
+                NOTIFY_THREAD_SWITCH(curThread)
 
                 // 将被调用方线程的返回值保存到主调用方线程的栈顶
                 // （注：esp 指针指向的是栈中下一个可写入数据的 slot，即栈顶的后一个 slot）
@@ -939,7 +1502,8 @@ loopStart:
             // 回收保存基类的栈顶空间，此时上面的次栈顶就变成了栈顶
             DROP();
 
-            // 创建子类之前，先校验基类的合法性
+            // 创建子类之前，先校验基类的合法性，校验失败时的报错要用到当前帧的 ip
+            STORE_CUR_FRAME();
             validateSuperClass(vm, className, fieldNum, superClass);
 
             // 调用 newClass 创建子类
@@ -984,8 +1548,18 @@ loopStart:
             // 在执行该指令之前，待创建闭包的函数已经添加进了常量表（endCompileUnit 函数完成的），直接从常量表中取出该函数
             ObjFn *objFn = VALUE_TO_OBJFN(fn->constants.datas[READ_SHORT()]);
 
+            // 上次创建的闭包引用的自由变量与这次要引用的完全相同时直接复用，例如循环中传给 map、each 的匿名函数
+            ObjClosure *objClosure = objFn->cachedClosure;
+            if (objClosure != NULL && isClosureReusable(objClosure, ip, curFrame)) {
+                ip += objFn->upvalueNum * 2;
+                PUSH(OBJ_TO_VALUE(objClosure));
+                goto loopStart;
+            }
+            STORE_CUR_FRAME();
+
             // 基于该函数创建闭包
-            ObjClosure *objClosure = newObjClosure(vm, objFn);
+            objClosure = newObjClosure(vm, objFn);
+            objFn->cachedClosure = objClosure;
 
             // 将上面创建好的闭包压入到运行时栈顶
             PUSH(OBJ_TO_VALUE(objClosure));
@@ -1021,6 +1595,128 @@ loopStart:
             goto loopStart;
         }
 
+        case OPCODE_BUILD_LIST:
+            //【取走运行时栈顶的元素，按顺序建成 list 并压入到运行时栈顶】
+            // 操作数为元素个数，占 2 个字节
+            STORE_CUR_FRAME();
+            buildList(vm, curThread, READ_SHORT());
+            goto loopStart;
+
+        case OPCODE_BUILD_MAP:
+            //【取走运行时栈顶的键值对，按顺序建成 map 并压入到运行时栈顶】
+            // 操作数为键值对个数，占 2 个字节
+            STORE_CUR_FRAME();
+            buildMap(vm, curThread, READ_SHORT());
+            goto loopStart;
+
+        case OPCODE_COPY_CONSTANT:
+            //【将常量表中由常量构成的 list 或 map 复制一份压入到运行时栈顶】
+            // 操作数为常量在常量表 constants 中的索引，占 2 个字节
+            // 每次对字面量求值都要得到新的对象，所以不能像 OPCODE_LOAD_CONSTANT 那样直接压入常量本身
+            STORE_CUR_FRAME();
+            PUSH(copyLiteral(vm, fn->constants.datas[READ_SHORT()]));
+            goto loopStart;
+
+        case OPCODE_SUBSCRIPT_GET: {
+            //【读取次栈顶对象中下标为栈顶值的元素，并用结果替换这两个值】，即 receiver[index]
+            // 操作数为方法 [_] 在 vm->allMethodNames 中的索引，占 2 个字节，只在调用方法时使用
+            // list 的整数下标、map 的键以及 ASCII 字符串的整数下标在这里直接读取，不必调用方法
+            Value receiver = PEEK2();
+            Value index = PEEK();
+            if (VALUE_IS_OBJLIST(receiver) && VALUE_IS_INT(index)) {
+                ObjList *objList = VALUE_TO_OBJLIST(receiver);
+                // 和 validateIndexValue 一样支持负数下标
+                int64_t idx = VALUE_TO_INT(index);
+                if (idx < 0) {
+                    idx += objList->elements.count;
+                }
+                if (idx >= 0 && idx < objList->elements.count) {
+                    ip += 2;
+                    DROP();
+                    PEEK() = objList->elements.datas[idx];
+                    goto loopStart;
+                }
+            } else if (VALUE_IS_OBJMAP(receiver) && isValidKey(index)) {
+                Value value = mapGet(VALUE_TO_OBJMAP(receiver), index);
+                ip += 2;
+                DROP();
+                // 没有该键时和 Map 的 [_] 方法一样返回 null
+                PEEK() = VALUE_IS_UNDEFINED(value) ? VT_TO_VALUE(VT_NULL) : value;
+                goto loopStart;
+            } else if (VALUE_IS_OBJSTR(receiver) && VALUE_IS_INT(index)) {
+                ObjString *objString = VALUE_TO_OBJSTR(receiver);
+                int64_t idx = VALUE_TO_INT(index);
+                if (idx < 0) {
+                    idx += objString->value.length;
+                }
+                // 只处理 ASCII 字符，多字节的 utf8 字符交给 String 的 [_] 方法解码
+                if (idx >= 0 && idx < objString->value.length && (uint8_t)objString->value.start[idx] < 0x80) {
+                    ip += 2;
+                    STORE_CUR_FRAME();
+                    DROP();
+                    PEEK() = OBJ_TO_VALUE(newObjString(vm, &objString->value.start[idx], 1));
+                    goto loopStart;
+                }
+            }
+            // 其余情况（用户类、range 下标、越界等）和 OPCODE_CALL1 一样调用方法 [_]，由其返回结果或报错
+            opCode = OPCODE_CALL1;
+            goto invokeMethod;
+        }
+
+        case OPCODE_SUBSCRIPT_SET: {
+            //【将栈顶的值写入第三个栈顶的对象中下标为次栈顶值的位置，并用该值替换这三个值】，即 receiver[index] = value
+            // 操作数为方法 [_]=(_) 在 vm->allMethodNames 中的索引，占 2 个字节，只在调用方法时使用
+            // list 的整数下标和 map 的键在这里直接写入，不必调用方法
+            Value receiver = curThread->esp[-3];
+            Value index = PEEK2();
+            if (VALUE_IS_OBJLIST(receiver) && VALUE_IS_INT(index)) {
+                ObjList *objList = VALUE_TO_OBJLIST(receiver);
+                int64_t idx = VALUE_TO_INT(index);
+                if (idx < 0) {
+                    idx += objList->elements.count;
+                }
+                if (idx >= 0 && idx < objList->elements.count) {
+                    ip += 2;
+                    objList->elements.datas[idx] = PEEK();
+                    curThread->esp[-3] = PEEK();
+                    curThread->esp -= 2;
+                    goto loopStart;
+                }
+            } else if (VALUE_IS_OBJMAP(receiver) && isValidKey(index)) {
+                ip += 2;
+                // 插入新键时可能扩容，先保存 ip，申请的内存在分配剖析中算在这条指令上
+                STORE_CUR_FRAME();
+                mapSet(vm, VALUE_TO_OBJMAP(receiver), index, PEEK());
+                curThread->esp[-3] = PEEK();
+                curThread->esp -= 2;
+                goto loopStart;
+            }
+            // 其余情况和 OPCODE_CALL2 一样调用方法 [_]=(_)
+            opCode = OPCODE_CALL2;
+            goto invokeMethod;
+        }
+
+        case OPCODE_INTRINSIC0:
+        case OPCODE_INTRINSIC1: {
+            //【对核心类的对象直接完成 count、abs 等原生方法的工作，并用结果替换接收者和参数】
+            // 操作数为 1 个字节的 Intrinsic（最高位为尾调用标记）和 2 个字节的方法在 vm->allMethodNames 中的索引
+            // 接收者的类中已经不是原来的原生方法（或开启了调用剖析）时，和 OPCODE_CALLx 一样调用方法
+            uint8_t intrinsic = READ_BYTE();
+            uint32_t argNum = opCode - OPCODE_INTRINSIC0 + 1;
+            Value *args = curThread->esp - argNum;
+            if (vm->callProfile == NULL) {
+                // 先保存 ip，num.toString 新建的字符串在分配剖析中算在这条指令上
+                STORE_CUR_FRAME();
+                if (callIntrinsic(vm, (Intrinsic)(intrinsic & ~INTRINSIC_TAIL_CALL), (ip[0] << 8) | ip[1], args)) {
+                    ip += 2;
+                    curThread->esp = args + 1;
+                    goto loopStart;
+                }
+            }
+            opCode = (intrinsic & INTRINSIC_TAIL_CALL ? OPCODE_TAIL_CALL0 : OPCODE_CALL0) + argNum - 1;
+            goto invokeMethod;
+        }
+
         case OPCODE_END:
             NOT_REACHED()
 
@@ -1039,3 +1735,28 @@ loopStart:
 #undef STORE_CUR_FRAME
 #undef LOAD_CUR_FRAME
 }
+
+// 执行指令，从线程 objThread 开始运行，直到没有线程可以运行
+// 申请内存会超出堆上限或 realloc 失败时，memManager 拒绝申请并 longjmp 回到这里，此时申请还没有改动任何对象，
+// 以错误结束正在运行的线程，从主调线程继续执行，和在安全点发现超限一样，主调线程可以通过 isDone 和 error 得知
+// 分配内存的指令和原生方法调用之前都已经保存了 ip，所以报错时的调用栈是准确的
+VMResult executeInstruction(VM *vm, ObjThread *objThread) {
+    jmp_buf allocFailJump;
+    jmp_buf *outerJump = vm->allocFailJump;
+    switch (setjmp(allocFailJump)) {
+        case 0:
+            break;
+        case ALLOC_FAIL_HEAP_LIMIT:
+            objThread = abortThreadOnHeapLimit(vm, vm->curThread, vm->refusedBytes);
+            break;
+        case ALLOC_FAIL_OUT_OF_MEMORY:
+            objThread = abortThreadOnOutOfMemory(vm, vm->curThread, vm->refusedBytes);
+            break;
+        default:
+            NOT_REACHED()
+    }
+    vm->allocFailJump = &allocFailJump;
+    VMResult result = runInstructions(vm, objThread);
+    vm->allocFailJump = outerJump;
+    return result;
+}
@@ -5,6 +5,8 @@
 #include "header_obj.h"
 #include "obj_map.h"
 #include "obj_thread.h"
+#include <setjmp.h>
+#include <signal.h>
 
 // 为定义在 opcode.inc 中的操作码加上前缀 OPCODE_
 #define OPCODE_SLOTS(opcode, effect) OPCODE_##opcode,
@@ -19,6 +21,50 @@ typedef enum {
 } OpCode;
 #undef OPCODE_SLOTS
 
+// 内联指令 OPCODE_INTRINSICx 所代替的方法，作为指令的第 1 个字节操作数
+// 接收者是核心类的对象，且其类仍绑定着原来的原生方法时，虚拟机直接完成该方法的工作，否则照常调用方法
+typedef enum {
+    INTRINSIC_COUNT,        // List、String、Map 的 count
+    INTRINSIC_ABS,          // Num 的 abs
+    INTRINSIC_SQRT,         // Num 的 sqrt
+    INTRINSIC_FLOOR,        // Num 的 floor
+    INTRINSIC_IS_INTEGER,   // Num 的 isInteger
+    INTRINSIC_TO_STRING,    // Num、String 的 toString
+    INTRINSIC_CONTAINS_KEY  // Map 的 containsKey(_)
+} Intrinsic;
+
+// 内联指令的第 1 个字节操作数的最高位，表示 return 之后的调用，照常调用方法时按尾调用 OPCODE_TAIL_CALLx 处理
+#define INTRINSIC_TAIL_CALL 0x80
+
+// 内联指令直接完成其工作的原生方法，buildCore 绑定方法时记录在 vm->intrinsicPrims 中，
+// 虚拟机据此判断接收者的类中的方法是否仍是原来的原生方法
+typedef enum {
+    IP_LIST_COUNT,
+    IP_STRING_COUNT,
+    IP_MAP_COUNT,
+    IP_NUM_ABS,
+    IP_NUM_SQRT,
+    IP_NUM_FLOOR,
+    IP_NUM_IS_INTEGER,
+    IP_NUM_TO_STRING,
+    IP_STRING_TO_STRING,
+    IP_MAP_CONTAINS_KEY,
+    IP_OBJECT_IS,           // OPCODE_IS 所代替的 is(_)
+    IP_NUM
+} IntrinsicPrim;
+
+// 线程的执行预算耗尽时的处理方式，执行预算见 obj_thread.h
+typedef enum {
+    BUDGET_ABORT, // 以运行时错误结束线程，主调线程可以通过 isDone 和 error 得知
+    BUDGET_YIELD  // 像 Thread.yield() 一样让出给主调线程，主调线程再次 call 它时从被打断处继续执行，并重新获得完整的预算
+} BudgetAction;
+
+// memManager 拒绝申请的原因，作为 longjmp 到 vm->allocFailJump 的值，所以从 1 开始
+typedef enum {
+    ALLOC_FAIL_HEAP_LIMIT = 1, // 申请后会超出 heapLimit + heapLimitSlack
+    ALLOC_FAIL_OUT_OF_MEMORY   // realloc 失败
+} AllocFailure;
+
 // 虚拟机执行结果
 typedef enum vmResult {
     VM_RESULT_SUCCESS,
@@ -38,12 +84,33 @@ struct vm {
     Class *fnClass;
     Class *threadClass;
 
-    uint32_t allocatedBytes;    // 累计已分配的内存总和
+    size_t allocatedBytes;                // 当前已分配的内存总和
+    size_t peakAllocatedBytes;            // allocatedBytes 曾达到的最大值
+    size_t lastAllocatedBytes;            // 最近一次新申请的内存大小，供 initObjHeader 按对象类型统计
+    size_t heapLimit;                     // 堆内存上限，超出后抛出运行时错误，为 0 表示不限制
+    bool isHeapLimitExceeded;             // 是否已超出 heapLimit，由虚拟机在安全点检查
+    size_t heapLimitSlack;                // 因超限结束线程后留给主调线程的余量，用量超出 heapLimit + heapLimitSlack 时才再次标记
+    jmp_buf *allocFailJump;               // memManager 拒绝申请时跳回虚拟机的位置，为 NULL 表示不能跳回（例如编译期间），见 executeInstruction
+    size_t refusedBytes;                  // memManager 最近一次拒绝的申请增加的字节数
+    uint64_t threadBudget;                // 新建线程的执行预算，为 0 表示不限制
+    BudgetAction budgetAction;            // 线程的执行预算耗尽时的处理方式
+    uint32_t objectCounts[OBJ_TYPE_NUM];  // 各类型对象的个数
+    size_t objectBytes[OBJ_TYPE_NUM];     // 各类型对象自身占用的内存，不含其指向的缓冲区
     ObjHeader *allObjects;      // 累计已分配的所有对象的链表（用于垃圾回收）
     SymbolTable allMethodNames; // 所有类的方法
+    // 内联指令 OPCODE_INTRINSICx 所代替的原生方法，类型即 class.h 中的 Primitive，vm.h 可能先于它被包含，所以这里直接写出
+    char (*intrinsicPrims[IP_NUM])(VM *vm, Value *args);
     ObjMap *allModules;         // 所有模块
     ObjThread *curThread;       // 当前正在执行的线程
     Lexer *curLexer;            // 当前词法分析器
+    struct flightRecorder *flightRecorder; // 飞行记录器，默认开启，为 NULL 表示已关闭，定义在 flight_recorder.h 中
+    volatile sig_atomic_t isSignalPending; // 信号处理函数留下了工作（采样、转储飞行记录），虚拟机在下一次循环回跳或方法调用之后处理
+    struct sampleProfile *sampleProfile; // 采样剖析数据，为 NULL 表示不采样，定义在 profiler.h 中
+    struct callProfile *callProfile;     // 调用剖析数据，为 NULL 表示不剖析，定义在 profiler.h 中
+    struct allocProfile *allocProfile;   // 分配剖析数据，为 NULL 表示不剖析，定义在 profiler.h 中
+#ifdef OPCODE_PROFILE
+    struct opcodeProfile *opcodeProfile; // 指令级剖析数据，为 NULL 表示不剖析，定义在 profiler.h 中
+#endif
 };
 
 // 初始化虚拟机
@@ -59,7 +126,10 @@ void freeVM(VM *vm);
 // needSlots 表示栈最少具有的容量，如果当前栈容量 stackCapacity 大于需要的栈数量，则直接返回即可
 void ensureStack(VM *vm, ObjThread *objThread, uint32_t needSlots);
 
+// 修正方法对应指令流中的操作数，包括实例属性的索引和基类
+void patchOperand(Class *class, ObjFn *fn);
+
 // 执行指令
-VMResult executeInstruction(VM *vm, register ObjThread *curThread);
+VMResult executeInstruction(VM *vm, ObjThread *objThread);
 
 #endif